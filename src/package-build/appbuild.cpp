@@ -0,0 +1,143 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include "src/package-fs/builder.h"
+#include "src/package-fs/fs.h"
+#include "src/package-fs/logging.h"
+#include "src/package-fs/lowlevel/util.h"
+#include <getopt.h>
+
+static void appbuild_usage()
+{
+    std::cerr << "packagebuild [-t|--tar] [-c|--compress] [-d|--deduplicate] [-j|--threads <n>]" << std::endl;
+    std::cerr << "             [-f|--format <version>] [-n|--name <name>] [-v|--version <version>]" << std::endl;
+    std::cerr << "             [-D|--description <text>] [-a|--author <author>] <diskimage> <source>" << std::endl;
+}
+
+int appbuild_start(int argc, char *argv[])
+{
+    bool tar = false;
+    bool compress = false;
+    bool deduplicate = false;
+    unsigned int threads = 1;
+    uint16_t format = FORMAT_VERSION_DEFAULT;
+    const char *appname = "";
+    const char *appver = "";
+    const char *appdesc = "";
+    const char *appauthor = "";
+
+    static const struct option options[] = {
+        { "tar", no_argument, NULL, 't' },
+        { "compress", no_argument, NULL, 'c' },
+        { "deduplicate", no_argument, NULL, 'd' },
+        { "threads", required_argument, NULL, 'j' },
+        { "format", required_argument, NULL, 'f' },
+        { "name", required_argument, NULL, 'n' },
+        { "version", required_argument, NULL, 'v' },
+        { "description", required_argument, NULL, 'D' },
+        { "author", required_argument, NULL, 'a' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "tcdj:f:n:v:D:a:", options, NULL)) >= 0)
+    {
+        switch (c)
+        {
+        case 't':
+            tar = true;
+            break;
+        case 'c':
+            compress = true;
+            break;
+        case 'd':
+            deduplicate = true;
+            break;
+        case 'j':
+            threads = (unsigned int) atoi(optarg);
+            break;
+        case 'f':
+            format = (uint16_t) atoi(optarg);
+            break;
+        case 'n':
+            appname = optarg;
+            break;
+        case 'v':
+            appver = optarg;
+            break;
+        case 'D':
+            appdesc = optarg;
+            break;
+        case 'a':
+            appauthor = optarg;
+            break;
+        default:
+            appbuild_usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2 || threads == 0)
+    {
+        appbuild_usage();
+        return 1;
+    }
+
+    // Set the application name.
+    AppLib::Logging::setApplicationName(std::string("appbuild"));
+
+    const char *disk_path = argv[optind];
+    const char *source_path = argv[optind + 1];
+
+    if (!AppLib::LowLevel::Util::createPackage(disk_path, appname, appver, appdesc, appauthor, format))
+    {
+        AppLib::Logging::showErrorW("Unable to create the package at '%s'.", disk_path);
+        return 1;
+    }
+
+    try
+    {
+        AppLib::FS filesystem(disk_path, 0, 0, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+        AppLib::Builder builder(filesystem, threads);
+        builder.setCompression(compress);
+        builder.setDeduplication(deduplicate);
+
+        if (!tar)
+            builder.importDirectory(source_path);
+        else if (strcmp(source_path, "-") == 0)
+            builder.importTar(std::cin);
+        else
+        {
+            std::ifstream input(source_path, std::ios::in | std::ios::binary);
+            if (!input.is_open())
+            {
+                AppLib::Logging::showErrorW("Unable to open '%s'.", source_path);
+                return 1;
+            }
+            builder.importTar(input);
+        }
+        builder.finish();
+
+        AppLib::Logging::showSuccessW("Built the package at '%s':", disk_path);
+        AppLib::Logging::showSuccessO("  * %llu entries", (unsigned long long) builder.getEntryCount());
+        AppLib::Logging::showSuccessO("  * %llu bytes of file data", (unsigned long long) builder.getByteCount());
+    }
+    catch (std::exception& e)
+    {
+        AppLib::Logging::showErrorW("Unable to build the package: %s", e.what());
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    return appbuild_start(argc, argv);
+}
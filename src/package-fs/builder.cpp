@@ -0,0 +1,498 @@
+/* vim: set ts=4 sw=4 tw=0 :*/
+
+#include "src/package-fs/config.h"
+
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include "src/package-fs/builder.h"
+#include "src/package-fs/logging.h"
+#include "src/package-fs/lowlevel/util.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+namespace AppLib
+{
+    Builder::Builder(FS& filesystem, unsigned int threads)
+        : filesystem(filesystem)
+    {
+        this->threads = std::max(threads, 1u);
+        this->compression = false;
+        this->deduplication = false;
+        this->entries = 0;
+        this->bytes = 0;
+    }
+
+    void Builder::setCompression(bool enabled)
+    {
+        this->compression = enabled;
+    }
+
+    void Builder::setDeduplication(bool enabled)
+    {
+        this->deduplication = enabled;
+    }
+
+    void Builder::addDirectory(std::string path, mode_t mode, uid_t uid, gid_t gid, time_t mtime)
+    {
+        this->ensureParents(path);
+        struct stat st;
+        try
+        {
+            this->filesystem.getattr(path, st);
+            if (!S_ISDIR(st.st_mode))
+            {
+                this->filesystem.unlink(path);
+                this->filesystem.mkdir(path, mode & 07777);
+            }
+            else
+                this->filesystem.chmod(path, mode & 07777);
+        }
+        catch (Exception::FileNotFound& e)
+        {
+            this->filesystem.mkdir(path, mode & 07777);
+        }
+        this->filesystem.chown(path, uid, gid);
+        this->directory_times[path] = mtime;
+        this->entries += 1;
+    }
+
+    void Builder::addFile(std::string path, mode_t mode, uid_t uid, gid_t gid, time_t mtime,
+            std::istream& data, uint64_t size)
+    {
+        if (size > this->filesystem.getMaximumFileSize())
+            throw Exception::FileTooBig();
+        this->ensureParents(path);
+        struct stat st;
+        try
+        {
+            this->filesystem.getattr(path, st);
+            this->filesystem.unlink(path);
+        }
+        catch (Exception::FileNotFound& e)
+        {
+        }
+        this->filesystem.create(path, mode & 07777);
+        this->writeData(path, data, size);
+        if (this->deduplication)
+            this->filesystem.deduplicate(path);
+        if (this->compression)
+        {
+            try
+            {
+                this->filesystem.compress(path, this->threads);
+            }
+            catch (Exception::NotSupported& e)
+            {
+                // Packages that can't hold compressed data keep it as is.
+                this->compression = false;
+                Logging::showWarningW("Files can not be compressed in this package; storing them uncompressed.");
+            }
+        }
+        this->applyAttributes(path, uid, gid, mtime);
+        this->entries += 1;
+        this->bytes += size;
+    }
+
+    void Builder::addSymlink(std::string path, std::string target, uid_t uid, gid_t gid, time_t mtime)
+    {
+        this->ensureParents(path);
+        this->filesystem.symlink(path, target);
+        this->applyAttributes(path, uid, gid, mtime);
+        this->entries += 1;
+    }
+
+    void Builder::addHardlink(std::string path, std::string target)
+    {
+        this->ensureParents(path);
+        this->filesystem.link(path, target);
+        this->entries += 1;
+    }
+
+    void Builder::addDevice(std::string path, mode_t mode, dev_t devid, uid_t uid, gid_t gid, time_t mtime)
+    {
+        this->ensureParents(path);
+        this->filesystem.mknod(path, mode, devid);
+        this->applyAttributes(path, uid, gid, mtime);
+        this->entries += 1;
+    }
+
+    void Builder::importDirectory(std::string source, std::string dest)
+    {
+        struct Entry
+        {
+            std::string source;
+            std::string dest;
+            struct stat st;
+        };
+
+        // Scan the whole tree first, directories before what they
+        // contain and the entries of each directory in name order.
+        std::vector<Entry> scanned;
+        std::vector<std::pair<std::string, std::string> > pending;
+        pending.push_back(std::make_pair(source, dest));
+        while (!pending.empty())
+        {
+            std::pair<std::string, std::string> dir = pending.back();
+            pending.pop_back();
+            DIR *d = opendir(dir.first.c_str());
+            if (d == NULL)
+            {
+                Logging::showErrorW("Unable to read the directory '%s'.", dir.first.c_str());
+                throw Exception::SourceNotReadable();
+            }
+            std::vector<std::string> names;
+            struct dirent *de;
+            while ((de = readdir(d)) != NULL)
+            {
+                if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+                    names.push_back(de->d_name);
+            }
+            closedir(d);
+            std::sort(names.begin(), names.end());
+
+            std::vector<std::pair<std::string, std::string> > subdirs;
+            for (std::vector<std::string>::iterator i = names.begin(); i != names.end(); i++)
+            {
+                Entry e;
+                e.source = dir.first + "/" + *i;
+                e.dest = Builder::joinPath(dir.second, *i);
+                if (lstat(e.source.c_str(), &e.st) != 0)
+                {
+                    Logging::showErrorW("Unable to read '%s'.", e.source.c_str());
+                    throw Exception::SourceNotReadable();
+                }
+                scanned.push_back(e);
+                if (S_ISDIR(e.st.st_mode))
+                    subdirs.push_back(std::make_pair(e.source, e.dest));
+            }
+            for (std::vector<std::pair<std::string, std::string> >::reverse_iterator i = subdirs.rbegin(); i != subdirs.rend(); i++)
+                pending.push_back(*i);
+        }
+
+        // Create every directory, and then write the files in one pass.
+        for (std::vector<Entry>::iterator i = scanned.begin(); i != scanned.end(); i++)
+        {
+            if (S_ISDIR(i->st.st_mode))
+                this->addDirectory(i->dest, i->st.st_mode, i->st.st_uid, i->st.st_gid, i->st.st_mtime);
+        }
+        std::map<std::pair<dev_t, ino_t>, std::string> links;
+        for (std::vector<Entry>::iterator i = scanned.begin(); i != scanned.end(); i++)
+        {
+            const struct stat& st = i->st;
+            if (S_ISREG(st.st_mode))
+            {
+                if (st.st_nlink > 1)
+                {
+                    std::pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+                    std::map<std::pair<dev_t, ino_t>, std::string>::iterator l = links.find(key);
+                    if (l != links.end())
+                    {
+                        this->addHardlink(i->dest, l->second);
+                        continue;
+                    }
+                    links[key] = i->dest;
+                }
+                std::ifstream in(i->source.c_str(), std::ios::in | std::ios::binary);
+                if (!in.is_open())
+                {
+                    Logging::showErrorW("Unable to open '%s'.", i->source.c_str());
+                    throw Exception::SourceNotReadable();
+                }
+                this->addFile(i->dest, st.st_mode, st.st_uid, st.st_gid, st.st_mtime, in, st.st_size);
+            }
+            else if (S_ISLNK(st.st_mode))
+            {
+                std::vector<char> target(st.st_size + 1, 0);
+                ssize_t len = readlink(i->source.c_str(), &target[0], st.st_size);
+                if (len < 0)
+                {
+                    Logging::showErrorW("Unable to read the symbolic link '%s'.", i->source.c_str());
+                    throw Exception::SourceNotReadable();
+                }
+                this->addSymlink(i->dest, std::string(&target[0], len), st.st_uid, st.st_gid, st.st_mtime);
+            }
+            else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode))
+                this->addDevice(i->dest, st.st_mode, st.st_rdev, st.st_uid, st.st_gid, st.st_mtime);
+            else if (!S_ISDIR(st.st_mode))
+                Logging::showWarningW("Skipping '%s', which is not a file, directory, link or device.", i->source.c_str());
+        }
+    }
+
+    void Builder::importTar(std::istream& input, std::string dest)
+    {
+        char header[512];
+        std::string long_name;
+        std::string long_link;
+        uint64_t pax_size = 0;
+        bool has_pax_size = false;
+        int zero_blocks = 0;
+
+        while (zero_blocks < 2)
+        {
+            if (!Builder::readFully(input, header, 512))
+                break;
+
+            // The archive ends with two zeroed blocks.
+            bool zero = true;
+            for (int i = 0; i < 512 && zero; i += 1)
+                zero = (header[i] == 0);
+            if (zero)
+            {
+                zero_blocks += 1;
+                continue;
+            }
+            zero_blocks = 0;
+
+            // The checksum is of the header with the checksum field
+            // itself read as spaces.
+            uint64_t checksum = Builder::parseNumber(header + 148, 8);
+            uint64_t sum = 0;
+            for (int i = 0; i < 512; i += 1)
+                sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) header[i];
+            if (sum != checksum)
+            {
+                Logging::showErrorW("The tar stream has a header with a bad checksum.");
+                throw Exception::SourceNotValid();
+            }
+
+            char type = header[156];
+            uint64_t size = has_pax_size ? pax_size : Builder::parseNumber(header + 124, 12);
+            has_pax_size = false;
+
+            // GNU long names and links, and pax records, describe the
+            // entry that follows them.
+            if (type == 'L' || type == 'K' || type == 'x')
+            {
+                std::vector<char> data(size);
+                if (size > 0 && !Builder::readFully(input, &data[0], size))
+                    throw Exception::SourceNotReadable();
+                this->skipData(input, (512 - size % 512) % 512);
+                if (type == 'L')
+                    long_name = std::string(&data[0], strnlen(&data[0], size));
+                else if (type == 'K')
+                    long_link = std::string(&data[0], strnlen(&data[0], size));
+                else
+                {
+                    // Each record is "<length> <key>=<value>\n".
+                    size_t off = 0;
+                    while (off < data.size())
+                    {
+                        size_t space = off;
+                        while (space < data.size() && data[space] != ' ')
+                            space += 1;
+                        uint64_t rlen = strtoull(std::string(&data[off], space - off).c_str(), NULL, 10);
+                        if (rlen == 0 || off + rlen > data.size() || space >= off + rlen)
+                            break;
+                        std::string record(&data[space + 1], off + rlen - space - 2);
+                        size_t eq = record.find('=');
+                        if (eq != std::string::npos)
+                        {
+                            std::string key = record.substr(0, eq);
+                            if (key == "path")
+                                long_name = record.substr(eq + 1);
+                            else if (key == "linkpath")
+                                long_link = record.substr(eq + 1);
+                            else if (key == "size")
+                            {
+                                pax_size = strtoull(record.substr(eq + 1).c_str(), NULL, 10);
+                                has_pax_size = true;
+                            }
+                        }
+                        off += rlen;
+                    }
+                }
+                continue;
+            }
+
+            std::string name = long_name;
+            if (name.empty())
+            {
+                name = std::string(header, strnlen(header, 100));
+                if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != 0)
+                    name = std::string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+            }
+            std::string link = long_link;
+            if (link.empty())
+                link = std::string(header + 157, strnlen(header + 157, 100));
+            long_name.clear();
+            long_link.clear();
+
+            mode_t mode = (mode_t) Builder::parseNumber(header + 100, 8);
+            uid_t uid = (uid_t) Builder::parseNumber(header + 108, 8);
+            gid_t gid = (gid_t) Builder::parseNumber(header + 116, 8);
+            time_t mtime = (time_t) Builder::parseNumber(header + 136, 12);
+            std::string path = Builder::joinPath(dest, name);
+
+            if (type == '0' || type == '\0' || type == '7')
+            {
+                this->addFile(path, mode, uid, gid, mtime, input, size);
+                this->skipData(input, (512 - size % 512) % 512);
+                continue;
+            }
+            else if (path == dest || path == "/")
+            {
+                // The archive's own root.
+            }
+            else if (type == '5')
+                this->addDirectory(path, mode, uid, gid, mtime);
+            else if (type == '2')
+                this->addSymlink(path, link, uid, gid, mtime);
+            else if (type == '1')
+                this->addHardlink(path, Builder::joinPath(dest, link));
+            else if (type == '3' || type == '4' || type == '6')
+            {
+                mode_t kind = (type == '3') ? S_IFCHR : ((type == '4') ? S_IFBLK : S_IFIFO);
+                dev_t devid = makedev(Builder::parseNumber(header + 329, 8), Builder::parseNumber(header + 337, 8));
+                this->addDevice(path, kind | (mode & 07777), devid, uid, gid, mtime);
+            }
+            else
+                Logging::showWarningW("Skipping '%s', which has an unsupported type '%c'.", name.c_str(), type);
+
+            // Anything that isn't a file has no data, except for the
+            // types that are skipped.
+            if (type != '0' && type != '\0' && type != '7')
+                this->skipData(input, ((size + 511) / 512) * 512);
+        }
+    }
+
+    void Builder::finish()
+    {
+        // Deepest first, although setting a time doesn't change the
+        // parent's.
+        for (std::map<std::string, time_t>::reverse_iterator i = this->directory_times.rbegin();
+                i != this->directory_times.rend(); i++)
+            this->filesystem.utimens(i->first, i->second, i->second);
+        this->directory_times.clear();
+    }
+
+    uint64_t Builder::getEntryCount() const
+    {
+        return this->entries;
+    }
+
+    uint64_t Builder::getByteCount() const
+    {
+        return this->bytes;
+    }
+
+    std::string Builder::joinPath(const std::string& dest, const std::string& path)
+    {
+        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(dest);
+        std::vector<std::string> rest = LowLevel::Util::splitPathBySeperators(path);
+        for (std::vector<std::string>::iterator i = rest.begin(); i != rest.end(); i++)
+        {
+            if (*i == "..")
+            {
+                if (!components.empty())
+                    components.pop_back();
+            }
+            else if (*i != ".")
+                components.push_back(*i);
+        }
+        std::string result;
+        for (std::vector<std::string>::iterator i = components.begin(); i != components.end(); i++)
+            result += "/" + *i;
+        return result.empty() ? "/" : result;
+    }
+
+    void Builder::ensureParents(const std::string& path)
+    {
+        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
+        std::string current;
+        for (size_t i = 0; i + 1 < components.size(); i += 1)
+        {
+            current += "/" + components[i];
+            if (this->directory_times.find(current) != this->directory_times.end())
+                continue;
+            struct stat st;
+            try
+            {
+                this->filesystem.getattr(current, st);
+            }
+            catch (Exception::FileNotFound& e)
+            {
+                this->filesystem.mkdir(current, 0755);
+                this->directory_times[current] = time(NULL);
+            }
+        }
+    }
+
+    void Builder::applyAttributes(const std::string& path, uid_t uid, gid_t gid, time_t mtime)
+    {
+        this->filesystem.chown(path, uid, gid);
+        this->filesystem.utimens(path, mtime, mtime);
+    }
+
+    void Builder::writeData(const std::string& path, std::istream& data, uint64_t size)
+    {
+        // Allocate every block of the file at once, so that they are
+        // contiguous, before copying the data across.
+        this->filesystem.truncate(path, size);
+        if (size == 0)
+            return;
+        if (this->buffer.empty())
+            this->buffer.resize(BUILDER_BUFFER_SIZE);
+
+        FSFile file = this->filesystem.open(path);
+        file.seekp(0);
+        uint64_t done = 0;
+        while (done < size)
+        {
+            uint64_t amount = std::min<uint64_t>(size - done, this->buffer.size());
+            if (!Builder::readFully(data, &this->buffer[0], amount))
+            {
+                Logging::showErrorW("Unable to read the data of '%s'.", path.c_str());
+                throw Exception::SourceNotReadable();
+            }
+            file.write(&this->buffer[0], amount);
+            if (file.fail())
+                throw Exception::InternalInconsistency();
+            done += amount;
+        }
+        file.close();
+    }
+
+    bool Builder::readFully(std::istream& input, char *out, uint64_t count)
+    {
+        input.read(out, count);
+        return (uint64_t) input.gcount() == count;
+    }
+
+    void Builder::skipData(std::istream& input, uint64_t count)
+    {
+        if (count == 0)
+            return;
+        if (this->buffer.empty())
+            this->buffer.resize(BUILDER_BUFFER_SIZE);
+        while (count > 0)
+        {
+            uint64_t amount = std::min<uint64_t>(count, this->buffer.size());
+            if (!Builder::readFully(input, &this->buffer[0], amount))
+                throw Exception::SourceNotReadable();
+            count -= amount;
+        }
+    }
+
+    uint64_t Builder::parseNumber(const char *field, size_t length)
+    {
+        // Large values are stored in base 256, flagged by the top bit
+        // of the first byte.
+        if ((field[0] & 0x80) != 0)
+        {
+            uint64_t value = field[0] & 0x3F;
+            for (size_t i = 1; i < length; i += 1)
+                value = (value << 8) | (unsigned char) field[i];
+            return value;
+        }
+        uint64_t value = 0;
+        size_t i = 0;
+        while (i < length && (field[i] == ' ' || field[i] == 0))
+            i += 1;
+        for (; i < length && field[i] >= '0' && field[i] <= '7'; i += 1)
+            value = (value << 3) | (field[i] - '0');
+        return value;
+    }
+}
@@ -0,0 +1,133 @@
+/* vim: set ts=4 sw=4 tw=0 :*/
+
+#ifndef CLASS_BUILDER
+#define CLASS_BUILDER
+
+#include "src/package-fs/config.h"
+
+#include <string>
+#include <istream>
+#include <map>
+#include <utility>
+#include <vector>
+#include "src/package-fs/fs.h"
+#include <sys/types.h>
+
+namespace AppLib
+{
+    //! Populates a package from a directory tree or a tar stream.
+    /*!
+     * Each file is truncated to its final size before any of its
+     * data is written, so that its blocks are allocated in a single
+     * contiguous run at the end of the package, and its data is then
+     * copied in chunks of BUILDER_BUFFER_SIZE bytes.  A package that
+     * is built from scratch is therefore written out sequentially.
+     *
+     * The times of directories are set by finish(), since adding
+     * children to a directory changes them.
+     */
+    class Builder
+    {
+    public:
+        //! Creates a builder that adds to the specified package.
+        /*!
+         * @param filesystem The package to add to.
+         * @param threads The number of threads used to compress each
+         *        file, if compression is enabled.
+         */
+        Builder(FS& filesystem, unsigned int threads = 1);
+
+        //! Sets whether each file is compressed after it is added.
+        void setCompression(bool enabled);
+
+        //! Sets whether each file is deduplicated after it is added.
+        void setDeduplication(bool enabled);
+
+        //! Adds a directory to the package.  Missing parents are
+        //! created, and an existing directory is updated in place.
+        void addDirectory(std::string path, mode_t mode, uid_t uid, gid_t gid, time_t mtime);
+
+        //! Adds a file to the package, copying size bytes of data from
+        //! the specified stream.
+        /*!
+         * @throw Exception::SourceNotReadable
+         * @throw Exception::FileTooBig
+         */
+        void addFile(std::string path, mode_t mode, uid_t uid, gid_t gid, time_t mtime,
+                std::istream& data, uint64_t size);
+
+        //! Adds a symbolic link to the package.
+        void addSymlink(std::string path, std::string target, uid_t uid, gid_t gid, time_t mtime);
+
+        //! Adds a hard link to a file that has already been added.
+        void addHardlink(std::string path, std::string target);
+
+        //! Adds a device node or FIFO to the package.
+        void addDevice(std::string path, mode_t mode, dev_t devid, uid_t uid, gid_t gid, time_t mtime);
+
+        //! Adds everything beneath a directory on the host to the
+        //! specified directory in the package.
+        /*!
+         * The whole tree is scanned before anything is added, so that
+         * every directory exists before the first file is written and
+         * the files are then written out in a single pass.  Files with
+         * several links on the host are added once and linked to.
+         *
+         * @throw Exception::SourceNotReadable
+         */
+        void importDirectory(std::string source, std::string dest = "/");
+
+        //! Adds the entries of a tar stream (ustar, with GNU long names
+        //! and pax path, linkpath and size records) to the specified
+        //! directory in the package.
+        /*!
+         * @throw Exception::SourceNotReadable
+         * @throw Exception::SourceNotValid
+         */
+        void importTar(std::istream& input, std::string dest = "/");
+
+        //! Sets the times of the directories that were added.
+        void finish();
+
+        //! Returns the number of entries and bytes of file data added.
+        uint64_t getEntryCount() const;
+        uint64_t getByteCount() const;
+
+    private:
+        FS& filesystem;
+        unsigned int threads;
+        bool compression;
+        bool deduplication;
+        uint64_t entries;
+        uint64_t bytes;
+        std::vector<char> buffer;
+
+        //! The modification times of the directories that were added,
+        //! applied by finish().
+        std::map<std::string, time_t> directory_times;
+
+        //! Joins a path from a source onto the destination directory.
+        static std::string joinPath(const std::string& dest, const std::string& path);
+
+        //! Creates any missing parent directories of a path.
+        void ensureParents(const std::string& path);
+
+        //! Sets the ownership and times of an entry.
+        void applyAttributes(const std::string& path, uid_t uid, gid_t gid, time_t mtime);
+
+        //! Copies size bytes from data to the start of a file.
+        void writeData(const std::string& path, std::istream& data, uint64_t size);
+
+        //! Reads exactly count bytes from a tar stream, returning false
+        //! at the end of the stream.
+        static bool readFully(std::istream& input, char *out, uint64_t count);
+
+        //! Skips count bytes of a tar stream.
+        void skipData(std::istream& input, uint64_t count);
+
+        //! Parses a numeric field of a tar header.
+        static uint64_t parseNumber(const char *field, size_t length);
+    };
+}
+
+#endif
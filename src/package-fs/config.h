@@ -17,6 +17,17 @@
 #define LENGTH_FSINFO    (4096)
 #define OFFSET_DATA      (LENGTH_BOOTSTRAP + LENGTH_LOOKUP + LENGTH_FSINFO)
 
+// Version 2 packages keep a journal of metadata changes in the last
+// LENGTH_JOURNAL bytes of the bootstrap area.
+#define LENGTH_JOURNAL   (2 * 1024 * 1024)
+#define OFFSET_JOURNAL   (LENGTH_BOOTSTRAP - LENGTH_JOURNAL)
+
+// Version 2 packages keep a prefetch profile in the LENGTH_PROFILE
+// bytes before the journal, at the end of the space the first
+// megabyte of the bootstrap area leaves for an executable stub.
+#define LENGTH_PROFILE   (256 * 1024)
+#define OFFSET_PROFILE   (OFFSET_JOURNAL - LENGTH_PROFILE)
+
 // Name of the filesystem implementation.  Must be 9 characters
 // because the automatic terminating NULL character makes it 10
 // in total (and we write out 10 bytes to our FSINFO block).
@@ -32,21 +43,116 @@
 #define BSIZE_FILE      4096
 #define BSIZE_DIRECTORY 4096
 
+// The versions of the on-disk format, as stored in the ver_major
+// field of the FSInfo block.  Packages created before the format was
+// versioned have a ver_major of 0 and use the version 1 format.
+#define FORMAT_VERSION_1 1
+#define FORMAT_VERSION_2 2
+#define FORMAT_VERSION_DEFAULT FORMAT_VERSION_2
+
 // Number of subdirectories / subfiles allowed in a single
-// directory.
+// directory in a version 1 package.  Version 2 directories
+// continue into further blocks and are unbounded.
 #define DIRECTORY_CHILDREN_MAX 1901
 
-// The maximum file size allowed (10MB + data offset from the 32-bit
-// integer limit).
+// The maximum file size allowed in a version 1 package (10MB + data
+// offset from the 32-bit integer limit), and in a version 2 package.
 #define MSIZE_FILE (0xFFFFFFFF - OFFSET_DATA - (1024 * 1024 * 10))
+#define MSIZE_FILE_V2 ((uint64_t) 1 << 48)
+
+// Compressed files are compressed in extents of EXTENT_BLOCKS blocks.
+// The first segment of a compressed extent has SEGMENT_COMPRESSED set
+// in the low bits of its position (which are otherwise always zero,
+// as blocks are aligned), and the segments past the end of the
+// compressed data are 0.  The compressed data starts with a header of
+// HSIZE_EXTENT bytes giving its length and codec.
+#define EXTENT_BLOCKS      16
+#define EXTENT_SIZE        (EXTENT_BLOCKS * BSIZE_FILE)
+#define SEGMENT_COMPRESSED 1
+#define SEGMENT_FLAGS_MASK (BSIZE_FILE - 1)
+#define HSIZE_EXTENT       8
+
+// Deduplicated data blocks may be used by several files at once.  The
+// segments that address them have SEGMENT_SHARED set in the low bits
+// of their positions, and each such block is recorded in the block
+// index (version 2 packages only) with a hash of its contents and the
+// number of segments that reference it, in entries of
+// BLOCKINDEX_ENTRY_SIZE bytes.
+#define SEGMENT_SHARED        2
+#define BLOCKINDEX_ENTRY_SIZE 16
 
-// Define the sizes of each of the header types.
+// The highest inode ID in a version 1 package, and in a version 2
+// package (where the lookup table is split into LOOKUP_BLOCK_IDS
+// blocks that are each addressed from the fixed lookup area).
+#define INODE_ID_MAX     0xFFFF
+#define LOOKUP_BLOCK_IDS (BSIZE_FILE / 8)
+#define INODE_ID_MAX_V2  ((LENGTH_LOOKUP / 8) * LOOKUP_BLOCK_IDS - 1)
+
+// Define the sizes of each of the header types in a version 1
+// package.
 #define HSIZE_FILE       308
 #define HSIZE_SEGINFO    8
 #define HSIZE_FREELIST   8
 #define HSIZE_FSINFO     1614
 #define HSIZE_DIRECTORY  294
 
+// And in a version 2 package.
+#define HSIZE_FILE_V2       320
+#define HSIZE_SEGINFO_V2    16
+#define HSIZE_FREELIST_V2   16
+#define HSIZE_DIRECTORY_V2  310
+#define HSIZE_DIRINFO_V2    16
+#define HSIZE_BLOCKINDEX_V2 16
+
+// The number of decoded inodes kept in memory by each open
+// filesystem.  Each cached inode costs a few hundred bytes, plus
+// four bytes per slot up to the last child of a directory.
+#define INODE_CACHE_SIZE 8192
+
+// The number of resolved paths (and paths known not to exist)
+// remembered by each open package.
+#define PATH_CACHE_SIZE 16384
+
+// The number of files whose decoded segment lists are kept
+// in memory by each open package.
+#define SEGMENT_CACHE_SIZE 256
+
+// The size of the chunks in which the builder copies file data into
+// a package.
+#define BUILDER_BUFFER_SIZE (1024 * 1024)
+
+// The number of bytes of sequential writes to a file opened through a
+// mount that are held in memory before being written to the package.
+#define WRITE_BUFFER_SIZE (256 * 1024)
+
+// The number of seconds after which the metadata changes collected
+// by the journal are written out, even if there are only a few.
+#define JOURNAL_COMMIT_INTERVAL 5
+
+// The number of seconds after a package is mounted during which the
+// blocks read from it are recorded into its prefetch profile, if it
+// doesn't have one yet.
+#define PROFILE_RECORD_TIME 10
+
+// The largest gap, in bytes, between two ranges of a prefetch profile
+// that are read as one.  Reading a little more is cheaper than seeking.
+#define PROFILE_MERGE_GAP (64 * 1024)
+
+// The smallest read through a mount that is spliced from the package
+// to the kernel rather than copied.  Below this, setting up the splice
+// costs more than the copy.
+#define SPLICE_READ_MIN (64 * 1024)
+
+// The size of the sequential reads each thread of the package checker
+// makes while scanning its share of the package.
+#define CHECKER_READ_SIZE (4 * 1024 * 1024)
+
+// The number of seconds the kernel may cache attributes and
+// directory entries of a package that is mounted read-only.
+// Read-only packages can't change underneath the kernel, so
+// this can be long.
+#define READONLY_CACHE_TIMEOUT 86400
+
 /************ End Configuration **************/
 
 #define LIBRARY_VERSION_MAJOR 0
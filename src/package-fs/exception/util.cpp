@@ -20,5 +20,15 @@ namespace AppLib
         {
             return "The specified functionality is not implemented.";
         }
+
+        const char* SourceNotReadable::what() const throw()
+        {
+            return "The source being imported into the package could not be read.";
+        }
+
+        const char* SourceNotValid::what() const throw()
+        {
+            return "The source being imported into the package is not in a supported format.";
+        }
     }
 }
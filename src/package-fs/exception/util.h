@@ -23,6 +23,16 @@ namespace AppLib
         {
             virtual const char* what() const throw();
         };
+
+        class SourceNotReadable : public std::exception
+        {
+            virtual const char* what() const throw();
+        };
+
+        class SourceNotValid : public std::exception
+        {
+            virtual const char* what() const throw();
+        };
     }
 }
 
@@ -4,15 +4,18 @@
 #include <cstdlib>
 #include "src/package-fs/fs.h"
 #include "src/package-fs/exception/package.h"
+#include "src/package-fs/lowlevel/journal.h"
+#include "src/package-fs/lowlevel/profile.h"
 #include "src/package-fs/lowlevel/util.h"
 #include <linux/kdev_t.h>
 
 namespace AppLib
 {
-    FS::FS(std::string path, uid_t uid, gid_t gid)
+    FS::FS(std::string path, uid_t uid, gid_t gid,
+            LowLevel::BlockStreamBackend::BlockStreamBackend backend)
         : uid(uid), gid(gid)
     {
-        this->stream = new LowLevel::BlockStream(path.c_str());
+        this->stream = new LowLevel::BlockStream(path.c_str(), backend);
         if (!this->stream->is_open())
         {
             delete this->stream;
@@ -28,94 +31,36 @@ namespace AppLib
         }
     }
 
+    FS::~FS()
+    {
+        // The package writes out its journal as it is closed, so it has
+        // to go before the stream does.
+        delete this->filesystem;
+        this->stream->close();
+        delete this->stream;
+    }
+
     void FS::getattr(std::string path, struct stat& stbufOut) const
     {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
-
-        // Ensure that the inode is also one of the
-        // accepted types.
-        if (buf.type != LowLevel::INodeType::INT_DIRECTORY &&
-                buf.type != LowLevel::INodeType::INT_FILEINFO &&
-                buf.type != LowLevel::INodeType::INT_SYMLINK &&
-                buf.type != LowLevel::INodeType::INT_DEVICE &&
-                buf.type != LowLevel::INodeType::INT_HARDLINK)
-            throw Exception::FileNotFound();
-
-        // Resolve hardlink if needed.
-        if (buf.type == LowLevel::INodeType::INT_HARDLINK)
-            buf = buf.resolve(this->filesystem);
-
-        // Set the values into the stat structure.
-        stbufOut.st_ino = buf.inodeid;
-        stbufOut.st_dev = buf.dev;
-        stbufOut.st_mode = buf.mask;
-        stbufOut.st_nlink = buf.nlink;
-        stbufOut.st_uid = buf.uid;
-        stbufOut.st_gid = buf.gid;
-        stbufOut.st_rdev = buf.rdev;
-        stbufOut.st_atime = buf.atime;
-        stbufOut.st_mtime = buf.mtime;
-        stbufOut.st_ctime = buf.ctime;
-
-        // File-based inodes are treated differently to directory inodes.
-        if (buf.type == LowLevel::INodeType::INT_FILEINFO ||
-                buf.type == LowLevel::INodeType::INT_SYMLINK ||
-                buf.type == LowLevel::INodeType::INT_DEVICE)
-        {
-            stbufOut.st_size = buf.dat_len;
-            stbufOut.st_blksize = BSIZE_FILE;
-            stbufOut.st_blocks = buf.blocks;
-
-            if (buf.type == LowLevel::INodeType::INT_FILEINFO)
-                stbufOut.st_mode = S_IFREG | stbufOut.st_mode;
-            else if (buf.type == LowLevel::INodeType::INT_SYMLINK)
-                stbufOut.st_mode = S_IFLNK | stbufOut.st_mode;
-        }
-        else if (buf.type == LowLevel::INodeType::INT_DIRECTORY)
-        {
-            stbufOut.st_size = BSIZE_DIRECTORY;
-            stbufOut.st_blksize = BSIZE_FILE;
-            stbufOut.st_blocks = BSIZE_DIRECTORY / BSIZE_FILE;
-            stbufOut.st_mode = S_IFDIR | stbufOut.st_mode;
-        }
-        else
-            throw Exception::InternalInconsistency();
+        this->copyINodeToStat(buf, stbufOut);
     }
 
     std::string FS::readlink(std::string path) const
     {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
-
-        if (buf.type == LowLevel::INodeType::INT_SYMLINK)
-        {
-            // Read the link information out of the file.
-            FSFile* file = new FSFile(this->filesystem, this->stream, buf.inodeid);
-            file->open(std::ios_base::in);
-            char* buffer = (char*)malloc(buf.dat_len + 1);
-            std::streamsize count = file->read(buffer, buf.dat_len);
-            if (count < buf.dat_len)
-                buffer[count] = '\0';
-            else
-                buffer[buf.dat_len] = '\0';
-            std::string result = buffer;
-            free(buffer);
-
-            // Check to make sure it is valid.
-            if (count != buf.dat_len)
-                throw Exception::InternalInconsistency();
-
-            return result;
-        }
-        else
-            throw Exception::NotSupported();
+        return this->readSymlink(buf);
     }
 
     void FS::mknod(std::string path, mode_t mode, dev_t devid)
     {
+        LowLevel::Transaction guard(this->filesystem);
         auto configuration = [&](LowLevel::INode& buf)
         {
             buf.dev = MINOR(devid);
@@ -126,6 +71,7 @@ namespace AppLib
 
     void FS::mkdir(std::string path, mode_t mode)
     {
+        LowLevel::Transaction guard(this->filesystem);
         auto configuration = [&](LowLevel::INode& buf)
         {
         };
@@ -134,6 +80,7 @@ namespace AppLib
 
     void FS::unlink(std::string path)
     {
+        LowLevel::Transaction guard(this->filesystem);
         LowLevel::INode child, parent;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
@@ -149,7 +96,7 @@ namespace AppLib
             throw Exception::InternalInconsistency();
 
         // Get the inode's position.
-        uint32_t pos = this->filesystem->getINodePositionByID(child.inodeid);
+        uint64_t pos = this->filesystem->getINodePositionByID(child.inodeid);
         if (pos == 0)
             throw Exception::InternalInconsistency();
 
@@ -157,6 +104,10 @@ namespace AppLib
         int result = 0;
         LowLevel::INode real = child.resolve(this->filesystem);
 
+        // Forget the path before we start changing the tree.
+        std::string key = this->getCacheKey(path);
+        this->pathcache.invalidate(key);
+
         // Remove the inode from the directory.
         LowLevel::FSResult::FSResult res = this->filesystem->removeChildFromDirectoryINode(parent.inodeid, real.inodeid);
         if (res == LowLevel::FSResult::E_FAILURE_NOT_A_DIRECTORY)
@@ -170,7 +121,7 @@ namespace AppLib
         // the hardlink block
         if (real.inodeid != child.inodeid)
         {
-            uint32_t rpos = this->filesystem->getINodePositionByID(real.inodeid);
+            uint64_t rpos = this->filesystem->getINodePositionByID(real.inodeid);
             if (this->filesystem->resetBlock(rpos) != LowLevel::FSResult::E_SUCCESS)
                 throw Exception::InternalInconsistency();
             if (this->filesystem->setINodePositionByID(real.inodeid, 0) != LowLevel::FSResult::E_SUCCESS)
@@ -196,10 +147,13 @@ namespace AppLib
             // Otherwise just save the new nlink value.
             this->saveINode(child);
         }
+
+        this->pathcache.insertNegative(key);
     }
 
     void FS::rmdir(std::string path)
     {
+        LowLevel::Transaction guard(this->filesystem);
         LowLevel::INode child, parent;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
@@ -215,10 +169,14 @@ namespace AppLib
             throw Exception::DirectoryNotEmpty();
 
         // Get the inode's position.
-        uint32_t pos = this->filesystem->getINodePositionByID(child.inodeid);
+        uint64_t pos = this->filesystem->getINodePositionByID(child.inodeid);
         if (pos == 0)
             throw Exception::InternalInconsistency();
 
+        // Forget the path before we start changing the tree.
+        std::string key = this->getCacheKey(path);
+        this->pathcache.invalidateTree(key);
+
         // Remove the inode from the directory.
         LowLevel::FSResult::FSResult res = this->filesystem->removeChildFromDirectoryINode(parent.inodeid, child.inodeid);
         if (res == LowLevel::FSResult::E_FAILURE_NOT_A_DIRECTORY)
@@ -228,15 +186,20 @@ namespace AppLib
         else if (res != LowLevel::FSResult::E_SUCCESS)
             throw Exception::InternalInconsistency();
 
-        // Now reset the block and release the inode ID.
+        // Now reset the blocks and release the inode ID.
+        if (this->filesystem->resetDirectoryInfoBlocks(pos) != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
         if (this->filesystem->resetBlock(pos) != LowLevel::FSResult::E_SUCCESS)
             throw Exception::InternalInconsistency();
         if (this->filesystem->setINodePositionByID(child.inodeid, 0) != LowLevel::FSResult::E_SUCCESS)
             throw Exception::InternalInconsistency();
+
+        this->pathcache.insertNegative(key);
     }
 
     void FS::symlink(std::string linkPath, std::string targetPath)
     {
+        LowLevel::Transaction guard(this->filesystem);
         auto configuration = [&](LowLevel::INode& buf)
         {
         };
@@ -269,7 +232,8 @@ namespace AppLib
 
     void FS::rename(std::string srcPath, std::string destPath)
     {
-        this->ensurePathRenamability(destPath, this->uid);
+        LowLevel::Transaction guard(this->filesystem);
+        this->ensurePathRenamability(destPath, this->getContextUID());
         this->ensurePathExists(srcPath);
 
         LowLevel::INode child, srcParent, destParent;
@@ -292,6 +256,12 @@ namespace AppLib
                 this->unlink(destPath);
         }
 
+        // Forget both paths (and anything beneath them) before we
+        // start changing the tree.
+        std::string srcKey = this->getCacheKey(srcPath);
+        this->pathcache.invalidateTree(srcKey);
+        this->pathcache.invalidateTree(this->getCacheKey(destPath));
+
         // Check if the directory owner needs to change.
         if (srcParent.inodeid != destParent.inodeid)
         {
@@ -320,16 +290,29 @@ namespace AppLib
         child.setFilename(LowLevel::Util::extractBasenameFromPath(destPath).c_str());
         this->touchINode(child, "c");
         this->saveINode(child);
+
+        if (srcKey != this->getCacheKey(destPath))
+            this->pathcache.insertNegative(srcKey);
     }
 
     void FS::link(std::string linkPath, std::string targetPath)
     {
+        LowLevel::Transaction guard(this->filesystem);
         this->ensurePathIsAvailable(linkPath);
         this->ensurePathExists(targetPath);
 
         LowLevel::INode child;
         if (!this->retrievePathToINode(targetPath, child))
             throw Exception::FileNotFound();
+        this->link(linkPath, child.inodeid);
+    }
+
+    void FS::link(std::string linkPath, uint32_t targetid)
+    {
+        LowLevel::Transaction guard(this->filesystem);
+        this->ensurePathIsAvailable(linkPath);
+
+        LowLevel::INode child = this->retrieveINodeByID(targetid);
 
         // Ensure the target is a plain old file.
         if (child.type == LowLevel::INodeType::INT_DIRECTORY)
@@ -358,6 +341,7 @@ namespace AppLib
 
     void FS::chmod(std::string path, mode_t mode)
     {
+        LowLevel::Transaction guard(this->filesystem);
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
@@ -366,14 +350,36 @@ namespace AppLib
         this->saveINode(child);
     }
 
+    void FS::chmod(uint32_t id, mode_t mode)
+    {
+        LowLevel::Transaction guard(this->filesystem);
+        LowLevel::INode child = this->retrieveINodeByID(id);
+        child.mask = this->extractMaskFromMode(mode);
+        this->touchINode(child, "ca");
+        this->saveINode(child);
+    }
+
     void FS::chown(std::string path, uid_t uid, gid_t gid)
     {
+        LowLevel::Transaction guard(this->filesystem);
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
-        if (uid != -1)
+        if (uid != (uid_t) -1)
             child.uid = uid;
-        if (gid != -1)
+        if (gid != (gid_t) -1)
+            child.gid = gid;
+        this->touchINode(child, "ca");
+        this->saveINode(child);
+    }
+
+    void FS::chown(uint32_t id, uid_t uid, gid_t gid)
+    {
+        LowLevel::Transaction guard(this->filesystem);
+        LowLevel::INode child = this->retrieveINodeByID(id);
+        if (uid != (uid_t) -1)
+            child.uid = uid;
+        if (gid != (gid_t) -1)
             child.gid = gid;
         this->touchINode(child, "ca");
         this->saveINode(child);
@@ -381,7 +387,8 @@ namespace AppLib
 
     void FS::truncate(std::string path, off_t size)
     {
-        if (size > MSIZE_FILE)
+        LowLevel::Transaction guard(this->filesystem);
+        if ((uint64_t) size > this->getMaximumFileSize())
             throw Exception::FileTooBig();
         this->ensurePathExists(path);
 
@@ -400,8 +407,104 @@ namespace AppLib
             throw Exception::InternalInconsistency();
     }
 
+    void FS::truncate(uint32_t id, off_t size)
+    {
+        LowLevel::Transaction guard(this->filesystem);
+        if ((uint64_t) size > this->getMaximumFileSize())
+            throw Exception::FileTooBig();
+
+        LowLevel::INode buf = this->retrieveINodeByID(id);
+        this->touchINode(buf, "cma");
+        this->saveINode(buf);
+
+        FSFile file = this->filesystem->getFile(buf.inodeid);
+        file.open();
+        file.truncate(size);
+        file.close();
+        if (file.fail() || file.bad())
+            throw Exception::InternalInconsistency();
+    }
+
+    void FS::compress(std::string path, unsigned int threads)
+    {
+        LowLevel::Transaction guard(this->filesystem);
+        this->ensurePathExists(path);
+
+        LowLevel::INode buf;
+        if (!this->retrievePathToINode(path, buf))
+            throw Exception::FileNotFound();
+        if (buf.type != LowLevel::INodeType::INT_FILEINFO)
+            throw Exception::NotSupported();
+
+        LowLevel::FSResult::FSResult res = this->filesystem->compressFile(buf.inodeid, threads);
+        if (res == LowLevel::FSResult::E_FAILURE_NOT_IMPLEMENTED)
+            throw Exception::NotSupported();
+        else if (res != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
+    }
+
+    void FS::deduplicate(std::string path)
+    {
+        LowLevel::Transaction guard(this->filesystem);
+        this->ensurePathExists(path);
+
+        LowLevel::INode buf;
+        if (!this->retrievePathToINode(path, buf))
+            throw Exception::FileNotFound();
+        if (buf.type != LowLevel::INodeType::INT_FILEINFO)
+            throw Exception::NotSupported();
+
+        LowLevel::FSResult::FSResult res = this->filesystem->deduplicateFile(buf.inodeid);
+        if (res == LowLevel::FSResult::E_FAILURE_NOT_IMPLEMENTED)
+            throw Exception::NotSupported();
+        else if (res != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
+    }
+
+    void FS::sync()
+    {
+        LowLevel::ExclusiveLock guard(this->filesystem->getLock());
+        if (this->filesystem->sync() != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
+    }
+
+    void FS::commitJournal()
+    {
+        LowLevel::ExclusiveLock guard(this->filesystem->getLock());
+        if (this->filesystem->commitJournal() != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
+    }
+
+    bool FS::startProfile()
+    {
+        LowLevel::Profile* profile = this->filesystem->getProfile();
+        if (!profile->isAvailable())
+            return false;
+        profile->start();
+        return true;
+    }
+
+    void FS::saveProfile()
+    {
+        LowLevel::ExclusiveLock guard(this->filesystem->getLock());
+        LowLevel::Profile* profile = this->filesystem->getProfile();
+        profile->stop();
+        if (profile->isAvailable() && !profile->save())
+            throw Exception::InternalInconsistency();
+    }
+
+    uint64_t FS::prefetchProfile()
+    {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
+        LowLevel::Profile* profile = this->filesystem->getProfile();
+        if (!profile->load())
+            return 0;
+        return profile->prefetch();
+    }
+
     FSFile FS::open(std::string path)
     {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
         this->ensurePathExists(path);
 
         LowLevel::INode buf;
@@ -416,6 +519,7 @@ namespace AppLib
 
     std::vector<std::string> FS::readdir(std::string path)
     {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
         this->ensurePathExists(path);
 
         LowLevel::INode buf;
@@ -435,6 +539,7 @@ namespace AppLib
 
     void FS::create(std::string path, mode_t mode)
     {
+        LowLevel::Transaction guard(this->filesystem);
         auto configuration = [&](LowLevel::INode& buf)
         {
         };
@@ -443,6 +548,7 @@ namespace AppLib
 
     void FS::utimens(std::string path, time_t access, time_t modification)
     {
+        LowLevel::Transaction guard(this->filesystem);
         this->ensurePathExists(path);
 
         LowLevel::INode buf;
@@ -453,18 +559,149 @@ namespace AppLib
         this->saveINode(buf);
     }
 
+    void FS::utimens(uint32_t id, time_t access, time_t modification)
+    {
+        LowLevel::Transaction guard(this->filesystem);
+        LowLevel::INode buf = this->retrieveINodeByID(id);
+        buf.atime = access;
+        buf.mtime = modification;
+        this->saveINode(buf);
+    }
+
+    void FS::getattr(uint32_t id, struct stat& stbufOut) const
+    {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
+        LowLevel::INode buf = this->filesystem->getINodeByID(id);
+        this->copyINodeToStat(buf, stbufOut);
+    }
+
+    uint32_t FS::lookup(uint32_t parentid, std::string name, struct stat& stbufOut) const
+    {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
+        if (name.length() > 255)
+            throw Exception::FilenameTooLong();
+
+        LowLevel::INode parent = this->filesystem->getINodeByID(parentid);
+        if (parent.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        if (parent.type != LowLevel::INodeType::INT_DIRECTORY)
+            throw Exception::NotADirectory();
+
+        // Children that are hardlinks come back already resolved.
+        LowLevel::INode buf = this->filesystem->getChildOfDirectory(parentid, name);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        this->copyINodeToStat(buf, stbufOut);
+        return buf.inodeid;
+    }
+
+    std::string FS::readlink(uint32_t id) const
+    {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
+        LowLevel::INode buf = this->filesystem->getINodeByID(id);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        return this->readSymlink(buf);
+    }
+
+    FSFile FS::open(uint32_t id)
+    {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
+        LowLevel::INode buf = this->filesystem->getINodeByID(id);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+
+        // Open the file and return it.
+        FSFile file = this->filesystem->getFile(buf.inodeid);
+        file.open();
+        return file;
+    }
+
+    std::vector<std::pair<std::string, struct stat> > FS::readdirplus(uint32_t id) const
+    {
+        // The children are already decoded in full, so their
+        // attributes come for free.
+        std::vector<std::pair<std::string, struct stat> > result;
+        this->readdirplus(id, [&](const std::string& name, const struct stat& st) -> bool
+        {
+            result.push_back(std::make_pair(name, st));
+            return true;
+        });
+        return result;
+    }
+
+    void FS::readdirplus(uint32_t id, const std::function<bool (const std::string&, const struct stat&)>& callback) const
+    {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
+        LowLevel::INode buf = this->filesystem->getINodeByID(id);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        if (buf.type != LowLevel::INodeType::INT_DIRECTORY)
+            throw Exception::NotADirectory();
+
+        struct stat st;
+        this->filesystem->forEachChildOfDirectory(buf.inodeid, [&](const LowLevel::INode& child) -> bool
+        {
+            memset(&st, 0, sizeof(struct stat));
+            this->copyINodeToStat(child, st);
+            return callback(child.filename, st);
+        });
+    }
+
+    std::vector<int> FS::getattr(const std::vector<std::string>& paths, std::vector<struct stat>& stbufsOut) const
+    {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
+        std::vector<int> results(paths.size(), 0);
+        stbufsOut.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            LowLevel::INode buf;
+            memset(&stbufsOut[i], 0, sizeof(struct stat));
+            try
+            {
+                if (!this->retrievePathToINode(paths[i], buf))
+                    results[i] = -ENOENT;
+                else
+                    this->copyINodeToStat(buf, stbufsOut[i]);
+            }
+            catch (Exception::FileNotFound& e)
+            {
+                results[i] = -ENOENT;
+            }
+        }
+        return results;
+    }
+
+    void FS::touch(uint32_t id, std::string modes)
+    {
+        LowLevel::Transaction guard(this->filesystem);
+        LowLevel::INode child = this->filesystem->getINodeByID(id);
+        if (child.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        this->touchINode(child, modes);
+        this->saveINode(child);
+    }
+
     void FS::setuid(uid_t uid)
     {
-        this->uid = uid;
+        FSContext initial = { this->uid, this->gid };
+        this->context.get(initial)->uid = uid;
     }
 
     void FS::setgid(gid_t gid)
     {
-        this->gid = gid;
+        FSContext initial = { this->uid, this->gid };
+        this->context.get(initial)->gid = gid;
+    }
+
+    uint64_t FS::getMaximumFileSize() const
+    {
+        return this->filesystem->getFormat()->max_file_size;
     }
 
     void FS::touch(std::string path, std::string modes)
     {
+        LowLevel::Transaction guard(this->filesystem);
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
@@ -478,6 +715,101 @@ namespace AppLib
      *
      ****/
 
+    uid_t FS::getContextUID() const
+    {
+        const FSContext* context = this->context.peek();
+        return (context == NULL) ? this->uid : context->uid;
+    }
+
+    gid_t FS::getContextGID() const
+    {
+        const FSContext* context = this->context.peek();
+        return (context == NULL) ? this->gid : context->gid;
+    }
+
+    void FS::copyINodeToStat(const LowLevel::INode& buf, struct stat& stbufOut) const
+    {
+        // Ensure that the inode is also one of the
+        // accepted types.
+        if (buf.type != LowLevel::INodeType::INT_DIRECTORY &&
+                buf.type != LowLevel::INodeType::INT_FILEINFO &&
+                buf.type != LowLevel::INodeType::INT_SYMLINK &&
+                buf.type != LowLevel::INodeType::INT_DEVICE &&
+                buf.type != LowLevel::INodeType::INT_HARDLINK)
+            throw Exception::FileNotFound();
+
+        // Resolve hardlink if needed.
+        if (buf.type == LowLevel::INodeType::INT_HARDLINK)
+        {
+            LowLevel::INode real = buf.resolve(this->filesystem);
+            if (real.type == LowLevel::INodeType::INT_HARDLINK ||
+                    real.type == LowLevel::INodeType::INT_INVALID)
+                throw Exception::InternalInconsistency();
+            this->copyINodeToStat(real, stbufOut);
+            return;
+        }
+
+        // Set the values into the stat structure.
+        stbufOut.st_ino = buf.inodeid;
+        stbufOut.st_dev = buf.dev;
+        stbufOut.st_mode = buf.mask;
+        stbufOut.st_nlink = buf.nlink;
+        stbufOut.st_uid = buf.uid;
+        stbufOut.st_gid = buf.gid;
+        stbufOut.st_rdev = buf.rdev;
+        stbufOut.st_atime = buf.atime;
+        stbufOut.st_mtime = buf.mtime;
+        stbufOut.st_ctime = buf.ctime;
+
+        // File-based inodes are treated differently to directory inodes.
+        if (buf.type == LowLevel::INodeType::INT_FILEINFO ||
+                buf.type == LowLevel::INodeType::INT_SYMLINK ||
+                buf.type == LowLevel::INodeType::INT_DEVICE)
+        {
+            stbufOut.st_size = buf.dat_len;
+            stbufOut.st_blksize = BSIZE_FILE;
+            stbufOut.st_blocks = buf.blocks;
+
+            if (buf.type == LowLevel::INodeType::INT_FILEINFO)
+                stbufOut.st_mode = S_IFREG | stbufOut.st_mode;
+            else if (buf.type == LowLevel::INodeType::INT_SYMLINK)
+                stbufOut.st_mode = S_IFLNK | stbufOut.st_mode;
+        }
+        else if (buf.type == LowLevel::INodeType::INT_DIRECTORY)
+        {
+            stbufOut.st_size = BSIZE_DIRECTORY;
+            stbufOut.st_blksize = BSIZE_FILE;
+            stbufOut.st_blocks = BSIZE_DIRECTORY / BSIZE_FILE;
+            stbufOut.st_mode = S_IFDIR | stbufOut.st_mode;
+        }
+        else
+            throw Exception::InternalInconsistency();
+    }
+
+    std::string FS::readSymlink(const LowLevel::INode& buf) const
+    {
+        if (buf.type != LowLevel::INodeType::INT_SYMLINK)
+            throw Exception::NotSupported();
+
+        // Read the link information out of the file.
+        FSFile file(this->filesystem, this->stream, buf.inodeid);
+        file.open(std::ios_base::in);
+        char* buffer = (char*)malloc(buf.dat_len + 1);
+        std::streamsize count = file.read(buffer, buf.dat_len);
+        if ((uint64_t) count < buf.dat_len)
+            buffer[count] = '\0';
+        else
+            buffer[buf.dat_len] = '\0';
+        std::string result = buffer;
+        free(buffer);
+
+        // Check to make sure it is valid.
+        if ((uint64_t) count != buf.dat_len)
+            throw Exception::InternalInconsistency();
+
+        return result;
+    }
+
     void FS::ensurePathIsValid(std::string path) const
     {
         std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
@@ -494,30 +826,21 @@ namespace AppLib
     {
         this->ensurePathIsValid(path);
         std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
-        LowLevel::INode buf = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < components.size(); i++)
-        {
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid, components[i]);
-            if (buf.type == LowLevel::INodeType::INT_INVALID)
-                throw Exception::FileNotFound();
-        }
+        LowLevel::INode buf;
+        if (!this->retrieveComponentsToINode(components, components.size(), buf))
+            throw Exception::FileNotFound();
     }
 
     void FS::ensurePathIsAvailable(std::string path) const
     {
         this->ensurePathIsValid(path);
         std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
-        LowLevel::INode buf = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < components.size() - 1; i++)
-        {
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid, components[i]);
-            if (buf.type == LowLevel::INodeType::INT_INVALID)
-                throw Exception::FileNotFound();
-        }
-        if (components.size() != 0)
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid,
-                    components[components.size() - 1].c_str());
-        if (buf.type == LowLevel::INodeType::INT_INVALID)
+        if (components.size() == 0)
+            throw Exception::FileExists();
+        LowLevel::INode buf;
+        if (!this->retrieveComponentsToINode(components, components.size() - 1, buf))
+            throw Exception::FileNotFound();
+        if (!this->retrieveComponentsToINode(components, components.size(), buf))
             return;
         throw Exception::FileExists();
     }
@@ -561,23 +884,100 @@ namespace AppLib
     {
         this->ensurePathIsValid(path);
         std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
+        if (limit < 0 && (size_t)(-limit) > components.size())
+            return false;
+        size_t count = (limit <= 0 ? components.size() - (-limit) : limit);
+        if (!this->retrieveComponentsToINode(components, count, out))
+            return false;
+        if (out.type == LowLevel::INodeType::INT_HARDLINK)
+            out = out.resolve(this->filesystem);
+        return true;
+    }
+
+    bool FS::retrieveParentPathToINode(std::string path, LowLevel::INode& out) const
+    {
+        return this->retrievePathToINode(path, out, -1);
+    }
+
+    LowLevel::INode FS::retrieveINodeByID(uint32_t id) const
+    {
+        LowLevel::INode buf = this->filesystem->getINodeByID(id);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        return buf;
+    }
+
+    bool FS::retrieveComponentsToINode(const std::vector<std::string>& components,
+            size_t count, LowLevel::INode& out) const
+    {
+        if (count > components.size())
+            return false;
+
+        // Work out the cache key for each leading part of the path.
+        std::vector<std::string> keys(count + 1);
+        keys[0] = "/";
+        std::string key = "";
+        for (size_t i = 0; i < count; i++)
+        {
+            key += "/" + components[i];
+            keys[i + 1] = key;
+        }
+
+        // Start from the deepest part of the path that we already
+        // know about, which for a previously seen path is the whole
+        // thing.
+        size_t start = 0;
         out = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < (limit <= 0 ? components.size() - (-limit) : limit); i++)
+        for (size_t i = count; i > 0; i--)
+        {
+            int32_t id = 0;
+            if (!this->pathcache.lookup(keys[i], id))
+                continue;
+            if (id < 0)
+                return false;
+            LowLevel::INode node = this->filesystem->getINodeByID(id);
+            if (node.type == LowLevel::INodeType::INT_INVALID)
+            {
+                this->pathcache.invalidate(keys[i]);
+                continue;
+            }
+            out = node;
+            start = i;
+            break;
+        }
+
+        // Walk the rest of the path.
+        for (size_t i = start; i < count; i++)
         {
             out = this->filesystem->getChildOfDirectory(out.inodeid, components[i]);
             if (out.type == LowLevel::INodeType::INT_INVALID)
+            {
+                this->pathcache.insertNegative(keys[i + 1]);
                 return false;
+            }
+
+            // Children that are hardlinks come back already resolved,
+            // in which case the ID within the directory is the ID of
+            // the link rather than the target.
+            if (out.type != LowLevel::INodeType::INT_HARDLINK && out.realid != 0)
+                this->pathcache.insert(keys[i + 1], out.realid);
+            else
+                this->pathcache.insert(keys[i + 1], out.inodeid);
         }
         if (out.type == LowLevel::INodeType::INT_INVALID)
             return false;
-        if (out.type == LowLevel::INodeType::INT_HARDLINK)
-            out = out.resolve(this->filesystem);
         return true;
     }
 
-    bool FS::retrieveParentPathToINode(std::string path, LowLevel::INode& out) const
+    std::string FS::getCacheKey(std::string path) const
     {
-        return this->retrievePathToINode(path, out, -1);
+        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
+        std::string key = "";
+        for (size_t i = 0; i < components.size(); i++)
+            key += "/" + components[i];
+        if (key == "")
+            return "/";
+        return key;
     }
 
     void FS::saveINode(LowLevel::INode& buf)
@@ -589,7 +989,7 @@ namespace AppLib
             throw Exception::INodeSaveFailed();
     }
 
-    void FS::saveNewINode(uint32_t pos, LowLevel::INode& buf)
+    void FS::saveNewINode(uint64_t pos, LowLevel::INode& buf)
     {
         if (buf.type == LowLevel::INodeType::INT_INVALID ||
                 buf.type == LowLevel::INodeType::INT_UNSET)
@@ -610,24 +1010,19 @@ namespace AppLib
             return mode; // Keep other information.
     }
 
-    LowLevel::INode FS::assignNewINode(LowLevel::INodeType::INodeType type, uint32_t& posOut)
+    LowLevel::INode FS::assignNewINode(LowLevel::INodeType::INodeType type, uint64_t& posOut)
     {
         if (type == LowLevel::INodeType::INT_INVALID ||
                 type == LowLevel::INodeType::INT_UNSET)
             throw Exception::INodeSaveInvalid();
 
-        // Determine appropriate type.
-        LowLevel::INodeType::INodeType simple = LowLevel::INodeType::INT_FILEINFO;
-        if (type == LowLevel::INodeType::INT_DIRECTORY)
-            simple = type;
-
         // Get a free block.
-        posOut = this->filesystem->getFirstFreeBlock(simple);
+        posOut = this->filesystem->getFirstFreeBlock();
         if (posOut == 0)
             throw Exception::NoFreeSpace();
 
         // Get a free inode number.
-        uint16_t id = this->filesystem->getFirstFreeINodeNumber();
+        uint32_t id = this->filesystem->getFirstFreeINodeNumber();
         if (id == 0)
             throw Exception::INodeExhaustion();
         LowLevel::INode buf;
@@ -677,7 +1072,7 @@ namespace AppLib
         if (!this->retrieveParentPathToINode(path, parent))
             throw Exception::FileNotFound();
 
-        uint32_t pos;
+        uint64_t pos;
         LowLevel::INode child = this->assignNewINode(type, pos);
         try
         {
@@ -685,8 +1080,8 @@ namespace AppLib
             child.ctime = this->getTime();
             child.mtime = this->getTime();
             child.atime = this->getTime();
-            child.uid = this->uid;
-            child.gid = this->gid;
+            child.uid = this->getContextUID();
+            child.gid = this->getContextGID();
             configuration(child);
             child.setFilename(LowLevel::Util::extractBasenameFromPath(path).c_str());
             this->saveNewINode(pos, child);
@@ -716,6 +1111,9 @@ namespace AppLib
             throw;
         }
 
+        // Replace any negative entry for the new path.
+        this->pathcache.insert(this->getCacheKey(path), child.inodeid);
+
         return child;
     }
 }
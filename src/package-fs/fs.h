@@ -8,9 +8,12 @@
 #include <string>
 #include <cstdio>
 #include <functional>
+#include <utility>
 #include "src/package-fs/fsfile.h"
+#include "src/package-fs/pathcache.h"
 #include "src/package-fs/lowlevel/blockstream.h"
 #include "src/package-fs/lowlevel/fs.h"
+#include "src/package-fs/lowlevel/threadlocal.h"
 #include "src/package-fs/exception/package.h"
 #include "src/package-fs/exception/fs.h"
 #include "src/package-fs/exception/util.h"
@@ -25,9 +28,18 @@ namespace AppLib
     private:
         AppLib::LowLevel::BlockStream * stream;
         AppLib::LowLevel::FS * filesystem;
+        mutable AppLib::PathCache pathcache;
         uid_t uid;
         gid_t gid;
 
+        //! The user and group a thread has set for its own operations.
+        struct FSContext
+        {
+            uid_t uid;
+            gid_t gid;
+        };
+        LowLevel::ThreadLocal < FSContext > context;
+
     public:
         //! Opens an existing package.
         /*!
@@ -35,14 +47,24 @@ namespace AppLib
          * optional uid and gid parameters effectively perform
          * setuid and setgid for you.
          *
+         * @note Every operation may be called concurrently from
+         *       multiple threads.  Operations that only read the
+         *       package run in parallel, while those that modify
+         *       it run one at a time.
+         *
          * @param path The path to open the package at.
          * @param uid The context user ID to set for package operations.
          * @param gid The context group ID to set for package operations.
+         * @param backend The I/O backend to access the package image with.
          *
          * @throw Exception::PackageNotFound
          * @throw Exception::PackageNotValid
          */
-        FS(std::string packagePath, uid_t uid = 0, gid_t gid = 0);
+        FS(std::string packagePath, uid_t uid = 0, gid_t gid = 0,
+                LowLevel::BlockStreamBackend::BlockStreamBackend backend =
+                    LowLevel::BlockStreamBackend::BSB_FSTREAM);
+        //! Closes the package.
+        ~FS();
         //! Retrieves attributes on a file or directory.
         /*!
          * Retrieves attributes on a file, directory, device or
@@ -181,6 +203,20 @@ namespace AppLib
          * @throw Exception::NotSupported
          */
         void link(std::string linkPath, std::string targetPath);
+        //! Creates a hardlink to the inode with the specified ID.
+        /*!
+         * As link(), but the target is given by its inode ID,
+         * so it need not be reachable by a path.
+         *
+         * @param linkPath The path of the new link.
+         * @param targetid The inode ID of the target of the link.
+         *
+         * @throw Exception::FileExists
+         * @throw Exception::FileNotFound
+         * @throw Exception::IsADirectory
+         * @throw Exception::NotSupported
+         */
+        void link(std::string linkPath, uint32_t targetid);
         //! Changes the permissions on a file in the package.
         /*!
          * Changes the permission mask on a file, directory,
@@ -193,6 +229,14 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void chmod(std::string path, mode_t mask);
+        //! Changes the permissions on the inode with the specified ID.
+        /*!
+         * @param id The inode ID of the file to change.
+         * @param mask The permissions mask to set.
+         *
+         * @throw Exception::FileNotFound
+         */
+        void chmod(uint32_t id, mode_t mask);
         //! Changes the ownership of a file in the package.
         /*!
          * Changes the ownership of a file, directory, device
@@ -206,6 +250,15 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void chown(std::string path, uid_t uid = -1, gid_t gid = -1);
+        //! Changes the ownership of the inode with the specified ID.
+        /*!
+         * @param id The inode ID of the file to change.
+         * @param uid The user ID to set, or -1 to leave as-is.
+         * @param gid The group ID to set, or -1 to leave as-is.
+         *
+         * @throw Exception::FileNotFound
+         */
+        void chown(uint32_t id, uid_t uid = -1, gid_t gid = -1);
         //! Truncates a file in the package to a specified size.
         /*!
          * Truncates a file in the package to a specified size.
@@ -224,6 +277,96 @@ namespace AppLib
          * @throw Exception::InternalInconsistency
          */
         void truncate(std::string path, off_t size);
+        //! Truncates the file with the specified inode ID.
+        /*!
+         * @param id The inode ID of the file to truncate.
+         * @param size The new size of the file.
+         *
+         * @throw Exception::FileTooBig
+         * @throw Exception::FileNotFound
+         * @throw Exception::InternalInconsistency
+         */
+        void truncate(uint32_t id, off_t size);
+        //! Compresses the data of a file in the package.
+        /*!
+         * Compresses the data of a file in the package, one extent
+         * of EXTENT_BLOCKS blocks at a time.  Extents that do not
+         * shrink by at least one block are left as they are, and
+         * compressed extents are expanded again when they are next
+         * written to.
+         *
+         * @note Only version 2 packages can hold compressed files, and
+         *       only when the library was built with XZ support.
+         *
+         * @param path The path to the file to compress.
+         * @param threads The number of extents to compress at once.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotSupported
+         * @throw Exception::InternalInconsistency
+         */
+        void compress(std::string path, unsigned int threads = 1);
+        //! Shares the data of a file with identical data elsewhere in the package.
+        /*!
+         * Hashes each block of a file in the package and shares it
+         * with any block that already has the same contents, so that
+         * identical data is only stored once.  Blocks with no match
+         * yet are recorded so that files deduplicated later can share
+         * them.  A shared block gets a copy of its own again when it
+         * is next written to.
+         *
+         * @note Only version 2 packages can hold shared blocks.
+         *
+         * @param path The path to the file to deduplicate.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotSupported
+         * @throw Exception::InternalInconsistency
+         */
+        void deduplicate(std::string path);
+        //! Writes out any pending changes to the package.
+        /*!
+         * Commits the metadata changes that are waiting in the
+         * journal and flushes the package to disk.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void sync();
+        //! Writes out the metadata changes waiting in the journal.
+        /*!
+         * Writes out the group of changes collected by the
+         * journal once it is JOURNAL_COMMIT_INTERVAL seconds
+         * old.  Groups are otherwise only written when a later
+         * change ends, so mounts call this periodically.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void commitJournal();
+        //! Starts recording a prefetch profile of the package.
+        /*!
+         * Records the parts of the package that are read from now
+         * on, until saveProfile() is called.
+         *
+         * @return Whether the package can hold a profile.
+         */
+        bool startProfile();
+        //! Stops recording the prefetch profile and saves it.
+        /*!
+         * Replaces any profile the package had with the parts of it
+         * read since startProfile() was called.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void saveProfile();
+        //! Reads ahead the parts of the package in its prefetch profile.
+        /*!
+         * Asks for everything in the package's profile to be read
+         * into the page cache in the background.
+         *
+         * @return The number of bytes asked for, or 0 if the package
+         *         has no profile.
+         */
+        uint64_t prefetchProfile();
         //! Opens the file in the package and returns an FSFile.
         /*!
          * Opens a file in the package and returns an FSFile which
@@ -275,16 +418,140 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void utimens(std::string path, time_t access, time_t modification);
+        //! Sets the access and modification times on an inode.
+        /*!
+         * @param id The inode ID to set times on.
+         * @param access The access time to set (in seconds).
+         * @param modification The modification time to set (in seconds).
+         *
+         * @throw Exception::FileNotFound
+         */
+        void utimens(uint32_t id, time_t access, time_t modification);
+
+        //! Retrieves attributes on an inode.
+        /*!
+         * Retrieves attributes on the file, directory, device or
+         * symlink with the specified inode ID, without resolving
+         * a path.  If the inode is a hardlink, the attributes of
+         * the file it links to are returned.
+         *
+         * @param id The inode ID to get attributes of.
+         * @param stbufOut The structure to store the result in.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::InternalInconsistency
+         */
+        void getattr(uint32_t id, struct stat& stbufOut) const;
+        //! Looks up an entry within a directory.
+        /*!
+         * Finds the entry with the specified name in the directory
+         * with the specified inode ID and retrieves its attributes.
+         * Hardlinks are resolved, so the returned ID is that of the
+         * file the entry refers to.
+         *
+         * @param parentid The inode ID of the directory.
+         * @param name The name of the entry within the directory.
+         * @param stbufOut The structure to store the result in.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         * @throw Exception::FilenameTooLong
+         * @throw Exception::InternalInconsistency
+         */
+        uint32_t lookup(uint32_t parentid, std::string name, struct stat& stbufOut) const;
+        //! Returns the target of a symbolic link by inode ID.
+        /*!
+         * @param id The inode ID of the symlink to read.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotSupported
+         * @throw Exception::InternalInconsistency
+         */
+        std::string readlink(uint32_t id) const;
+        //! Opens the file with the specified inode ID and returns an FSFile.
+        /*!
+         * @note This function will call open() on FSFile
+         *       automatically.  You should not call open()
+         *       on the returned FSFile.
+         *
+         * @param id The inode ID of the file to open.
+         *
+         * @throw Exception::FileNotFound
+         */
+        FSFile open(uint32_t id);
+        //! Lists the entries in a directory along with their attributes.
+        /*!
+         * Lists all of the entries in the directory with the
+         * specified inode ID (excluding '.' and '..'), retrieving
+         * the attributes of each entry in the same pass.
+         *
+         * @param id The inode ID of the directory.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         * @throw Exception::InternalInconsistency
+         */
+        std::vector<std::pair<std::string, struct stat> > readdirplus(uint32_t id) const;
+        //! Streams the entries in a directory along with their attributes.
+        /*!
+         * Calls the callback with each entry in the directory with
+         * the specified inode ID (excluding '.' and '..') as it is
+         * read, without building a list of them, stopping early if
+         * the callback returns false.  The package is locked until
+         * this returns, so the callback must not change it.
+         *
+         * @param id The inode ID of the directory.
+         * @param callback The function to call with each entry.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         * @throw Exception::InternalInconsistency
+         */
+        void readdirplus(uint32_t id, const std::function<bool (const std::string&, const struct stat&)>& callback) const;
+        //! Retrieves attributes on many files at once.
+        /*!
+         * Retrieves the attributes of each of the paths, as getattr()
+         * does, taking the package lock once for all of them.  Paths
+         * that don't exist are reported in the result rather than by
+         * throwing.
+         *
+         * @param paths The paths to retrieve the attributes of.
+         * @param stbufsOut Resized to hold the attributes of each path.
+         *
+         * @return 0 or a negative errno for each path.
+         */
+        std::vector<int> getattr(const std::vector<std::string>& paths, std::vector<struct stat>& stbufsOut) const;
+        /*!
+         * Touches the inode with the specified ID, updating
+         * each of the specified times to the current time on
+         * the local machine.
+         *
+         * @note This function saves the new times to disk.
+         *
+         * @param id The inode ID to touch.
+         * @param modes A string containing one or more of 'a', 'm' or 'c'.
+         *
+         * @throw Exception::FileNotFound
+         */
+        void touch(uint32_t id, std::string modes);
 
         /*!
-         * Sets the current context UID for package operations.
+         * Sets the current context UID for package operations
+         * performed by the calling thread.
          */
         void setuid(uid_t uid);
         /*!
-         * Sets the current context GID for package operations.
+         * Sets the current context GID for package operations
+         * performed by the calling thread.
          */
         void setgid(gid_t gid);
 
+        /*!
+         * Returns the size of the largest file the package can
+         * hold, which depends on the package's format version.
+         */
+        uint64_t getMaximumFileSize() const;
+
         /*!
          * Touches the specified file, updating each of the
          * specified times to the current time on the local
@@ -300,6 +567,28 @@ namespace AppLib
         void touch(std::string path, std::string modes);
 
     private:
+        /*!
+         * Retrieves the context UID and GID set by the calling
+         * thread, or those the package was opened with if the
+         * calling thread hasn't set them.
+         */
+        uid_t getContextUID() const;
+        gid_t getContextGID() const;
+        /*!
+         * Copies the attributes of an inode into a stat
+         * structure, resolving it first if it is a hardlink.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::InternalInconsistency
+         */
+        void copyINodeToStat(const LowLevel::INode& buf, struct stat& stbufOut) const;
+        /*!
+         * Reads the target out of a symlink inode.
+         *
+         * @throw Exception::NotSupported
+         * @throw Exception::InternalInconsistency
+         */
+        std::string readSymlink(const LowLevel::INode& buf) const;
         /*!
          * Ensures the specified path is valid.
          *
@@ -355,6 +644,26 @@ namespace AppLib
          * by the path, storing the result in out.
          */
         bool retrieveParentPathToINode(std::string path, LowLevel::INode& out) const;
+        /*!
+         * Retrieves the inode with the specified ID (the file
+         * it links to, if it is a hardlink).
+         *
+         * @throw Exception::FileNotFound
+         */
+        LowLevel::INode retrieveINodeByID(uint32_t id) const;
+        /*!
+         * Retrieves the inode represented by the first count
+         * path components, storing the result in out.  Hardlinks
+         * are not resolved.  Resolved paths (and paths that do
+         * not exist) are remembered in the path cache.
+         */
+        bool retrieveComponentsToINode(const std::vector<std::string>& components,
+                size_t count, LowLevel::INode& out) const;
+        /*!
+         * Returns the normalized form of the path that is used
+         * as the key in the path cache.
+         */
+        std::string getCacheKey(std::string path) const;
         /*!
          * Saves an existing inode to disk.
          *
@@ -368,7 +677,7 @@ namespace AppLib
          * @throw Exception::INodeSaveInvalid
          * @throw Exception::INodeSaveFailed
          */
-        void saveNewINode(uint32_t pos, LowLevel::INode& buf);
+        void saveNewINode(uint64_t pos, LowLevel::INode& buf);
         /*!
          * Extracts the permissions mask from the full mode
          * information.
@@ -383,7 +692,7 @@ namespace AppLib
          * @throw Exception::NoFreeSpace
          * @throw Exception::INodeExhaustion
          */
-        LowLevel::INode assignNewINode(LowLevel::INodeType::INodeType type, uint32_t& posOut);
+        LowLevel::INode assignNewINode(LowLevel::INodeType::INodeType type, uint64_t& posOut);
         /*!
          * Retrieves the current time on the local machine.
          */
@@ -5,16 +5,20 @@
 #include "src/package-fs/lowlevel/util.h"
 #include "src/package-fs/logging.h"
 #include "src/package-fs/lowlevel/blockstream.h"
+#include "src/package-fs/lowlevel/journal.h"
+#include "src/package-fs/lowlevel/segmentlist.h"
 #include <map>
+#include <memory>
 #include <math.h>
 #include <stdarg.h>
+#include <string.h>
 #include <algorithm>
 
 using namespace AppLib::LowLevel;
 
 namespace AppLib
 {
-    FSFile::FSFile(FS * filesystem, BlockStream * fd, uint16_t inodeid)
+    FSFile::FSFile(FS * filesystem, BlockStream * fd, uint32_t inodeid)
     {
         this->inodeid = inodeid;
         this->filesystem = filesystem;
@@ -24,10 +28,17 @@ namespace AppLib
         this->posg = 0;
         this->posp = 0;
         this->state = std::ios::goodbit;
+        this->extent_index = 0;
+        this->wbuffer_pos = 0;
+        this->wbuffer_limit = 0;
+        this->pending_atime = 0;
+        this->pending_mtime = 0;
+        this->pending_ctime = 0;
     }
 
     void FSFile::open(std::ios_base::openmode mode)
     {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
         if (this->bad() || this->fail())
             return;
 
@@ -70,15 +81,39 @@ namespace AppLib
             return;
         }
 
-        // Store the current positions.
-        std::streampos oldg = this->fd->tellg();
-        std::streampos oldp = this->fd->tellp();
+        if (count <= 0)
+            return;
+
+        // Data that doesn't carry on from what is buffered means the
+        // buffer has to be written out first.
+        if (!this->wbuffer.empty() && this->posp != this->wbuffer_pos + this->wbuffer.size())
+        {
+            if (!this->flush())
+                return;
+        }
 
-        // Get the base position of the specified inode.
-        uint32_t bpos = this->filesystem->getINodePositionByID(this->inodeid);
+        // Writes that would fill the buffer on their own go straight
+        // to the package.
+        if (this->wbuffer_limit == 0 || (this->wbuffer.empty() && (uint64_t) count >= this->wbuffer_limit))
+        {
+            this->writeDirect(data, count);
+            return;
+        }
+
+        if (this->wbuffer.empty())
+            this->wbuffer_pos = this->posp;
+        this->wbuffer.insert(this->wbuffer.end(), data, data + count);
+        this->posp += count;
+        if (this->wbuffer.size() >= this->wbuffer_limit)
+            this->flush();
+    }
+
+    void FSFile::writeDirect(const char *data, std::streamsize count)
+    {
+        LowLevel::Transaction guard(this->filesystem);
 
         // Get the total size of the file (for detected when to EOF).
-        uint32_t fsize = this->size();
+        uint64_t fsize = this->size();
 
         // If we need to truncate the file to a new size, do so.
         if (fsize < this->posp + count)
@@ -93,148 +128,91 @@ namespace AppLib
             fsize = this->size();
         }
 
-        // Calculate the number of blocks we will have to write.
-        uint32_t bstart = (this->posp / 4096);
-        uint32_t bend = ((this->posp + count - 1) / 4096);
-
-        // Loop through all of the blocks in the file
-        // First we get a list of all of the segments to write, starting
-        // at this->posp until this->posp + count.
-        uint32_t bcount = 0;
-        uint32_t doff = 0;
-        uint32_t spos = 0;
-        uint32_t ipos = bpos;
-        uint32_t hsize = HSIZE_FILE;
-        while (ipos != 0)
+        // Get the positions of the file's blocks.
+        std::shared_ptr<SegmentList> list = this->filesystem->getFileSegments(this->inodeid);
+        if (!list)
         {
-            for (int i = hsize; i < BSIZE_FILE; i += 4)
-            {
-                this->fd->seekg(bpos + i);
-                spos = 0;
-                Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-
-                if (fsize - this->posp == 0)
-                {
-                    // We've hit EOF.  Return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    this->clear(std::ios::eofbit);
-                    return;
-                }
-
-                if (spos == 0)
-                {
-                    // We've run out of segments to write to (this shouldn't
-                    // happen because we truncated the file).
-                    ipos = 0;	// Make it jump out of the while() loop.
-                    this->clear(std::ios::eofbit | std::ios::failbit);
-                    return;
-                }
-
-                if (bcount < bstart)
-                {
-                    // Before the data needs to be read.
-                    bcount += 1;
-                    continue;
-                }
-                else if (bcount == bstart)
-                {
-                    // First block to read.  Calculate how many
-                    // bytes to read (as it may not be the full block).
-                    uint32_t soff = this->posp - ((this->posp / 4096) * 4096);
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > (BSIZE_FILE - soff, fsize - this->posp));
-
-                    // Seek the correct position.
-                    this->fd->seekp(spos + soff);
-
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
-
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-
-                    if (bcount == bend)
-                    {
-                        // We're going to finish writing on this block too.
-                        this->fd->seekg(oldg);
-                        this->fd->seekp(oldp);
-                        if (this->posg == fsize)
-                            this->clear(std::ios::eofbit);
-                        return;
-                    }
-                }
-                else if (bcount > bstart && bcount < bend)
-                {
-                    // A block in the middle which must be completely
-                    // written to.
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return;
+        }
 
-                    // Calculate how many bytes to write.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posp));
+        // Compressed extents are expanded before they are written to.
+        bool expanded = false;
+        for (uint64_t e = this->posp / EXTENT_SIZE; e <= (this->posp + count - 1) / EXTENT_SIZE; e++)
+        {
+            if (!list->isCompressed(e * EXTENT_BLOCKS))
+                continue;
+            if (this->filesystem->expandExtent(this->inodeid, e) != FSResult::E_SUCCESS)
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return;
+            }
+            expanded = true;
+        }
+        if (expanded)
+            list = this->filesystem->getFileSegments(this->inodeid);
+        if (!list)
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return;
+        }
 
-                    // Seek the correct position.
-                    this->fd->seekp(spos);
+        // As are shared blocks, which get a copy of their own.
+        for (uint64_t i = this->posp / BSIZE_FILE; i <= (this->posp + count - 1) / BSIZE_FILE; i++)
+        {
+            if (list->isShared(i) && this->filesystem->unshareBlock(this->inodeid, i) != FSResult::E_SUCCESS)
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return;
+            }
+        }
 
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
+        uint64_t total = count;
+        uint64_t doff = 0;
+        while (doff < total)
+        {
+            uint64_t index = this->posp / BSIZE_FILE;
+            uint64_t soff = this->posp % BSIZE_FILE;
+            if (index >= list->blocks.size())
+            {
+                // We've run out of segments to write to (this shouldn't
+                // happen because we truncated the file).
+                this->clear(std::ios::eofbit | std::ios::failbit);
+                return;
+            }
 
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-                }
-                else if (bcount > bstart && bcount == bend)
-                {
-                    // Last block to write to.  Calculate how many bytes
-                    // to write in the last block.
-                    uint32_t srem = count - doff;
-
-                    // Calculate how many bytes to write.
-                    uint32_t stotal = std::min < uint32_t > (srem, std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posp)));
-
-                    // Seek the correct position.
-                    this->fd->seekp(spos);
-
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
-
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-
-                    // Now that we've reached the last block, we've
-                    // written all the data and can now return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    if (this->posp == fsize)
-                        this->clear(std::ios::eofbit);
-                    return;
-                }
-                else
-                {
-                    // End of writing..  Return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    if (this->posp == fsize)
-                        this->clear(std::ios::eofbit);
-                    return;
-                }
+            // Write as far as the blocks are contiguous on disk.
+            uint64_t stotal = std::min < uint64_t > (total - doff, BSIZE_FILE - soff);
+            while (doff + stotal < total && index + 1 < list->blocks.size() &&
+                    list->getPosition(index + 1) == list->getPosition(index) + BSIZE_FILE)
+            {
+                index += 1;
+                stotal += std::min < uint64_t > (total - doff - stotal, BSIZE_FILE);
+            }
 
-                bcount += 1;
+            this->fd->writeDataAt(data + doff, stotal, list->getPosition(this->posp / BSIZE_FILE) + soff);
+            if (this->fd->fail())
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return;
             }
-            hsize = HSIZE_SEGINFO;
-            INode inode = this->filesystem->getINodeByPosition(ipos);
-            ipos = inode.info_next;
+
+            // Increase the counters.
+            doff += stotal;
+            this->posp += stotal;
         }
 
-        // Set the fail bit if we get here, because we shouldn't.
-        this->clear(std::ios::badbit | std::ios::failbit);
-        return;
+        if (this->posp == fsize)
+            this->clear(std::ios::eofbit);
     }
 
     std::streamsize FSFile::read(char *out, std::streamsize count)
     {
+        // Buffered data is written out so that it can be read back.
+        if (!this->wbuffer.empty() && !this->flush())
+            return 0;
+
+        LowLevel::SharedLock guard(this->filesystem->getLock());
         if (this->bad() || this->fail())
             return 0;
 
@@ -244,177 +222,143 @@ namespace AppLib
             return 0;
         }
 
-        // Store the current positions.
-        std::streampos oldg = this->fd->tellg();
-        std::streampos oldp = this->fd->tellp();
-
-        // Get the base position of the specified inode.
-        uint32_t bpos = this->filesystem->getINodePositionByID(this->inodeid);
-
-        // Calculate the number of blocks we will have to read.
-        uint32_t bstart = (this->posg / 4096);
-        uint32_t bend = ((this->posg + count - 1) / 4096);
-
         // Get the total size of the file (for detected when to EOF).
-        uint32_t fsize = this->size();
-
-        // First we get a list of all of the segments to read, starting
-        // at this->posg until this->posg + count.
-        uint32_t bcount = 0;
-        uint32_t doff = 0;
-        uint32_t spos = 0;
-        uint32_t ipos = bpos;
-        uint32_t hsize = HSIZE_FILE;
-        while (ipos != 0)
+        uint64_t fsize = this->size();
+        if (this->posg >= fsize)
         {
-            for (int i = hsize; i < BSIZE_FILE; i += 4)
-            {
-                this->fd->seekg(bpos + i);
-                spos = 0;
-                Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
+            // We've hit EOF.  Return.
+            this->clear(std::ios::eofbit);
+            return 0;
+        }
 
-                if (fsize - this->posg == 0)
-                {
-                    // We've hit EOF.  Return.
-                    this->fd->seekg(oldg);
-                    this->clear(std::ios::eofbit);
-                    return doff;
-                }
+        // Get the positions of the file's blocks.
+        std::shared_ptr<SegmentList> list = this->filesystem->getFileSegments(this->inodeid);
+        if (!list)
+            return 0;
 
-                if (spos == 0)
-                {
-                    // We've run out of segments to read.
-                    ipos = 0;	// Make it jump out of the while() loop.
-                    this->clear(std::ios::eofbit);
-                    return doff;
-                }
+        uint64_t total = std::min < uint64_t > (count, fsize - this->posg);
+        uint64_t doff = 0;
+        while (doff < total)
+        {
+            uint64_t index = this->posg / BSIZE_FILE;
+            uint64_t soff = this->posg % BSIZE_FILE;
+            if (index >= list->blocks.size())
+            {
+                // We've run out of segments to read.
+                this->clear(std::ios::eofbit);
+                return doff;
+            }
 
-                if (bcount < bstart)
-                {
-                    // Before the data needs to be read.
-                    bcount += 1;
-                    continue;
-                }
-                else if (bcount == bstart)
+            // Compressed extents are decompressed whole and copied from.
+            if (list->isCompressed(index))
+            {
+                uint64_t extent = index / EXTENT_BLOCKS;
+                uint64_t estart = extent * EXTENT_SIZE;
+                uint64_t elen = std::min < uint64_t > (EXTENT_SIZE, fsize - estart);
+                if (this->extent_list != list || this->extent_index != extent)
                 {
-                    // First block to read.  Calculate how many
-                    // bytes to read (as it may not be the full block).
-                    uint32_t soff = this->posg - ((this->posg / 4096) * 4096);
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE - soff, fsize - this->posg));
-
-                    // Seek the correct position.
-                    this->fd->seekg(spos + soff);
-
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
-
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
-
-                    if (bcount == bend)
+                    this->extent_data.resize(EXTENT_SIZE);
+                    if (this->filesystem->readExtent(*list, extent, elen, &this->extent_data[0]) != FSResult::E_SUCCESS)
                     {
-                        // We're going to finish reading on this block too.
-                        this->fd->seekg(oldg);
-                        if (this->posg == fsize)
-                            this->clear(std::ios::eofbit);
+                        this->extent_list.reset();
+                        this->clear(std::ios::badbit | std::ios::failbit);
                         return doff;
                     }
+                    this->extent_list = list;
+                    this->extent_index = extent;
                 }
-                else if (bcount > bstart && bcount < bend)
-                {
-                    // A block in the middle which must be completely
-                    // read (up to EOF of course).
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posg));
-
-                    // Seek the correct position.
-                    this->fd->seekg(spos);
-
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
+                uint64_t eoff = this->posg - estart;
+                uint64_t etotal = std::min < uint64_t > (total - doff, elen - eoff);
+                memcpy(out + doff, &this->extent_data[eoff], etotal);
+                doff += etotal;
+                this->posg += etotal;
+                continue;
+            }
 
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
-                }
-                else if (bcount > bstart && bcount == bend)
-                {
-                    // Last block to read.  Calculate how many bytes
-                    // to read in the last block.
-                    uint32_t srem = count - doff;
+            // Read as far as the blocks are contiguous on disk.
+            uint64_t stotal = std::min < uint64_t > (total - doff, BSIZE_FILE - soff);
+            while (doff + stotal < total && index + 1 < list->blocks.size() &&
+                    !list->isCompressed(index + 1) &&
+                    list->getPosition(index + 1) == list->getPosition(index) + BSIZE_FILE)
+            {
+                index += 1;
+                stotal += std::min < uint64_t > (total - doff - stotal, BSIZE_FILE);
+            }
 
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (srem, std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posg)));
+            std::streamsize bread = this->fd->readAt(out + doff, stotal, list->getPosition(this->posg / BSIZE_FILE) + soff);
 
-                    // Seek the correct position.
-                    this->fd->seekg(spos);
+            // Increase the counters.
+            if (bread <= 0)
+                break;
+            doff += bread;
+            this->posg += bread;
+            if ((uint64_t) bread < stotal)
+                break;
+        }
 
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
+        if (this->posg == fsize)
+            this->clear(std::ios::eofbit);
+        return doff;
+    }
 
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
+    std::streamsize FSFile::readDirect(std::streamsize count,
+            const std::function < void (int fd, const std::vector < std::pair < uint64_t, uint64_t > >& extents) > &reply)
+    {
+        // Buffered data is left for read() to write out.
+        if (!this->wbuffer.empty())
+            return -1;
+
+        LowLevel::SharedLock guard(this->filesystem->getLock());
+        if (this->bad() || this->fail() || this->invalid || !this->opened)
+            return -1;
+
+        std::vector < std::pair < uint64_t, uint64_t > > extents;
+        int rawfd = -1;
+        uint64_t fsize = this->size();
+        uint64_t total = 0;
+        if (this->posg < fsize)
+        {
+            std::shared_ptr<SegmentList> list = this->filesystem->getFileSegments(this->inodeid);
+            if (!list)
+                return -1;
 
-                    // Now that we've reached the last block, we've
-                    // read all the data and can now return.
-                    this->fd->seekg(oldg);
-                    if (this->posg == fsize)
-                        this->clear(std::ios::eofbit);
-                    return doff;
-                }
+            // Collect the runs of blocks that are contiguous on disk.
+            total = std::min < uint64_t > (count, fsize - this->posg);
+            for (uint64_t pos = this->posg; pos < this->posg + total; )
+            {
+                uint64_t index = pos / BSIZE_FILE;
+                if (index >= list->blocks.size() || list->isCompressed(index))
+                    return -1;
+                uint64_t len = std::min < uint64_t > (this->posg + total - pos, BSIZE_FILE - pos % BSIZE_FILE);
+                uint64_t at = list->getPosition(index) + pos % BSIZE_FILE;
+                if (!extents.empty() && extents.back().first + extents.back().second == at)
+                    extents.back().second += len;
                 else
-                {
-                    // End of reading..  Return.
-                    this->fd->seekg(oldg);
-                    if (this->posg == fsize)
-                        this->clear(std::ios::eofbit);
-                    return doff;
-                }
+                    extents.push_back(std::make_pair(at, len));
+                pos += len;
+            }
 
-                bcount += 1;
+            for (size_t i = 0; i < extents.size(); i += 1)
+            {
+                rawfd = this->fd->getReadDescriptor(extents[i].first, extents[i].second);
+                if (rawfd == -1)
+                    return -1;
             }
-            hsize = HSIZE_SEGINFO;
-            INode inode = this->filesystem->getINodeByPosition(ipos);
-            ipos = inode.info_next;
         }
 
-        // If we get here, then there wasn't any blocks to read or the original
-        // request to grab the inode based on ID failed, so we return 0 (for no
-        // data read).
-        return 0;
+        reply(rawfd, extents);
+        this->posg += total;
+        if (this->posg >= fsize)
+            this->clear(std::ios::eofbit);
+        return total;
     }
 
     bool FSFile::truncate(std::streamsize len)
     {
+        if (!this->wbuffer.empty() && !this->flush())
+            return false;
+
+        LowLevel::Transaction guard(this->filesystem);
         if (this->bad() || this->fail())
             return false;
 
@@ -422,14 +366,94 @@ namespace AppLib
         return (fres == FSResult::E_SUCCESS);
     }
 
-    uint32_t FSFile::size()
+    uint64_t FSFile::size()
     {
+        LowLevel::SharedLock guard(this->filesystem->getLock());
         INode fnode = this->filesystem->getINodeByID(this->inodeid);
+        if (!this->wbuffer.empty())
+            return std::max < uint64_t > (fnode.dat_len, this->wbuffer_pos + this->wbuffer.size());
         return fnode.dat_len;
     }
 
+    void FSFile::setBufferSize(size_t size)
+    {
+        if (this->wbuffer.size() >= size)
+            this->flush();
+        this->wbuffer_limit = size;
+        this->wbuffer.reserve(size);
+    }
+
+    void FSFile::touch(std::string modes)
+    {
+        time_t now = time(NULL);
+        if (modes.find('a') != std::string::npos)
+            this->pending_atime = now;
+        if (modes.find('m') != std::string::npos)
+            this->pending_mtime = now;
+        if (modes.find('c') != std::string::npos)
+            this->pending_ctime = now;
+    }
+
+    bool FSFile::flush()
+    {
+        if (this->bad() || this->fail())
+            return false;
+
+        if (!this->wbuffer.empty())
+        {
+            // The buffer is moved aside while it is written, so that the
+            // write sees only what is on disk.
+            std::vector < char > data;
+            data.swap(this->wbuffer);
+            uint64_t posp = this->posp;
+            std::ios::iostate state = this->state;
+            this->posp = this->wbuffer_pos;
+            this->writeDirect(&data[0], data.size());
+            this->posp = posp;
+            data.clear();
+            this->wbuffer.swap(data);
+            if (this->bad() || this->fail())
+                return false;
+            this->clear(state);
+        }
+
+        if (this->pending_atime == 0 && this->pending_mtime == 0 && this->pending_ctime == 0)
+            return true;
+
+        LowLevel::Transaction guard(this->filesystem);
+        INode node = this->filesystem->getINodeByID(this->inodeid);
+        if (node.type == INodeType::INT_INVALID)
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return false;
+        }
+        if (this->pending_atime != 0)
+            node.atime = this->pending_atime;
+        if (this->pending_mtime != 0)
+            node.mtime = this->pending_mtime;
+        if (this->pending_ctime != 0)
+            node.ctime = this->pending_ctime;
+        this->pending_atime = 0;
+        this->pending_mtime = 0;
+        this->pending_ctime = 0;
+        if (this->filesystem->updateINode(node) != FSResult::E_SUCCESS)
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return false;
+        }
+        return true;
+    }
+
+    bool FSFile::hasBufferedData()
+    {
+        return !this->wbuffer.empty();
+    }
+
     void FSFile::close()
     {
+        if (this->opened)
+            this->flush();
+        std::vector < char > ().swap(this->wbuffer);
         this->opened = false;
     }
 
@@ -5,31 +5,66 @@
 
 #include "src/package-fs/config.h"
 
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 #include "src/package-fs/lowlevel/blockstream.h"
+#include <time.h>
 
 namespace AppLib
 {
     namespace LowLevel
     {
         class FS;
+        class SegmentList;
     }
 
     class FSFile
     {
     public:
-        FSFile(LowLevel::FS * filesystem, LowLevel::BlockStream * fd, uint16_t inodeid);
+        FSFile(LowLevel::FS * filesystem, LowLevel::BlockStream * fd, uint32_t inodeid);
         void open(std::ios_base::openmode mode = std::ios_base::in | std::ios_base::out);
         void open(int mode); // FIXME: Workaround for Cython.
         void write(const char *data, std::streamsize count);
         std::streamsize read(char *out, std::streamsize count);
+
+        //! Reads up to count bytes without copying them, when they are
+        //! stored uncompressed in the package: reply is called, with the
+        //! package locked, with a file descriptor of the package and the
+        //! positions and lengths of the data in it, which it must read
+        //! before returning.  Returns the number of bytes passed to reply,
+        //! or -1 without calling it if the data has to be read with
+        //! read() instead.
+        std::streamsize readDirect(std::streamsize count,
+                const std::function < void (int fd, const std::vector < std::pair < uint64_t, uint64_t > >& extents) > &reply);
         bool truncate(std::streamsize len);
         void close();
         void seekp(std::streampos pos);
         void seekg(std::streampos pos);
         std::streampos tellp();
         std::streampos tellg();
-        uint32_t size();
+        uint64_t size();
+
+        //! Sets how many bytes of sequential writes are held in memory
+        //! before they are written to the package.  Writes are not
+        //! buffered when this is 0, which is the default.
+        void setBufferSize(size_t size);
+
+        //! Records that the file was accessed ("a"), modified ("m") or
+        //! changed ("c") now.  The times are written along with the
+        //! buffered data by flush() or close().
+        void touch(std::string modes);
+
+        //! Writes out any buffered data, and then any recorded times in
+        //! a single update of the file's inode.
+        bool flush();
+
+        //! Returns whether there is buffered data that has not been
+        //! written to the package yet.
+        bool hasBufferedData();
 
         // State functions.
         std::ios::iostate rdstate();
@@ -41,14 +76,36 @@ namespace AppLib
         bool fail();
 
     private:
-        uint16_t inodeid;
+        uint32_t inodeid;
         LowLevel::FS *filesystem;
         LowLevel::BlockStream *fd;
         bool opened;
         bool invalid;
-        uint32_t posp;
-        uint32_t posg;
+        uint64_t posp;
+        uint64_t posg;
         std::ios::iostate state;
+
+        //! Data written since the last flush, which starts at
+        //! wbuffer_pos in the file.
+        std::vector < char > wbuffer;
+        uint64_t wbuffer_pos;
+        size_t wbuffer_limit;
+
+        //! The times recorded by touch(), or 0 where there are none.
+        time_t pending_atime;
+        time_t pending_mtime;
+        time_t pending_ctime;
+
+        //! Writes data at the put position straight to the package.
+        void writeDirect(const char *data, std::streamsize count);
+
+        //! The last compressed extent that was read, kept so that
+        //! sequential reads only decompress each extent once.  It
+        //! belongs to the segment list it was read through, which is
+        //! replaced whenever the file's extents change.
+        std::shared_ptr < LowLevel::SegmentList > extent_list;
+        uint64_t extent_index;
+        std::vector < char > extent_data;
     };
 }
 
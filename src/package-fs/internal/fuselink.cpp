@@ -3,7 +3,10 @@
 #include "src/package-fs/config.h"
 #include "src/package-fs/internal/fuselink.h"
 #include "src/package-fs/logging.h"
+#include <chrono>
+#include <condition_variable>
 #include <string>
+#include <thread>
 #include <time.h>
 #include <linux/kdev_t.h>
 
@@ -12,16 +15,31 @@ namespace AppLib
     namespace FUSE
     {
         FS * FuseLink::filesystem = NULL;
+        bool FuseLink::readonly = false;
+        double FuseLink::timeout = 0;
         void (*FuseLink::continuefunc) (void) = NULL;
+        std::unordered_map<fuse_ino_t, FuseLink::Entry> FuseLink::entries;
+        std::mutex FuseLink::entrylock;
+        std::unordered_multimap<fuse_ino_t, FuseLink::FileHandle *> FuseLink::files;
+        std::mutex FuseLink::filelock;
+        std::unordered_map<fuse_ino_t, std::pair<fuse_ino_t, std::string> > FuseLink::orphans;
+        unsigned int FuseLink::orphancount = 0;
 
         Mounter::Mounter(std::string image, std::string mount,
-                bool foreground, bool allow_other, void (*continuefunc) (void))
+                bool foreground, bool allow_other, void (*continuefunc) (void),
+                LowLevel::BlockStreamBackend::BlockStreamBackend backend,
+                bool multithreaded, bool readonly, unsigned int profileTime)
         {
             this->mountResult = -EALREADY;
 
-            // Define the fuse_operations structure.
-            static fuse_operations ops;
+            // Define the fuse_lowlevel_ops structure.
+            static fuse_lowlevel_ops ops;
+            ops.init = &FuseLink::init;
+            ops.destroy = &FuseLink::destroy;
+            ops.lookup = &FuseLink::lookup;
+            ops.forget = &FuseLink::forget;
             ops.getattr = &FuseLink::getattr;
+            ops.setattr = &FuseLink::setattr;
             ops.readlink = &FuseLink::readlink;
             ops.mknod = &FuseLink::mknod;
             ops.mkdir = &FuseLink::mkdir;
@@ -30,46 +48,52 @@ namespace AppLib
             ops.symlink = &FuseLink::symlink;
             ops.rename = &FuseLink::rename;
             ops.link = &FuseLink::link;
-            ops.chmod = &FuseLink::chmod;
-            ops.chown = &FuseLink::chown;
-            ops.truncate = &FuseLink::truncate;
             ops.open = &FuseLink::open;
             ops.read = &FuseLink::read;
             ops.write = &FuseLink::write;
+            ops.flush = &FuseLink::flush;
+            ops.release = &FuseLink::release;
+            ops.fsync = &FuseLink::fsync;
+            ops.opendir = &FuseLink::opendir;
+            ops.readdir = &FuseLink::readdir;
+            ops.releasedir = &FuseLink::releasedir;
+            ops.fsyncdir = NULL;
             ops.statfs = NULL;
-            ops.flush = NULL;
-            ops.release = NULL;
-            ops.fsync = NULL;
             ops.setxattr = NULL;
             ops.getxattr = NULL;
             ops.listxattr = NULL;
             ops.removexattr = NULL;
-            ops.opendir = NULL;
-            ops.readdir = &FuseLink::readdir;
-            ops.releasedir = NULL;
-            ops.fsyncdir = NULL;
-            ops.init = &FuseLink::init;
-            ops.destroy = &FuseLink::destroy;
             ops.access = NULL;
             ops.create = &FuseLink::create;
-            ops.ftruncate = NULL;
-            ops.fgetattr = NULL;
-            ops.lock = NULL;
-            ops.utimens = &FuseLink::utimens;
+            ops.getlk = NULL;
+            ops.setlk = NULL;
             ops.bmap = NULL;
             ops.ioctl = NULL;
             ops.poll = NULL;
 
             // Attempt to open the package and set
-            // continuation function.
-            FuseLink::filesystem = new FS(image);
+            // continuation function.  Mounted packages are read-mostly,
+            // so by default they are opened with a backend that does not
+            // serialize reads on the stream lock.
+            FuseLink::filesystem = new FS(image, 0, 0, backend);
             FuseLink::continuefunc = continuefunc;
+            FuseLink::readonly = readonly;
+
+            // A read-only package can't change underneath the kernel, so
+            // the kernel is allowed to keep attributes, directory entries
+            // (including those that don't exist) and file contents cached.
+            // Otherwise every request has to come back to us.
+            FuseLink::timeout = readonly ? READONLY_CACHE_TIMEOUT : 0;
 
             // Mounts the specified disk image at the
             // specified mount path using FUSE.
             struct fuse_args fargs = FUSE_ARGS_INIT(0, NULL);
 
-            if (fuse_opt_add_arg(&fargs, "appfs") == -1)
+            if (fuse_opt_add_arg(&fargs, "appfs") == -1
+#ifdef DEBUG
+                || fuse_opt_add_arg(&fargs, "-d") == -1
+#endif
+                )
             {
                 Logging::showErrorW("Unable to set FUSE options.");
                 fuse_opt_free_args(&fargs);
@@ -77,33 +101,31 @@ namespace AppLib
                 return;
             }
 
-            if (foreground)
+            std::string opts = "default_permissions";
+            if (allow_other)
             {
-                if (fuse_opt_add_arg(&fargs, "-f") == -1
-#ifdef DEBUG
-                    || fuse_opt_add_arg(&fargs, "-d") == -1
-#endif
-                    )
-                {
-                    Logging::showErrorW("Unable to set FUSE options.");
-                    fuse_opt_free_args(&fargs);
-                    this->mountResult = -5;
-                    return;
-                }
+                Logging::showInfoW("Allowing other users access to filesystem.");
+                opts = "allow_other," + opts;
+            }
+            if (readonly)
+            {
+                Logging::showInfoW("Mounting the package read-only.");
+                opts += ",ro";
             }
 
-            const char *normal_opts = "default_permissions,use_ino,attr_timeout=0,entry_timeout=0";
-            const char *allow_opts = "allow_other,default_permissions,use_ino,attr_timeout=0,entry_timeout=0";
-            const char *opts = NULL;
-            if (allow_other)
+            // Requests are handled on a single thread unless asked
+            // otherwise.  The fstream backend keeps one stream position
+            // for every thread, so it can't service concurrent readers.
+            if (multithreaded && backend == LowLevel::BlockStreamBackend::BSB_FSTREAM)
             {
-                Logging::showInfoW("Allowing other users access to filesystem.");
-                opts = allow_opts;
+                Logging::showWarningW("The fstream backend can not be used from multiple threads;");
+                Logging::showWarningO("the package will be mounted single-threaded.");
+                multithreaded = false;
             }
-            else
-                opts = normal_opts;
+            if (multithreaded)
+                Logging::showInfoW("Handling filesystem requests on multiple threads.");
 
-            if (fuse_opt_add_arg(&fargs, "-s") == -1 || fuse_opt_add_arg(&fargs, "-o") || fuse_opt_add_arg(&fargs, opts) == -1 || fuse_opt_add_arg(&fargs, mount.c_str()) == -1)
+            if (fuse_opt_add_arg(&fargs, "-o") == -1 || fuse_opt_add_arg(&fargs, opts.c_str()) == -1)
             {
                 Logging::showErrorW("Unable to set FUSE options.");
                 fuse_opt_free_args(&fargs);
@@ -113,11 +135,107 @@ namespace AppLib
 
             FUSEData appfs_status;
             appfs_status.filesystem = FuseLink::filesystem;
-            appfs_status.readonly = false;
+            appfs_status.readonly = readonly;
             appfs_status.mount = mount;
             appfs_status.image = image;
 
-            this->mountResult = fuse_main(fargs.argc, fargs.argv, &ops, &appfs_status);
+            // Mount and serve requests until the package is unmounted.
+            this->mountResult = 1;
+            struct fuse_chan *ch = fuse_mount(mount.c_str(), &fargs);
+            if (ch != NULL)
+            {
+                struct fuse_session *se = fuse_lowlevel_new(&fargs, &ops, sizeof(ops), &appfs_status);
+                if (se != NULL)
+                {
+                    if (fuse_daemonize(foreground ? 1 : 0) != -1 &&
+                            fuse_set_signal_handlers(se) != -1)
+                    {
+                        // Threads don't survive daemonizing, so the
+                        // background work is only started from here on.
+                        std::thread recorder;
+                        std::thread committer;
+                        std::mutex backgroundlock;
+                        std::condition_variable backgroundwake;
+                        bool unmounted = false;
+
+                        // A profile is recorded on read-only mounts too.  It
+                        // is written straight to its own area of the package,
+                        // outside the journal, and is the only write those
+                        // mounts make.
+                        uint64_t prefetched = FuseLink::filesystem->prefetchProfile();
+                        if (prefetched > 0)
+                            Logging::showInfoW("Prefetching %llu KB of the package.", (unsigned long long) prefetched / 1024);
+                        else if (profileTime > 0 && FuseLink::filesystem->startProfile())
+                        {
+                            Logging::showInfoW("Recording a prefetch profile for the first %u seconds.", profileTime);
+                            recorder = std::thread([&]()
+                            {
+                                std::unique_lock<std::mutex> lock(backgroundlock);
+                                backgroundwake.wait_for(lock, std::chrono::seconds(profileTime), [&]() { return unmounted; });
+                                lock.unlock();
+                                try
+                                {
+                                    FuseLink::filesystem->saveProfile();
+                                }
+                                catch (std::exception& e)
+                                {
+                                    Logging::showWarningW("Unable to save the prefetch profile.");
+                                }
+                            });
+                        }
+
+                        // The journal only writes out a group when a later
+                        // transaction ends, so a mount that goes quiet has
+                        // it written out on a timer instead.
+                        if (!readonly)
+                        {
+                            committer = std::thread([&]()
+                            {
+                                std::unique_lock<std::mutex> lock(backgroundlock);
+                                while (!backgroundwake.wait_for(lock, std::chrono::seconds(JOURNAL_COMMIT_INTERVAL),
+                                            [&]() { return unmounted; }))
+                                {
+                                    lock.unlock();
+                                    try
+                                    {
+                                        FuseLink::filesystem->commitJournal();
+                                    }
+                                    catch (std::exception& e)
+                                    {
+                                        Logging::showWarningW("Unable to write out the journal.");
+                                    }
+                                    lock.lock();
+                                }
+                            });
+                        }
+
+                        fuse_session_add_chan(se, ch);
+                        int res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                        this->mountResult = (res == -1) ? 1 : 0;
+                        fuse_remove_signal_handlers(se);
+                        fuse_session_remove_chan(ch);
+
+                        // Stop the background work.  A profile that is still
+                        // being recorded keeps what was read so far.
+                        {
+                            std::lock_guard<std::mutex> lock(backgroundlock);
+                            unmounted = true;
+                        }
+                        backgroundwake.notify_all();
+                        if (recorder.joinable())
+                            recorder.join();
+                        if (committer.joinable())
+                            committer.join();
+                    }
+                    fuse_session_destroy(se);
+                }
+                fuse_unmount(mount.c_str(), ch);
+            }
+            fuse_opt_free_args(&fargs);
+
+            // Closing the package writes out what the journal holds.
+            delete FuseLink::filesystem;
+            FuseLink::filesystem = NULL;
         }
 
         int Mounter::getResult()
@@ -145,359 +263,834 @@ namespace AppLib
             }
         }
 
-        int FuseLink::getattr(const char *path, struct stat *stbuf)
+        void FuseLink::init(void *userdata, struct fuse_conn_info *conn)
+        {
+            // Let file data be spliced from the package (see read).
+            conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+
+            if (FuseLink::continuefunc != NULL)
+            {
+                FuseLink::continuefunc();
+            }
+        }
+
+        void FuseLink::destroy(void *userdata)
+        {
+            if (FuseLink::readonly)
+                return;
+
+            // Write out what open files still buffer, and the metadata
+            // changes waiting in the journal, as the package is unmounted.
+            {
+                std::lock_guard<std::mutex> guard(FuseLink::filelock);
+                for (std::unordered_multimap<fuse_ino_t, FileHandle *>::iterator i = FuseLink::files.begin();
+                        i != FuseLink::files.end(); i++)
+                {
+                    std::lock_guard<std::mutex> hguard(i->second->lock);
+                    i->second->file.clear();
+                    i->second->file.flush();
+                }
+            }
+            try
+            {
+                FuseLink::filesystem->sync();
+            }
+            catch (std::exception& e)
+            {
+                FuseLink::handleException(e, "destroy");
+            }
+        }
+
+        void FuseLink::lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
 
-            // Create a new stat object in the stbuf position.
-            memset(stbuf, 0, sizeof(struct stat));
+            // Look the name up in the directory.
+            struct fuse_entry_param e;
+            try
+            {
+                FuseLink::fillEntry(req, parent, name, e);
+                fuse_reply_entry(req, &e);
+            }
+            catch (std::exception& ex)
+            {
+                int err = FuseLink::handleException(ex, "lookup");
+
+                // Let the kernel remember names that don't exist for
+                // as long as it remembers those that do.
+                if (err == -ENOENT && FuseLink::timeout > 0)
+                {
+                    memset(&e, 0, sizeof(e));
+                    e.ino = 0;
+                    e.entry_timeout = FuseLink::timeout;
+                    fuse_reply_entry(req, &e);
+                    return;
+                }
+                fuse_reply_err(req, -err);
+            }
+        }
+
+        void FuseLink::forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+        {
+            {
+                std::lock_guard<std::mutex> guard(FuseLink::entrylock);
+                std::unordered_map<fuse_ino_t, Entry>::iterator i = FuseLink::entries.find(ino);
+                if (i != FuseLink::entries.end())
+                {
+                    if (nlookup >= i->second.nlookup)
+                        FuseLink::entries.erase(i);
+                    else
+                        i->second.nlookup -= nlookup;
+                }
+            }
+            fuse_reply_none(req);
+        }
+
+        void FuseLink::getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+        {
+            FuseLink::setContext(req);
 
             // Attempt to get attributes.
             try
             {
-                FuseLink::filesystem->getattr(path, *stbuf);
-                return 0;
+                FuseLink::flushFiles(ino, true);
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(struct stat));
+                FuseLink::filesystem->getattr(FuseLink::getINodeID(ino), stbuf);
+                fuse_reply_attr(req, &stbuf, FuseLink::timeout);
+            }
+            catch (std::exception& e)
+            {
+                fuse_reply_err(req, -FuseLink::handleException(e, "getattr"));
+            }
+        }
+
+        void FuseLink::setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                int to_set, struct fuse_file_info *fi)
+        {
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
+
+            // Apply each of the requested changes in turn, once anything
+            // buffered by open handles has been written out.  They are
+            // applied by inode, as the file may have no name left.
+            try
+            {
+                FuseLink::flushFiles(ino, true);
+                uint32_t id = FuseLink::getINodeID(ino);
+                if (to_set & FUSE_SET_ATTR_MODE)
+                    FuseLink::filesystem->chmod(id, attr->st_mode);
+                if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+                    FuseLink::filesystem->chown(id,
+                            (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : -1,
+                            (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : -1);
+                if ((to_set & FUSE_SET_ATTR_SIZE) && fi != NULL)
+                {
+                    if ((uint64_t) attr->st_size > FuseLink::filesystem->getMaximumFileSize())
+                        throw Exception::FileTooBig();
+                    FileHandle *handle = (FileHandle *) (uintptr_t) fi->fh;
+                    {
+                        std::lock_guard<std::mutex> guard(handle->lock);
+                        handle->file.clear();
+                        if (!handle->file.truncate(attr->st_size))
+                            throw Exception::InternalInconsistency();
+                    }
+                    FuseLink::filesystem->touch(id, "cma");
+                }
+                else if (to_set & FUSE_SET_ATTR_SIZE)
+                    FuseLink::filesystem->truncate(id, attr->st_size);
+                if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                            FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))
+                {
+                    struct stat current;
+                    memset(&current, 0, sizeof(struct stat));
+                    FuseLink::filesystem->getattr(id, current);
+                    time_t now = time(NULL);
+                    time_t atime = current.st_atime;
+                    time_t mtime = current.st_mtime;
+                    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                        atime = now;
+                    else if (to_set & FUSE_SET_ATTR_ATIME)
+                        atime = attr->st_atime;
+                    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                        mtime = now;
+                    else if (to_set & FUSE_SET_ATTR_MTIME)
+                        mtime = attr->st_mtime;
+                    FuseLink::filesystem->utimens(id, atime, mtime);
+                }
+
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(struct stat));
+                FuseLink::filesystem->getattr(id, stbuf);
+                fuse_reply_attr(req, &stbuf, FuseLink::timeout);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "getattr");
+                fuse_reply_err(req, -FuseLink::handleException(e, "setattr"));
             }
         }
 
-        int FuseLink::readlink(const char *path, char *out, size_t size)
+        void FuseLink::readlink(fuse_req_t req, fuse_ino_t ino)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
 
             // Attempt to read link information.
             try
             {
-                std::string result = FuseLink::filesystem->readlink(path);
-                for (size_t i = 0; i < size; i++)
-                    out[i] = '\0';
-                for (size_t i = 0; i < result.length() && i < size; i++)
-                    out[i] = result[i];
-                return 0;
+                std::string result = FuseLink::filesystem->readlink(FuseLink::getINodeID(ino));
+                fuse_reply_readlink(req, result.c_str());
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "readlink");
+                fuse_reply_err(req, -FuseLink::handleException(e, "readlink"));
             }
         }
 
-        int FuseLink::mknod(const char *path, mode_t mode, dev_t devid)
+        void FuseLink::mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                mode_t mode, dev_t rdev)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
             // Attempt to create device node.
             try
             {
-                FuseLink::filesystem->mknod(path, mode, devid);
-                return 0;
+                FuseLink::filesystem->mknod(FuseLink::getPath(parent, name), mode, rdev);
+                FuseLink::replyEntry(req, parent, name);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "mknod");
+                fuse_reply_err(req, -FuseLink::handleException(e, "mknod"));
             }
         }
 
-        int FuseLink::mkdir(const char *path, mode_t mode)
+        void FuseLink::mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
             // Attempt to create directory.
             try
             {
-                FuseLink::filesystem->mkdir(path, mode);
-                return 0;
+                FuseLink::filesystem->mkdir(FuseLink::getPath(parent, name), mode);
+                FuseLink::replyEntry(req, parent, name);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "mkdir");
+                fuse_reply_err(req, -FuseLink::handleException(e, "mkdir"));
             }
         }
 
-        int FuseLink::unlink(const char *path)
+        void FuseLink::unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
             // Attempt to unlink file.
             try
             {
-                FuseLink::filesystem->unlink(path);
-                return 0;
+                struct stat stbuf;
+                uint32_t id = FuseLink::filesystem->lookup(FuseLink::getINodeID(parent), name, stbuf);
+                fuse_ino_t ino = FuseLink::getINodeNumber(id);
+                {
+                    // A file that is still open keeps its inode until the
+                    // last handle is released, under a hidden name.
+                    std::lock_guard<std::mutex> guard(FuseLink::filelock);
+                    if (stbuf.st_nlink == 1 && FuseLink::files.count(ino) > 0)
+                    {
+                        char hidden[64];
+                        snprintf(hidden, sizeof(hidden), ".fuse_hidden%08x%08x",
+                                (unsigned int) id, FuseLink::orphancount++);
+                        FuseLink::filesystem->rename(FuseLink::getPath(parent, name),
+                                FuseLink::getPath(parent, hidden));
+                        FuseLink::orphans[ino] = std::make_pair(parent, std::string(hidden));
+                    }
+                    else
+                        FuseLink::filesystem->unlink(FuseLink::getPath(parent, name));
+                }
+                FuseLink::detach(parent, name, ino);
+                fuse_reply_err(req, 0);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "unlink");
+                fuse_reply_err(req, -FuseLink::handleException(e, "unlink"));
             }
         }
 
-        int FuseLink::rmdir(const char *path)
+        void FuseLink::rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
             // Attempt to remove directory.
             try
             {
-                FuseLink::filesystem->rmdir(path);
-                return 0;
+                struct stat stbuf;
+                uint32_t id = FuseLink::filesystem->lookup(FuseLink::getINodeID(parent), name, stbuf);
+                FuseLink::filesystem->rmdir(FuseLink::getPath(parent, name));
+                FuseLink::detach(parent, name, FuseLink::getINodeNumber(id));
+                fuse_reply_err(req, 0);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "rmdir");
+                fuse_reply_err(req, -FuseLink::handleException(e, "rmdir"));
             }
         }
 
-        int FuseLink::symlink(const char *target, const char *path)
+        void FuseLink::symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
             // Attempt to create symbolic link.
             try
             {
-                FuseLink::filesystem->symlink(path, target);
-                return 0;
+                FuseLink::filesystem->symlink(FuseLink::getPath(parent, name), link);
+                FuseLink::replyEntry(req, parent, name);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "symlink");
+                fuse_reply_err(req, -FuseLink::handleException(e, "symlink"));
             }
         }
 
-        int FuseLink::rename(const char *src, const char *dest)
+        void FuseLink::rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                fuse_ino_t newparent, const char *newname)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
             // Attempt to rename file or directory.
             try
             {
-                FuseLink::filesystem->rename(src, dest);
-                return 0;
+                struct stat stbuf;
+                fuse_ino_t moved = FuseLink::getINodeNumber(
+                        FuseLink::filesystem->lookup(FuseLink::getINodeID(parent), name, stbuf));
+                fuse_ino_t replaced = 0;
+                try
+                {
+                    replaced = FuseLink::getINodeNumber(
+                            FuseLink::filesystem->lookup(FuseLink::getINodeID(newparent), newname, stbuf));
+                }
+                catch (Exception::FileNotFound& e)
+                {
+                    // Nothing is being replaced.
+                }
+
+                FuseLink::filesystem->rename(FuseLink::getPath(parent, name),
+                        FuseLink::getPath(newparent, newname));
+
+                // Whatever was at the destination is gone, and the
+                // source now lives there.
+                if (replaced != 0 && replaced != moved)
+                    FuseLink::detach(newparent, newname, replaced);
+                {
+                    std::lock_guard<std::mutex> guard(FuseLink::entrylock);
+                    std::unordered_map<fuse_ino_t, Entry>::iterator i = FuseLink::entries.find(moved);
+                    if (i != FuseLink::entries.end() && i->second.parent == parent && i->second.name == name)
+                    {
+                        i->second.parent = newparent;
+                        i->second.name = newname;
+                    }
+                }
+                fuse_reply_err(req, 0);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "rename");
+                fuse_reply_err(req, -FuseLink::handleException(e, "rename"));
             }
         }
 
-        int FuseLink::link(const char *target, const char *path)
+        void FuseLink::link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
             // Attempt to create hard link.
             try
             {
-                FuseLink::filesystem->link(path, target);
-                return 0;
+                FuseLink::filesystem->link(FuseLink::getPath(newparent, newname), FuseLink::getINodeID(ino));
+                FuseLink::replyEntry(req, newparent, newname);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "link");
+                fuse_reply_err(req, -FuseLink::handleException(e, "link"));
             }
         }
 
-        int FuseLink::chmod(const char *path, mode_t mode)
+        void FuseLink::open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly && (fi->flags & O_ACCMODE) != O_RDONLY)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
-            // Attempt to change permissions mask.
+            // Open the file, keeping it open for the handle's lifetime.
             try
             {
-                FuseLink::filesystem->chmod(path, mode);
-                return 0;
+                FileHandle *handle = FuseLink::openFile(ino, (fi->flags & O_ACCMODE) != O_RDONLY);
+                fi->fh = (uint64_t) (uintptr_t) handle;
+                fi->keep_cache = FuseLink::readonly;
+                if (fuse_reply_open(req, fi) == -ENOENT)
+                    FuseLink::release(NULL, ino, fi);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "chmod");
+                fuse_reply_err(req, -FuseLink::handleException(e, "open"));
             }
         }
 
-        int FuseLink::chown(const char *path, uid_t user, gid_t group)
+        void FuseLink::read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                struct fuse_file_info *fi)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
 
-            // Attempt to change ownership.
+            // Read data from the file.
             try
             {
-                FuseLink::filesystem->chown(path, user, group);
-                return 0;
+                uint64_t max = FuseLink::filesystem->getMaximumFileSize();
+                if ((uint64_t) offset > max || ((uint64_t) offset + (uint64_t) size) > max)
+                {
+                    fuse_reply_err(req, EFBIG);
+                    return;
+                }
+                FuseLink::flushFiles(ino, false);
+
+                FileHandle *handle = (FileHandle *) (uintptr_t) fi->fh;
+                std::vector<char> out;
+                uint32_t count = 0;
+                {
+                    std::lock_guard<std::mutex> guard(handle->lock);
+                    if (!FuseLink::readonly)
+                        handle->file.touch("a");
+                    handle->file.clear();
+                    handle->file.seekg(offset);
+
+                    // Large reads of data that is stored as is are handed
+                    // to the kernel as positions in the package, so that
+                    // FUSE can splice it across without it being copied
+                    // through this process.
+                    if (size >= SPLICE_READ_MIN &&
+                            handle->file.readDirect(size, [&](int fd,
+                                    const std::vector<std::pair<uint64_t, uint64_t> >& extents)
+                            {
+                                FuseLink::replyExtents(req, fd, extents);
+                            }) >= 0)
+                        return;
+
+                    out.resize(size);
+                    count = handle->file.read(out.data(), size);
+                    if (handle->file.fail() || handle->file.bad())
+                    {
+                        fuse_reply_err(req, EIO);
+                        return;
+                    }
+                }
+                fuse_reply_buf(req, out.data(), count);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "chown");
+                fuse_reply_err(req, -FuseLink::handleException(e, "read"));
             }
         }
 
-        int FuseLink::truncate(const char *path, off_t size)
+        void FuseLink::replyExtents(fuse_req_t req, int fd,
+                const std::vector<std::pair<uint64_t, uint64_t> >& extents)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
-
-            // Attempt to truncate file.
-            try
+            if (extents.empty())
             {
-                FuseLink::filesystem->truncate(path, size);
-                return 0;
+                fuse_reply_buf(req, NULL, 0);
+                return;
             }
-            catch (std::exception& e)
+
+            // struct fuse_bufvec ends in room for one buffer.
+            std::vector<char> storage(sizeof(struct fuse_bufvec) +
+                    (extents.size() - 1) * sizeof(struct fuse_buf));
+            struct fuse_bufvec *bufv = (struct fuse_bufvec *) storage.data();
+            bufv->count = extents.size();
+            bufv->idx = 0;
+            bufv->off = 0;
+            for (size_t i = 0; i < extents.size(); i += 1)
             {
-                return FuseLink::handleException(e, "truncate");
+                bufv->buf[i].size = extents[i].second;
+                bufv->buf[i].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+                bufv->buf[i].mem = NULL;
+                bufv->buf[i].fd = fd;
+                bufv->buf[i].pos = extents[i].first;
             }
+
+            // Pages aren't moved, as they belong to the package's page
+            // cache.
+            fuse_reply_data(req, bufv, (enum fuse_buf_copy_flags) 0);
         }
 
-        int FuseLink::open(const char *path, struct fuse_file_info *options)
+        void FuseLink::write(fuse_req_t req, fuse_ino_t ino, const char *in, size_t size,
+                off_t offset, struct fuse_file_info *fi)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
-            // Open the file to see whether it exists.
+            // Write data to the file.
             try
             {
-                FSFile file = FuseLink::filesystem->open(path);
-                file.close();
-                return 0;
+                uint64_t max = FuseLink::filesystem->getMaximumFileSize();
+                if ((uint64_t) offset > max || ((uint64_t) offset + (uint64_t) size) > max)
+                {
+                    fuse_reply_err(req, EFBIG);
+                    return;
+                }
+                FileHandle *handle = (FileHandle *) (uintptr_t) fi->fh;
+                {
+                    std::lock_guard<std::mutex> guard(handle->lock);
+                    handle->file.touch("cma");
+                    handle->file.clear();
+                    handle->file.seekp(offset);
+                    handle->file.write(in, size);
+                    if (handle->file.fail() || handle->file.bad())
+                    {
+                        fuse_reply_err(req, EIO);
+                        return;
+                    }
+                }
+                fuse_reply_write(req, size);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "open");
+                fuse_reply_err(req, -FuseLink::handleException(e, "write"));
             }
         }
 
-        int FuseLink::read(const char *path, char *out, size_t length,
-                off_t offset, struct fuse_file_info *options)
+        void FuseLink::flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FileHandle *handle = (FileHandle *) (uintptr_t) fi->fh;
+            bool ok;
+            {
+                std::lock_guard<std::mutex> guard(handle->lock);
+                handle->file.clear();
+                ok = handle->file.flush();
+            }
+            fuse_reply_err(req, ok ? 0 : EIO);
+        }
 
-            // Read data from the file.
-            try
+        void FuseLink::release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+        {
+            FileHandle *handle = (FileHandle *) (uintptr_t) fi->fh;
             {
-                if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
-                    return -EFBIG;
-                FuseLink::filesystem->touch(path, "a");
-                FSFile file = FuseLink::filesystem->open(path);
-                file.seekg(offset);
-                uint32_t read = file.read(out, length);
-                file.close();
-                if (file.fail() || file.bad())
-                    return -EIO;
-                return read;
+                std::lock_guard<std::mutex> guard(FuseLink::filelock);
+                std::pair<std::unordered_multimap<fuse_ino_t, FileHandle *>::iterator,
+                    std::unordered_multimap<fuse_ino_t, FileHandle *>::iterator> range = FuseLink::files.equal_range(ino);
+                for (std::unordered_multimap<fuse_ino_t, FileHandle *>::iterator i = range.first; i != range.second; i++)
+                {
+                    if (i->second == handle)
+                    {
+                        FuseLink::files.erase(i);
+                        break;
+                    }
+                }
             }
-            catch (std::exception& e)
+
+            // Closing the file writes out anything it still buffers.
             {
-                return FuseLink::handleException(e, "read");
+                std::lock_guard<std::mutex> guard(handle->lock);
+                handle->file.clear();
+                handle->file.close();
             }
+            delete handle;
+
+            // A file unlinked while open goes once nothing has it open.
+            {
+                std::lock_guard<std::mutex> guard(FuseLink::filelock);
+                std::unordered_map<fuse_ino_t, std::pair<fuse_ino_t, std::string> >::iterator orphan =
+                    FuseLink::orphans.find(ino);
+                if (orphan != FuseLink::orphans.end() && FuseLink::files.count(ino) == 0)
+                {
+                    try
+                    {
+                        FuseLink::filesystem->unlink(FuseLink::getPath(orphan->second.first,
+                                    orphan->second.second.c_str()));
+                    }
+                    catch (std::exception& e)
+                    {
+                        FuseLink::handleException(e, "release");
+                    }
+                    FuseLink::orphans.erase(orphan);
+                }
+            }
+            if (req != NULL)
+                fuse_reply_err(req, 0);
         }
 
-        int FuseLink::write(const char *path, const char *in, size_t length,
-                off_t offset, struct fuse_file_info *options)
+        void FuseLink::fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                struct fuse_file_info *fi)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FileHandle *handle = (FileHandle *) (uintptr_t) fi->fh;
+            bool ok;
+            {
+                std::lock_guard<std::mutex> guard(handle->lock);
+                handle->file.clear();
+                ok = handle->file.flush();
+            }
 
-            // Write data to the file.
+            // Unlike flush, fsync also has to make the metadata changes
+            // waiting in the journal durable.
             try
             {
-                if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
-                    return -EFBIG;
-                FuseLink::filesystem->touch(path, "cma");
-                FSFile file = FuseLink::filesystem->open(path);
-                file.seekp(offset);
-                file.write(in, length);
-                file.close();
-                if (file.fail() || file.bad())
-                    return -EIO;
-                return length;
+                if (ok)
+                    FuseLink::filesystem->sync();
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "write");
+                fuse_reply_err(req, -FuseLink::handleException(e, "fsync"));
+                return;
             }
+            fuse_reply_err(req, ok ? 0 : EIO);
         }
 
-        int FuseLink::readdir(const char *path, void *dbuf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+        void FuseLink::opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
 
-            // List all children in a directory.
+            // List all children in the directory, along with the
+            // attributes that readdir reports back for each of them.
             try
             {
-                // Retrieve all children.
-                std::vector<std::string> result =
-                    FuseLink::filesystem->readdir(path);
+                uint32_t id = FuseLink::getINodeID(ino);
+                DirectoryHandle *handle = new DirectoryHandle();
+                handle->entries = FuseLink::filesystem->readdirplus(id);
 
-                // Use the filler() function to report back entries.
-                filler(dbuf, ".", NULL, 0);
-                filler(dbuf, "..", NULL, 0);
-                for (int i = 0; i < result.size(); i++)
-                    filler(dbuf, result[i].c_str(), NULL, 0);
-                return 0;
+                struct stat self;
+                memset(&self, 0, sizeof(struct stat));
+                self.st_ino = id;
+                self.st_mode = S_IFDIR;
+
+                // The parent is only known if the kernel looked this
+                // directory up.  Otherwise, and for the root, ".." is
+                // left without an inode number for the kernel to fill in.
+                struct stat up;
+                memset(&up, 0, sizeof(struct stat));
+                up.st_mode = S_IFDIR;
+                fuse_ino_t parent = FuseLink::getParent(ino);
+                if (parent != 0)
+                {
+                    try
+                    {
+                        FuseLink::filesystem->getattr(FuseLink::getINodeID(parent), up);
+                    }
+                    catch (Exception::FileNotFound& e)
+                    {
+                        memset(&up, 0, sizeof(struct stat));
+                        up.st_mode = S_IFDIR;
+                    }
+                }
+
+                handle->entries.insert(handle->entries.begin(), std::make_pair(std::string(".."), up));
+                handle->entries.insert(handle->entries.begin(), std::make_pair(std::string("."), self));
+
+                fi->fh = (uint64_t) (uintptr_t) handle;
+                if (fuse_reply_open(req, fi) == -ENOENT)
+                    delete handle;
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "readdir");
+                fuse_reply_err(req, -FuseLink::handleException(e, "opendir"));
             }
         }
 
-        void *FuseLink::init(struct fuse_conn_info *conn)
+        void FuseLink::readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                struct fuse_file_info *fi)
         {
-            if (FuseLink::continuefunc != NULL)
+            DirectoryHandle *handle = (DirectoryHandle *) (uintptr_t) fi->fh;
+
+            // Fill the buffer with as many entries as fit from the
+            // requested offset onwards.
+            std::vector<char> out(size);
+            size_t used = 0;
+            for (size_t i = offset; i < handle->entries.size(); i++)
             {
-                FuseLink::continuefunc();
+                size_t length = fuse_add_direntry(req, out.data() + used, size - used,
+                        handle->entries[i].first.c_str(), &handle->entries[i].second, i + 1);
+                if (length > size - used)
+                    break;
+                used += length;
             }
-
-            return NULL;
+            fuse_reply_buf(req, out.data(), used);
         }
 
-        void FuseLink::destroy(void *)
+        void FuseLink::releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
         {
-            return;
+            delete (DirectoryHandle *) (uintptr_t) fi->fh;
+            fuse_reply_err(req, 0);
         }
 
-        int FuseLink::create(const char *path, mode_t mode, struct fuse_file_info *options)
+        void FuseLink::create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                mode_t mode, struct fuse_file_info *fi)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            FuseLink::setContext(req);
+
+            if (FuseLink::readonly)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
 
-            // Attempt to create normal file.
+            // Attempt to create normal file and open it.
             try
             {
-                FuseLink::filesystem->create(path, mode);
-                return 0;
+                FuseLink::filesystem->create(FuseLink::getPath(parent, name), mode);
+                struct fuse_entry_param e;
+                FuseLink::fillEntry(req, parent, name, e);
+                FileHandle *handle = FuseLink::openFile(e.ino, true);
+                fi->fh = (uint64_t) (uintptr_t) handle;
+                if (fuse_reply_create(req, &e, fi) == -ENOENT)
+                    FuseLink::release(NULL, e.ino, fi);
             }
             catch (std::exception& e)
             {
-                return FuseLink::handleException(e, "create");
+                fuse_reply_err(req, -FuseLink::handleException(e, "create"));
             }
         }
 
-        int FuseLink::utimens(const char *path, const struct timespec tv[2])
+        void FuseLink::setContext(fuse_req_t req)
         {
-            FuseLink::filesystem->setuid(fuse_get_context()->uid);
-            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+            const struct fuse_ctx *context = fuse_req_ctx(req);
+            FuseLink::filesystem->setuid(context->uid);
+            FuseLink::filesystem->setgid(context->gid);
+        }
 
-            // Set the access and modification times.
-            try
-            {
-                FuseLink::filesystem->utimens(path, tv[0].tv_sec, tv[1].tv_sec);
-                return 0;
-            }
-            catch (std::exception& e)
+        uint32_t FuseLink::getINodeID(fuse_ino_t ino)
+        {
+            if (ino < FUSE_ROOT_ID || ino > (fuse_ino_t) UINT32_MAX)
+                throw Exception::FileNotFound();
+            return (uint32_t) (ino - FUSE_ROOT_ID);
+        }
+
+        fuse_ino_t FuseLink::getINodeNumber(uint32_t id)
+        {
+            return (fuse_ino_t) id + FUSE_ROOT_ID;
+        }
+
+        std::string FuseLink::getPath(fuse_ino_t ino)
+        {
+            std::lock_guard<std::mutex> guard(FuseLink::entrylock);
+
+            // Walk up through the names the kernel looked up to get
+            // to this inode.
+            std::string path = "";
+            while (ino != FUSE_ROOT_ID)
             {
-                return FuseLink::handleException(e, "utimens");
+                std::unordered_map<fuse_ino_t, Entry>::iterator i = FuseLink::entries.find(ino);
+                if (i == FuseLink::entries.end() || i->second.name.empty())
+                    throw Exception::FileNotFound();
+                path = "/" + i->second.name + path;
+                ino = i->second.parent;
             }
+            if (path == "")
+                return "/";
+            return path;
+        }
+
+        fuse_ino_t FuseLink::getParent(fuse_ino_t ino)
+        {
+            std::lock_guard<std::mutex> guard(FuseLink::entrylock);
+            if (ino == FUSE_ROOT_ID)
+                return 0;
+            std::unordered_map<fuse_ino_t, Entry>::iterator i = FuseLink::entries.find(ino);
+            if (i == FuseLink::entries.end() || i->second.name.empty())
+                return 0;
+            return i->second.parent;
+        }
+
+        std::string FuseLink::getPath(fuse_ino_t parent, const char *name)
+        {
+            std::string path = FuseLink::getPath(parent);
+            if (path == "/")
+                return path + name;
+            return path + "/" + name;
+        }
+
+        void FuseLink::remember(fuse_ino_t parent, const char *name, fuse_ino_t ino)
+        {
+            std::lock_guard<std::mutex> guard(FuseLink::entrylock);
+            Entry& entry = FuseLink::entries[ino];
+            entry.parent = parent;
+            entry.name = name;
+            entry.nlookup += 1;
+        }
+
+        void FuseLink::detach(fuse_ino_t parent, const char *name, fuse_ino_t ino)
+        {
+            // The kernel forgets the inode in its own time, but it can
+            // no longer be reached by the name it was looked up by.
+            std::lock_guard<std::mutex> guard(FuseLink::entrylock);
+            std::unordered_map<fuse_ino_t, Entry>::iterator i = FuseLink::entries.find(ino);
+            if (i != FuseLink::entries.end() && i->second.parent == parent && i->second.name == name)
+                i->second.name.clear();
+        }
+
+        void FuseLink::fillEntry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                struct fuse_entry_param& e)
+        {
+            memset(&e, 0, sizeof(e));
+            uint32_t id = FuseLink::filesystem->lookup(FuseLink::getINodeID(parent), name, e.attr);
+            e.ino = FuseLink::getINodeNumber(id);
+            e.attr_timeout = FuseLink::timeout;
+            e.entry_timeout = FuseLink::timeout;
+            FuseLink::remember(parent, name, e.ino);
+        }
+
+        void FuseLink::replyEntry(fuse_req_t req, fuse_ino_t parent, const char *name)
+        {
+            struct fuse_entry_param e;
+            FuseLink::fillEntry(req, parent, name, e);
+            fuse_reply_entry(req, &e);
         }
 
         int FuseLink::handleException(std::exception& e, std::string function)
@@ -538,5 +1131,34 @@ namespace AppLib
             Logging::showErrorO("-> '%s'", e.what());
             return -EIO;
         }
+
+        FuseLink::FileHandle * FuseLink::openFile(fuse_ino_t ino, bool writable)
+        {
+            FileHandle *handle = new FileHandle(FuseLink::filesystem->open(FuseLink::getINodeID(ino)));
+            if (writable)
+                handle->file.setBufferSize(WRITE_BUFFER_SIZE);
+
+            std::lock_guard<std::mutex> guard(FuseLink::filelock);
+            FuseLink::files.insert(std::make_pair(ino, handle));
+            return handle;
+        }
+
+        void FuseLink::flushFiles(fuse_ino_t ino, bool times)
+        {
+            // Data is always flushed, but the times recorded by each
+            // handle are only written when they are going to be seen.
+            std::lock_guard<std::mutex> guard(FuseLink::filelock);
+            std::pair<std::unordered_multimap<fuse_ino_t, FileHandle *>::iterator,
+                std::unordered_multimap<fuse_ino_t, FileHandle *>::iterator> range = FuseLink::files.equal_range(ino);
+            for (std::unordered_multimap<fuse_ino_t, FileHandle *>::iterator i = range.first; i != range.second; i++)
+            {
+                std::lock_guard<std::mutex> hguard(i->second->lock);
+                if (times || i->second->file.hasBufferedData())
+                {
+                    i->second->file.clear();
+                    i->second->file.flush();
+                }
+            }
+        }
     }
 }
@@ -8,50 +8,145 @@
 #define _FILE_OFFSET_BITS 64
 
 #include <exception>
-#include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
 #include <stdio.h>
 #include <errno.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include "src/package-fs/fs.h"
 
 namespace AppLib
 {
     namespace FUSE
     {
+        //! Links the FUSE low-level (inode-based) API to a package.
+        /*!
+         * FUSE inode numbers are the AppFS inode ID plus one, as FUSE
+         * reserves inode 0 and uses 1 for the root directory.  Requests
+         * that only read the package go straight to the inode ID, while
+         * those that modify it are turned back into paths using the
+         * names the kernel has looked up.
+         */
         class FuseLink
         {
         public:
             static FS * filesystem;
+            static bool readonly;
+            static double timeout;
             static void (*continuefunc) (void);
-            static int getattr(const char *path, struct stat *stbuf);
-            static int readlink(const char *path, char *out, size_t size);
-            static int mknod(const char *path, mode_t mask, dev_t devid);
-            static int mkdir(const char *path, mode_t mask);
-            static int unlink(const char *path);
-            static int rmdir(const char *path);
-            static int symlink(const char *path, const char *source);
-            static int rename(const char *src, const char *dest);
-            static int link(const char *path, const char *source);
-            static int chmod(const char *path, mode_t mode);
-            static int chown(const char *path, uid_t user, gid_t group);
-            static int truncate(const char *path, off_t size);
-            static int open(const char *path, struct fuse_file_info *options);
-            static int read(const char *path, char *out, size_t length,
-                            off_t offset, struct fuse_file_info *options);
-            static int write(const char *, const char *, size_t, off_t, struct fuse_file_info *);
-            static int readdir(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
-            static void *init(struct fuse_conn_info *conn);
-            static void destroy(void *);
-            static int create(const char *, mode_t, struct fuse_file_info *);
-            static int utimens(const char *, const struct timespec tv[2]);
+            static void init(void *userdata, struct fuse_conn_info *conn);
+            static void destroy(void *userdata);
+            static void lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+            static void getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                                int to_set, struct fuse_file_info *fi);
+            static void readlink(fuse_req_t req, fuse_ino_t ino);
+            static void mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                              mode_t mode, dev_t rdev);
+            static void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+            static void unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name);
+            static void rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                               fuse_ino_t newparent, const char *newname);
+            static void link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname);
+            static void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                             struct fuse_file_info *fi);
+            static void write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                              off_t off, struct fuse_file_info *fi);
+            static void flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                              struct fuse_file_info *fi);
+            static void opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                                struct fuse_file_info *fi);
+            static void releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                               mode_t mode, struct fuse_file_info *fi);
         private:
+            //! A name the kernel has looked up, and the number of
+            //! lookups it has not yet forgotten.
+            struct Entry
+            {
+                fuse_ino_t parent;
+                std::string name;
+                uint64_t nlookup;
+            };
+
+            //! A file opened by the kernel.  Requests against the same
+            //! handle may arrive on different threads, so the file's
+            //! position is guarded.
+            struct FileHandle
+            {
+                FSFile file;
+                std::mutex lock;
+                FileHandle(const FSFile& file) : file(file) { }
+            };
+
+            //! A directory opened by the kernel, listed in full when it
+            //! is opened so that readdir offsets stay stable.
+            struct DirectoryHandle
+            {
+                std::vector<std::pair<std::string, struct stat> > entries;
+            };
+
+            static std::unordered_map<fuse_ino_t, Entry> entries;
+            static std::mutex entrylock;
+
+            //! The open files, by inode number.  Writes and times are
+            //! buffered in each file until it is flushed, so requests
+            //! that look at a file through anything but its own handle
+            //! flush it first.
+            static std::unordered_multimap<fuse_ino_t, FileHandle *> files;
+            static std::mutex filelock;
+
+            //! The files that were unlinked while open, by inode number,
+            //! with the directory and hidden name they were renamed to.
+            //! Each is unlinked when its last handle is released.  They
+            //! are guarded by filelock.
+            static std::unordered_map<fuse_ino_t, std::pair<fuse_ino_t, std::string> > orphans;
+            static unsigned int orphancount;
+
+            static void setContext(fuse_req_t req);
+            static uint32_t getINodeID(fuse_ino_t ino);
+            static fuse_ino_t getINodeNumber(uint32_t id);
+            static std::string getPath(fuse_ino_t ino);
+
+            //! Returns the directory the kernel looked ino up in, or 0
+            //! if it is the root or hasn't been looked up.
+            static fuse_ino_t getParent(fuse_ino_t ino);
+            static std::string getPath(fuse_ino_t parent, const char *name);
+            static void remember(fuse_ino_t parent, const char *name, fuse_ino_t ino);
+            static void detach(fuse_ino_t parent, const char *name, fuse_ino_t ino);
+            static void fillEntry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                                  struct fuse_entry_param& e);
+            static void replyEntry(fuse_req_t req, fuse_ino_t parent, const char *name);
             static int handleException(std::exception& e, std::string function);
+            static FileHandle * openFile(fuse_ino_t ino, bool writable);
+            static void flushFiles(fuse_ino_t ino, bool times);
+
+            //! Replies to a read with data at the given positions and
+            //! lengths in fd, which is read (or spliced) before this
+            //! returns.
+            static void replyExtents(fuse_req_t req, int fd,
+                                     const std::vector<std::pair<uint64_t, uint64_t> >& extents);
         };
 
         class Mounter
         {
         public:
             Mounter(std::string image, std::string mount,
-                    bool foreground, bool allowOther, void (*continue_func) (void));
+                    bool foreground, bool allowOther, void (*continue_func) (void),
+                    LowLevel::BlockStreamBackend::BlockStreamBackend backend =
+                        LowLevel::BlockStreamBackend::BSB_MMAP,
+                    bool multithreaded = false, bool readonly = false,
+                    unsigned int profileTime = 0);
             int getResult();
 
         private:
@@ -0,0 +1,246 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <string.h>
+#include <algorithm>
+#include "src/package-fs/lowlevel/blockindex.h"
+#include "src/package-fs/lowlevel/endian.h"
+#include "src/package-fs/lowlevel/fs.h"
+#include "src/package-fs/logging.h"
+
+extern "C"
+{
+#include "src/shared/siphash24.h"
+}
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        // The key used to hash block contents.  It is fixed so that the
+        // hashes stored in a package stay valid from one open to the next.
+        static const uint8_t block_hash_key[16] =
+        {
+            0x41, 0x70, 0x70, 0x46, 0x53, 0x20, 0x62, 0x6c,
+            0x6f, 0x63, 0x6b, 0x20, 0x68, 0x61, 0x73, 0x68
+        };
+
+        BlockIndex::BlockIndex(FS * filesystem, BlockStream * fd, const Format* format)
+        {
+            this->filesystem = filesystem;
+            this->fd = fd;
+            this->format = format;
+            this->last_index_block = 0;
+
+            // Make a cache out of the on-disk data.
+            if (this->isAvailable())
+                this->syncronizeCache();
+        }
+
+        bool BlockIndex::isAvailable() const
+        {
+            return this->fd != NULL && this->format->hsize_blockindex != 0;
+        }
+
+        uint64_t BlockIndex::findBlock(uint32_t hash, const char *data)
+        {
+            char block[BSIZE_FILE];
+            std::pair < std::multimap < uint32_t, uint64_t >::iterator,
+                std::multimap < uint32_t, uint64_t >::iterator > range = this->hashes.equal_range(hash);
+            for (std::multimap < uint32_t, uint64_t >::iterator i = range.first; i != range.second; i++)
+            {
+                if (this->fd->readAt(block, BSIZE_FILE, i->second) != BSIZE_FILE)
+                    continue;
+                if (memcmp(block, data, BSIZE_FILE) == 0)
+                    return i->second;
+            }
+            return 0;
+        }
+
+        bool BlockIndex::addBlock(uint64_t pos, uint32_t hash)
+        {
+            if (this->entries.find(pos) != this->entries.end())
+            {
+                this->addReference(pos);
+                return true;
+            }
+            if (this->empty_slots.size() == 0 && !this->extendIndex())
+                return false;
+
+            Entry entry;
+            entry.hash = hash;
+            entry.refs = 1;
+            entry.slot = this->empty_slots.back();
+            this->empty_slots.pop_back();
+            this->writeEntry(pos, entry);
+            this->entries.insert(std::make_pair(pos, entry));
+            this->hashes.insert(std::make_pair(hash, pos));
+            return true;
+        }
+
+        void BlockIndex::addReference(uint64_t pos)
+        {
+            std::unordered_map < uint64_t, Entry >::iterator i = this->entries.find(pos);
+            if (i == this->entries.end())
+                return;
+            i->second.refs += 1;
+            this->writeEntry(pos, i->second);
+        }
+
+        uint32_t BlockIndex::releaseReference(uint64_t pos)
+        {
+            std::unordered_map < uint64_t, Entry >::iterator i = this->entries.find(pos);
+            if (i == this->entries.end())
+            {
+                Logging::showWarningW("BLOCKINDEX: Block at %llu is not shared.", (unsigned long long) pos);
+                return 0;
+            }
+            if (i->second.refs > 1)
+            {
+                i->second.refs -= 1;
+                this->writeEntry(pos, i->second);
+                return i->second.refs;
+            }
+
+            // This was the last reference, so the entry is cleared.
+            const char zero[BLOCKINDEX_ENTRY_SIZE] = { 0 };
+            this->fd->writeAt(zero, BLOCKINDEX_ENTRY_SIZE, i->second.slot);
+            this->empty_slots.push_back(i->second.slot);
+            std::pair < std::multimap < uint32_t, uint64_t >::iterator,
+                std::multimap < uint32_t, uint64_t >::iterator > range = this->hashes.equal_range(i->second.hash);
+            for (std::multimap < uint32_t, uint64_t >::iterator h = range.first; h != range.second; h++)
+            {
+                if (h->second == pos)
+                {
+                    this->hashes.erase(h);
+                    break;
+                }
+            }
+            this->entries.erase(i);
+            return 0;
+        }
+
+        uint32_t BlockIndex::getReferences(uint64_t pos) const
+        {
+            std::unordered_map < uint64_t, Entry >::const_iterator i = this->entries.find(pos);
+            if (i == this->entries.end())
+                return 0;
+            return i->second.refs;
+        }
+
+        void BlockIndex::getStatistics(uint64_t& blocks, uint64_t& references) const
+        {
+            blocks = this->entries.size();
+            references = 0;
+            for (std::unordered_map < uint64_t, Entry >::const_iterator i = this->entries.begin(); i != this->entries.end(); i++)
+                references += i->second.refs;
+        }
+
+        uint32_t BlockIndex::hashBlock(const char *data)
+        {
+            uint8_t out[8];
+            siphash24(out, data, BSIZE_FILE, block_hash_key);
+            return Endian::getU32((const char *) out);
+        }
+
+        void BlockIndex::writeEntry(uint64_t pos, const Entry& entry)
+        {
+            char data[BLOCKINDEX_ENTRY_SIZE];
+            Endian::putU64(data, pos);
+            Endian::putU32(data + 8, entry.hash);
+            Endian::putU32(data + 12, entry.refs);
+            this->fd->writeAt(data, BLOCKINDEX_ENTRY_SIZE, entry.slot);
+        }
+
+        bool BlockIndex::extendIndex()
+        {
+            uint64_t pos = this->filesystem->getFirstFreeBlock();
+            if (pos == 0)
+            {
+                Logging::showErrorW("BLOCKINDEX: Unable to allocate a new block index block.");
+                return false;
+            }
+            INode inode(0, "", INodeType::INT_BLOCKINDEX);
+            if (this->filesystem->writeINode(pos, inode) != FSResult::E_SUCCESS)
+            {
+                this->filesystem->resetBlock(pos);
+                return false;
+            }
+
+            // Link the new block from the FSInfo block or from the
+            // current last block.
+            FSResult::FSResult res;
+            if (this->last_index_block == 0)
+            {
+                FSInfo fsinfo = this->filesystem->getFSInfo();
+                fsinfo.pos_blockindex = pos;
+                res = this->filesystem->updateFSInfo(fsinfo);
+            }
+            else
+            {
+                INode onode(0, "", INodeType::INT_BLOCKINDEX);
+                onode.flst_next = pos;
+                res = this->filesystem->updateRawINode(onode, this->last_index_block);
+            }
+            if (res != FSResult::E_SUCCESS)
+            {
+                this->filesystem->resetBlock(pos);
+                return false;
+            }
+            this->last_index_block = pos;
+
+            // Make the entries of the new block available, lowest
+            // position last so that it is used first.
+            for (uint32_t i = this->format->getBlockIndexSlots(); i > 0; i -= 1)
+                this->empty_slots.push_back(pos + this->format->hsize_blockindex + (i - 1) * BLOCKINDEX_ENTRY_SIZE);
+            return true;
+        }
+
+        void BlockIndex::syncronizeCache()
+        {
+            this->entries.clear();
+            this->hashes.clear();
+            this->empty_slots.clear();
+            this->last_index_block = 0;
+
+            FSInfo fsinfo = this->filesystem->getFSInfo();
+            uint64_t ipos = fsinfo.pos_blockindex;
+            char block[BSIZE_FILE];
+
+            // Each block of the chain is read in a single request.
+            while (ipos != 0)
+            {
+                if (this->fd->readAt(block, BSIZE_FILE, ipos) != BSIZE_FILE ||
+                    Endian::getU16(block + this->format->off_type) != INodeType::INT_BLOCKINDEX)
+                {
+                    Logging::showWarningW("BLOCKINDEX: Unable to read block index block at %llu.", (unsigned long long) ipos);
+                    break;
+                }
+                this->last_index_block = ipos;
+
+                for (uint32_t i = 0; i < this->format->getBlockIndexSlots(); i += 1)
+                {
+                    uint32_t off = this->format->hsize_blockindex + i * BLOCKINDEX_ENTRY_SIZE;
+                    uint64_t pos = Endian::getU64(block + off);
+                    Entry entry;
+                    entry.hash = Endian::getU32(block + off + 8);
+                    entry.refs = Endian::getU32(block + off + 12);
+                    entry.slot = ipos + off;
+                    if (pos == 0 || entry.refs == 0 || this->entries.find(pos) != this->entries.end())
+                        this->empty_slots.push_back(entry.slot);
+                    else
+                    {
+                        this->entries.insert(std::make_pair(pos, entry));
+                        this->hashes.insert(std::make_pair(entry.hash, pos));
+                    }
+                }
+
+                ipos = this->format->getPos(block + this->format->off_blockindex_next);
+            }
+
+            // Use the lowest entries first.
+            std::reverse(this->empty_slots.begin(), this->empty_slots.end());
+        }
+    }
+}
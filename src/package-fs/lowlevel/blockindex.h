@@ -0,0 +1,115 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_BLOCKINDEX
+#define CLASS_LOWLEVEL_BLOCKINDEX
+
+#include "src/package-fs/config.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        class BlockIndex;
+    }
+}
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "src/package-fs/lowlevel/blockstream.h"
+#include "src/package-fs/lowlevel/format.h"
+#include "src/package-fs/lowlevel/fs.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! The index of shared data blocks in a package.
+        /*!
+         * Each data block that has been deduplicated is recorded in a
+         * chain of INT_BLOCKINDEX blocks starting at the pos_blockindex
+         * field of the FSInfo block, along with a hash of its contents
+         * and the number of segments that reference it.  The whole index
+         * is kept in memory, and each change is written to the entry for
+         * the block straight away, in the same way as the FreeList.
+         *
+         * Only version 2 packages have a block index.
+         */
+        class BlockIndex
+        {
+        public:
+            BlockIndex(FS * filesystem, BlockStream * fd, const Format* format);
+
+            //! Returns whether the package can hold shared blocks.
+            bool isAvailable() const;
+
+            //! Returns the position of a shared block whose contents are
+            //! the same as the BSIZE_FILE bytes of data, or 0 if there is
+            //! none.  Blocks with the same hash are compared in full.
+            uint64_t findBlock(uint32_t hash, const char *data);
+
+            //! Records the block at pos as shared with one reference.
+            //! Returns false if the index could not be extended.
+            bool addBlock(uint64_t pos, uint32_t hash);
+
+            //! Adds a reference to a shared block.
+            void addReference(uint64_t pos);
+
+            //! Removes a reference from a shared block, returning the
+            //! number of references that are left.  Once there are none,
+            //! the block is removed from the index and can be freed.
+            uint32_t releaseReference(uint64_t pos);
+
+            //! Returns the number of references to a shared block, or 0
+            //! if it is not in the index.
+            uint32_t getReferences(uint64_t pos) const;
+
+            //! Returns the number of shared blocks, and the number of
+            //! references to them.
+            void getStatistics(uint64_t& blocks, uint64_t& references) const;
+
+            //! Returns the hash stored for the contents of a block.
+            static uint32_t hashBlock(const char *data);
+
+        private:
+            struct Entry
+            {
+                uint32_t hash;
+                uint32_t refs;
+
+                //! The position on disk of the entry recording the block.
+                uint64_t slot;
+            };
+
+            FS * filesystem;
+            BlockStream *fd;
+            const Format* format;
+
+            //! The shared blocks, by their position.
+            std::unordered_map < uint64_t, Entry > entries;
+
+            //! The positions of the shared blocks, by their hash.
+            std::multimap < uint32_t, uint64_t > hashes;
+
+            //! Positions on disk of entries that don't currently record
+            //! a block, lowest position last.
+            std::vector < uint64_t > empty_slots;
+
+            //! The position of the last block in the chain, or 0 if there
+            //! are no block index blocks yet.
+            uint64_t last_index_block;
+
+            //! Writes the entry for the block at pos to disk.
+            void writeEntry(uint64_t pos, const Entry& entry);
+
+            //! Adds a new block to the end of the chain, making its
+            //! entries available.
+            bool extendIndex();
+
+            //! Builds the in-memory index from what is on disk.
+            void syncronizeCache();
+        };
+    }
+}
+
+#endif
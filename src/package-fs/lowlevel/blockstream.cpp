@@ -2,11 +2,14 @@
 
 #include "src/package-fs/config.h"
 
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include "src/package-fs/logging.h"
 #include "src/package-fs/lowlevel/endian.h"
 #include "src/package-fs/lowlevel/blockstream.h"
+#include "src/package-fs/lowlevel/journal.h"
+#include "src/package-fs/lowlevel/profile.h"
 #include <errno.h>
 #define _open ::open
 #define _tell ::tell
@@ -16,7 +19,9 @@
 #define _close ::close
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #define CREATE_CRITICAL() this->mutex = new pthread_mutex_t; pthread_mutex_init(this->mutex, NULL);
 #define ENTER_CRITICAL() pthread_mutex_lock(this->mutex);
@@ -26,74 +31,338 @@ namespace AppLib
 {
     namespace LowLevel
     {
-        BlockStream::BlockStream(std::string filename)
+        BlockStream::BlockStream(std::string filename, BlockStreamBackend::BlockStreamBackend backend)
         {
             CREATE_CRITICAL();
 
             ENTER_CRITICAL();
 
+            this->backend = backend;
+            this->fd = NULL;
+            this->rawfd = -1;
+            this->map = NULL;
+            this->mapLength = 0;
             this->opened = false;
             this->invalid = false;
+            this->journal = NULL;
+            this->profile = NULL;
 
-            this->fd = new std::fstream(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-            if (!this->fd->is_open())
+            if (this->backend == BlockStreamBackend::BSB_FSTREAM)
+            {
+                this->fd = new std::fstream(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+                if (!this->fd->is_open())
+                {
+                    Logging::showErrorW("Unable to open specified file as BlockStream.");
+                    this->invalid = true;
+                    this->opened = false;
+                    this->clear(std::ios::badbit | std::ios::failbit);
+                    LEAVE_CRITICAL();
+                    return;
+                }
+                else
+                {
+                    this->fd->exceptions(std::ifstream::badbit | std::ios::failbit | std::ios::eofbit);
+                    this->invalid = false;
+                    this->opened = true;
+                }
+
+                LEAVE_CRITICAL();
+                return;
+            }
+
+            this->rawfd = _open(filename.c_str(), O_RDWR | O_CLOEXEC);
+            if (this->rawfd < 0)
             {
                 Logging::showErrorW("Unable to open specified file as BlockStream.");
                 this->invalid = true;
                 this->opened = false;
                 this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return;
             }
-            else
+            this->invalid = false;
+            this->opened = true;
+
+            if (this->backend == BlockStreamBackend::BSB_MMAP)
             {
-                this->fd->exceptions(std::ifstream::badbit | std::ios::failbit | std::ios::eofbit);
-                this->invalid = false;
-                this->opened = true;
+                // Map the image as it is right now.  Anything written past
+                // the end of the mapping later on is read back with pread,
+                // so the mapping never needs to be resized underneath a
+                // concurrent reader.
+                struct stat info;
+                if (fstat(this->rawfd, &info) == 0 && info.st_size > 0)
+                {
+                    void *addr = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, this->rawfd, 0);
+                    if (addr != MAP_FAILED)
+                    {
+                        this->map = (char *) addr;
+                        this->mapLength = info.st_size;
+                    }
+                    else
+                        Logging::showWarningW("Unable to map package image; falling back to pread.");
+                }
             }
 
             LEAVE_CRITICAL();
         }
 
+        BlockStream::~BlockStream()
+        {
+            if (this->opened)
+                this->close();
+            if (this->fd != NULL)
+                delete this->fd;
+            pthread_mutex_destroy(this->mutex);
+            delete this->mutex;
+        }
+
         void BlockStream::write(const char *data, std::streamsize count)
         {
+            // Writes at the stream position go through writeAt when there
+            // is a journal, so that they are recorded like any other.
+            if (this->journal != NULL)
+            {
+                std::streampos pos = this->tellp();
+                if (this->fail())
+                    return;
+                this->writeAt(data, count, pos);
+                this->seekp(pos + (std::streamoff) count);
+                return;
+            }
+
             ENTER_CRITICAL();
 
             if (this->invalid || !this->opened || this->fail())
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return;
             }
 
-            this->fd->write(data, count);
+            if (this->backend == BlockStreamBackend::BSB_FSTREAM)
+                this->fd->write(data, count);
+            else
+            {
+                RawState * raw = this->getRawState();
+                if (this->rawWrite(data, count, raw->pos))
+                    raw->pos += count;
+            }
 
             LEAVE_CRITICAL();
         }
 
         std::streamsize BlockStream::read(char *out, std::streamsize count)
         {
+            if (this->journal != NULL)
+            {
+                std::streampos pos = this->tellg();
+                if (this->fail())
+                    return 0;
+                std::streamsize total = this->readAt(out, count, pos);
+                this->seekg(pos + (std::streamoff) total);
+                return total;
+            }
+
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+            {
+                // Each thread has its own position, so the raw backends
+                // don't need to serialize reads.
+                if (this->invalid || !this->opened || this->fail())
+                {
+                    if (!this->fail())
+                        this->clear(std::ios::badbit | std::ios::failbit);
+                    return 0;
+                }
+
+                RawState * raw = this->getRawState();
+                std::streamsize total = this->rawRead(out, count, raw->pos);
+                raw->pos += total;
+                return total;
+            }
+
+            ENTER_CRITICAL();
+
+            if (this->invalid || !this->opened || this->fail())
+            {
+                if (!this->fail())
+                    this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
+                return 0;
+            }
+
+            this->fd->readsome(out, count);
+            std::streamsize total = this->fd->gcount();
+
+            LEAVE_CRITICAL();
+
+            return total;
+        }
+
+        std::streamsize BlockStream::readAt(char *out, std::streamsize count, std::streampos pos)
+        {
+            std::streamsize total = this->readThrough(out, count, pos);
+            if (this->journal != NULL)
+                total = this->journal->overlay(out, count, pos, total);
+            Profile * profile = this->profile;
+            if (profile != NULL)
+                profile->record(pos, total);
+            return total;
+        }
+
+        int BlockStream::getReadDescriptor(std::streampos pos, std::streamsize count)
+        {
+            if (this->backend == BlockStreamBackend::BSB_FSTREAM || this->invalid || !this->opened)
+                return -1;
+            if (this->journal != NULL && this->journal->holds(pos, count))
+                return -1;
+            Profile * profile = this->profile;
+            if (profile != NULL)
+                profile->record(pos, count);
+            return this->rawfd;
+        }
+
+        void BlockStream::writeAt(const char *data, std::streamsize count, std::streampos pos)
+        {
+            if (this->journal != NULL && this->journal->isRecording())
+            {
+                if (this->invalid || !this->opened)
+                    return;
+                this->journal->record(data, count, pos);
+                return;
+            }
+            this->writeDataAt(data, count, pos);
+        }
+
+        void BlockStream::writeDataAt(const char *data, std::streamsize count, std::streampos pos)
+        {
+            if (this->journal != NULL)
+                this->journal->patch(data, count, pos);
+            this->writeThrough(data, count, pos);
+        }
+
+        std::streamsize BlockStream::readThrough(char *out, std::streamsize count, std::streampos pos)
+        {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+            {
+                if (this->invalid || !this->opened)
+                    return 0;
+                return this->rawRead(out, count, pos);
+            }
+
             ENTER_CRITICAL();
 
             if (this->invalid || !this->opened || this->fail())
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return 0;
             }
 
+            std::streampos old = this->fd->tellg();
+            this->fd->seekg(pos);
             this->fd->readsome(out, count);
             std::streamsize total = this->fd->gcount();
+            this->fd->seekg(old);
 
             LEAVE_CRITICAL();
 
             return total;
         }
 
+        void BlockStream::writeThrough(const char *data, std::streamsize count, std::streampos pos)
+        {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+            {
+                if (this->invalid || !this->opened)
+                    return;
+                this->rawWrite(data, count, pos);
+                return;
+            }
+
+            ENTER_CRITICAL();
+
+            if (this->invalid || !this->opened || this->fail())
+            {
+                if (!this->fail())
+                    this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
+                return;
+            }
+
+            std::streampos old = this->fd->tellp();
+            this->fd->seekp(pos);
+            this->fd->write(data, count);
+            this->fd->seekp(old);
+
+            LEAVE_CRITICAL();
+        }
+
+        void BlockStream::sync()
+        {
+            ENTER_CRITICAL();
+
+            if (this->invalid || !this->opened)
+            {
+                LEAVE_CRITICAL();
+                return;
+            }
+
+            if (this->backend == BlockStreamBackend::BSB_FSTREAM)
+                this->fd->flush();
+            else if (fdatasync(this->rawfd) != 0)
+                this->clear(std::ios::badbit | std::ios::failbit);
+
+            LEAVE_CRITICAL();
+        }
+
+        void BlockStream::setJournal(Journal * journal)
+        {
+            this->journal = journal;
+        }
+
+        void BlockStream::setProfile(Profile * profile)
+        {
+            this->profile = profile;
+        }
+
+        void BlockStream::prefetch(uint64_t pos, uint64_t count)
+        {
+            if (this->backend == BlockStreamBackend::BSB_FSTREAM || this->invalid || !this->opened)
+                return;
+
+            // Within the mapping, the pages are what reads will touch.
+            if (this->map != NULL && pos < this->mapLength)
+            {
+                uint64_t page = sysconf(_SC_PAGESIZE);
+                uint64_t start = pos - pos % page;
+                uint64_t end = std::min < uint64_t > (pos + count, this->mapLength);
+                madvise(this->map + start, end - start, MADV_WILLNEED);
+                if (pos + count <= this->mapLength)
+                    return;
+                count = pos + count - this->mapLength;
+                pos = this->mapLength;
+            }
+            posix_fadvise(this->rawfd, pos, count, POSIX_FADV_WILLNEED);
+        }
+
         void BlockStream::close()
         {
             ENTER_CRITICAL();
 
-            this->fd->close();
+            if (this->backend == BlockStreamBackend::BSB_FSTREAM)
+                this->fd->close();
+            else
+            {
+                if (this->map != NULL)
+                    munmap(this->map, this->mapLength);
+                this->map = NULL;
+                this->mapLength = 0;
+                if (this->rawfd >= 0)
+                    _close(this->rawfd);
+                this->rawfd = -1;
+            }
             this->opened = false;
 
             LEAVE_CRITICAL();
@@ -101,12 +370,44 @@ namespace AppLib
 
         void BlockStream::seekp(std::streampos pos, std::ios_base::seekdir dir)
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+            {
+                if (this->invalid || !this->opened || this->fail())
+                {
+                    if (!this->fail())
+                        this->clear(std::ios::badbit | std::ios::failbit);
+                    return;
+                }
+
+                // The raw backends share one position between get and
+                // put, exactly as std::filebuf does, but each thread
+                // has a position of its own.
+                RawState * raw = this->getRawState();
+                std::streamoff res = (std::streamoff) pos;
+                if (dir == std::ios_base::cur)
+                    res += raw->pos;
+                else if (dir == std::ios_base::end)
+                {
+                    struct stat info;
+                    if (fstat(this->rawfd, &info) != 0)
+                        res = -1;
+                    else
+                        res += info.st_size;
+                }
+                if (res < 0)
+                    this->clear(std::ios::failbit);
+                else
+                    raw->pos = res;
+                return;
+            }
+
             ENTER_CRITICAL();
 
             if (this->invalid || !this->opened || this->fail())
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return;
             }
 
@@ -117,12 +418,19 @@ namespace AppLib
 
         void BlockStream::seekg(std::streampos pos, std::ios_base::seekdir dir)
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+            {
+                this->seekp(pos, dir);
+                return;
+            }
+
             ENTER_CRITICAL();
 
             if (this->invalid || !this->opened || this->fail())
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return;
             }
 
@@ -133,12 +441,24 @@ namespace AppLib
 
         std::streampos BlockStream::tellp()
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+            {
+                if (this->invalid || !this->opened || this->fail())
+                {
+                    if (!this->fail())
+                        this->clear(std::ios::badbit | std::ios::failbit);
+                    return 0;
+                }
+                return this->getRawState()->pos;
+            }
+
             ENTER_CRITICAL();
 
             if (this->invalid || !this->opened || this->fail())
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return 0;
             }
 
@@ -151,12 +471,16 @@ namespace AppLib
 
         std::streampos BlockStream::tellg()
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+                return this->tellp();
+
             ENTER_CRITICAL();
 
             if (this->invalid || !this->opened || this->fail())
             {
                 if (!this->fail())
                     this->clear(std::ios::badbit | std::ios::failbit);
+                LEAVE_CRITICAL();
                 return 0;
             }
 
@@ -167,43 +491,122 @@ namespace AppLib
             return pos;
         }
 
+        BlockStreamBackend::BlockStreamBackend BlockStream::getBackend()
+        {
+            return this->backend;
+        }
+
+        BlockStream::RawState * BlockStream::getRawState()
+        {
+            RawState initial = { 0, std::ios::goodbit };
+            return this->raw.get(initial);
+        }
+
+        std::streamsize BlockStream::rawRead(char *out, std::streamsize count, std::streamoff pos)
+        {
+            // Serve the read out of the mapping where we can.
+            if (this->map != NULL && pos >= 0 && (size_t) pos + count <= this->mapLength)
+            {
+                memcpy(out, this->map + pos, count);
+                return count;
+            }
+
+            std::streamsize total = 0;
+            while (total < count)
+            {
+                ssize_t res = pread(this->rawfd, out + total, count - total, pos + total);
+                if (res < 0 && errno == EINTR)
+                    continue;
+                if (res < 0)
+                {
+                    this->clear(std::ios::badbit | std::ios::failbit);
+                    break;
+                }
+                if (res == 0)
+                    break;
+                total += res;
+            }
+            return total;
+        }
+
+        bool BlockStream::rawWrite(const char *data, std::streamsize count, std::streamoff pos)
+        {
+            std::streamsize total = 0;
+            while (total < count)
+            {
+                ssize_t res = pwrite(this->rawfd, data + total, count - total, pos + total);
+                if (res < 0 && errno == EINTR)
+                    continue;
+                if (res <= 0)
+                {
+                    this->clear(std::ios::badbit | std::ios::failbit);
+                    return false;
+                }
+                total += res;
+            }
+            return true;
+        }
+
         bool BlockStream::is_open()
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+                return this->rawfd >= 0 && this->opened;
             return this->fd->is_open();
         }
 
         std::ios::iostate BlockStream::rdstate()
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+            {
+                // A thread that hasn't used the stream yet has seen no
+                // errors, so there's no need to give it a state.
+                const RawState * raw = this->raw.peek();
+                return (raw == NULL) ? std::ios::goodbit : raw->state;
+            }
             return this->fd->rdstate();
         }
 
         void BlockStream::clear()
         {
-            this->fd->clear();
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+                this->getRawState()->state = std::ios::goodbit;
+            else
+                this->fd->clear();
         }
 
         void BlockStream::clear(std::ios::iostate state)
         {
-            this->fd->clear(state);
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+                this->getRawState()->state = state;
+            else
+                this->fd->clear(state);
         }
 
         bool BlockStream::good()
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+                return this->rdstate() == std::ios::goodbit;
             return this->fd->good();
         }
 
         bool BlockStream::bad()
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+                return (this->rdstate() & std::ios::badbit) != 0;
             return this->fd->bad();
         }
 
         bool BlockStream::eof()
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+                return (this->rdstate() & std::ios::eofbit) != 0;
             return this->fd->eof();
         }
 
         bool BlockStream::fail()
         {
+            if (this->backend != BlockStreamBackend::BSB_FSTREAM)
+                return (this->rdstate() & (std::ios::failbit | std::ios::badbit)) != 0;
             return this->fd->fail();
         }
     }
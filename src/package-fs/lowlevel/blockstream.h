@@ -5,10 +5,13 @@
 
 #include "src/package-fs/config.h"
 
+#include <atomic>
 #include <string>
 #include <iostream>
+#include <fstream>
 #include "src/package-fs/logging.h"
 #include "src/package-fs/lowlevel/endian.h"
+#include "src/package-fs/lowlevel/threadlocal.h"
 #include <errno.h>
 #include <pthread.h>
 
@@ -16,10 +19,35 @@ namespace AppLib
 {
     namespace LowLevel
     {
+        class Journal;
+        class Profile;
+
+        namespace BlockStreamBackend
+        {
+            enum BlockStreamBackend
+            {
+                // A seekable std::fstream.  Every operation is serialized
+                // on the stream mutex.
+                BSB_FSTREAM = 0,
+
+                // A raw file descriptor accessed with pread / pwrite.
+                // Positional reads and writes do not take the stream mutex,
+                // and each thread has its own stream position and state,
+                // so threads may read concurrently.
+                BSB_PREAD = 1,
+
+                // As BSB_PREAD, but reads within the size of the image at
+                // open time are served from a shared read-only mapping.
+                BSB_MMAP = 2
+            };
+        }
+
         class BlockStream
         {
               public:
-            BlockStream(std::string filename);
+            BlockStream(std::string filename,
+                    BlockStreamBackend::BlockStreamBackend backend = BlockStreamBackend::BSB_FSTREAM);
+            ~BlockStream();
             void write(const char *data, std::streamsize count);
              std::streamsize read(char *out, std::streamsize count);
             void close();
@@ -28,6 +56,54 @@ namespace AppLib
              std::streampos tellp();
              std::streampos tellg();
 
+            //! Reads up to count bytes from the absolute position pos
+            //! without using or modifying the stream position.  On the
+            //! BSB_PREAD and BSB_MMAP backends this does not lock.
+             std::streamsize readAt(char *out, std::streamsize count, std::streampos pos);
+
+            //! Writes count bytes at the absolute position pos without
+            //! using or modifying the stream position.  On the BSB_PREAD
+            //! and BSB_MMAP backends this does not lock.
+            void writeAt(const char *data, std::streamsize count, std::streampos pos);
+
+            //! Returns a file descriptor that count bytes at the absolute
+            //! position pos can be read from by the caller as readAt would
+            //! read them, or -1 if they have to be read with readAt (on the
+            //! BSB_FSTREAM backend, or while the journal holds newer copies
+            //! of them).  The read is recorded in the profile as readAt's
+            //! are.
+            int getReadDescriptor(std::streampos pos, std::streamsize count);
+
+            //! Writes file data, which is never journaled, at the absolute
+            //! position pos.  Outside of a transaction this is the same
+            //! as writeAt.
+            void writeDataAt(const char *data, std::streamsize count, std::streampos pos);
+
+            //! Reads and writes at the absolute position pos, bypassing
+            //! the journal.  These are used by the journal itself.
+             std::streamsize readThrough(char *out, std::streamsize count, std::streampos pos);
+            void writeThrough(const char *data, std::streamsize count, std::streampos pos);
+
+            //! Waits for everything written so far to reach the disk.  On
+            //! the BSB_FSTREAM backend this can only flush the stream.
+            void sync();
+
+            //! Sets the journal that writes are recorded in while a
+            //! transaction is open, and that reads are checked against.
+            void setJournal(Journal * journal);
+
+            //! Sets the profile that reads are recorded in, or NULL to
+            //! stop recording them.
+            void setProfile(Profile * profile);
+
+            //! Asks for count bytes at the absolute position pos to be
+            //! read ahead into the page cache, without waiting for them.
+            //! This does nothing on the BSB_FSTREAM backend.
+            void prefetch(uint64_t pos, uint64_t count);
+
+            //! Returns the backend this stream was opened with.
+             BlockStreamBackend::BlockStreamBackend getBackend();
+
             // State functions.
             bool is_open();
              std::ios::iostate rdstate();
@@ -39,10 +115,32 @@ namespace AppLib
             bool fail();
 
               private:
+             BlockStreamBackend::BlockStreamBackend backend;
              std::fstream * fd;
+            int rawfd;
+            char *map;
+            size_t mapLength;
+
+            //! A thread's position and state in the stream on the raw
+            //! backends.  An error seen by one thread's read or write is
+            //! reported to that thread only.
+            struct RawState
+            {
+                std::streamoff pos;
+                std::ios::iostate state;
+            };
+            ThreadLocal < RawState > raw;
             bool opened;
             bool invalid;
             pthread_mutex_t * mutex;
+            Journal *journal;
+            std::atomic < Profile * > profile;
+
+            //! Returns the calling thread's position and state in the
+            //! stream on the raw backends.
+            RawState * getRawState();
+            std::streamsize rawRead(char *out, std::streamsize count, std::streamoff pos);
+            bool rawWrite(const char *data, std::streamsize count, std::streamoff pos);
         };
     }
 }
@@ -0,0 +1,747 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <thread>
+#include "src/package-fs/lowlevel/checker.h"
+#include "src/package-fs/lowlevel/endian.h"
+#include "src/package-fs/lowlevel/fsinfo.h"
+#include "src/package-fs/lowlevel/journal.h"
+#include "src/package-fs/lowlevel/segmentlist.h"
+#include "src/package-fs/logging.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        Checker::Checker(FS * filesystem, BlockStream * fd)
+        {
+            this->filesystem = filesystem;
+            this->fd = fd;
+            this->format = filesystem->getFormat();
+            this->errors = 0;
+            this->warnings = 0;
+            this->end = 0;
+        }
+
+        bool Checker::check(unsigned int threads)
+        {
+            this->errors = 0;
+            this->warnings = 0;
+            this->lookup_blocks.clear();
+            this->lookup_positions.clear();
+            this->lookup.clear();
+            this->records.clear();
+            this->owners.clear();
+            this->shared.clear();
+            this->clear_lookup.clear();
+            this->remove_children.clear();
+            this->fix_counts.clear();
+            this->fix_nlinks.clear();
+            this->leaked.clear();
+
+            if (this->fd == NULL || !this->filesystem->isValid())
+            {
+                this->reportError("The package can not be read.");
+                return false;
+            }
+
+            // Get the size of the package.
+            std::streampos oldg = this->fd->tellg();
+            this->fd->seekg(0, std::ios::end);
+            this->end = (uint64_t) this->fd->tellg();
+            this->fd->seekg(oldg);
+            this->end = ((this->end + BSIZE_FILE - 1) / BSIZE_FILE) * BSIZE_FILE;
+            if (this->end < OFFSET_DATA)
+            {
+                this->reportError("The package is only %llu bytes long.", (unsigned long long) this->end);
+                return false;
+            }
+            uint64_t blocks = (this->end - OFFSET_DATA) / BSIZE_FILE;
+            this->owners.assign(blocks, BlockOwner::BO_NONE);
+
+            this->readLookupTable();
+
+            // Scan the data area.  Each thread reads a contiguous range,
+            // rounded to whole reads, so every read is sequential.
+            uint64_t chunk = CHECKER_READ_SIZE / BSIZE_FILE;
+            threads = std::max(threads, 1u);
+            uint64_t share = (blocks + threads - 1) / threads;
+            share = std::max(chunk, ((share + chunk - 1) / chunk) * chunk);
+            std::vector < std::map < uint64_t, Record > > parts;
+            std::vector < std::thread > workers;
+            parts.resize(threads);
+            for (unsigned int i = 0; i < threads && i * share < blocks; i += 1)
+            {
+                uint64_t from = OFFSET_DATA + i * share * BSIZE_FILE;
+                uint64_t to = OFFSET_DATA + std::min(blocks, (i + 1) * share) * BSIZE_FILE;
+                workers.push_back(std::thread(&Checker::scanRange, this, from, to, std::ref(parts[i])));
+            }
+            for (size_t i = 0; i < workers.size(); i += 1)
+                workers[i].join();
+            for (size_t i = 0; i < parts.size(); i += 1)
+            {
+                this->records.insert(parts[i].begin(), parts[i].end());
+                parts[i].clear();
+            }
+
+            // Everything else is checked against what was read.
+            this->checkLookupTable();
+
+            std::map < uint32_t, std::vector < uint32_t > > tree;
+            std::map < uint32_t, uint32_t > hardlinks;
+            for (std::map < uint32_t, uint64_t >::iterator i = this->lookup.begin(); i != this->lookup.end(); i++)
+            {
+                const Record& record = this->records.find(i->second)->second;
+                switch (record.node.type)
+                {
+                case INodeType::INT_FILEINFO:
+                case INodeType::INT_SYMLINK:
+                    this->checkFile(i->first, record);
+                    break;
+                case INodeType::INT_DIRECTORY:
+                    this->checkDirectory(i->first, record, tree);
+                    break;
+                case INodeType::INT_HARDLINK:
+                    {
+                        std::map < uint32_t, uint64_t >::iterator target = this->lookup.find(record.node.realid);
+                        INodeType::INodeType type = INodeType::INT_INVALID;
+                        if (target != this->lookup.end())
+                            type = this->records.find(target->second)->second.node.type;
+                        if (type != INodeType::INT_FILEINFO && type != INodeType::INT_DEVICE)
+                            this->reportError("Hard link %u refers to inode %u, which is not a file.", i->first, record.node.realid);
+                        else
+                            hardlinks[record.node.realid] += 1;
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+            this->checkTree(tree, hardlinks);
+
+            FSInfo fsinfo = this->filesystem->getFSInfo();
+            this->checkBlockIndex(fsinfo.pos_blockindex);
+            this->checkFreeList(fsinfo.pos_freelist);
+
+            // A temporary block isn't referenced from anywhere.
+            for (std::map < uint64_t, Record >::iterator i = this->records.begin(); i != this->records.end(); i++)
+            {
+                if (i->second.node.type == INodeType::INT_TEMPORARY &&
+                    this->owners[(i->first - OFFSET_DATA) / BSIZE_FILE] == BlockOwner::BO_NONE)
+                    this->owners[(i->first - OFFSET_DATA) / BSIZE_FILE] = BlockOwner::BO_METADATA;
+            }
+
+            this->checkUnused();
+            this->checkJournal();
+
+            this->records.clear();
+            return this->errors == 0;
+        }
+
+        bool Checker::repair()
+        {
+            if (this->getRepairableCount() == 0)
+                return true;
+
+            bool ok = true;
+            {
+                Transaction guard(this->filesystem);
+                for (size_t i = 0; i < this->remove_children.size(); i += 1)
+                {
+                    if (this->filesystem->removeChildFromDirectoryINode(this->remove_children[i].first,
+                            this->remove_children[i].second) != FSResult::E_SUCCESS)
+                        ok = false;
+                }
+                for (size_t i = 0; i < this->clear_lookup.size(); i += 1)
+                {
+                    if (this->filesystem->setINodePositionByID(this->clear_lookup[i], 0) != FSResult::E_SUCCESS)
+                        ok = false;
+                }
+                for (std::map < uint32_t, uint32_t >::iterator i = this->fix_counts.begin(); i != this->fix_counts.end(); i++)
+                {
+                    INode node = this->filesystem->getRealINodeByID(i->first);
+                    node.children_count = i->second;
+                    if (node.type != INodeType::INT_DIRECTORY || this->filesystem->updateINode(node) != FSResult::E_SUCCESS)
+                        ok = false;
+                }
+                for (std::map < uint32_t, uint16_t >::iterator i = this->fix_nlinks.begin(); i != this->fix_nlinks.end(); i++)
+                {
+                    INode node = this->filesystem->getRealINodeByID(i->first);
+                    node.nlink = i->second;
+                    if (this->filesystem->updateINode(node) != FSResult::E_SUCCESS)
+                        ok = false;
+                }
+                for (size_t i = 0; i < this->leaked.size(); i += 1)
+                {
+                    if (this->filesystem->resetBlock(this->leaked[i]) != FSResult::E_SUCCESS)
+                        ok = false;
+                }
+            }
+            if (this->filesystem->sync() != FSResult::E_SUCCESS)
+                ok = false;
+
+            this->clear_lookup.clear();
+            this->remove_children.clear();
+            this->fix_counts.clear();
+            this->fix_nlinks.clear();
+            this->leaked.clear();
+            return ok;
+        }
+
+        uint64_t Checker::getErrorCount() const
+        {
+            return this->errors;
+        }
+
+        uint64_t Checker::getWarningCount() const
+        {
+            return this->warnings;
+        }
+
+        uint64_t Checker::getRepairableCount() const
+        {
+            return this->clear_lookup.size() + this->remove_children.size() + this->fix_counts.size() +
+                   this->fix_nlinks.size() + (this->leaked.empty() ? 0 : 1);
+        }
+
+        void Checker::getStatistics(uint64_t& inodes, uint64_t& blocks) const
+        {
+            inodes = this->lookup.size();
+            blocks = this->owners.size();
+        }
+
+        void Checker::readLookupTable()
+        {
+            std::vector < char > table(LENGTH_LOOKUP, 0);
+            if (this->fd->readAt(&table[0], LENGTH_LOOKUP, OFFSET_LOOKUP) != LENGTH_LOOKUP)
+            {
+                this->reportError("Unable to read the inode lookup table.");
+                return;
+            }
+            for (uint32_t i = 0; (i + 1) * this->format->pos_size <= LENGTH_LOOKUP; i += 1)
+            {
+                uint64_t pos = this->format->getPos(&table[i * this->format->pos_size]);
+                if (pos == 0)
+                    continue;
+                if (this->format->version == FORMAT_VERSION_1)
+                    this->lookup[i] = pos;
+                else
+                {
+                    this->lookup_blocks[i] = pos;
+                    this->lookup_positions.insert(pos);
+                }
+            }
+        }
+
+        void Checker::scanRange(uint64_t from, uint64_t to, std::map < uint64_t, Record > &out)
+        {
+            std::vector < char > buffer(CHECKER_READ_SIZE);
+            for (uint64_t pos = from; pos < to; pos += CHECKER_READ_SIZE)
+            {
+                std::streamsize length = (std::streamsize) std::min < uint64_t > (CHECKER_READ_SIZE, to - pos);
+                std::streamsize got = this->fd->readAt(&buffer[0], length, pos);
+                if (got < length)
+                    memset(&buffer[std::max < std::streamsize > (got, 0)], 0, length - std::max < std::streamsize > (got, 0));
+                for (std::streamsize off = 0; off + BSIZE_FILE <= length; off += BSIZE_FILE)
+                {
+                    Record record;
+                    if (this->decodeBlock(&buffer[off], pos + off, record))
+                        out.insert(out.end(), std::make_pair(pos + off, record));
+                }
+            }
+        }
+
+        bool Checker::decodeBlock(const char *block, uint64_t pos, Record& out)
+        {
+            const Format* format = this->format;
+
+            // Lookup blocks are recorded with a type of INT_UNSET.
+            if (this->lookup_positions.find(pos) != this->lookup_positions.end())
+            {
+                out.node.type = INodeType::INT_UNSET;
+                out.entries.resize(LOOKUP_BLOCK_IDS);
+                for (uint32_t i = 0; i < LOOKUP_BLOCK_IDS; i += 1)
+                    out.entries[i] = format->getPos(block + i * format->pos_size);
+                return true;
+            }
+
+            uint16_t type = Endian::getU16(block + format->off_type);
+            switch (type)
+            {
+            case INodeType::INT_FILEINFO:
+            case INodeType::INT_SEGINFO:
+            case INodeType::INT_DIRECTORY:
+            case INodeType::INT_SYMLINK:
+            case INodeType::INT_HARDLINK:
+            case INodeType::INT_TEMPORARY:
+            case INodeType::INT_FREELIST:
+            case INodeType::INT_DEVICE:
+                break;
+            case INodeType::INT_DIRINFO:
+                if (format->hsize_dirinfo == 0)
+                    return false;
+                break;
+            case INodeType::INT_BLOCKINDEX:
+                if (format->hsize_blockindex == 0)
+                    return false;
+                break;
+            default:
+                return false;
+            }
+            if (!out.node.readBinaryRepresentation(block, BSIZE_FILE, *format))
+                return false;
+
+            uint32_t hsize = 0;
+            if (type == INodeType::INT_FILEINFO || type == INodeType::INT_SYMLINK)
+                hsize = format->hsize_file;
+            else if (type == INodeType::INT_SEGINFO)
+                hsize = format->hsize_seginfo;
+            else if (type == INodeType::INT_FREELIST)
+                hsize = format->hsize_freelist;
+            if (hsize != 0)
+            {
+                for (uint32_t i = hsize; i + format->pos_size <= BSIZE_FILE; i += format->pos_size)
+                    out.entries.push_back(format->getPos(block + i));
+            }
+            else if (type == INodeType::INT_DIRINFO)
+            {
+                std::vector < uint32_t > ids(format->dirinfo_children);
+                format->getIDArray(block + format->hsize_dirinfo, &ids[0], format->dirinfo_children);
+                out.entries.assign(ids.begin(), ids.end());
+            }
+            else if (type == INodeType::INT_BLOCKINDEX)
+            {
+                for (uint32_t i = 0; i < format->getBlockIndexSlots(); i += 1)
+                {
+                    uint32_t off = format->hsize_blockindex + i * BLOCKINDEX_ENTRY_SIZE;
+                    out.entries.push_back(Endian::getU64(block + off));
+                    out.refs.push_back(Endian::getU32(block + off + 12));
+                }
+            }
+            return true;
+        }
+
+        bool Checker::isDataPosition(uint64_t pos) const
+        {
+            return pos >= OFFSET_DATA && pos < this->end && (pos - OFFSET_DATA) % BSIZE_FILE == 0;
+        }
+
+        bool Checker::claim(uint64_t pos, BlockOwner::BlockOwner owner, const char *what, uint32_t id)
+        {
+            if (!this->isDataPosition(pos))
+            {
+                this->reportError("The %s of inode %u is at %llu, outside of the data area.", what, id, (unsigned long long) pos);
+                return false;
+            }
+            uint8_t& current = this->owners[(pos - OFFSET_DATA) / BSIZE_FILE];
+            if (current != BlockOwner::BO_NONE)
+            {
+                this->reportError("The %s of inode %u at %llu is already in use.", what, id, (unsigned long long) pos);
+                return false;
+            }
+            current = owner;
+            return true;
+        }
+
+        const Checker::Record* Checker::find(uint64_t pos, INodeType::INodeType type) const
+        {
+            std::map < uint64_t, Record >::const_iterator i = this->records.find(pos);
+            if (i == this->records.end() || i->second.node.type != type)
+                return NULL;
+            return &i->second;
+        }
+
+        void Checker::checkLookupTable()
+        {
+            // In a version 2 package, the inode positions are in the
+            // lookup blocks.
+            for (std::map < uint32_t, uint64_t >::iterator i = this->lookup_blocks.begin(); i != this->lookup_blocks.end(); i++)
+            {
+                if (!this->claim(i->second, BlockOwner::BO_METADATA, "lookup block", i->first * LOOKUP_BLOCK_IDS))
+                    continue;
+                const Record* block = this->find(i->second, INodeType::INT_UNSET);
+                for (uint32_t j = 0; block != NULL && j < LOOKUP_BLOCK_IDS; j += 1)
+                {
+                    if (block->entries[j] != 0)
+                        this->lookup[i->first * LOOKUP_BLOCK_IDS + j] = block->entries[j];
+                }
+            }
+
+            for (std::map < uint32_t, uint64_t >::iterator i = this->lookup.begin(); i != this->lookup.end(); )
+            {
+                std::map < uint64_t, Record >::iterator record = this->records.end();
+                if (this->isDataPosition(i->second))
+                    record = this->records.find(i->second);
+                bool valid = false;
+                if (record != this->records.end() && record->second.node.inodeid == i->first)
+                {
+                    INodeType::INodeType type = record->second.node.type;
+                    valid = (type == INodeType::INT_FILEINFO || type == INodeType::INT_DIRECTORY ||
+                             type == INodeType::INT_SYMLINK || type == INodeType::INT_HARDLINK ||
+                             type == INodeType::INT_DEVICE) && record->second.node.verify();
+                }
+                if (!valid)
+                {
+                    this->reportError("Inode %u is recorded at %llu, which doesn't hold it.", i->first, (unsigned long long) i->second);
+                    this->clear_lookup.push_back(i->first);
+                    this->lookup.erase(i++);
+                    continue;
+                }
+                if (!this->claim(i->second, BlockOwner::BO_METADATA, "inode", i->first))
+                {
+                    this->lookup.erase(i++);
+                    continue;
+                }
+                i++;
+            }
+
+            std::map < uint32_t, uint64_t >::iterator root = this->lookup.find(0);
+            if (root == this->lookup.end() || this->records.find(root->second)->second.node.type != INodeType::INT_DIRECTORY)
+                this->reportError("The root directory is missing.");
+            else if (this->filesystem->getFSInfo().pos_root != root->second)
+                this->reportError("The root directory is at %llu, but the package records it at %llu.",
+                        (unsigned long long) root->second, (unsigned long long) this->filesystem->getFSInfo().pos_root);
+        }
+
+        void Checker::checkFile(uint32_t id, const Record& file)
+        {
+            const Format* format = this->format;
+            const INode& node = file.node;
+            if (node.dat_len > format->max_file_size)
+            {
+                this->reportError("File %u is %llu bytes long, more than the package allows.", id, (unsigned long long) node.dat_len);
+                return;
+            }
+
+            // Collect the segments from the file block and its chain of
+            // segment information blocks, as getFileSegments does.
+            uint64_t count = (node.dat_len + BSIZE_FILE - 1) / BSIZE_FILE;
+            bool sparse = (node.flags & INodeFlag::INF_COMPRESSED) != 0;
+            SegmentList list(format);
+            uint64_t limit = list.getInfoBlocksNeeded(format->max_file_size / BSIZE_FILE + 1);
+            const std::vector < uint64_t > *entries = &file.entries;
+            uint64_t next = node.info_next;
+            uint64_t infos = 0;
+            bool ended = false;
+            while (true)
+            {
+                for (size_t i = 0; i < entries->size() && !ended; i += 1)
+                {
+                    if (((*entries)[i] == 0 && !sparse) || list.blocks.size() >= count)
+                        ended = true;
+                    else
+                        list.blocks.push_back((*entries)[i]);
+                }
+                if (next == 0 || infos >= limit)
+                    break;
+                const Record* info = this->find(next, INodeType::INT_SEGINFO);
+                if (info == NULL)
+                {
+                    this->reportError("File %u has a segment list block at %llu that is not valid.", id, (unsigned long long) next);
+                    break;
+                }
+                if (!this->claim(next, BlockOwner::BO_METADATA, "segment list block", id))
+                    break;
+                infos += 1;
+                entries = &info->entries;
+                next = info->node.info_next;
+            }
+
+            if (list.blocks.size() < count)
+                this->reportError("File %u is %llu bytes long, but only has %llu blocks.", id,
+                        (unsigned long long) node.dat_len, (unsigned long long) list.blocks.size());
+            else if (infos > list.getInfoBlocksNeeded(count))
+                this->reportWarning("File %u has %llu more segment list blocks than it needs.", id,
+                        (unsigned long long) (infos - list.getInfoBlocksNeeded(count)));
+
+            for (uint64_t i = 0; i < list.blocks.size(); i += 1)
+            {
+                uint64_t tags = list.blocks[i] & SEGMENT_FLAGS_MASK;
+                uint64_t pos = list.getPosition(i);
+                if ((tags & ~(uint64_t) (SEGMENT_COMPRESSED | SEGMENT_SHARED)) != 0 ||
+                    ((tags & SEGMENT_COMPRESSED) != 0 && (i % EXTENT_BLOCKS != 0 || !sparse || (tags & SEGMENT_SHARED) != 0)) ||
+                    ((tags & SEGMENT_SHARED) != 0 && format->hsize_blockindex == 0))
+                {
+                    this->reportError("Block %llu of file %u is tagged with %llu, which is not valid there.",
+                            (unsigned long long) i, id, (unsigned long long) tags);
+                    continue;
+                }
+
+                // The blocks past the end of the compressed data of an
+                // extent are holes.
+                if (pos == 0)
+                {
+                    if (!list.isCompressed(i) || i % EXTENT_BLOCKS == 0)
+                        this->reportError("Block %llu of file %u is missing.", (unsigned long long) i, id);
+                    continue;
+                }
+
+                if ((tags & SEGMENT_SHARED) == 0)
+                    this->claim(pos, BlockOwner::BO_DATA, "data block", id);
+                else if (!this->isDataPosition(pos))
+                    this->reportError("The shared data block of inode %u is at %llu, outside of the data area.", id, (unsigned long long) pos);
+                else
+                {
+                    uint8_t& owner = this->owners[(pos - OFFSET_DATA) / BSIZE_FILE];
+                    if (owner == BlockOwner::BO_NONE)
+                        owner = BlockOwner::BO_SHARED;
+                    if (owner != BlockOwner::BO_SHARED)
+                        this->reportError("The shared data block of inode %u at %llu is already in use.", id, (unsigned long long) pos);
+                    else
+                        this->shared[pos] += 1;
+                }
+            }
+        }
+
+        void Checker::checkDirectory(uint32_t id, const Record& dir, std::map < uint32_t, std::vector < uint32_t > > &tree)
+        {
+            const Format* format = this->format;
+            std::vector < uint32_t > children;
+            if (dir.node.children)
+                children = *dir.node.children;
+
+            // Version 2 directories continue into information blocks.
+            uint64_t next = dir.node.dir_next;
+            uint64_t limit = (format->dirinfo_children == 0) ? 0 : format->max_id / format->dirinfo_children + 1;
+            if (next != 0)
+                children.resize(format->dir_children, 0);
+            while (next != 0 && limit > 0)
+            {
+                const Record* info = this->find(next, INodeType::INT_DIRINFO);
+                if (info == NULL)
+                {
+                    this->reportError("Directory %u has an information block at %llu that is not valid.", id, (unsigned long long) next);
+                    break;
+                }
+                if (!this->claim(next, BlockOwner::BO_METADATA, "directory information block", id))
+                    break;
+                children.insert(children.end(), info->entries.begin(), info->entries.end());
+                next = info->node.dir_next;
+                limit -= 1;
+            }
+
+            uint32_t listed = 0;
+            std::vector < uint32_t >& valid = tree[id];
+            for (size_t i = 0; i < children.size(); i += 1)
+            {
+                uint32_t child = children[i];
+                if (child == 0)
+                    continue;
+                listed += 1;
+                if (child == id || this->lookup.find(child) == this->lookup.end())
+                {
+                    this->reportError("Directory %u lists inode %u, which doesn't exist.", id, child);
+                    this->remove_children.push_back(std::make_pair(id, child));
+                    continue;
+                }
+                valid.push_back(child);
+            }
+
+            // Removing the children that don't exist corrects the count
+            // for them, so only a count that was already wrong needs to
+            // be set.
+            if (listed != dir.node.children_count)
+            {
+                this->reportError("Directory %u has %u children, but records %u.", id, listed, dir.node.children_count);
+                this->fix_counts[id] = valid.size();
+            }
+        }
+
+        void Checker::checkTree(const std::map < uint32_t, std::vector < uint32_t > > &tree, std::map < uint32_t, uint32_t > &hardlinks)
+        {
+            // Find the directory each inode is in.
+            std::map < uint32_t, uint32_t > parents;
+            for (std::map < uint32_t, std::vector < uint32_t > >::const_iterator i = tree.begin(); i != tree.end(); i++)
+            {
+                for (size_t j = 0; j < i->second.size(); j += 1)
+                {
+                    uint32_t child = i->second[j];
+                    std::map < uint32_t, uint32_t >::iterator parent = parents.find(child);
+                    if (parent != parents.end())
+                        this->reportError("Inode %u is in both directory %u and directory %u.", child, parent->second, i->first);
+                    else
+                        parents[child] = i->first;
+                }
+            }
+
+            // Walk the tree from the root.
+            std::set < uint32_t > reached;
+            std::deque < uint32_t > pending;
+            if (tree.find(0) != tree.end())
+            {
+                reached.insert(0);
+                pending.push_back(0);
+            }
+            while (!pending.empty())
+            {
+                std::map < uint32_t, std::vector < uint32_t > >::const_iterator dir = tree.find(pending.front());
+                pending.pop_front();
+                if (dir == tree.end())
+                    continue;
+                for (size_t j = 0; j < dir->second.size(); j += 1)
+                {
+                    if (reached.insert(dir->second[j]).second)
+                        pending.push_back(dir->second[j]);
+                }
+            }
+
+            for (std::map < uint32_t, uint64_t >::iterator i = this->lookup.begin(); i != this->lookup.end(); i++)
+            {
+                if (i->first == 0)
+                    continue;
+                const INode& node = this->records.find(i->second)->second.node;
+                std::map < uint32_t, uint32_t >::iterator parent = parents.find(i->first);
+                uint32_t links = hardlinks[i->first];
+
+                // A file that has been unlinked but is still the target of
+                // a hard link isn't in any directory.
+                if (parent == parents.end())
+                {
+                    if (links == 0)
+                        this->reportWarning("Inode %u (%s) is not in any directory.", i->first, node.filename.c_str());
+                }
+                else if (reached.find(i->first) == reached.end())
+                    this->reportWarning("Inode %u (%s) can not be reached from the root directory.", i->first, node.filename.c_str());
+
+                if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_DEVICE)
+                {
+                    uint32_t expected = links + (parent != parents.end() ? 1 : 0);
+                    if (expected != 0 && expected != node.nlink)
+                    {
+                        this->reportError("Inode %u has %u links, but records %u.", i->first, expected, node.nlink);
+                        this->fix_nlinks[i->first] = (uint16_t) expected;
+                    }
+                }
+            }
+        }
+
+        void Checker::checkFreeList(uint64_t pos)
+        {
+            while (pos != 0)
+            {
+                const Record* list = this->find(pos, INodeType::INT_FREELIST);
+                if (list == NULL)
+                {
+                    this->reportError("The free list block at %llu is not valid.", (unsigned long long) pos);
+                    return;
+                }
+                if (!this->claim(pos, BlockOwner::BO_METADATA, "free list block", 0))
+                    return;
+
+                for (size_t i = 0; i < list->entries.size(); i += 1)
+                {
+                    uint64_t free = list->entries[i];
+                    if (free == 0)
+                        continue;
+                    if (!this->isDataPosition(free))
+                    {
+                        this->reportError("The free list records %llu, which is outside of the data area.", (unsigned long long) free);
+                        continue;
+                    }
+                    uint8_t& owner = this->owners[(free - OFFSET_DATA) / BSIZE_FILE];
+                    if (owner == BlockOwner::BO_FREE)
+                        this->reportWarning("The free list records %llu more than once.", (unsigned long long) free);
+                    else if (owner != BlockOwner::BO_NONE)
+                        this->reportError("The block at %llu is in use, but the free list records it as free.", (unsigned long long) free);
+                    else
+                        owner = BlockOwner::BO_FREE;
+                }
+
+                pos = list->node.flst_next;
+            }
+        }
+
+        void Checker::checkBlockIndex(uint64_t pos)
+        {
+            std::map < uint64_t, uint32_t > indexed;
+            while (pos != 0 && this->format->hsize_blockindex != 0)
+            {
+                const Record* index = this->find(pos, INodeType::INT_BLOCKINDEX);
+                if (index == NULL)
+                {
+                    this->reportError("The block index block at %llu is not valid.", (unsigned long long) pos);
+                    break;
+                }
+                if (!this->claim(pos, BlockOwner::BO_METADATA, "block index block", 0))
+                    break;
+
+                for (size_t i = 0; i < index->entries.size(); i += 1)
+                {
+                    if (index->entries[i] == 0 || index->refs[i] == 0)
+                        continue;
+                    if (!indexed.insert(std::make_pair(index->entries[i], index->refs[i])).second)
+                        this->reportWarning("The block index records %llu more than once.", (unsigned long long) index->entries[i]);
+                }
+
+                pos = index->node.flst_next;
+            }
+
+            for (std::map < uint64_t, uint32_t >::iterator i = this->shared.begin(); i != this->shared.end(); i++)
+            {
+                std::map < uint64_t, uint32_t >::iterator entry = indexed.find(i->first);
+                if (entry == indexed.end())
+                    this->reportError("The shared block at %llu is not in the block index.", (unsigned long long) i->first);
+                else if (entry->second != i->second)
+                    this->reportError("The shared block at %llu is used %u times, but the block index records %u.",
+                            (unsigned long long) i->first, i->second, entry->second);
+            }
+
+            // A block the index holds on to is not free, even if nothing
+            // uses it any more.
+            for (std::map < uint64_t, uint32_t >::iterator i = indexed.begin(); i != indexed.end(); i++)
+            {
+                if (this->shared.find(i->first) != this->shared.end())
+                    continue;
+                this->reportWarning("The block index records %llu, but no file uses it.", (unsigned long long) i->first);
+                if (this->isDataPosition(i->first) && this->owners[(i->first - OFFSET_DATA) / BSIZE_FILE] == BlockOwner::BO_NONE)
+                    this->owners[(i->first - OFFSET_DATA) / BSIZE_FILE] = BlockOwner::BO_SHARED;
+            }
+        }
+
+        void Checker::checkUnused()
+        {
+            for (uint64_t i = 0; i < this->owners.size(); i += 1)
+            {
+                if (this->owners[i] == BlockOwner::BO_NONE)
+                    this->leaked.push_back(OFFSET_DATA + i * BSIZE_FILE);
+            }
+            if (!this->leaked.empty())
+                this->reportWarning("%llu blocks are neither in use nor free.", (unsigned long long) this->leaked.size());
+        }
+
+        void Checker::checkJournal()
+        {
+            if (Journal::isPending(this->fd, this->format))
+                this->reportError("The journal holds changes that have not been replayed.");
+        }
+
+        void Checker::reportError(const char *fmt, ...)
+        {
+            char msg[1024];
+            va_list arglist;
+            va_start(arglist, fmt);
+            vsnprintf(msg, sizeof(msg), fmt, arglist);
+            va_end(arglist);
+            Logging::showErrorW("CHECK: %s", msg);
+            this->errors += 1;
+        }
+
+        void Checker::reportWarning(const char *fmt, ...)
+        {
+            char msg[1024];
+            va_list arglist;
+            va_start(arglist, fmt);
+            vsnprintf(msg, sizeof(msg), fmt, arglist);
+            va_end(arglist);
+            Logging::showWarningW("CHECK: %s", msg);
+            this->warnings += 1;
+        }
+    }
+}
@@ -0,0 +1,177 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_CHECKER
+#define CLASS_LOWLEVEL_CHECKER
+
+#include "src/package-fs/config.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        class Checker;
+    }
+}
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "src/package-fs/lowlevel/blockstream.h"
+#include "src/package-fs/lowlevel/format.h"
+#include "src/package-fs/lowlevel/fs.h"
+#include "src/package-fs/lowlevel/inode.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! What a block of the data area is used for, as found by the
+        //! Checker.
+        namespace BlockOwner
+        {
+            enum BlockOwner
+            {
+                BO_NONE = 0,
+                BO_METADATA = 1,
+                BO_DATA = 2,
+                BO_SHARED = 3,
+                BO_FREE = 4
+            };
+        }
+
+        //! Verifies the structure of a package, and repairs what it safely can.
+        /*!
+         * The data area is read once, front to back, split into as many
+         * contiguous ranges as there are threads, each of which is read
+         * sequentially in CHECKER_READ_SIZE requests.  Every block whose
+         * header could belong to a metadata block is decoded as it is
+         * read, and everything else is then checked against those copies
+         * in memory, so no block is read twice and nothing is read out of
+         * order however the package is laid out.
+         *
+         * The checks cover the inode lookup table, the headers of the
+         * inodes it addresses, the segment lists of files (including
+         * compressed extents, their holes and shared blocks), the free
+         * list, the block index and the links between directories and
+         * their children.  Every block of the data area must be used by
+         * exactly one thing or be free, shared blocks aside.
+         *
+         * The package's journal is replayed when the FS is constructed,
+         * so by the time a check starts it should be clear.
+         */
+        class Checker
+        {
+        public:
+            Checker(FS * filesystem, BlockStream * fd);
+
+            //! Checks the package, returning whether no errors were
+            //! found.  Problems are reported through Logging as they are
+            //! found.
+            bool check(unsigned int threads = 1);
+
+            //! Repairs the problems found by the last check that can be
+            //! repaired without losing anything that is still reachable:
+            //! lookup table entries and directory children that refer to
+            //! inodes that don't exist are removed, directory child counts
+            //! and link counts are corrected, and blocks that nothing uses
+            //! are freed.  The package should be checked again afterwards.
+            bool repair();
+
+            //! Returns the number of errors, warnings and repairable
+            //! problems found by the last check.
+            uint64_t getErrorCount() const;
+            uint64_t getWarningCount() const;
+            uint64_t getRepairableCount() const;
+
+            //! Returns the number of inodes and blocks examined by the last
+            //! check.
+            void getStatistics(uint64_t& inodes, uint64_t& blocks) const;
+
+        private:
+            //! The decoded copy of a block that could be metadata.
+            struct Record
+            {
+                INode node;
+
+                //! The positions (or inode IDs, for directory information
+                //! blocks) held in the block, and the reference counts of
+                //! block index entries.
+                std::vector < uint64_t > entries;
+                std::vector < uint32_t > refs;
+            };
+
+            FS * filesystem;
+            BlockStream * fd;
+            const Format* format;
+
+            uint64_t errors;
+            uint64_t warnings;
+            uint64_t end;
+
+            //! The positions of the lookup blocks (version 2 only), by
+            //! their index in the lookup table, and the same positions as
+            //! a set.  Lookup blocks have no header to recognise them by,
+            //! so they are decoded by position.
+            std::map < uint32_t, uint64_t > lookup_blocks;
+            std::set < uint64_t > lookup_positions;
+
+            //! The position of each inode in the lookup table, by ID.
+            std::map < uint32_t, uint64_t > lookup;
+
+            //! The decoded blocks, by position.
+            std::map < uint64_t, Record > records;
+
+            //! The use of each block of the data area.
+            std::vector < uint8_t > owners;
+
+            //! The number of segments that reference each shared block.
+            std::map < uint64_t, uint32_t > shared;
+
+            //! The repairs collected by the last check.
+            std::vector < uint32_t > clear_lookup;
+            std::vector < std::pair < uint32_t, uint32_t > > remove_children;
+            std::map < uint32_t, uint32_t > fix_counts;
+            std::map < uint32_t, uint16_t > fix_nlinks;
+            std::vector < uint64_t > leaked;
+
+            //! Reads the inode lookup table, and the lookup blocks of a
+            //! version 2 package.
+            void readLookupTable();
+
+            //! Decodes the metadata blocks in the specified range of the
+            //! data area into out.
+            void scanRange(uint64_t from, uint64_t to, std::map < uint64_t, Record > &out);
+
+            //! Decodes a single block read at pos, returning false if it
+            //! can't be metadata.
+            bool decodeBlock(const char *block, uint64_t pos, Record& out);
+
+            //! Marks a block as used, reporting an error if it already is
+            //! or if it isn't in the data area.
+            bool claim(uint64_t pos, BlockOwner::BlockOwner owner, const char *what, uint32_t id);
+
+            //! Returns the record of the block at pos if it is of the
+            //! specified type.
+            const Record* find(uint64_t pos, INodeType::INodeType type) const;
+
+            //! Returns whether pos is the start of a block in the data
+            //! area.
+            bool isDataPosition(uint64_t pos) const;
+
+            void checkLookupTable();
+            void checkFile(uint32_t id, const Record& file);
+            void checkDirectory(uint32_t id, const Record& dir, std::map < uint32_t, std::vector < uint32_t > > &tree);
+            void checkTree(const std::map < uint32_t, std::vector < uint32_t > > &tree, std::map < uint32_t, uint32_t > &hardlinks);
+            void checkFreeList(uint64_t pos);
+            void checkBlockIndex(uint64_t pos);
+            void checkUnused();
+            void checkJournal();
+
+            void reportError(const char *fmt, ...);
+            void reportWarning(const char *fmt, ...);
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,71 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "src/package-fs/lowlevel/compression.h"
+
+#ifdef HAVE_XZ
+extern "C"
+{
+#include "src/journal/compress.h"
+}
+#endif
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        bool Compression::isAvailable()
+        {
+#ifdef HAVE_XZ
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        bool Compression::compress(const char *data, uint32_t len, std::vector < char > &out,
+                                   CompressionCodec::CompressionCodec& codec)
+        {
+            codec = CompressionCodec::CC_NONE;
+            if (len == 0)
+                return false;
+#ifdef HAVE_XZ
+            uint64_t size = 0;
+            out.resize(len);
+            if (!compress_blob(data, len, &out[0], &size))
+                return false;
+            out.resize(size);
+            codec = CompressionCodec::CC_XZ;
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        bool Compression::decompress(uint16_t codec, const char *data, uint32_t len,
+                                     char *out, uint32_t out_len)
+        {
+            if (len == 0)
+                return false;
+#ifdef HAVE_XZ
+            if (codec == CompressionCodec::CC_XZ)
+            {
+                void *buffer = NULL;
+                uint64_t alloc = 0;
+                uint64_t size = 0;
+                // Stop one byte past the expected size, so that a corrupt
+                // extent can't decompress into an arbitrary amount of data.
+                bool ok = uncompress_blob(data, len, &buffer, &alloc, &size, (uint64_t) out_len + 1) && size == out_len;
+                if (ok)
+                    memcpy(out, buffer, out_len);
+                free(buffer);
+                return ok;
+            }
+#endif
+            return false;
+        }
+    }
+}
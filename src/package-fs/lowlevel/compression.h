@@ -0,0 +1,52 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_COMPRESSION
+#define CLASS_LOWLEVEL_COMPRESSION
+
+#include "src/package-fs/config.h"
+
+#include <vector>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        // WARN: The values here are stored in the header of each
+        //       compressed extent, so they must not be changed.
+        namespace CompressionCodec
+        {
+            enum CompressionCodec
+            {
+                CC_NONE = 0,
+                CC_XZ = 1
+            };
+        }
+
+        //! Compresses and decompresses the extents of compressed files.
+        /*!
+         * This uses the codecs journald is built with, so compression
+         * is only available when the library is built with XZ support.
+         * A package with compressed files can still be opened without
+         * it, but those extents can't be read.
+         */
+        class Compression
+        {
+        public:
+            //! Returns whether data can be compressed.
+            static bool isAvailable();
+
+            //! Compresses len bytes of data into out, returning false if
+            //! the data doesn't get any smaller.
+            static bool compress(const char *data, uint32_t len, std::vector < char > &out,
+                                 CompressionCodec::CompressionCodec& codec);
+
+            //! Decompresses len bytes of data stored with the specified
+            //! codec into out, returning false unless exactly out_len
+            //! bytes are produced.
+            static bool decompress(uint16_t codec, const char *data, uint32_t len,
+                                   char *out, uint32_t out_len);
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,123 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include "src/package-fs/lowlevel/dirindex.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        DirectoryIndex::DirectoryIndex()
+        {
+        }
+
+        bool DirectoryIndex::isIndexed(uint32_t parentid)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            return this->directories.find(parentid) != this->directories.end();
+        }
+
+        void DirectoryIndex::build(uint32_t parentid,
+                const std::vector < std::pair < uint32_t, std::string > > &entries)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            this->drop(parentid);
+            this->directories[parentid] = NameMap();
+            for (size_t i = 0; i < entries.size(); i += 1)
+                this->add(parentid, entries[i].first, entries[i].second);
+        }
+
+        bool DirectoryIndex::lookup(uint32_t parentid, std::string filename, uint32_t& out)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            std::unordered_map < uint32_t, NameMap >::iterator d = this->directories.find(parentid);
+            if (d == this->directories.end())
+                return false;
+            NameMap::iterator i = d->second.find(filename);
+            if (i == d->second.end())
+                return false;
+            out = i->second;
+            return true;
+        }
+
+        void DirectoryIndex::add(uint32_t parentid, uint32_t childid, std::string filename)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            std::unordered_map < uint32_t, NameMap >::iterator d = this->directories.find(parentid);
+            if (d == this->directories.end())
+                return;
+
+            // A child can only be indexed in one place at a time.
+            this->forget(childid);
+
+            // Keep the first child with a given name, which is the one
+            // a scan of the directory would have found.
+            if (d->second.insert(NameMap::value_type(filename, childid)).second)
+                this->children[childid] = std::make_pair(parentid, filename);
+        }
+
+        void DirectoryIndex::remove(uint32_t parentid, uint32_t childid)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            uint32_t current = 0;
+            if (this->getParent(childid, current) && current == parentid)
+                this->forget(childid);
+        }
+
+        void DirectoryIndex::forget(uint32_t childid)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            std::unordered_map < uint32_t, std::pair < uint32_t, std::string > >::iterator c = this->children.find(childid);
+            if (c == this->children.end())
+                return;
+
+            std::unordered_map < uint32_t, NameMap >::iterator d = this->directories.find(c->second.first);
+            if (d != this->directories.end())
+            {
+                NameMap::iterator i = d->second.find(c->second.second);
+                if (i != d->second.end() && i->second == childid)
+                    d->second.erase(i);
+            }
+            this->children.erase(c);
+        }
+
+        void DirectoryIndex::rename(uint32_t childid, std::string filename)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            uint32_t parentid = 0;
+            if (!this->getParent(childid, parentid))
+                return;
+            this->forget(childid);
+            this->add(parentid, childid, filename);
+        }
+
+        bool DirectoryIndex::getParent(uint32_t childid, uint32_t& out)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            std::unordered_map < uint32_t, std::pair < uint32_t, std::string > >::iterator c = this->children.find(childid);
+            if (c == this->children.end())
+                return false;
+            out = c->second.first;
+            return true;
+        }
+
+        void DirectoryIndex::drop(uint32_t parentid)
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            std::unordered_map < uint32_t, NameMap >::iterator d = this->directories.find(parentid);
+            if (d == this->directories.end())
+                return;
+            for (NameMap::iterator i = d->second.begin(); i != d->second.end(); i++)
+                this->children.erase(i->second);
+            this->directories.erase(d);
+        }
+
+        void DirectoryIndex::clear()
+        {
+            std::lock_guard < std::recursive_mutex > guard(this->mutex);
+            this->directories.clear();
+            this->children.clear();
+        }
+    }
+}
@@ -0,0 +1,78 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_DIRINDEX
+#define CLASS_LOWLEVEL_DIRINDEX
+
+#include "src/package-fs/config.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! An in-memory filename to inode ID index for directories.
+        /*!
+         * A directory is only indexed once it has been populated with
+         * build(); until then all of the lookups for it miss and the
+         * caller must fall back to scanning the directory on disk.  The
+         * owning FS keeps the indexes coherent as children are added,
+         * removed and renamed.  Every method may be called concurrently.
+         */
+        class DirectoryIndex
+        {
+        public:
+            DirectoryIndex();
+
+            //! Returns whether the specified directory has been indexed.
+            bool isIndexed(uint32_t parentid);
+
+            //! Indexes the specified directory with the specified children,
+            //! replacing any existing index for it.
+            void build(uint32_t parentid,
+                    const std::vector < std::pair < uint32_t, std::string > > &entries);
+
+            //! Looks up a child by filename within an indexed directory,
+            //! returning false if the directory isn't indexed or the
+            //! filename isn't present.
+            bool lookup(uint32_t parentid, std::string filename, uint32_t& out);
+
+            //! Records a child within an indexed directory.  Does nothing
+            //! if the directory isn't indexed.
+            void add(uint32_t parentid, uint32_t childid, std::string filename);
+
+            //! Removes a child from an indexed directory.  Does nothing if
+            //! the child isn't indexed within that directory.
+            void remove(uint32_t parentid, uint32_t childid);
+
+            //! Removes a child from whichever directory it was indexed in.
+            void forget(uint32_t childid);
+
+            //! Changes the indexed filename of a child.
+            void rename(uint32_t childid, std::string filename);
+
+            //! Returns the ID of the indexed directory that the child
+            //! belongs to, returning false if the child isn't indexed.
+            bool getParent(uint32_t childid, uint32_t& out);
+
+            //! Drops the index for a single directory.
+            void drop(uint32_t parentid);
+
+            //! Drops every directory index.
+            void clear();
+
+        private:
+            typedef std::unordered_map < std::string, uint32_t > NameMap;
+
+            std::unordered_map < uint32_t, NameMap > directories;
+            std::unordered_map < uint32_t, std::pair < uint32_t, std::string > > children;
+            std::recursive_mutex mutex;
+        };
+    }
+}
+
+#endif
@@ -139,5 +139,62 @@ namespace AppLib
         {
             Endian::doW(fd, const_cast < char *>(data), size);
         }
+
+        uint16_t Endian::getU16(const char *data)
+        {
+            const unsigned char *b = reinterpret_cast < const unsigned char *>(data);
+            return (uint16_t) (b[0] | (b[1] << 8));
+        }
+
+        uint32_t Endian::getU32(const char *data)
+        {
+            const unsigned char *b = reinterpret_cast < const unsigned char *>(data);
+            return (uint32_t) b[0] | ((uint32_t) b[1] << 8) | ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+        }
+
+        uint64_t Endian::getU64(const char *data)
+        {
+            return (uint64_t) Endian::getU32(data) | ((uint64_t) Endian::getU32(data + 4) << 32);
+        }
+
+        void Endian::putU16(char *data, uint16_t value)
+        {
+            data[0] = (char) (value & 0xFF);
+            data[1] = (char) ((value >> 8) & 0xFF);
+        }
+
+        void Endian::putU32(char *data, uint32_t value)
+        {
+            for (unsigned int i = 0; i < 4; i += 1)
+                data[i] = (char) ((value >> (i * 8)) & 0xFF);
+        }
+
+        void Endian::putU64(char *data, uint64_t value)
+        {
+            Endian::putU32(data, (uint32_t) (value & 0xFFFFFFFF));
+            Endian::putU32(data + 4, (uint32_t) (value >> 32));
+        }
+
+        void Endian::getU32Array(const char *data, uint32_t * out, unsigned int count)
+        {
+            if (Endian::little_endian)
+                memcpy(out, data, count * 4);
+            else
+            {
+                for (unsigned int i = 0; i < count; i += 1)
+                    out[i] = Endian::getU32(data + i * 4);
+            }
+        }
+
+        void Endian::putU32Array(char *data, const uint32_t * in, unsigned int count)
+        {
+            if (Endian::little_endian)
+                memcpy(data, in, count * 4);
+            else
+            {
+                for (unsigned int i = 0; i < count; i += 1)
+                    Endian::putU32(data + i * 4, in[i]);
+            }
+        }
     }
 }
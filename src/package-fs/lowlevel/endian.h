@@ -26,6 +26,20 @@ namespace AppLib
                 static void doR(std::iostream * fd, char * data, unsigned int size);
                 static void doW(std::iostream * fd, char * data, unsigned int size);
                 static void doW(std::iostream * fd, const char * data, unsigned int size);
+
+                // Decode little-endian values out of, and encode them
+                // into, an in-memory buffer.
+                static uint16_t getU16(const char * data);
+                static uint32_t getU32(const char * data);
+                static uint64_t getU64(const char * data);
+                static void putU16(char * data, uint16_t value);
+                static void putU32(char * data, uint32_t value);
+                static void putU64(char * data, uint64_t value);
+
+                // Decode and encode a whole array of little-endian
+                // 32-bit values at once.
+                static void getU32Array(const char * data, uint32_t * out, unsigned int count);
+                static void putU32Array(char * data, const uint32_t * in, unsigned int count);
         };
     }
 }
@@ -0,0 +1,162 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include "src/package-fs/lowlevel/format.h"
+#include "src/package-fs/lowlevel/endian.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        static const Format format_v1 =
+        {
+            FORMAT_VERSION_1,
+            2, 4, 2,            // id_size, pos_size, count_size
+            2, 4,               // off_type, hsize_header
+            0,                  // off_flags
+            296, 298, 302,      // off_file_blocks, off_file_len, off_file_info_next
+            HSIZE_FILE,
+            4, HSIZE_SEGINFO,   // off_seginfo_next, hsize_seginfo
+            4, HSIZE_FREELIST,  // off_freelist_next, hsize_freelist
+            292, 0,             // off_dir_count, off_dir_next
+            HSIZE_DIRECTORY,
+            DIRECTORY_CHILDREN_MAX,
+            0, 0, 0,            // off_dirinfo_next, hsize_dirinfo, dirinfo_children
+            0, 0,               // off_blockindex_next, hsize_blockindex
+            0,                  // length_journal
+            0,                  // length_profile
+            INODE_ID_MAX,
+            MSIZE_FILE,
+            0xFFFFFFFF
+        };
+
+        static const Format format_v2 =
+        {
+            FORMAT_VERSION_2,
+            4, 8, 4,
+            4, 8,
+            6,
+            300, 304, 312,
+            HSIZE_FILE_V2,
+            8, HSIZE_SEGINFO_V2,
+            8, HSIZE_FREELIST_V2,
+            298, 302,
+            HSIZE_DIRECTORY_V2,
+            (BSIZE_DIRECTORY - HSIZE_DIRECTORY_V2) / 4,
+            8, HSIZE_DIRINFO_V2,
+            (BSIZE_DIRECTORY - HSIZE_DIRINFO_V2) / 4,
+            8, HSIZE_BLOCKINDEX_V2,
+            LENGTH_JOURNAL,
+            LENGTH_PROFILE,
+            INODE_ID_MAX_V2,
+            MSIZE_FILE_V2,
+            (uint64_t) 1 << 56
+        };
+
+        const Format* Format::get(uint16_t version)
+        {
+            if (version == FORMAT_VERSION_1)
+                return &format_v1;
+            else if (version == FORMAT_VERSION_2)
+                return &format_v2;
+            return NULL;
+        }
+
+        uint16_t Format::getVersion(uint16_t ver_major)
+        {
+            if (ver_major < FORMAT_VERSION_2)
+                return FORMAT_VERSION_1;
+            return ver_major;
+        }
+
+        uint32_t Format::getID(const char *data) const
+        {
+            if (this->id_size == 2)
+                return Endian::getU16(data);
+            return Endian::getU32(data);
+        }
+
+        void Format::putID(char *data, uint32_t id) const
+        {
+            if (this->id_size == 2)
+                Endian::putU16(data, (uint16_t) id);
+            else
+                Endian::putU32(data, id);
+        }
+
+        uint64_t Format::getPos(const char *data) const
+        {
+            if (this->pos_size == 4)
+                return Endian::getU32(data);
+            return Endian::getU64(data);
+        }
+
+        void Format::putPos(char *data, uint64_t pos) const
+        {
+            if (this->pos_size == 4)
+                Endian::putU32(data, (uint32_t) pos);
+            else
+                Endian::putU64(data, pos);
+        }
+
+        uint32_t Format::getCount(const char *data) const
+        {
+            if (this->count_size == 2)
+                return Endian::getU16(data);
+            return Endian::getU32(data);
+        }
+
+        void Format::putCount(char *data, uint32_t count) const
+        {
+            if (this->count_size == 2)
+                Endian::putU16(data, (uint16_t) count);
+            else
+                Endian::putU32(data, count);
+        }
+
+        void Format::getIDArray(const char *data, uint32_t *out, uint32_t count) const
+        {
+            if (this->id_size == 4)
+                Endian::getU32Array(data, out, count);
+            else
+            {
+                for (uint32_t i = 0; i < count; i += 1)
+                    out[i] = Endian::getU16(data + i * 2);
+            }
+        }
+
+        void Format::putIDArray(char *data, const uint32_t *in, uint32_t count) const
+        {
+            if (this->id_size == 4)
+                Endian::putU32Array(data, in, count);
+            else
+            {
+                for (uint32_t i = 0; i < count; i += 1)
+                    Endian::putU16(data + i * 2, (uint16_t) in[i]);
+            }
+        }
+
+        uint32_t Format::getSegmentsInFileBlock() const
+        {
+            return (BSIZE_FILE - this->hsize_file) / this->pos_size;
+        }
+
+        uint32_t Format::getSegmentsInInfoBlock() const
+        {
+            return (BSIZE_FILE - this->hsize_seginfo) / this->pos_size;
+        }
+
+        uint32_t Format::getFreeListSlots() const
+        {
+            return (BSIZE_FILE - this->hsize_freelist) / this->pos_size;
+        }
+
+        uint32_t Format::getBlockIndexSlots() const
+        {
+            if (this->hsize_blockindex == 0)
+                return 0;
+            return (BSIZE_FILE - this->hsize_blockindex) / BLOCKINDEX_ENTRY_SIZE;
+        }
+    }
+}
@@ -0,0 +1,128 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_FORMAT
+#define CLASS_LOWLEVEL_FORMAT
+
+#include "src/package-fs/config.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! The layout of one version of the on-disk format.
+        /*!
+         * Version 1 packages store inode IDs in 16 bits and positions
+         * and file lengths in 32 bits, and a directory is a single
+         * block.  Version 2 packages store inode IDs in 32 bits and
+         * positions and file lengths in 64 bits, and a directory
+         * continues into a chain of INT_DIRINFO blocks.  Everything
+         * that reads or writes the fields of a block directly takes its
+         * offsets and sizes from here.
+         */
+        class Format
+        {
+        public:
+            //! The format version (FORMAT_VERSION_1 or FORMAT_VERSION_2).
+            uint16_t version;
+
+            //! The number of bytes used to store an inode ID, a position
+            //! (or file length) and a count (of blocks or children).
+            uint32_t id_size;
+            uint32_t pos_size;
+            uint32_t count_size;
+
+            //! The offset of the type field of every block, and the size
+            //! of the ID and type fields together.
+            uint32_t off_type;
+            uint32_t hsize_header;
+
+            //! The offset of the flags of an inode (0 for version 1
+            //! packages, which have no room for them).
+            uint32_t off_flags;
+
+            //! The offsets of the fields of a file, symlink or device.
+            uint32_t off_file_blocks;
+            uint32_t off_file_len;
+            uint32_t off_file_info_next;
+            uint32_t hsize_file;
+
+            //! The offset of the next field of a segment information
+            //! block, and the size of its header.
+            uint32_t off_seginfo_next;
+            uint32_t hsize_seginfo;
+
+            //! The offset of the next field of a free list block, and the
+            //! size of its header.
+            uint32_t off_freelist_next;
+            uint32_t hsize_freelist;
+
+            //! The offsets of the fields of a directory, and the number
+            //! of children it holds in its own block.
+            uint32_t off_dir_count;
+            uint32_t off_dir_next;
+            uint32_t hsize_directory;
+            uint32_t dir_children;
+
+            //! The offset of the next field of a directory information
+            //! block, the size of its header, and the number of children
+            //! it holds (all 0 for version 1 packages).
+            uint32_t off_dirinfo_next;
+            uint32_t hsize_dirinfo;
+            uint32_t dirinfo_children;
+
+            //! The offset of the next field of a block index block, and
+            //! the size of its header (both 0 for version 1 packages,
+            //! which have no block index).
+            uint32_t off_blockindex_next;
+            uint32_t hsize_blockindex;
+
+            //! The length of the journal at OFFSET_JOURNAL (0 for version
+            //! 1 packages, which have no journal).
+            uint32_t length_journal;
+
+            //! The length of the prefetch profile at OFFSET_PROFILE (0 for
+            //! version 1 packages, which have no profile).
+            uint32_t length_profile;
+
+            //! The highest inode ID, the largest file and the largest
+            //! package.
+            uint32_t max_id;
+            uint64_t max_file_size;
+            uint64_t max_package_size;
+
+            //! Returns the layout for the specified format version, or
+            //! NULL if the version is not supported.
+            static const Format* get(uint16_t version);
+
+            //! Returns the format version recorded in an FSInfo ver_major
+            //! field.
+            static uint16_t getVersion(uint16_t ver_major);
+
+            //! Decodes and encodes an inode ID, a position or a count in
+            //! this format's width.
+            uint32_t getID(const char *data) const;
+            void putID(char *data, uint32_t id) const;
+            uint64_t getPos(const char *data) const;
+            void putPos(char *data, uint64_t pos) const;
+            uint32_t getCount(const char *data) const;
+            void putCount(char *data, uint32_t count) const;
+
+            //! Decodes and encodes an array of inode IDs.
+            void getIDArray(const char *data, uint32_t *out, uint32_t count) const;
+            void putIDArray(char *data, const uint32_t *in, uint32_t count) const;
+
+            //! Returns the number of segment positions held in a file
+            //! block and in a segment information block.
+            uint32_t getSegmentsInFileBlock() const;
+            uint32_t getSegmentsInInfoBlock() const;
+
+            //! Returns the number of position slots in a free list block.
+            uint32_t getFreeListSlots() const;
+
+            //! Returns the number of entries in a block index block.
+            uint32_t getBlockIndexSlots() const;
+        };
+    }
+}
+
+#endif
@@ -2,295 +2,355 @@
 
 #include "src/package-fs/lowlevel/freelist.h"
 #include "src/package-fs/lowlevel/fs.h"
-#include <math.h>
+#include <string.h>
+#include <algorithm>
 
 namespace AppLib
 {
     namespace LowLevel
     {
-        FreeList::FreeList(FS * filesystem, BlockStream * fd)
+        FreeList::FreeList(FS * filesystem, BlockStream * fd, const Format* format)
         {
             this->filesystem = filesystem;
             this->fd = fd;
+            this->format = format;
+            this->last_list_block = 0;
+            this->free_count = 0;
 
             // Make a cache out of the on-disk data.
             this->syncronizeCache();
         }
 
-        uint32_t FreeList::allocateBlock()
+        uint64_t FreeList::allocateBlock()
         {
-            // Check to see if the size of the position cache is 0, in which case
-            // we need to actually allocate a new block at the end of the file.
-            if (this->position_cache.size() == 0)
+            std::vector < uint64_t > res;
+            if (!this->allocateBlocks(1, res))
+                return 0;
+            return res[0];
+        }
+
+        bool FreeList::allocateBlocks(uint64_t count, std::vector < uint64_t > &out, uint64_t *reused)
+        {
+            if (reused != NULL)
+                *reused = 0;
+            if (count == 0)
+                return true;
+
+            // Use the first run of free blocks that can hold all of
+            // the requested blocks.
+            for (std::map < uint64_t, uint64_t >::iterator i = this->extents.begin(); i != this->extents.end(); i++)
             {
-                // Get the filesize.
-                std::streampos oldg = this->fd->tellg();
-                this->fd->seekg(0, std::ios::end);
-                uint32_t fsize = (uint32_t) this->fd->tellg();
-                 this->fd->seekg(oldg);
-
-                // Align the position on the upper 4096 boundary.
-                double fblocks = fsize / 4096.0f;
-                uint32_t alignedpos = ceil(fblocks) * 4096;
-
-                // Force the block to be consumed so that the next time
-                // we try to allocate a block, the seek-to-end-of-file
-                // will work as expected.
-                std::streampos oldp = this->fd->tellp();
-                const char* zero = "\0";
-                this->fd->seekp(alignedpos);
-                for (int i = 0; i < 4096; i += 1)
-                    this->fd->write(zero, 1);
-                this->fd->seekp(oldp);
-
-                Logging::showDebugW("FREELIST: Allocate (  new   ) block at %u.", alignedpos);
-
-                 return alignedpos;
+                if (i->second >= count)
+                {
+                    Logging::showDebugW("FREELIST: Allocate (existing) %llu blocks at %llu.",
+                            (unsigned long long) count, (unsigned long long) i->first);
+                    this->takeExtent(i->first, count, out);
+                    if (reused != NULL)
+                        *reused = count;
+                    return true;
+                }
             }
 
-            // Get the first unallocated block.
-            std::map < uint32_t, uint32_t >::iterator i = this->position_cache.begin();
-
-            // Update the position in the free block allocation table
-            // to be equal to 0 to indicate that the free block is taken.
-            std::streampos oldp = this->fd->tellp();
-            this->fd->seekp(i->first);
-            Endian::doW(this->fd, reinterpret_cast < char *>(&i->second), 4);
-            this->fd->seekp(oldp);
-            uint32_t res = i->second;
-
-            Logging::showDebugW("FREELIST: Allocate (existing) block at %u.", res);
-
-            // Remove the entry from the position cache.
-            this->position_cache.erase(i);
+            // Otherwise use up whatever free blocks there are, in order
+            // of their position.
+            uint64_t remaining = count;
+            while (remaining > 0 && this->extents.size() > 0)
+            {
+                std::map < uint64_t, uint64_t >::iterator i = this->extents.begin();
+                uint64_t amount = std::min(remaining, i->second);
+                Logging::showDebugW("FREELIST: Allocate (existing) %llu blocks at %llu.",
+                        (unsigned long long) amount, (unsigned long long) i->first);
+                this->takeExtent(i->first, amount, out);
+                remaining -= amount;
+                if (reused != NULL)
+                    *reused += amount;
+            }
+            if (remaining == 0)
+                return true;
+
+            // And allocate the rest at the end of the file.
+            uint64_t start = this->extendImage(remaining);
+            if (start == 0)
+                return false;
+            Logging::showDebugW("FREELIST: Allocate (  new   ) %llu blocks at %llu.",
+                    (unsigned long long) remaining, (unsigned long long) start);
+            for (uint64_t i = 0; i < remaining; i += 1)
+                out.push_back(start + i * BSIZE_FILE);
+            return true;
+        }
 
-            // Return the new writable position.
-            return res;
+        bool FreeList::reserveBlocks(uint64_t count)
+        {
+            if (count == 0)
+                return true;
+
+            uint64_t start = this->extendImage(count);
+            if (start == 0)
+                return false;
+            Logging::showDebugW("FREELIST: Reserve %llu blocks at %llu.",
+                    (unsigned long long) count, (unsigned long long) start);
+
+            // Record the new blocks from the end so that any of them that
+            // are needed to extend the free space allocation table come
+            // after the blocks that are left free.
+            for (uint64_t i = count; i > 0; i -= 1)
+                this->freeBlock(start + (i - 1) * BSIZE_FILE);
+            return true;
         }
 
-        void FreeList::freeBlock(uint32_t pos)
+        void FreeList::freeBlock(uint64_t pos)
         {
-            // Get a new, blank writable index on the disk (and if
-            // we need to allocate a new block on disk for the freelist
-            // tell it to use the one we are free'ing).
-            uint32_t dpos = this->getIndexInList(0, pos);
-
-            // Although hacky, getIndexInList returns 1 to indicate that
-            // it used the provided availPos argument for it's new block.
-            // In that case, since getIndexInList immediately reallocated
-            // the new block, we're no longer actually going to free it
-            // (since it is now used).
-            if (dpos == 1)
+            if (this->isBlockFree(pos))
             {
-                Logging::showDebugW("FREELIST: Reallocated block at %u for list use.", pos);
+                Logging::showWarningW("FREELIST: Block at %llu is already free.", (unsigned long long) pos);
                 return;
             }
 
-            // If we can actually store the free'd block on disk, do so.
-            if (dpos != 0)
+            // If the free space allocation table is full, the block is
+            // immediately reused to extend it, so it is no longer free.
+            if (!this->recordBlock(pos))
             {
-                // Store the current position of the file descriptor.
-                std::streampos oldg = this->fd->tellg();
-
-                // Write to disk.
-                this->fd->seekp(dpos);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&pos), 4);
-
-                // Restore the position of the file descriptor.
-                this->fd->seekg(oldg);
-
-                Logging::showDebugW("FREELIST: Free block at %u.", pos);
+                Logging::showDebugW("FREELIST: Reallocated block at %llu for list use.", (unsigned long long) pos);
+                return;
             }
-            else
-                Logging::showDebugW("FREELIST: Unable to record free'd block %u on disk.", pos);
 
-            // Add the new free position to the cache.
-            this->position_cache.insert(std::map < uint32_t, uint32_t >::value_type(dpos, pos));
+            Logging::showDebugW("FREELIST: Free block at %llu.", (unsigned long long) pos);
+            this->insertExtent(pos);
         }
 
-        uint32_t FreeList::getIndexInList(uint32_t pos)
+        bool FreeList::isBlockFree(uint64_t pos)
         {
-            return this->getIndexInList(pos, 0);
+            std::map < uint64_t, uint64_t >::iterator i = this->extents.upper_bound(pos);
+            if (i == this->extents.begin())
+                return false;
+            i--;
+            return (pos - i->first) % BSIZE_FILE == 0 && pos < i->first + i->second * BSIZE_FILE;
         }
 
-        uint32_t FreeList::getIndexInList(uint32_t pos, uint32_t availPos)
+        uint64_t FreeList::getFreeBlockCount()
         {
-            // Get the FSInfo inode by position.
-            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            return this->free_count;
+        }
 
-            // Get the position of the first FreeList inode.
-            uint32_t fpos = fsinfo.pos_freelist;
-            uint32_t ipos = 0;
-            uint32_t tpos = 0;
+        INodeType::INodeType FreeList::getBlockType(uint64_t pos)
+        {
+            return INodeType::INT_INVALID;
+        }
 
-            // Store the current position of the file descriptor.
-            std::streampos oldg = this->fd->tellg();
+        void FreeList::insertExtent(uint64_t pos)
+        {
+            uint64_t start = pos;
+            uint64_t length = 1;
 
-            // Loop through the FreeList inodes, searching for
-            // correct index.
-            while (fpos != 0)
+            // Merge with the following run.
+            std::map < uint64_t, uint64_t >::iterator next = this->extents.find(pos + BSIZE_FILE);
+            if (next != this->extents.end())
             {
-                for (int i = 8; i < 4096; i += 4)
-                {
-                    this->fd->seekg(fpos + i);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&tpos), 4);
-                    if (tpos == pos)
-                    {
-                        // Success, we've matched correctly.
-                        // Seek back to the original position.
-                        this->fd->seekg(oldg);
+                length += next->second;
+                this->extents.erase(next);
+            }
 
-                        // Return the correct position.
-                        return fpos + i;
-                    }
+            // Merge with the preceding run.
+            std::map < uint64_t, uint64_t >::iterator prev = this->extents.lower_bound(pos);
+            if (prev != this->extents.begin())
+            {
+                prev--;
+                if (prev->first + prev->second * BSIZE_FILE == pos)
+                {
+                    start = prev->first;
+                    length += prev->second;
                 }
-
-                // Once we have scanned all the entries in our current FreeList block, we need
-                // to move onto the next one.
-                this->fd->seekg(fpos + 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&fpos), 4);
             }
 
-            // Special condition: If the pos is 0, and ipos is 0,
-            // then we need to allocate a new FreeList block for
-            // storing a new value.
-            if (pos == 0 && ipos == 0)
+            this->extents[start] = length;
+            this->free_count += 1;
+        }
+
+        void FreeList::takeExtent(uint64_t pos, uint64_t count, std::vector < uint64_t > &out)
+        {
+            uint64_t length = this->extents[pos];
+            this->extents.erase(pos);
+            if (length > count)
+                this->extents.insert(std::pair < uint64_t, uint64_t > (pos + count * BSIZE_FILE, length - count));
+            this->free_count -= count;
+
+            // Set the free block allocation table entries to 0 to
+            // indicate that the blocks are taken.
+            const char zero[8] = { 0 };
+            for (uint64_t i = 0; i < count; i += 1)
             {
-                // Create a new FreeList block.
-                uint32_t fpos = availPos;
-                if (fpos == 0)
-                    fpos = this->allocateBlock();
-                if (fpos == 0)
+                uint64_t bpos = pos + i * BSIZE_FILE;
+                std::unordered_map < uint64_t, uint64_t >::iterator s = this->slots.find(bpos);
+                if (s != this->slots.end())
                 {
-                    this->fd->seekg(oldg);
-                    return 0;
+                    this->fd->writeAt(zero, this->format->pos_size, s->second);
+                    this->empty_slots.push_back(s->second);
+                    this->slots.erase(s);
                 }
+                this->filesystem->invalidateINodeCache(bpos);
+                out.push_back(bpos);
+            }
+        }
+
+        uint64_t FreeList::extendImage(uint64_t count)
+        {
+            // Get the filesize.
+            std::streampos oldg = this->fd->tellg();
+            this->fd->seekg(0, std::ios::end);
+            uint64_t fsize = (uint64_t) this->fd->tellg();
+            this->fd->seekg(oldg);
+
+            // Align the position on the upper block boundary.
+            uint64_t alignedpos = ((fsize + BSIZE_FILE - 1) / BSIZE_FILE) * BSIZE_FILE;
+            if (alignedpos + count * BSIZE_FILE > this->format->max_package_size)
+            {
+                Logging::showErrorW("FREELIST: Package can not grow beyond %llu bytes.",
+                        (unsigned long long) this->format->max_package_size);
+                return 0;
+            }
+
+            // Force the blocks to be consumed so that the next time
+            // we try to allocate a block, the seek-to-end-of-file
+            // will work as expected.  Only the last block is written;
+            // the blocks before it read back as zeros until they are
+            // written to, so data written straight after allocation
+            // is only written once.
+            char zero[BSIZE_FILE];
+            memset(zero, 0, sizeof(zero));
+            uint64_t total = count * BSIZE_FILE;
+            try
+            {
+                this->fd->writeDataAt(zero, BSIZE_FILE, alignedpos + total - BSIZE_FILE);
+            }
+            catch (const std::ios_base::failure&)
+            {
+                // Handled below.
+            }
+            if (this->fd->fail())
+            {
+                Logging::showErrorW("FREELIST: Unable to extend package to %llu bytes.",
+                        (unsigned long long) (alignedpos + total));
+                this->fd->clear();
+                return 0;
+            }
+            for (uint64_t i = 0; i < count; i += 1)
+                this->filesystem->invalidateINodeCache(alignedpos + i * BSIZE_FILE);
+
+            return alignedpos;
+        }
+
+        bool FreeList::recordBlock(uint64_t pos)
+        {
+            if (this->empty_slots.size() == 0)
+            {
+                // Turn the free'd block into a new FreeList block.
                 INode fnode(0, "", INodeType::INT_FREELIST);
-                FSResult::FSResult res = this->filesystem->writeINode(fpos, fnode);
+                FSResult::FSResult res = this->filesystem->writeINode(pos, fnode);
                 if (res != FSResult::E_SUCCESS)
                 {
-                    this->fd->seekg(oldg);
-                    return 0;
+                    Logging::showDebugW("FREELIST: Unable to record free'd block %llu on disk.", (unsigned long long) pos);
+                    return true;
                 }
 
                 // Now assign the new FreeList block as the next one in
                 // the list for the current last FreeList block.
-                uint32_t lpos = fsinfo.pos_freelist;
-                uint32_t llpos = lpos;
-                if (lpos == 0)
+                if (this->last_list_block == 0)
                 {
                     // Update FSInfo inode.
-                    fsinfo.pos_freelist = fpos;
-
-                    this->fd->seekp(OFFSET_FSINFO);
-                    try
+                    FSInfo fsinfo = this->filesystem->getFSInfo();
+                    fsinfo.pos_freelist = pos;
+                    if (this->filesystem->updateFSInfo(fsinfo) != FSResult::E_SUCCESS)
                     {
-                        std::string data = fsinfo.getBinaryRepresentation();
-                        this->fd->write(data.c_str(), data.size());
-                    }
-                    catch(std::ifstream::failure e)
-                    {
-                        // End-of-file.
-                        this->fd->clear();
-                        this->fd->seekg(oldg);
-                        return 0;
+                        Logging::showDebugW("FREELIST: Unable to record free'd block %llu on disk.", (unsigned long long) pos);
+                        return true;
                     }
                 }
                 else
                 {
-                    while (lpos != 0)
-                    {
-                        llpos = lpos;
-
-                        // Get the next position.
-                        INode node = this->filesystem->getINodeByPosition(lpos);
-                        lpos = node.flst_next;
-                    }
-
                     // Update FreeList inode.
-                    INode onode = this->filesystem->getINodeByPosition(llpos);
-                    onode.flst_next = fpos;
-                    FSResult::FSResult res = this->filesystem->updateRawINode(onode, llpos);
-                    if (res != FSResult::E_SUCCESS)
+                    INode onode = this->filesystem->getINodeByPosition(this->last_list_block);
+                    onode.flst_next = pos;
+                    if (this->filesystem->updateRawINode(onode, this->last_list_block) != FSResult::E_SUCCESS)
                     {
-                        this->fd->seekg(oldg);
-                        return 0;
+                        Logging::showDebugW("FREELIST: Unable to record free'd block %llu on disk.", (unsigned long long) pos);
+                        return true;
                     }
                 }
+                this->last_list_block = pos;
 
-                // Seek back to the original position.
-                this->fd->seekg(oldg);
-
-                // If we used the availPos as our new freelist index,
-                // return 1 instead of the normal value.
-                if (fpos == availPos)
-                    return 1;
-                else
-                    return fpos + HSIZE_FREELIST;
+                // Make the entries of the new block available, lowest
+                // position last so that it is used first.
+                for (uint32_t i = this->format->getFreeListSlots(); i > 0; i -= 1)
+                    this->empty_slots.push_back(pos + this->format->hsize_freelist + (i - 1) * this->format->pos_size);
+                return false;
             }
 
-            // Seek back to the original position.
-            this->fd->seekg(oldg);
+            uint64_t dpos = this->empty_slots.back();
+            this->empty_slots.pop_back();
 
-            return 0;
-        }
+            // Write to disk.
+            char data[8];
+            this->format->putPos(data, pos);
+            this->fd->writeAt(data, this->format->pos_size, dpos);
 
-        bool FreeList::isBlockFree(uint32_t pos)
-        {
-            for (std::map < uint32_t, uint32_t >::iterator i = this->position_cache.begin(); i != this->position_cache.end(); i++)
-            {
-                if (i->first == pos)
-                    return true;
-            }
-
-            return false;
-        }
-
-        INodeType::INodeType FreeList::getBlockType(uint32_t pos)
-        {
-            return INodeType::INT_INVALID;
+            this->slots[pos] = dpos;
+            return true;
         }
 
         void FreeList::syncronizeCache()
         {
             // Clear the cache.
-            this->position_cache.clear();
+            this->extents.clear();
+            this->slots.clear();
+            this->empty_slots.clear();
+            this->last_list_block = 0;
+            this->free_count = 0;
 
-            // Get the FSInfo inode by position.
-            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            // Get the FSInfo inode.
+            FSInfo fsinfo = this->filesystem->getFSInfo();
 
             // Get the position of the first FreeList inode.
-            uint32_t fpos = fsinfo.pos_freelist;
-            uint32_t ipos = 0;
-            uint32_t tpos = 0;
-
-            // Check to make sure there is at least one freelist block.
-            if (fpos == 0)
-                return;
-
-            // Store the current position of the file descriptor.
-            std::streampos oldg = this->fd->tellg();
+            uint64_t fpos = fsinfo.pos_freelist;
+            uint64_t tpos = 0;
+            const char zero[8] = { 0 };
+            char block[BSIZE_FILE];
 
             // Loop through the FreeList inodes, adding non-zero values
-            // to the cache.
+            // to the cache.  Each block is read in a single request.
             while (fpos != 0)
             {
-                for (int i = 8; i < 4096; i += 4)
+                if (this->fd->readAt(block, BSIZE_FILE, fpos) != BSIZE_FILE)
+                {
+                    Logging::showWarningW("FREELIST: Unable to read FreeList block at %llu.", (unsigned long long) fpos);
+                    break;
+                }
+                this->last_list_block = fpos;
+
+                for (uint32_t i = this->format->hsize_freelist; i + this->format->pos_size <= BSIZE_FILE; i += this->format->pos_size)
                 {
-                    this->fd->seekg(fpos + i);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&tpos), 4);
-                    if (tpos != 0)
+                    tpos = this->format->getPos(block + i);
+                    if (tpos == 0)
+                        this->empty_slots.push_back(fpos + i);
+                    else if (this->slots.find(tpos) != this->slots.end())
                     {
-                        this->position_cache.insert(std::pair < uint32_t, uint32_t > (fpos + i, tpos));
+                        // The same block is recorded twice; drop the
+                        // duplicate entry so it can't outlive the first.
+                        this->fd->writeAt(zero, this->format->pos_size, fpos + i);
+                        this->empty_slots.push_back(fpos + i);
+                    }
+                    else
+                    {
+                        this->slots[tpos] = fpos + i;
+                        this->insertExtent(tpos);
                     }
                 }
 
                 // Get the next position.
-                fpos = this->filesystem->getINodeByPosition(fpos).flst_next;
+                fpos = this->format->getPos(block + this->format->off_freelist_next);
             }
 
-            // Seek back to the original position.
-            this->fd->seekg(oldg);
+            // Use the lowest entries first.
+            std::reverse(this->empty_slots.begin(), this->empty_slots.end());
 
             // The cache has now been (re)built.
         }
@@ -17,6 +17,8 @@ namespace AppLib
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include "src/package-fs/lowlevel/endian.h"
 #include "src/package-fs/lowlevel/fs.h"
 
@@ -27,53 +29,91 @@ namespace AppLib
         class FreeList
         {
         public:
-            FreeList(FS * filesystem, BlockStream * fd);
+            FreeList(FS * filesystem, BlockStream * fd, const Format* format);
 
             // Finds a free block, marks it as allocated in the free
             // space allocation table, and returns it's position for
             // writing.
-            uint32_t allocateBlock();
+            uint64_t allocateBlock();
+
+            // Finds the specified number of free blocks, marks them as
+            // allocated and appends their positions to out.  A single
+            // contiguous run of free blocks is used if one is large
+            // enough, otherwise the free blocks are used in order and the
+            // remainder is allocated at the end of the package in one go.
+            // Returns false if not all of the blocks could be allocated
+            // (those that were are still appended to out).  If reused is
+            // given, it is set to the number of blocks at the start of
+            // those appended that were freed earlier and may still hold
+            // old data; the rest read back as zeros.
+            bool allocateBlocks(uint64_t count, std::vector < uint64_t > &out, uint64_t *reused = NULL);
+
+            // Extends the package by the specified number of blocks and
+            // marks them as free, so that later allocations are laid out
+            // contiguously without growing the package a block at a time.
+            bool reserveBlocks(uint64_t count);
 
             // Frees a specified block, marking it as unallocated in
             // the free space allocation table.
-            void freeBlock(uint32_t pos);
+            void freeBlock(uint64_t pos);
 
             // Returns whether a specified position is free.
-            bool isBlockFree(uint32_t pos);
+            bool isBlockFree(uint64_t pos);
+
+            // Returns the number of blocks that are currently free.
+            uint64_t getFreeBlockCount();
 
             // Returns the specified type of an inode at the specified
             // position, returning INT_FREEBLOCK and INT_DATA in appropriate
             // circumstances.
-            INodeType::INodeType getBlockType(uint32_t pos);
+            INodeType::INodeType getBlockType(uint64_t pos);
 
          private:
             FS * filesystem;
             BlockStream *fd;
+            const Format* format;
 
-            // Returns the position in the free space allocation table
-            // where a 32-bit position integer can be written, that
-            // currently matches pos.
-            uint32_t getIndexInList(uint32_t pos);
-
-            // Returns the position in the free space allocation table
-            // where a 32-bit position integer can be written, that
-            // currently matches pos.  Optionally providing an availPos
-            // which is free space that has not yet been marked as free
-            // (used as part of freeBlock to immediately repurpose free'd
-            // blocks for use as part of the FreeList structure).  In the
-            // event that this function reuses availPos for the freelist,
-            // it returns 1.
-            uint32_t getIndexInList(uint32_t pos, uint32_t availPos);
-
-            // An in-memory cache of the free space allocation table, so
-            // that fast lookups can be done to determine whether or not
-            // a block is free or not (without having to cycle through the
-            // entire free block allocation table).
+            // An in-memory copy of the free space allocation table, as
+            // runs of contiguous free blocks, so that allocation and
+            // lookups don't need to touch the disk.
             //
-            // The first (key) value is the position that's free, the second
-            // value is the position on disk of the free allocation index
-            // (i.e. the result of getIndexInList for the specified position).
-            std::map < uint32_t, uint32_t > position_cache;
+            // The first (key) value is the position of the first free
+            // block in the run, the second value is the number of blocks
+            // in the run.  Adjacent runs are always merged.
+            std::map < uint64_t, uint64_t > extents;
+
+            // The position on disk of the free allocation index that
+            // records each free block.
+            std::unordered_map < uint64_t, uint64_t > slots;
+
+            // Positions on disk of free allocation indexes that don't
+            // currently record a free block.
+            std::vector < uint64_t > empty_slots;
+
+            // The position of the last block in the FreeList chain, or 0
+            // if there are no FreeList blocks yet.
+            uint64_t last_list_block;
+
+            // The number of free blocks across all of the runs.
+            uint64_t free_count;
+
+            // Adds a single free block to the runs, merging it with its
+            // neighbours.
+            void insertExtent(uint64_t pos);
+
+            // Allocates count blocks from the start of the run at pos,
+            // clearing their free allocation indexes on disk.
+            void takeExtent(uint64_t pos, uint64_t count, std::vector < uint64_t > &out);
+
+            // Extends the package by count zeroed blocks, returning the
+            // position of the first one or 0 on failure.
+            uint64_t extendImage(uint64_t count);
+
+            // Records a free block in the free space allocation table.  If
+            // there is no room left in the table, the block itself is used
+            // to extend the table and false is returned (in which case the
+            // block is no longer free).
+            bool recordBlock(uint64_t pos);
 
             // Resyncronizes the cache based on what is on disk.
             void syncronizeCache();
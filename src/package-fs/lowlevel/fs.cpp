@@ -11,10 +11,20 @@
 #include "src/package-fs/lowlevel/util.h"
 #include "src/package-fs/lowlevel/blockstream.h"
 #include "src/package-fs/lowlevel/freelist.h"
+#include "src/package-fs/lowlevel/blockindex.h"
+#include "src/package-fs/lowlevel/journal.h"
+#include "src/package-fs/lowlevel/profile.h"
+#include "src/package-fs/lowlevel/inodecache.h"
+#include "src/package-fs/lowlevel/dirindex.h"
+#include "src/package-fs/lowlevel/inodebitmap.h"
+#include "src/package-fs/lowlevel/rwlock.h"
+#include "src/package-fs/lowlevel/segmentlist.h"
+#include "src/package-fs/lowlevel/compression.h"
 #include <errno.h>
 #include <assert.h>
 #include <math.h>
 #include <vector>
+#include <thread>
 
 namespace AppLib
 {
@@ -31,7 +41,46 @@ namespace AppLib
             Endian::detectEndianness();
 
             this->fd = fd;
-            this->freelist = new FreeList(this, fd);
+
+            // The layout of everything after the FSInfo block depends on
+            // the format version recorded in it, so read that first.
+            this->format = Format::get(FORMAT_VERSION_DEFAULT);
+            if (fd != NULL)
+            {
+                FSInfo info;
+                char block[LENGTH_FSINFO];
+                std::streamsize count = fd->readAt(block, LENGTH_FSINFO, OFFSET_FSINFO);
+                if (count > 0 && info.readBinaryRepresentation(block, (uint32_t) count))
+                    this->format = info.getFormat();
+                else
+                {
+                    Logging::showErrorW("Unable to read the FSInfo block; the package can not be opened.");
+                    this->fd = NULL;
+                }
+            }
+
+            // Anything left in the journal by an unclean shutdown has to be
+            // in place before the rest of the package is read.
+            this->journal = new Journal(this->fd, this->format);
+            if (this->fd != NULL && this->journal->isAvailable())
+            {
+                if (!this->journal->recover())
+                {
+                    Logging::showErrorW("Unable to replay the journal; the package can not be opened.");
+                    this->fd = NULL;
+                }
+                else
+                    this->fd->setJournal(this->journal);
+            }
+
+            this->profile = new Profile(this->fd, this->format);
+            this->inodecache = new INodeCache();
+            this->dirindex = new DirectoryIndex();
+            this->inodebitmap = new INodeBitmap(this->format->max_id);
+            this->lock = new RWLock();
+            this->freelist = new FreeList(this, this->fd, this->format);
+            this->blockindex = new BlockIndex(this, this->fd, this->format);
+            this->loadINodeBitmap();
 
 #if 0 == 1
             // Check for text-mode stream, which will break binary packages.
@@ -64,36 +113,54 @@ namespace AppLib
 #endif
         }
 
+        FS::~FS()
+        {
+            if (this->fd != NULL && this->journal->isAvailable())
+            {
+                this->journal->flush();
+                this->fd->setJournal(NULL);
+            }
+            this->profile->stop();
+            delete this->profile;
+            delete this->journal;
+            delete this->blockindex;
+            delete this->freelist;
+            delete this->inodebitmap;
+            delete this->dirindex;
+            delete this->inodecache;
+            delete this->lock;
+        }
+
         bool FS::isValid()
         {
             return (this->fd != NULL);
         }
 
-        INode FS::getINodeByID(uint16_t id)
+        INode FS::getINodeByID(uint32_t id)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             // Retrieve the position using our getINodePositionByID
             // function.
-            uint32_t ipos = this->getINodePositionByID(id);
+            uint64_t ipos = this->getINodePositionByID(id);
             if (ipos == 0 || ipos < OFFSET_FSINFO)
                 return INode(0, "", INodeType::INT_INVALID);
             return this->getINodeByPosition(ipos);
         }
 
-        INode FS::getRealINodeByID(uint16_t id)
+        INode FS::getRealINodeByID(uint32_t id)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             // Retrieve the position using our getINodePositionByID
             // function.
-            uint32_t ipos = this->getINodePositionByID(id);
+            uint64_t ipos = this->getINodePositionByID(id);
             if (ipos == 0 || ipos < OFFSET_FSINFO)
                 return INode(0, "", INodeType::INT_INVALID);
             return this->getINodeByRealPosition(ipos);
         }
 
-        INode FS::getINodeByPosition(uint32_t ipos)
+        INode FS::getINodeByPosition(uint64_t ipos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -106,95 +173,50 @@ namespace AppLib
             return node;
         }
 
-        INode FS::getINodeByRealPosition(uint32_t ipos)
+        INode FS::getINodeByRealPosition(uint64_t ipos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             INode node(0, "", INodeType::INT_INVALID);
 
-            // Seek to the inode position
-            std::streampos old = this->fd->tellg();
-            this->fd->seekg(ipos);
-
-            // Read the data.
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.inodeid), 2);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.type), 2);
-            if (node.type == INodeType::INT_SEGINFO)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.info_next), 4);
-
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
-
+            // Serve the inode out of the cache if we can.
+            if (this->inodecache->get(ipos, node))
                 return node;
-            }
-            else if (node.type == INodeType::INT_FREELIST)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.flst_next), 4);
-
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
-
-                return node;
-            }
-            else if (node.type == INodeType::INT_FSINFO)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.fs_name), 10);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_major), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_minor), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_revision), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_name), 256);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_ver), 32);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_desc), 1024);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_author), 256);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.pos_root), 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.pos_freelist), 4);
-
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
 
+            // Read the whole block in a single request and decode it
+            // from memory.  A directory block is the largest inode.
+            char block[BSIZE_DIRECTORY];
+            std::streamsize count = this->fd->readAt(block, BSIZE_DIRECTORY, ipos);
+            if (count <= 0)
                 return node;
-            }
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.filename), 256);
-            if (node.type != INodeType::INT_HARDLINK)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.uid), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.gid), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.mask), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.atime), 8);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.mtime), 8);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ctime), 8);
-            }
-            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_DEVICE)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.dev), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.rdev), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.nlink), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.blocks), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.dat_len), 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.info_next), 4);
-            }
-            else if (node.type == INodeType::INT_DIRECTORY)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.parent), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.children_count), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.children), DIRECTORY_CHILDREN_MAX * 2);
-            }
-            else if (node.type == INodeType::INT_HARDLINK)
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.realid), 2);
-
-            // Seek back to the original reading position.
-            this->fd->seekg(old);
 
             // Ensure that if our node data is invalid, we return an invalid
             // INode instead of partial data.
-            if (!node.verify())
-                return INode(0, "", INodeType::INT_INVALID);
+            if (!node.readBinaryRepresentation(block, (uint32_t) count, *this->format) || !node.verify())
+                node = INode(0, "", INodeType::INT_INVALID);
+
+            // The children of a large directory continue into its
+            // directory information blocks.
+            if (node.type == INodeType::INT_DIRECTORY && node.dir_next != 0)
+            {
+                std::shared_ptr < DirectoryChildren > list(new DirectoryChildren());
+                if (node.children)
+                    *list = *node.children;
+                list->resize(this->format->dir_children, 0);
+                this->readDirectoryInfoBlocks(node.dir_next, *list);
+                while (!list->empty() && list->back() == 0)
+                    list->pop_back();
+                if (list->empty())
+                    node.children.reset();
+                else
+                    node.children = list;
+            }
 
+            this->inodecache->put(ipos, node);
             return node;
         }
 
-        FSResult::FSResult FS::writeINode(uint32_t pos, INode node)
+        FSResult::FSResult FS::writeINode(uint64_t pos, const INode& node)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -206,41 +228,44 @@ namespace AppLib
             // Check to make sure the inode ID is not already assigned.
             // TODO: This needs to be updated with a full list of inode types whose inode ID should
             //       be ignored.
-            if (node.type != INodeType::INT_SEGINFO && node.type != INodeType::INT_FREELIST && this->getINodePositionByID(node.inodeid) != 0)
+            if (node.type != INodeType::INT_SEGINFO && node.type != INodeType::INT_FREELIST && node.type != INodeType::INT_DIRINFO && node.type != INodeType::INT_BLOCKINDEX && this->getINodePositionByID(node.inodeid) != 0)
                 return FSResult::E_FAILURE_INODE_ALREADY_ASSIGNED;
 
             // Do some sanity checks on the content.
             if (!node.verify())
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
-            std::streampos old = this->fd->tellp();
-            std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
-            if (this->fd->fail())
-                Logging::showErrorW("Write failure on write of new INode.");
-            if (this->fd->bad())
-                Logging::showErrorW("Write bad on write of new INode.");
-            if (this->fd->eof())
-                Logging::showErrorW("Write EOF on write of new INode.");
-            // TODO: Should we return with failure if any of the above if
-            // statements execute?
-
-            const char *z = "";	// a const char* always has a \0 terminator, which we use to write into the file.
+            // The inode is written out along with the zeros that fill
+            // the rest of its block, in a single request.
+            uint32_t size = 0;
             // TODO: This needs to be updated with a full list of inode types.
-            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SEGINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_FREELIST || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK)
+            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SEGINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_FREELIST || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK || node.type == INodeType::INT_BLOCKINDEX)
+                size = BSIZE_FILE;
+            else if (node.type == INodeType::INT_DIRECTORY || node.type == INodeType::INT_DIRINFO)
+                size = BSIZE_DIRECTORY;
+            else
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            std::vector < char > block(size, 0);
+            node.writeBinaryRepresentation(&block[0], *this->format);
+
+            this->inodecache->invalidate(pos);
+            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK)
+                this->segmentcache.erase(node.inodeid);
+            try
             {
-                for (int i = 0; i < BSIZE_FILE - data.length(); i += 1)
-                    Endian::doW(this->fd, z, 1);
+                this->fd->writeAt(&block[0], size, pos);
             }
-            else if (node.type == INodeType::INT_DIRECTORY)
+            catch (const std::ios_base::failure&)
             {
-                int target = BSIZE_DIRECTORY - data.length();
-                for (int i = 0; i < target; i += 1)
-                    Endian::doW(this->fd, z, 1);
+                // Handled below.
             }
-            else
-                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            if (this->fd->fail())
+            {
+                Logging::showErrorW("Write failure on write of new INode.");
+                this->fd->clear();
+                return FSResult::E_FAILURE_GENERAL;
+            }
+
             if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_DIRECTORY || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK)
             {
                 LowLevel::FSResult::FSResult sres = this->setINodePositionByID(node.inodeid, pos);
@@ -248,11 +273,10 @@ namespace AppLib
                     return sres;
             }
             this->unreserveINodeID(node.inodeid);
-            Util::seekp_ex(this->fd, old);
             return FSResult::E_SUCCESS;
         }
 
-        FSResult::FSResult FS::updateRawINode(INode node, uint32_t pos)
+        FSResult::FSResult FS::updateRawINode(const INode& node, uint64_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -263,7 +287,7 @@ namespace AppLib
 
             // Ensure that this INode is a type that allows updating via
             // manual positioning.
-            if (node.type != INodeType::INT_FREELIST)
+            if (node.type != INodeType::INT_FREELIST && node.type != INodeType::INT_BLOCKINDEX)
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
             // Do some sanity checks on the content.
@@ -271,16 +295,52 @@ namespace AppLib
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
             // Do a very simple update of the data.
-            std::streampos old = this->fd->tellp();
-            std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
-            Util::seekp_ex(this->fd, old);
+            char data[HSIZE_FREELIST_V2];
+            node.writeBinaryRepresentation(data, *this->format);
+            this->inodecache->invalidate(pos);
+            this->fd->writeAt(data, node.getBinarySize(*this->format), pos);
             return FSResult::E_SUCCESS;
 
         }
 
-        FSResult::FSResult FS::updateINode(INode node)
+        FSInfo FS::getFSInfo()
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            FSInfo info;
+            char block[LENGTH_FSINFO];
+            std::streamsize count = this->fd->readAt(block, LENGTH_FSINFO, OFFSET_FSINFO);
+            if (count <= 0 || !info.readBinaryRepresentation(block, (uint32_t) count))
+            {
+                Logging::showErrorW("Unable to read the FSInfo block.");
+                return FSInfo();
+            }
+            return info;
+        }
+
+        FSResult::FSResult FS::updateFSInfo(const FSInfo& info)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            char data[LENGTH_FSINFO];
+            info.writeBinaryRepresentation(data);
+            try
+            {
+                this->fd->writeAt(data, info.getBinarySize(), OFFSET_FSINFO);
+            }
+            catch (const std::ios_base::failure&)
+            {
+                // Handled below.
+            }
+            if (this->fd->fail())
+            {
+                this->fd->clear();
+                return FSResult::E_FAILURE_GENERAL;
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::updateINode(const INode& node)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -292,7 +352,7 @@ namespace AppLib
 
             // Check to make sure the inode ID is already assigned.
             Logging::showDebugW("Updating INode %i...", node.inodeid);
-            uint32_t pos = this->getINodePositionByID(node.inodeid);
+            uint64_t pos = this->getINodePositionByID(node.inodeid);
             if (pos == 0)
                 return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
 
@@ -305,59 +365,95 @@ namespace AppLib
             if (!node.verify())
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
-            std::streampos old = this->fd->tellp();
-            std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
+            // If this changes the length or the start of the segment
+            // list, the decoded segment list is no longer valid.
+            INode old_node = this->getINodeByRealPosition(pos);
+            if (old_node.dat_len != node.dat_len || old_node.info_next != node.info_next)
+                this->segmentcache.erase(node.inodeid);
+
+            char data[BSIZE_DIRECTORY];
+            node.writeBinaryRepresentation(data, *this->format);
+            this->inodecache->invalidate(pos);
+            this->fd->writeAt(data, node.getBinarySize(*this->format), pos);
             // We do not write out the file data with zeros
             // as in writeINode because we want to keep the
             // content.
             LowLevel::FSResult::FSResult sres = this->setINodePositionByID(node.inodeid, pos);
             if (sres != LowLevel::FSResult::E_SUCCESS)
                 return sres;
-            Util::seekp_ex(this->fd, old);
+
+            // The filename may have changed, so update the index of
+            // the directory that contains this inode (a resolved hardlink
+            // target is written out with its own filename, not the link's).
+            if ((node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_DEVICE) && node.realid != 0)
+                this->dirindex->rename(node.inodeid, node.realfilename);
+            else
+                this->dirindex->rename(node.inodeid, node.filename);
             return FSResult::E_SUCCESS;
         }
 
-        uint32_t FS::getINodePositionByID(uint16_t id)
+        uint64_t FS::getINodePositionByID(uint32_t id)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            this->fd->clear();
-            std::streampos old = this->fd->tellg();
-            uint32_t newp = OFFSET_LOOKUP + (id * 4);
-            this->fd->seekg(newp);
-            uint32_t ipos = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-            this->fd->seekg(old);
+            uint64_t ipos = 0;
+            if (this->inodecache->getPosition(id, ipos))
+                return ipos;
+
+            uint64_t entry = this->getLookupEntryPosition(id, false);
+            char data[8];
+            if (entry != 0 && this->fd->readAt(data, this->format->pos_size, entry) == this->format->pos_size)
+                ipos = this->format->getPos(data);
+            this->inodecache->putPosition(id, ipos);
             return ipos;
         }
 
-        uint16_t FS::getFirstFreeINodeNumber()
+        uint64_t FS::getLookupEntryPosition(uint32_t id, bool allocate)
+        {
+            if (id > this->format->max_id)
+                return 0;
+            if (this->format->version == FORMAT_VERSION_1)
+                return OFFSET_LOOKUP + (uint64_t) id * this->format->pos_size;
+
+            // In a version 2 package, the lookup table area holds the
+            // positions of lookup blocks, each of which holds the
+            // positions of LOOKUP_BLOCK_IDS consecutive inodes.
+            uint64_t tpos = OFFSET_LOOKUP + (uint64_t) (id / LOOKUP_BLOCK_IDS) * this->format->pos_size;
+            char data[8];
+            if (this->fd->readAt(data, this->format->pos_size, tpos) != this->format->pos_size)
+                return 0;
+            uint64_t bpos = this->format->getPos(data);
+            if (bpos == 0)
+            {
+                if (!allocate)
+                    return 0;
+                bpos = this->freelist->allocateBlock();
+                if (bpos == 0)
+                    return 0;
+                std::vector < char > zero(BSIZE_FILE, 0);
+                this->fd->writeAt(&zero[0], BSIZE_FILE, bpos);
+                this->format->putPos(data, bpos);
+                this->fd->writeAt(data, this->format->pos_size, tpos);
+                if (this->fd->fail())
+                {
+                    this->fd->clear();
+                    return 0;
+                }
+            }
+            return bpos + (uint64_t) (id % LOOKUP_BLOCK_IDS) * this->format->pos_size;
+        }
+
+        uint32_t FS::getFirstFreeINodeNumber()
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            this->fd->clear();
-            std::streampos old = this->fd->tellg();
-            this->fd->seekg(OFFSET_LOOKUP);
-            uint32_t ipos = 0;
-            uint16_t count = 0;
-            uint16_t ret = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-            while ((ipos != 0 && count < 65535) || std::find(this->reservedINodes.begin(), this->reservedINodes.end(), count) != this->reservedINodes.end())
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-                count += 1;
-            }
-            if (count == 65535 && ipos != 0)
-                ret = 0;
-            else
-                ret = count;
-            this->fd->seekg(old);
+            uint32_t ret = 0;
+            if (!this->inodebitmap->findFirstFree(ret))
+                return 0;
             return ret;
         }
 
-        FSResult::FSResult FS::setINodePositionByID(uint16_t id, uint32_t pos)
+        FSResult::FSResult FS::setINodePositionByID(uint32_t id, uint64_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -369,14 +465,32 @@ namespace AppLib
                     return res;
             }
 
-            std::streampos old = this->fd->tellp();
-            Util::seekp_ex(this->fd, OFFSET_LOOKUP + (id * 4));
-            Endian::doW(this->fd, reinterpret_cast < char *>(&pos), 4);
-            Util::seekp_ex(this->fd, old);
+            // An inode that was never assigned has no lookup table
+            // entry to clear.
+            uint64_t entry = this->getLookupEntryPosition(id, pos != 0);
+            if (entry == 0 && pos != 0)
+                return FSResult::E_FAILURE_GENERAL;
+            if (entry != 0)
+            {
+                char data[8];
+                this->format->putPos(data, pos);
+                this->fd->writeAt(data, this->format->pos_size, entry);
+            }
+            this->inodecache->putPosition(id, pos);
+            this->inodebitmap->setUsed(id, pos != 0);
+
+            // Released inode IDs must no longer appear in (or have) a
+            // directory index.
+            if (pos == 0)
+            {
+                this->dirindex->forget(id);
+                this->dirindex->drop(id);
+                this->segmentcache.erase(id);
+            }
             return FSResult::E_SUCCESS;
         }
 
-        uint32_t FS::getFirstFreeBlock(INodeType::INodeType type)
+        uint64_t FS::getFirstFreeBlock()
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -384,7 +498,7 @@ namespace AppLib
             return this->freelist->allocateBlock();
         }
 
-        bool FS::isBlockFree(uint32_t pos)
+        bool FS::isBlockFree(uint64_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -392,187 +506,235 @@ namespace AppLib
             return this->freelist->isBlockFree(pos);
         }
 
-        FSResult::FSResult FS::addChildToDirectoryINode(uint16_t parentid, uint16_t childid)
+        FSResult::FSResult FS::reserveBlocks(uint64_t count)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            if (!this->freelist->reserveBlocks(count))
+                return FSResult::E_FAILURE_GENERAL;
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::addChildToDirectoryINode(uint32_t parentid, uint32_t childid)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             if (parentid == childid)
                 return FSResult::E_FAILURE_GENERAL;
 
-            signed int type_offset = 2;
-            signed int children_count_offset = 292;
-            signed int children_offset = 294;
-            uint32_t pos = this->getINodePositionByID(parentid);
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            uint64_t pos = this->getINodePositionByID(parentid);
 
             // Read to make sure it's a directory.
-            uint16_t parent_type = (uint16_t) INodeType::INT_UNSET;
-            this->fd->seekg(pos + type_offset);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&parent_type), 2);
-            if (parent_type != INodeType::INT_DIRECTORY)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            char type[2];
+            if (pos == 0 || this->fd->readAt(type, 2, pos + this->format->off_type) != 2 ||
+                Endian::getU16(type) != INodeType::INT_DIRECTORY)
                 return FSResult::E_FAILURE_NOT_A_DIRECTORY;
-            }
 
-            // Now seek to the start of the list of directory children.
-            this->fd->seekg(pos + children_offset);
-            Util::seekp_ex(this->fd, pos + children_offset);
+            // We're about to modify the directory inode in place.
+            this->inodecache->invalidate(pos);
 
             // Find the first available child slot.
-            uint16_t ccinode = 0;
-            uint16_t count = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-            while (ccinode != 0 && count < DIRECTORY_CHILDREN_MAX - 1)
+            uint64_t last = 0;
+            uint64_t slot = this->findDirectorySlot(pos, 0, last);
+            if (slot == 0)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-                count += 1;
+                // A version 1 directory can not grow past its own block.
+                if (this->format->off_dir_next == 0 || last == 0)
+                    return FSResult::E_FAILURE_MAXIMUM_CHILDREN_REACHED;
+
+                // Otherwise add a directory information block to the end
+                // of the chain and use its first slot.
+                uint64_t npos = this->freelist->allocateBlock();
+                if (npos == 0)
+                    return FSResult::E_FAILURE_GENERAL;
+                INode info(parentid, "", INodeType::INT_DIRINFO);
+                FSResult::FSResult res = this->writeINode(npos, info);
+                if (res != FSResult::E_SUCCESS)
+                {
+                    this->freelist->freeBlock(npos);
+                    return res;
+                }
+                char next[8];
+                this->format->putPos(next, npos);
+                this->fd->writeAt(next, this->format->pos_size, last +
+                                  ((last == pos) ? this->format->off_dir_next : this->format->off_dirinfo_next));
+                slot = npos + this->format->hsize_dirinfo;
             }
-            if (count == DIRECTORY_CHILDREN_MAX - 1 && ccinode != 0)
+
+            char data[4];
+            this->format->putID(data, childid);
+            this->fd->writeAt(data, this->format->id_size, slot);
+            this->adjustDirectoryCount(pos, 1);
+
+            // Add the child to the directory index if there is one.
+            if (this->dirindex->isIndexed(parentid))
             {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
-                return FSResult::E_FAILURE_MAXIMUM_CHILDREN_REACHED;
+                INode cnode = this->getINodeByID(childid);
+                if (cnode.type == INodeType::INT_INVALID)
+                    this->dirindex->drop(parentid);
+                else
+                    this->dirindex->add(parentid, childid, cnode.filename);
             }
-            else
-            {
-                uint32_t writeg = this->fd->tellg();
-                Util::seekp_ex(this->fd, writeg - 2);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&childid), 2);
-
-                uint16_t children_count_current = 0;
-                this->fd->seekg(pos + children_count_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                children_count_current += 1;
-                Util::seekp_ex(this->fd, pos + children_count_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
 
-                // Update times.
-                this->updateTimes(parentid, false, true, true);
+            // Update times.
+            this->updateTimes(parentid, false, true, true);
 
-                return FSResult::E_SUCCESS;
-            }
+            return FSResult::E_SUCCESS;
         }
 
-        FSResult::FSResult FS::removeChildFromDirectoryINode(uint16_t parentid, uint16_t childid)
+        FSResult::FSResult FS::removeChildFromDirectoryINode(uint32_t parentid, uint32_t childid)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int type_offset = 2;
-            signed int children_count_offset = 292;
-            signed int children_offset = 294;
-            uint32_t pos = this->getINodePositionByID(parentid);
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            uint64_t pos = this->getINodePositionByID(parentid);
 
             // Read to make sure it's a directory.
-            uint16_t parent_type = (uint16_t) INodeType::INT_UNSET;
-            this->fd->seekg(pos + type_offset);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&parent_type), 2);
-            if (parent_type != INodeType::INT_DIRECTORY)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            char type[2];
+            if (pos == 0 || this->fd->readAt(type, 2, pos + this->format->off_type) != 2 ||
+                Endian::getU16(type) != INodeType::INT_DIRECTORY)
                 return FSResult::E_FAILURE_NOT_A_DIRECTORY;
-            }
 
-            // Now seek to the start of the list of directory children.
-            this->fd->seekg(pos + children_offset);
-            Util::seekp_ex(this->fd, pos + children_offset);
+            // We're about to modify the directory inode in place.
+            this->inodecache->invalidate(pos);
 
             // Find the slot that the child inode is in.
-            uint16_t ccinode = 0;
-            uint16_t count = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-            while (ccinode != childid && count < DIRECTORY_CHILDREN_MAX - 1)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-                count += 1;
-            }
-            if (count == DIRECTORY_CHILDREN_MAX - 1 && ccinode != childid)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            uint64_t last = 0;
+            uint64_t slot = this->findDirectorySlot(pos, childid, last);
+            if (slot == 0)
                 return FSResult::E_FAILURE_INVALID_FILENAME;
-            }
-            else
-            {
-                uint32_t writeg = this->fd->tellg();
-                Util::seekp_ex(this->fd, writeg - 2);
-                uint16_t zeroid = 0;
-                Endian::doW(this->fd, reinterpret_cast < char *>(&zeroid), 2);
-
-                uint16_t children_count_current = 0;
-                this->fd->seekg(pos + children_count_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                children_count_current -= 1;
-                Util::seekp_ex(this->fd, pos + children_count_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
 
-                // Update times.
-                this->updateTimes(parentid, false, true, true);
+            char data[4];
+            this->format->putID(data, 0);
+            this->fd->writeAt(data, this->format->id_size, slot);
+            this->adjustDirectoryCount(pos, -1);
 
-                return FSResult::E_SUCCESS;
-            }
+            // Remove the child from the directory index.
+            this->dirindex->remove(parentid, childid);
+
+            // Update times.
+            this->updateTimes(parentid, false, true, true);
+
+            return FSResult::E_SUCCESS;
         }
 
-        FSResult::FSResult FS::filenameIsUnique(uint16_t parentid, std::string filename)
+        uint64_t FS::findDirectorySlot(uint64_t pos, uint32_t childid, uint64_t& last)
         {
-            assert( /* Check the stream is not in text-mode. */ this->isValid());
+            const Format* format = this->format;
+            uint32_t hsize = format->hsize_directory;
+            uint32_t slots = format->dir_children;
+            uint32_t noff = format->off_dir_next;
+            uint64_t limit = format->max_id / format->dir_children + 1;
+            char block[BSIZE_DIRECTORY];
+
+            last = 0;
+            while (pos != 0 && limit > 0)
+            {
+                if (this->fd->readAt(block, BSIZE_DIRECTORY, pos) != BSIZE_DIRECTORY)
+                    return 0;
+                last = pos;
+                for (uint32_t i = 0; i < slots; i += 1)
+                    if (format->getID(block + hsize + i * format->id_size) == childid)
+                        return pos + hsize + i * format->id_size;
+
+                // Version 1 directories have no information blocks.
+                if (noff == 0)
+                    break;
+                pos = format->getPos(block + noff);
+                hsize = format->hsize_dirinfo;
+                slots = format->dirinfo_children;
+                noff = format->off_dirinfo_next;
+                limit -= 1;
+            }
+            return 0;
+        }
 
-            std::vector < INode > inodechildren = this->getChildrenOfDirectory(parentid);
-            for (unsigned int i = 0; i < inodechildren.size(); i += 1)
+        void FS::readDirectoryInfoBlocks(uint64_t pos, std::vector < uint32_t >& children)
+        {
+            uint64_t limit = this->format->max_id / this->format->dirinfo_children + 1;
+            char block[BSIZE_DIRECTORY];
+            while (pos != 0 && limit > 0)
             {
-                if (filename == inodechildren[i].filename)
+                INode info;
+                if (this->fd->readAt(block, BSIZE_DIRECTORY, pos) != BSIZE_DIRECTORY ||
+                    !info.readBinaryRepresentation(block, BSIZE_DIRECTORY, *this->format) ||
+                    info.type != INodeType::INT_DIRINFO)
                 {
-                    return FSResult::E_FAILURE_NOT_UNIQUE;
+                    Logging::showWarningW("Directory information block at %llu is not valid.", (unsigned long long) pos);
+                    return;
                 }
+                size_t off = children.size();
+                children.resize(off + this->format->dirinfo_children);
+                this->format->getIDArray(block + this->format->hsize_dirinfo, &children[off], this->format->dirinfo_children);
+                pos = info.dir_next;
+                limit -= 1;
             }
+        }
+
+        void FS::adjustDirectoryCount(uint64_t pos, int32_t amount)
+        {
+            char data[4];
+            uint64_t cpos = pos + this->format->off_dir_count;
+            if (this->fd->readAt(data, this->format->count_size, cpos) != this->format->count_size)
+                return;
+            uint32_t count = this->format->getCount(data) + amount;
+            this->format->putCount(data, count);
+            this->fd->writeAt(data, this->format->count_size, cpos);
+        }
+
+        FSResult::FSResult FS::filenameIsUnique(uint32_t parentid, std::string filename)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            INode cnode = this->getChildOfDirectory(parentid, filename);
+            if (cnode.type != INodeType::INT_INVALID)
+                return FSResult::E_FAILURE_NOT_UNIQUE;
             return FSResult::E_SUCCESS;	// Indicates unique.
         }
 
-        std::vector < INode > FS::getChildrenOfDirectory(uint16_t parentid)
+        std::vector < INode > FS::getChildrenOfDirectory(uint32_t parentid)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             std::vector < INode > inodechildren;
             INode node = this->getINodeByID(parentid);
             if (node.type != INodeType::INT_DIRECTORY)
-            {
                 return inodechildren;
-            }
 
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
+            inodechildren.reserve(node.children_count);
+            this->forEachChildOfDirectory(parentid, [&](const INode& cnode) -> bool
             {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
-                {
+                inodechildren.push_back(cnode);
+                return true;
+            });
+
+            return inodechildren;
+        }
+
+        bool FS::forEachChildOfDirectory(uint32_t parentid, const std::function < bool (const INode&) > &callback)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            INode node = this->getINodeByID(parentid);
+            if (node.type != INodeType::INT_DIRECTORY)
+                return false;
+
+            if (!node.children)
+                return true;
+            const DirectoryChildren& children = *node.children;
+            for (DirectoryChildren::const_iterator i = children.begin(); i != children.end(); i++)
+            {
+                if (*i == 0)
                     continue;
-                }
-                else
-                {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
-                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
-                    {
-                        inodechildren.insert(inodechildren.end(), cnode);
-                    }
-                }
+                INode cnode = this->getINodeByID(*i);
+                if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
+                    if (!callback(cnode))
+                        break;
             }
 
-            return inodechildren;
+            return true;
         }
 
-        INode FS::getChildOfDirectory(uint16_t parentid, uint16_t childid)
+        INode FS::getChildOfDirectory(uint32_t parentid, uint32_t childid)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -582,65 +744,64 @@ namespace AppLib
                 return INode(0, "", INodeType::INT_INVALID);
             }
 
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
+            if (!node.children)
+                return INode(0, "", INodeType::INT_INVALID);
+            const DirectoryChildren& children = *node.children;
+            for (DirectoryChildren::const_iterator i = children.begin(); i != children.end(); i++)
             {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
-                {
+                if (*i == 0)
                     continue;
-                }
-                else
-                {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
-                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
-                    {
-                        if (cnode.inodeid == childid)
-                        {
-                            return cnode;
-                        }
-                    }
-                }
+                INode cnode = this->getINodeByID(*i);
+                if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
+                    if (cnode.inodeid == childid)
+                        return cnode;
             }
 
             return INode(0, "", INodeType::INT_INVALID);
         }
 
-        INode FS::getChildOfDirectory(uint16_t parentid, std::string filename)
+        INode FS::getChildOfDirectory(uint32_t parentid, std::string filename)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
+            // Look the child up in the directory index, building the
+            // index first if this is the first lookup in the directory.
+            if (!this->dirindex->isIndexed(parentid) && !this->indexDirectory(parentid))
+                return INode(0, "", INodeType::INT_INVALID);
+            uint32_t cid = 0;
+            if (!this->dirindex->lookup(parentid, filename, cid))
+                return INode(0, "", INodeType::INT_INVALID);
+            INode cnode = this->getINodeByID(cid);
+            if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
+                if (filename == cnode.filename)
+                    return cnode;
+
+            // The index is out of date with the disk, so drop it and
+            // fall back to scanning the directory.
+            Logging::showWarningW("Directory index for inode %u is stale; rescanning.", parentid);
+            this->dirindex->drop(parentid);
+
             INode node = this->getINodeByID(parentid);
             if (node.type == INodeType::INT_INVALID)
                 return INode(0, "", INodeType::INT_INVALID);
 
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
+            if (!node.children)
+                return INode(0, "", INodeType::INT_INVALID);
+            const DirectoryChildren& children = *node.children;
+            for (DirectoryChildren::const_iterator i = children.begin(); i != children.end(); i++)
             {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
-                {
+                if (*i == 0)
                     continue;
-                }
-                else
-                {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
-                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
-                        if (filename == cnode.filename)
-                            return cnode;
-                }
+                INode cnode = this->getINodeByID(*i);
+                if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
+                    if (filename == cnode.filename)
+                        return cnode;
             }
 
             return INode(0, "", INodeType::INT_INVALID);
         }
 
-        FSResult::FSResult FS::setFileContents(uint16_t id, const char *data, uint32_t len)
+        FSResult::FSResult FS::setFileContents(uint32_t id, const char *data, uint32_t len)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -666,14 +827,14 @@ namespace AppLib
             return FSResult::E_SUCCESS;
         }
 
-        FSResult::FSResult FS::getFileContents(uint16_t id, char **data_out, uint32_t * len_out, uint32_t len_max)
+        FSResult::FSResult FS::getFileContents(uint32_t id, char **data_out, uint32_t * len_out, uint32_t len_max)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             // Our new version of this function is simply going to use
             // the FSFile class.
             FSFile f = this->getFile(id);
-            uint32_t fsize = f.size();
+            uint64_t fsize = f.size();
             *len_out = (fsize < len_max) ? fsize : len_max;
             *data_out = (char *) malloc(*len_out);
 
@@ -695,54 +856,41 @@ namespace AppLib
             return FSResult::E_SUCCESS;
         }
 
-        FSResult::FSResult FS::setFileLengthDirect(uint32_t pos, uint32_t len)
+        FSResult::FSResult FS::setFileLengthDirect(uint64_t pos, uint64_t len)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_blocks_offset = 296;
-            signed int file_len_offset = 298;
-
             this->fd->clear();
 
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
-
             // Get the type directly.
-            uint16_t type_raw = (uint16_t) INodeType::INT_INVALID;
-            this->fd->seekg(pos + 2);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&type_raw), 2);
+            char type[2];
+            if (this->fd->readAt(type, 2, pos + this->format->off_type) != 2)
+                return FSResult::E_FAILURE_INVALID_POSITION;
+            uint16_t type_raw = Endian::getU16(type);
 
             if (type_raw == INodeType::INT_FILEINFO || type_raw == INodeType::INT_SYMLINK)
             {
-                Util::seekp_ex(this->fd, pos + file_len_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&len), 4);
-                Util::seekp_ex(this->fd, pos + file_blocks_offset);
-                uint16_t blocks = ceil(len / (double) BSIZE_FILE);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&blocks), 2);
-                Util::seekp_ex(this->fd, oldp);
-                this->fd->seekg(oldg);
-                this->fd->seekp(oldp);
+                char data[8];
+                this->inodecache->invalidate(pos);
+                this->format->putPos(data, len);
+                this->fd->writeAt(data, this->format->pos_size, pos + this->format->off_file_len);
+                this->format->putCount(data, (uint32_t) ((len + BSIZE_FILE - 1) / BSIZE_FILE));
+                this->fd->writeAt(data, this->format->count_size, pos + this->format->off_file_blocks);
                 return FSResult::E_SUCCESS;
             }
             else
-            {
-                this->fd->seekg(oldg);
                 return FSResult::E_FAILURE_INVALID_POSITION;
-            }
         }
 
-        FSResult::FSResult FS::setFileNextSegmentDirect(uint16_t id, uint32_t pos, uint32_t seg_next)
+        FSResult::FSResult FS::setFileNextSegmentDirect(uint32_t id, uint64_t pos, uint64_t seg_next)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_info_next_offset = 302;
-
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            char data[8];
+            this->format->putPos(data, seg_next);
 
             // Get the base position of the specified inode.
-            uint32_t bpos = this->getINodePositionByID(id);
+            uint64_t bpos = this->getINodePositionByID(id);
             INode node = this->getINodeByPosition(bpos);
             if (node.type != INodeType::INT_FILEINFO && node.type != INodeType::INT_SYMLINK)
             {
@@ -752,119 +900,54 @@ namespace AppLib
             {
                 // We're setting the position of the first segment
                 // in the file.
-                std::streampos oldp = this->fd->tellp();
-                this->fd->seekg(bpos + file_info_next_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&seg_next), 4);
-                this->fd->seekp(oldp);
-                this->fd->seekg(oldg);
+                this->inodecache->invalidate(bpos);
+                this->segmentcache.erase(id);
+                this->fd->writeAt(data, this->format->pos_size, bpos + this->format->off_file_info_next);
                 return FSResult::E_SUCCESS;
             }
 
-            // Now loop through all of the segment positions.
-            bool gnext = false;
-            uint32_t spos = 0;
-            uint32_t ipos = bpos;
-            uint32_t hsize = HSIZE_FILE;
-            while (ipos != 0)
+            // Find the current segment in the segment list.
+            std::shared_ptr < SegmentList > list = this->getFileSegments(id);
+            if (!list)
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            std::vector < uint64_t >::iterator i = std::find(list->blocks.begin(), list->blocks.end(), pos);
+            if (i == list->blocks.end() || i + 1 == list->blocks.end())
             {
-                for (int i = hsize; i < BSIZE_FILE; i += 4)
-                {
-                    this->fd->seekg(bpos + i);
-                    spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                    if (spos == 0)
-                    {
-                        // End of segment list.  Return 0.
-                        return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
-                    }
-                    else if (spos == pos)
-                    {
-                        // Matched, we need to fetch the next one.
-                        gnext = true;
-                    }
-                    else if (gnext)
-                    {
-                        // Replace the segment value.
-                        std::streampos oldp = this->fd->tellp();
-                        this->fd->seekp(bpos + i);
-                        Endian::doW(this->fd, reinterpret_cast < char *>(&seg_next), 4);
-                        this->fd->seekp(oldp);
-                        this->fd->seekg(oldg);
-                        return FSResult::E_SUCCESS;
-                    }
-                }
-                hsize = HSIZE_SEGINFO;
-                INode inode = this->getINodeByPosition(ipos);
-                if (inode.type != INodeType::INT_SEGINFO)
-                    break;
-                ipos = inode.info_next;
+                // Unable to locate the current segment (or the segment
+                // after it) within the specified file ID.
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
             }
 
-            // Unable to locate the current segment within the
-            // specified file ID.
-            this->fd->seekg(oldg);
-            return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            // Replace the segment value.
+            uint64_t index = (i - list->blocks.begin()) + 1;
+            this->fd->writeAt(data, this->format->pos_size, list->getSlotPosition(index));
+            if (seg_next == 0)
+                list->blocks.resize(index);
+            else
+                list->blocks[index] = seg_next;
+            return FSResult::E_SUCCESS;
         }
 
-        uint32_t FS::getFileNextBlock(uint16_t id, uint32_t pos)
+        uint64_t FS::getFileNextBlock(uint32_t id, uint64_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            std::shared_ptr < SegmentList > list = this->getFileSegments(id);
+            if (!list)
+                return 0;
 
-            // Get the base position of the specified inode.
-            uint32_t bpos = this->getINodePositionByID(id);
+            // Find the current segment and return the one after it.
+            std::vector < uint64_t >::iterator i = std::find(list->blocks.begin(), list->blocks.end(), pos);
+            if (i == list->blocks.end() || i + 1 == list->blocks.end())
+                return 0;
+            return *(i + 1);
+        }
+
+        FSResult::FSResult FS::resetBlock(uint64_t pos)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Now loop through all of the segment positions.
-            bool gnext = false;
-            uint32_t spos = 0;
-            uint32_t ipos = bpos;
-            uint32_t hsize = HSIZE_FILE;
-            while (ipos != 0)
-            {
-                for (int i = hsize; i < BSIZE_FILE; i += 4)
-                {
-                    this->fd->seekg(bpos + i);
-                    spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                    if (spos == 0)
-                    {
-                        // End of segment list.  Return 0.
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
-                    else if (spos == pos)
-                    {
-                        // Matched, we need to fetch the next one.
-                        gnext = true;
-                    }
-                    else if (gnext)
-                    {
-                        // Return the next segment value.
-                        this->fd->seekg(oldg);
-                        return spos;
-                    }
-                }
-                hsize = HSIZE_SEGINFO;
-                INode inode = this->getINodeByPosition(ipos);
-                if (inode.type != INodeType::INT_SEGINFO)
-                    break;
-                ipos = inode.info_next;
-            }
-
-            // Unable to locate the current segment within the
-            // specified file ID.
-            this->fd->seekg(oldg);
-            return 0;
-        }
-
-        FSResult::FSResult FS::resetBlock(uint32_t pos)
-        {
-            assert( /* Check the stream is not in text-mode. */ this->isValid());
-
-            if (this->freelist->isBlockFree(pos) || pos % 4096 != 0)
+            if (this->freelist->isBlockFree(pos) || pos % 4096 != 0)
             {
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
             }
@@ -882,74 +965,46 @@ namespace AppLib
 
             // Block must be marked as unused through the
             // free list allocation class.
+            this->inodecache->invalidate(pos);
             this->freelist->freeBlock(pos);
 
             return FSResult::E_SUCCESS;
         }
 
-        uint32_t FS::resolvePositionInFile(uint16_t inodeid, uint32_t pos)
+        FSResult::FSResult FS::resetDirectoryInfoBlocks(uint64_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
-
-            // Get the base position of the specified inode.
-            uint32_t bpos = this->getINodePositionByID(inodeid);
+            INode node = this->getINodeByRealPosition(pos);
+            if (node.type != INodeType::INT_DIRECTORY)
+                return FSResult::E_FAILURE_NOT_A_DIRECTORY;
 
-            // Now loop through all of the segment positions.
-            uint32_t bcount = 0;
-            uint32_t spos = 0;
-            uint32_t ipos = bpos;
-            uint32_t hsize = HSIZE_FILE;
-            while (ipos != 0)
+            uint64_t ipos = node.dir_next;
+            uint64_t limit = this->format->max_id / this->format->dirinfo_children + 1;
+            char data[8];
+            while (ipos != 0 && limit > 0 && !this->freelist->isBlockFree(ipos))
             {
-                for (int i = hsize; i < BSIZE_FILE; i += 4)
-                {
-                    this->fd->seekg(bpos + i);
-                    spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                    if (spos == 0)
-                    {
-                        // Invalid segment position (i.e. there are
-                        // no more segments available).
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
-
-                    if (bcount < pos && bcount + 4096 < pos)
-                    {
-                        // We haven't reached our target block yet.
-                        bcount += 4096;
-                        continue;
-                    }
-                    else if (bcount < pos && bcount + 4096 > pos)
-                    {
-                        // This is our target block.
-                        this->fd->seekg(oldg);
-                        return spos + (pos - bcount);
-                    }
-                    else
-                    {
-                        // We're past our target block.
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
-                }
-                hsize = HSIZE_SEGINFO;
-                INode inode = this->getINodeByPosition(ipos);
-                if (inode.type != INodeType::INT_SEGINFO)
-                    break;
-                ipos = inode.info_next;
+                uint64_t next = 0;
+                if (this->fd->readAt(data, this->format->pos_size, ipos + this->format->off_dirinfo_next) == this->format->pos_size)
+                    next = this->format->getPos(data);
+                this->resetBlock(ipos);
+                ipos = next;
+                limit -= 1;
             }
+            return FSResult::E_SUCCESS;
+        }
 
-            // Unable to locate the position within the file.
-            this->fd->seekg(oldg);
-            return 0;
+        uint64_t FS::resolvePositionInFile(uint32_t inodeid, uint64_t pos)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            std::shared_ptr < SegmentList > list = this->getFileSegments(inodeid);
+            if (!list)
+                return 0;
+            return list->resolve(pos);
         }
 
-        int32_t FS::resolvePathnameToINodeID(std::string path)
+        int64_t FS::resolvePathnameToINodeID(std::string path)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -976,7 +1031,7 @@ namespace AppLib
                 buf = "";
             }
 
-            uint16_t id = 0;
+            uint32_t id = 0;
             for (int i = 0; i < components.size(); i += 1)
             {
                 if (components[i] == ".")
@@ -999,7 +1054,7 @@ namespace AppLib
             return id;
         }
 
-        FSResult::FSResult FS::truncateFile(uint16_t inodeid, uint32_t len)
+        FSResult::FSResult FS::truncateFile(uint32_t inodeid, uint64_t len)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -1008,7 +1063,7 @@ namespace AppLib
             std::streampos oldp = this->fd->tellp();
 
             // Get the base position of the specified inode.
-            uint32_t bpos = this->getINodePositionByID(inodeid);
+            uint64_t bpos = this->getINodePositionByID(inodeid);
 
             // Then get the INode and find out the data length.
             INode node = this->getINodeByPosition(bpos);
@@ -1018,310 +1073,664 @@ namespace AppLib
 
             if (node.dat_len == len)
                 return FSResult::E_SUCCESS;
-            else if (node.dat_len > len)
-            {
-                // We need to delete blocks at the end of the file.
-                // Calculate the number of blocks to delete.
-                uint16_t blocks_to_delete = node.blocks - ceil(len / (double) BSIZE_FILE);
-
-                // Now loop through all of the segment positions.
-                uint32_t bcount = 0;
-                uint32_t spos = 0;
-                uint32_t ipos = bpos;
-                uint32_t hsize = HSIZE_FILE;
-                while (ipos != 0)
-                {
-                    for (int i = hsize; i < BSIZE_FILE; i += 4)
-                    {
-                        this->fd->seekg(bpos + i);
-                        spos = 0;
-                        Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                        if (spos == 0)
-                        {
-                            // We've run out of segments to erase.
-                            ipos = 0;	// Make it jump out of the while() loop.
-                            break;
-                        }
-
-                        if (bcount >= node.blocks - blocks_to_delete)
-                        {
-                            // First remove the block from the file segment list.
-                            uint32_t zeropos = 0;
-                            this->fd->seekp(bpos + i);
-                            Endian::doW(this->fd, reinterpret_cast < char *>(&zeropos), 4);
-
-                            // Next use resetBlock to erase the data in it (this also
-                            // frees it in the FreeList).
-                            this->resetBlock(spos);
-                        }
-
-                        bcount += 1;
-                    }
-                    if (ipos != 0)
-                    {
-                        hsize = HSIZE_SEGINFO;
-                        INode inode = this->getINodeByPosition(ipos);
-                        if (inode.type != INodeType::INT_SEGINFO)
-                        {
-                            this->fd->seekg(oldg);
-                            this->fd->seekp(oldp);
-                            return FSResult::E_FAILURE_INODE_NOT_VALID;
-                        }
-                        ipos = inode.info_next;
-                    }
-                }
 
-                // Now set the file's data length.
-                FSResult::FSResult res = this->setFileLengthDirect(bpos, len);
-                if (res != FSResult::E_SUCCESS)
-                    return res;
+            // Get the segment list for the file.
+            std::shared_ptr < SegmentList > list = this->getFileSegments(inodeid);
+            if (!list)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            uint64_t count = (len + BSIZE_FILE - 1) / BSIZE_FILE;
+            char data[8];
 
-                // Now free up any segment list blocks.
-                res = this->allocateInfoListBlocks(bpos, len);
+            // A compressed extent can't be cut short or extended in place,
+            // so the one that the end of the file falls in is expanded.
+            uint64_t boundary = std::min < uint64_t > (node.dat_len, len);
+            if (boundary % EXTENT_SIZE != 0 && list->isCompressed(boundary / BSIZE_FILE))
+            {
+                FSResult::FSResult res = this->expandExtent(inodeid, boundary / EXTENT_SIZE);
                 if (res != FSResult::E_SUCCESS)
                     return res;
-
-                // We successfully truncated the file.
-                this->fd->seekg(oldg);
-                this->fd->seekp(oldp);
-                return FSResult::E_SUCCESS;
+                list = this->getFileSegments(inodeid);
+                if (!list)
+                    return FSResult::E_FAILURE_INODE_NOT_VALID;
             }
-            else if (node.dat_len < len)
+
+            // Delete any blocks at the end of the file that are no
+            // longer needed.
+            for (uint64_t i = count; i < list->blocks.size(); i += 1)
             {
-                // Allocate new segment list blocks before we
-                // attempt to cycle through / store data in them.
-                FSResult::FSResult res = this->allocateInfoListBlocks(bpos, len);
-                if (res != FSResult::E_SUCCESS)
-                    return res;
+                // First remove the block from the file segment list.
+                this->format->putPos(data, 0);
+                this->fd->writeAt(data, this->format->pos_size, list->getSlotPosition(i));
 
-                // We need to add blocks at the end of the file.
-                // Calculate the number of blocks to add.
-                uint16_t blocks_to_add = ceil(len / (double) BSIZE_FILE) - node.blocks;
+                // Next free the block, unless other files still share it.
+                this->releaseDataBlock(list->blocks[i]);
+            }
+            if (list->blocks.size() > count)
+                list->blocks.resize(count);
 
-                // Now loop through all of the segment positions.
-                uint32_t bcount = 0;
-                uint32_t spos = 0;
-                uint32_t ipos = bpos;
-                uint32_t hsize = HSIZE_FILE;
-                while (ipos != 0)
+            // Zero what is left of the last block past the new end, so
+            // that it reads back as zeros if the file grows again.
+            if (len < node.dat_len && len % BSIZE_FILE != 0 && count <= list->blocks.size())
+            {
+                if (list->isShared(count - 1))
                 {
-                    for (int i = hsize; i < BSIZE_FILE; i += 4)
-                    {
-                        this->fd->seekg(bpos + i);
-                        spos = 0;
-                        Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                        if (spos != 0)
-                        {
-                            // We don't want to touch this position since it already
-                            // points to an existing segment.
-                            continue;
-                        }
-
-                        if (bcount < blocks_to_add)
-                        {
-                            // Allocate a new block.
-                            uint32_t npos = this->freelist->allocateBlock();
-
-                            // Now add it to the file segment list.
-                            this->fd->seekp(bpos + i);
-                            Endian::doW(this->fd, reinterpret_cast < char *>(&npos), 4);
-                        }
-                        else
-                        {
-                            ipos = 0;
-                            break;
-                        }
-
-                        bcount += 1;
-                    }
-                    if (ipos != 0)
-                    {
-                        hsize = HSIZE_SEGINFO;
-                        INode inode = this->getINodeByPosition(ipos);
-                        if (inode.type != INodeType::INT_SEGINFO)
-                        {
-                            this->fd->seekg(oldg);
-                            this->fd->seekp(oldp);
-                            return FSResult::E_FAILURE_INODE_NOT_VALID;
-                        }
-                        ipos = inode.info_next;
-                    }
+                    FSResult::FSResult res = this->unshareBlock(inodeid, count - 1);
+                    if (res != FSResult::E_SUCCESS)
+                        return res;
                 }
+                uint64_t dpos = list->getPosition(count - 1);
+                uint32_t tail = BSIZE_FILE - len % BSIZE_FILE;
+                std::vector < char > zeros(tail, '\0');
+                if (dpos != 0)
+                    this->fd->writeDataAt(&zeros[0], tail, dpos + len % BSIZE_FILE);
+            }
 
-                // Now set the file's data length.
-                res = this->setFileLengthDirect(bpos, len);
-                if (res != FSResult::E_SUCCESS)
-                    return res;
+            // Allocate or free segment list blocks so that there
+            // is room for exactly as many segments as we need.
+            FSResult::FSResult res = this->allocateInfoListBlocks(bpos, len);
+            if (res != FSResult::E_SUCCESS)
+            {
+                this->fd->seekg(oldg);
+                this->fd->seekp(oldp);
+                return res;
+            }
 
-                // We successfully truncated the file.
+            // Add any new blocks that are needed at the end of the file,
+            // allocating them together so that they are laid out
+            // contiguously where possible.
+            std::vector < uint64_t > npos;
+            uint64_t reused = 0;
+            bool allocated = true;
+            if (list->blocks.size() < count)
+                allocated = this->freelist->allocateBlocks(count - list->blocks.size(), npos, &reused);
+
+            // Freed blocks keep their old contents, so clear them before
+            // they become part of the file, a run of blocks at a time.
+            std::vector < char > zeros(reused == 0 ? 0 : EXTENT_SIZE, '\0');
+            for (size_t i = 0; i < reused; )
+            {
+                size_t run = 1;
+                while (i + run < reused && run < EXTENT_BLOCKS &&
+                       npos[i + run] == npos[i] + run * BSIZE_FILE)
+                    run += 1;
+                this->fd->writeDataAt(&zeros[0], run * BSIZE_FILE, npos[i]);
+                i += run;
+            }
+            for (std::vector < uint64_t >::iterator i = npos.begin(); i != npos.end(); i++)
+            {
+                // Now add it to the file segment list.
+                this->format->putPos(data, *i);
+                this->fd->writeAt(data, this->format->pos_size, list->getSlotPosition(list->blocks.size()));
+                list->blocks.push_back(*i);
+            }
+            if (!allocated)
+            {
                 this->fd->seekg(oldg);
                 this->fd->seekp(oldp);
-                return FSResult::E_SUCCESS;
+                return FSResult::E_FAILURE_GENERAL;
             }
 
-            // Impossible to get here?
-            return FSResult::E_FAILURE_UNKNOWN;
+            // Now set the file's data length.
+            res = this->setFileLengthDirect(bpos, len);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+
+            // We successfully truncated the file.
+            this->fd->seekg(oldg);
+            this->fd->seekp(oldp);
+            return FSResult::E_SUCCESS;
         }
 
-        FSResult::FSResult FS::allocateInfoListBlocks(uint32_t pos, uint32_t len)
+        FSResult::FSResult FS::allocateInfoListBlocks(uint64_t pos, uint64_t len)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_info_next_offset = 302;
-            signed int info_info_next_offset = 4;
-            signed int segments_in_file_block = (BSIZE_FILE - HSIZE_FILE) / 4;
-            signed int segments_in_info_block = (BSIZE_FILE - HSIZE_SEGINFO) / 4;
+            uint32_t file_info_next_offset = this->format->off_file_info_next;
+            uint32_t info_info_next_offset = this->format->off_seginfo_next;
+            char data[8];
+
+            // Get the INode.
+            INode node = this->getINodeByRealPosition(pos);
+            if (node.type != INodeType::INT_FILEINFO &&
+                node.type != INodeType::INT_SYMLINK)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            std::shared_ptr < SegmentList > list = this->getFileSegments(node.inodeid);
+            if (!list)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
 
             // Store the current positions.
             std::streampos oldg = this->fd->tellg();
             std::streampos oldp = this->fd->tellp();
 
-            // Get the INode.
-            INode node = this->getINodeByPosition(pos);
-            // TODO: Verify type of INode.
+            // Calculate how many info list blocks we need to address all
+            // of the data in the file, and how many are allocated now.
+            uint64_t tilcount = list->getInfoBlocksNeeded((len + BSIZE_FILE - 1) / BSIZE_FILE);
+            uint64_t cilcount = list->infos.size() - 1;
 
-            // First calculate the number of segment info 'markers' we need to
-            // address data in the entire file.
-            uint32_t mcount = len / BSIZE_FILE;
+            // Free up any blocks we don't need, starting from the
+            // end of the list.
+            while (tilcount < cilcount)
+            {
+                uint64_t dpos = list->infos[list->infos.size() - 1];
+                uint64_t ppos = list->infos[list->infos.size() - 2];
+                uint32_t poff = (list->infos.size() == 2) ? file_info_next_offset : info_info_next_offset;
 
-            // Subtract the number that can be addressed in the file block as we're
-            // only interested in the number of additional blocks.
-            if (mcount > segments_in_file_block)
-                mcount -= segments_in_file_block;
-            else
-                mcount = 0;
+                // Erase the link from the previous info block to this one.
+                this->inodecache->invalidate(ppos);
+                this->format->putPos(data, 0);
+                this->fd->writeAt(data, this->format->pos_size, ppos + poff);
 
-            // Do the same for the current number of segment allocated.
-            uint32_t ccount = node.blocks;
-            if (ccount > segments_in_file_block)
-                ccount -= segments_in_file_block;
-            else
-                ccount = 0;
-
-            // Calculate how many *additional* info list blocks we'd need to
-            // index all of the file, as well as how many info blocks are
-            // currently being used.
-            uint32_t tilcount = 0;
-            uint32_t cilcount = 0;
-            for (uint32_t i = 0; i < mcount; i += segments_in_info_block)
-                tilcount += 1;
-            for (uint32_t i = 0; i < ccount; i += segments_in_file_block)
+                // Now erase the block.
+                this->resetBlock(dpos);
+
+                list->infos.pop_back();
+                cilcount -= 1;
+            }
+
+            // Allocate as many blocks as we need.
+            while (tilcount > cilcount)
+            {
+                // Get a new block and mark it as a segment info block.
+                uint64_t npos = this->freelist->allocateBlock();
+                if (npos == 0)
+                {
+                    this->fd->seekg(oldg);
+                    this->fd->seekp(oldp);
+                    return FSResult::E_FAILURE_GENERAL;
+                }
+                INode inode(0, "", INodeType::INT_SEGINFO);
+                FSResult::FSResult res = this->writeINode(npos, inode);
+                if (res != FSResult::E_SUCCESS)
+                {
+                    this->fd->seekg(oldg);
+                    this->fd->seekp(oldp);
+                    return res;
+                }
+
+                // Set a link from the previous block to the new one.
+                uint64_t ppos = list->infos[list->infos.size() - 1];
+                uint32_t poff = (list->infos.size() == 1) ? file_info_next_offset : info_info_next_offset;
+                this->inodecache->invalidate(ppos);
+                this->format->putPos(data, npos);
+                this->fd->writeAt(data, this->format->pos_size, ppos + poff);
+
+                list->infos.push_back(npos);
                 cilcount += 1;
+            }
 
-            // Determine whether we need to increase, decrease or leave the
-            // number of allocated blocks the same.
-            if (tilcount == cilcount)
-                return FSResult::E_SUCCESS;
-            else if (tilcount < cilcount)
-            {
-                // Free up some blocks.  First loop through and build
-                // a vector list of all of the positions of the info
-                // list blocks (as there is no way to reverse through
-                // the list using I/O).
-                std::vector < uint32_t > list_positions;
-                uint32_t lpos = 0;
-                this->fd->seekg(pos + file_info_next_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
-                while (lpos != 0)
+            // If blocks were addressed from the info blocks we just freed,
+            // the list no longer matches the disk.
+            if (list->blocks.size() > 0 && list->getSlotPosition(list->blocks.size() - 1) == 0)
+                this->segmentcache.erase(node.inodeid);
+
+            this->fd->seekg(oldg);
+            this->fd->seekp(oldp);
+            return FSResult::E_SUCCESS;
+        }
+
+        std::shared_ptr < SegmentList > FS::getFileSegments(uint32_t inodeid)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            const Format* format = this->format;
+
+            {
+                std::lock_guard < std::mutex > guard(this->segmentlock);
+                std::unordered_map < uint32_t, std::shared_ptr < SegmentList > >::iterator c = this->segmentcache.find(inodeid);
+                if (c != this->segmentcache.end())
+                    return c->second;
+            }
+
+            uint64_t bpos = this->getINodePositionByID(inodeid);
+            if (bpos == 0)
+                return std::shared_ptr < SegmentList > ();
+            INode node = this->getINodeByRealPosition(bpos);
+            if (node.type != INodeType::INT_FILEINFO &&
+                node.type != INodeType::INT_SYMLINK)
+                return std::shared_ptr < SegmentList > ();
+
+            // Read each block of the segment list in one go, collecting
+            // data block positions until we have enough to cover the file
+            // and info block positions until the end of the chain.
+            std::shared_ptr < SegmentList > list(new SegmentList(format));
+            uint64_t count = (node.dat_len + BSIZE_FILE - 1) / BSIZE_FILE;
+            uint64_t limit = list->getInfoBlocksNeeded(format->max_file_size / BSIZE_FILE + 1);
+            uint64_t ipos = bpos;
+            uint32_t hsize = format->hsize_file;
+            uint32_t noff = format->off_file_info_next;
+            bool sparse = (node.flags & INodeFlag::INF_COMPRESSED) != 0;
+            bool ended = false;
+            char block[BSIZE_FILE];
+            while (ipos != 0 && list->infos.size() <= limit)
+            {
+                list->infos.push_back(ipos);
+                if (this->fd->readAt(block, BSIZE_FILE, ipos) != BSIZE_FILE)
+                    break;
+                for (uint32_t i = hsize; i + format->pos_size <= BSIZE_FILE && !ended; i += format->pos_size)
                 {
-                    list_positions.insert(list_positions.begin(), lpos);
-                    this->fd->seekg(lpos + info_info_next_offset);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
+                    uint64_t spos = format->getPos(block + i);
+                    if ((spos == 0 && !sparse) || list->blocks.size() >= count)
+                        ended = true;
+                    else
+                        list->blocks.push_back(spos);
                 }
+                ipos = format->getPos(block + noff);
+                hsize = format->hsize_seginfo;
+                noff = format->off_seginfo_next;
+            }
 
-                // Now delete the info list blocks.
-                while (tilcount < cilcount)
+            std::lock_guard < std::mutex > guard(this->segmentlock);
+            if (this->segmentcache.size() >= SEGMENT_CACHE_SIZE)
+                this->segmentcache.clear();
+            this->segmentcache.insert(std::make_pair(inodeid, list));
+            return list;
+        }
+
+        FSResult::FSResult FS::compressFile(uint32_t inodeid, unsigned int threads)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            if (this->format->off_flags == 0 || !Compression::isAvailable())
+                return FSResult::E_FAILURE_NOT_IMPLEMENTED;
+
+            uint64_t bpos = this->getINodePositionByID(inodeid);
+            if (bpos == 0)
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            INode node = this->getINodeByRealPosition(bpos);
+            if (node.type != INodeType::INT_FILEINFO)
+                return FSResult::E_FAILURE_NOT_A_FILE;
+            std::shared_ptr < SegmentList > list = this->getFileSegments(inodeid);
+            if (!list)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+
+            // Extents are read a batch at a time, compressed with one
+            // thread per extent, and then written back in order.
+            struct Pending
+            {
+                uint64_t first;
+                uint64_t n;
+                uint64_t len;
+                std::vector < char > raw;
+                std::vector < char > packed;
+                CompressionCodec::CompressionCodec codec;
+                bool ok;
+            };
+            std::vector < Pending > batch;
+            batch.reserve(std::max(threads, 1u));
+            FSResult::FSResult res = FSResult::E_SUCCESS;
+            bool compressed = false;
+            char data[8];
+
+            auto store = [&]() -> FSResult::FSResult
+            {
+                std::vector < std::thread > workers;
+                for (size_t w = 1; w < batch.size(); w += 1)
+                    workers.push_back(std::thread([&batch, w]()
+                    {
+                        Pending& p = batch[w];
+                        p.ok = Compression::compress(&p.raw[0], p.len, p.packed, p.codec);
+                    }));
+                batch[0].ok = Compression::compress(&batch[0].raw[0], batch[0].len, batch[0].packed, batch[0].codec);
+                for (std::vector < std::thread >::iterator t = workers.begin(); t != workers.end(); t++)
+                    t->join();
+
+                for (std::vector < Pending >::iterator p = batch.begin(); p != batch.end(); p++)
                 {
-                    uint32_t dpos = list_positions[list_positions.size() - 1];
-                    uint32_t ppos = 0;
-                    uint32_t poff = 0;
-                    if (list_positions.size() == 1)
+                    // Extents that wouldn't take fewer blocks are left alone.
+                    if (!p->ok)
+                        continue;
+                    uint64_t k = (HSIZE_EXTENT + p->packed.size() + BSIZE_FILE - 1) / BSIZE_FILE;
+                    if (k >= p->n)
+                        continue;
+
+                    // Write the compressed extent over its first k blocks.
+                    std::vector < char > stored(k * BSIZE_FILE, 0);
+                    Endian::putU32(&stored[0], (uint32_t) p->packed.size());
+                    Endian::putU16(&stored[4], (uint16_t) p->codec);
+                    memcpy(&stored[HSIZE_EXTENT], &p->packed[0], p->packed.size());
+                    for (uint64_t i = 0; i < k; i += 1)
+                        this->fd->writeAt(&stored[i * BSIZE_FILE], BSIZE_FILE, list->blocks[p->first + i]);
+
+                    // Then tag the extent and release the rest of its blocks.
+                    this->format->putPos(data, list->blocks[p->first] | SEGMENT_COMPRESSED);
+                    this->fd->writeAt(data, this->format->pos_size, list->getSlotPosition(p->first));
+                    this->format->putPos(data, 0);
+                    for (uint64_t i = k; i < p->n; i += 1)
                     {
-                        ppos = pos;
-                        poff = file_info_next_offset;
+                        this->fd->writeAt(data, this->format->pos_size, list->getSlotPosition(p->first + i));
+                        this->resetBlock(list->blocks[p->first + i]);
                     }
-                    else
+                    compressed = true;
+                    if (this->fd->fail())
                     {
-                        ppos = list_positions[list_positions.size() - 2];
-                        poff = info_info_next_offset;
+                        this->fd->clear();
+                        return FSResult::E_FAILURE_GENERAL;
                     }
+                }
+                batch.clear();
+                return FSResult::E_SUCCESS;
+            };
 
-                    // Erase the link from the previous info block to this one.
-                    this->fd->seekp(ppos + poff);
-                    uint32_t zeropos = 0;
-                    Endian::doW(this->fd, reinterpret_cast < char *>(&zeropos), 4);
+            for (uint64_t first = 0; first < list->blocks.size() && res == FSResult::E_SUCCESS; first += EXTENT_BLOCKS)
+            {
+                if (list->isCompressed(first))
+                {
+                    compressed = true;
+                    continue;
+                }
 
-                    // Now erase the block.
-                    this->resetBlock(dpos);
+                // Extents holding shared blocks are already stored once.
+                uint64_t n = std::min < uint64_t > (EXTENT_BLOCKS, list->blocks.size() - first);
+                bool shared = false;
+                for (uint64_t i = 0; i < n; i += 1)
+                    shared = shared || list->isShared(first + i);
+                if (shared)
+                    continue;
 
-                    cilcount -= 1;
+                // Read the whole extent.
+                batch.push_back(Pending());
+                Pending& p = batch.back();
+                p.first = first;
+                p.n = n;
+                p.len = std::min < uint64_t > (EXTENT_SIZE, node.dat_len - first * BSIZE_FILE);
+                p.raw.resize(EXTENT_SIZE);
+                for (uint64_t i = 0; i < n && res == FSResult::E_SUCCESS; i += 1)
+                {
+                    uint64_t blen = std::min < uint64_t > (BSIZE_FILE, p.len - i * BSIZE_FILE);
+                    if (this->fd->readAt(&p.raw[i * BSIZE_FILE], blen, list->blocks[first + i]) != (std::streamsize) blen)
+                        res = FSResult::E_FAILURE_GENERAL;
                 }
+                if (res == FSResult::E_SUCCESS && batch.size() >= std::max(threads, 1u))
+                    res = store();
+            }
+            if (res == FSResult::E_SUCCESS && !batch.empty())
+                res = store();
+
+            // The segment list now has gaps, which are only read back
+            // if the inode is marked as compressed.
+            this->segmentcache.erase(inodeid);
+            if (compressed && (node.flags & INodeFlag::INF_COMPRESSED) == 0)
+            {
+                node.flags |= INodeFlag::INF_COMPRESSED;
+                FSResult::FSResult ures = this->updateINode(node);
+                if (res == FSResult::E_SUCCESS)
+                    res = ures;
+            }
+            return res;
+        }
+
+        FSResult::FSResult FS::expandExtent(uint32_t inodeid, uint64_t extent)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
 
+            std::shared_ptr < SegmentList > list = this->getFileSegments(inodeid);
+            if (!list)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            uint64_t first = extent * EXTENT_BLOCKS;
+            if (!list->isCompressed(first))
                 return FSResult::E_SUCCESS;
+            INode node = this->getINodeByRealPosition(list->infos[0]);
+            uint64_t n = std::min < uint64_t > (EXTENT_BLOCKS, list->blocks.size() - first);
+            uint64_t len = std::min < uint64_t > (EXTENT_SIZE, node.dat_len - first * BSIZE_FILE);
+
+            std::vector < char > raw(EXTENT_SIZE, 0);
+            FSResult::FSResult res = this->readExtent(*list, extent, len, &raw[0]);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+
+            // Allocate blocks for the part of the extent that had none.
+            uint64_t missing = 0;
+            for (uint64_t i = 0; i < n; i += 1)
+                if (list->blocks[first + i] == 0)
+                    missing += 1;
+            std::vector < uint64_t > npos;
+            if (missing > 0 && !this->freelist->allocateBlocks(missing, npos))
+                return FSResult::E_FAILURE_GENERAL;
+
+            // Write the data out uncompressed, and then the positions of
+            // its blocks (which removes the tag from the first).
+            char data[8];
+            std::vector < uint64_t >::iterator next = npos.begin();
+            for (uint64_t i = 0; i < n; i += 1)
+            {
+                uint64_t dpos = list->blocks[first + i] & ~(uint64_t) SEGMENT_FLAGS_MASK;
+                if (dpos == 0)
+                    dpos = *next++;
+                this->fd->writeDataAt(&raw[i * BSIZE_FILE], BSIZE_FILE, dpos);
+                this->format->putPos(data, dpos);
+                this->fd->writeAt(data, this->format->pos_size, list->getSlotPosition(first + i));
             }
-            else if (tilcount > cilcount)
-            {
-                // Allocate some blocks.  Fetch the position of the last
-                // allocated block.
-                uint32_t lpos = 0;
-                uint32_t ppos = 0;
-                this->fd->seekg(pos + file_info_next_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
-                while (lpos != 0)
+            this->segmentcache.erase(inodeid);
+            if (this->fd->fail())
+            {
+                this->fd->clear();
+                return FSResult::E_FAILURE_GENERAL;
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::readExtent(const SegmentList& list, uint64_t extent, uint64_t len, char *out)
+        {
+            uint64_t first = extent * EXTENT_BLOCKS;
+            if (!list.isCompressed(first) || len > EXTENT_SIZE)
+                return FSResult::E_FAILURE_INVALID_POSITION;
+
+            // Read the header and then the blocks holding the rest.
+            char header[HSIZE_EXTENT];
+            uint64_t bpos = list.blocks[first] & ~(uint64_t) SEGMENT_FLAGS_MASK;
+            if (this->fd->readAt(header, HSIZE_EXTENT, bpos) != HSIZE_EXTENT)
+                return FSResult::E_FAILURE_GENERAL;
+            uint32_t clen = Endian::getU32(header);
+            uint16_t codec = Endian::getU16(header + 4);
+            uint64_t stored = HSIZE_EXTENT + (uint64_t) clen;
+            if (stored > EXTENT_SIZE)
+                return FSResult::E_FAILURE_GENERAL;
+            std::vector < char > data(stored);
+            for (uint64_t i = 0; i * BSIZE_FILE < stored; i += 1)
+            {
+                if (first + i >= list.blocks.size())
+                    return FSResult::E_FAILURE_GENERAL;
+                uint64_t dpos = list.blocks[first + i] & ~(uint64_t) SEGMENT_FLAGS_MASK;
+                uint64_t blen = std::min < uint64_t > (BSIZE_FILE, stored - i * BSIZE_FILE);
+                if (dpos == 0 || this->fd->readAt(&data[i * BSIZE_FILE], blen, dpos) != (std::streamsize) blen)
+                    return FSResult::E_FAILURE_GENERAL;
+            }
+
+            if (!Compression::decompress(codec, &data[HSIZE_EXTENT], clen, out, len))
+            {
+                Logging::showErrorW("Unable to decompress extent %llu of the file at %llu.",
+                                    (unsigned long long) extent, (unsigned long long) list.infos[0]);
+                return FSResult::E_FAILURE_GENERAL;
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::deduplicateFile(uint32_t inodeid)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            if (!this->blockindex->isAvailable())
+                return FSResult::E_FAILURE_NOT_IMPLEMENTED;
+
+            uint64_t bpos = this->getINodePositionByID(inodeid);
+            if (bpos == 0)
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            INode node = this->getINodeByRealPosition(bpos);
+            if (node.type != INodeType::INT_FILEINFO)
+                return FSResult::E_FAILURE_NOT_A_FILE;
+            std::shared_ptr < SegmentList > list = this->getFileSegments(inodeid);
+            if (!list)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+
+            char block[BSIZE_FILE];
+            char data[8];
+            for (uint64_t i = 0; i < list->blocks.size(); i += 1)
+            {
+                uint64_t dpos = list->getPosition(i);
+                if (dpos == 0 || list->isShared(i) || list->isCompressed(i))
+                    continue;
+
+                // Whole blocks are compared, so the zeros past the end of
+                // the file are part of the last block's contents.
+                if (this->fd->readAt(block, BSIZE_FILE, dpos) != BSIZE_FILE)
                 {
-                    ppos = lpos;
-                    this->fd->seekg(lpos + info_info_next_offset);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
+                    this->fd->clear();
+                    return FSResult::E_FAILURE_GENERAL;
                 }
-
-                // Now allocate as many blocks as we need.
-                while (tilcount > cilcount)
+                uint32_t hash = BlockIndex::hashBlock(block);
+                uint64_t spos = this->blockindex->findBlock(hash, block);
+                if (spos != 0)
+                {
+                    // Point the segment at the shared copy and free ours.
+                    this->blockindex->addReference(spos);
+                    this->resetBlock(dpos);
+                }
+                else
                 {
-                    // Get a new block.
-                    uint32_t npos = this->freelist->allocateBlock();
+                    // Offer this block to any later duplicates.
+                    if (!this->blockindex->addBlock(dpos, hash))
+                        return FSResult::E_FAILURE_GENERAL;
+                    spos = dpos;
+                }
+                this->format->putPos(data, spos | SEGMENT_SHARED);
+                this->fd->writeAt(data, this->format->pos_size, list->getSlotPosition(i));
+                list->blocks[i] = spos | SEGMENT_SHARED;
+            }
 
-                    // Set a link from the previous block to the new one.
-                    uint32_t poff = 0;
-                    if (ppos == 0)
-                    {
-                        ppos = pos;
-                        poff = file_info_next_offset;
-                    }
-                    else
-                        poff = info_info_next_offset;
+            if (this->fd->fail())
+            {
+                this->fd->clear();
+                this->segmentcache.erase(inodeid);
+                return FSResult::E_FAILURE_GENERAL;
+            }
+            return FSResult::E_SUCCESS;
+        }
 
-                    this->fd->seekp(ppos + poff);
-                    Endian::doW(this->fd, reinterpret_cast < char *>(&npos), 4);
+        FSResult::FSResult FS::unshareBlock(uint32_t inodeid, uint64_t index)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-                    ppos = npos;
-                    cilcount += 1;
+            std::shared_ptr < SegmentList > list = this->getFileSegments(inodeid);
+            if (!list)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            if (!list->isShared(index))
+                return FSResult::E_SUCCESS;
+            uint64_t spos = list->getPosition(index);
+
+            // The last user of a block can simply take it back; anyone
+            // else gets a copy.
+            uint64_t dpos = spos;
+            if (this->blockindex->getReferences(spos) > 1)
+            {
+                char block[BSIZE_FILE];
+                dpos = this->freelist->allocateBlock();
+                if (dpos == 0)
+                    return FSResult::E_FAILURE_GENERAL;
+                if (this->fd->readAt(block, BSIZE_FILE, spos) != BSIZE_FILE)
+                {
+                    this->fd->clear();
+                    this->resetBlock(dpos);
+                    return FSResult::E_FAILURE_GENERAL;
                 }
+                this->fd->writeDataAt(block, BSIZE_FILE, dpos);
+            }
+            this->blockindex->releaseReference(spos);
 
-                return FSResult::E_SUCCESS;
+            char data[8];
+            this->format->putPos(data, dpos);
+            this->fd->writeAt(data, this->format->pos_size, list->getSlotPosition(index));
+            list->blocks[index] = dpos;
+            if (this->fd->fail())
+            {
+                this->fd->clear();
+                this->segmentcache.erase(inodeid);
+                return FSResult::E_FAILURE_GENERAL;
             }
+            return FSResult::E_SUCCESS;
+        }
+
+        void FS::getBlockIndexStatistics(uint64_t& blocks, uint64_t& references)
+        {
+            this->blockindex->getStatistics(blocks, references);
+        }
+
+        void FS::beginTransaction()
+        {
+            this->journal->begin();
+        }
+
+        void FS::commitTransaction()
+        {
+            this->journal->commit();
+        }
+
+        FSResult::FSResult FS::sync()
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            if (!this->journal->flush())
+                return FSResult::E_FAILURE_GENERAL;
+            this->fd->sync();
+            if (this->fd->fail())
+            {
+                this->fd->clear();
+                return FSResult::E_FAILURE_GENERAL;
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::commitJournal()
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            if (!this->journal->commitExpired())
+            {
+                this->fd->clear();
+                return FSResult::E_FAILURE_GENERAL;
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        Profile * FS::getProfile()
+        {
+            return this->profile;
+        }
+
+        void FS::getJournalStatistics(uint64_t& groups, uint64_t& transactions)
+        {
+            this->journal->getStatistics(groups, transactions);
+        }
 
-            return FSResult::E_FAILURE_UNKNOWN;
+        void FS::releaseDataBlock(uint64_t segment)
+        {
+            // The tail of a compressed extent has no blocks.
+            uint64_t dpos = segment & ~(uint64_t) SEGMENT_FLAGS_MASK;
+            if (dpos == 0)
+                return;
+            if ((segment & SEGMENT_SHARED) != 0 && this->blockindex->releaseReference(dpos) > 0)
+                return;
+            this->resetBlock(dpos);
         }
 
-        FSFile FS::getFile(uint16_t inodeid)
+        FSFile FS::getFile(uint32_t inodeid)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             return FSFile(this, this->fd, inodeid);
         }
 
-        uint32_t FS::getTemporaryBlock(bool forceRecheck)
+        uint64_t FS::getTemporaryBlock(bool forceRecheck)
         {
             // FIXME: This function is most certainly broken and needs
             //        rewriting before use.
             assert(false);
 
             // We use a static variable to speed up later calls.
-            static uint32_t temporary_position = 0;
+            static uint64_t temporary_position = 0;
             if (temporary_position != 0 && !forceRecheck)
                 return temporary_position;
 
-            uint32_t block_position = OFFSET_DATA + 2;
+            uint64_t block_position = OFFSET_DATA + 2;
             std::streampos oldg = this->fd->tellg();
             std::streampos oldp = this->fd->tellp();
 
@@ -1329,7 +1738,7 @@ namespace AppLib
             // they are a temporary block or not.
             this->fd->seekg(block_position);
             uint16_t type_stor = INodeType::INT_UNSET;
-            uint32_t cpos = this->fd->tellg();
+            uint64_t cpos = this->fd->tellg();
             while (!this->fd->eof() && cpos == block_position && !this->freelist->isBlockFree(cpos))
             {
                 // FIXME: What the hell is this doing??!?!
@@ -1362,7 +1771,7 @@ namespace AppLib
             this->fd->seekg(oldg);
 
             // No temporary block allocated; allocate a new one.
-            uint32_t newpos = this->getFirstFreeBlock(INodeType::INT_FILEINFO);
+            uint64_t newpos = this->getFirstFreeBlock();
             if (newpos == 0)
                 return 0;
             Util::seekp_ex(this->fd, newpos);
@@ -1380,24 +1789,64 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Close the file stream.
+            // Write out the journal, and then close the file stream.
+            if (this->journal->isAvailable())
+            {
+                this->journal->flush();
+                this->fd->setJournal(NULL);
+            }
+            this->profile->stop();
             this->fd->close();
         }
 
-        void FS::reserveINodeID(uint16_t id)
+        void FS::reserveINodeID(uint32_t id)
+        {
+            this->inodebitmap->setReserved(id, true);
+        }
+
+        void FS::unreserveINodeID(uint32_t id)
+        {
+            this->inodebitmap->setReserved(id, false);
+        }
+
+        void FS::loadINodeBitmap()
         {
-            this->reservedINodes.insert(this->reservedINodes.end(), id);
+            this->inodebitmap->clear();
+            if (this->fd == NULL)
+                return;
+
+            // Read the whole lookup table in one request.  In a version 2
+            // package this is the table of lookup blocks, each of which
+            // is read in one request as well.
+            const Format* format = this->format;
+            std::vector<char> table(LENGTH_LOOKUP);
+            std::vector<char> block(BSIZE_FILE);
+            std::streamsize count = this->fd->readAt(&table[0], LENGTH_LOOKUP, OFFSET_LOOKUP);
+            for (std::streamsize i = 0; i + format->pos_size <= count; i += format->pos_size)
+            {
+                uint64_t ipos = format->getPos(&table[i]);
+                if (ipos == 0)
+                    continue;
+                if (format->version == FORMAT_VERSION_1)
+                {
+                    this->inodebitmap->setUsed(i / format->pos_size, true);
+                    continue;
+                }
+                uint32_t base = (i / format->pos_size) * LOOKUP_BLOCK_IDS;
+                if (this->fd->readAt(&block[0], BSIZE_FILE, ipos) != BSIZE_FILE)
+                    continue;
+                for (uint32_t j = 0; j < LOOKUP_BLOCK_IDS; j += 1)
+                    if (format->getPos(&block[j * format->pos_size]) != 0)
+                        this->inodebitmap->setUsed(base + j, true);
+            }
         }
 
-        void FS::unreserveINodeID(uint16_t id)
+        const Format* FS::getFormat()
         {
-            std::vector<uint16_t>::iterator it =
-                std::find(this->reservedINodes.begin(), this->reservedINodes.end(), id);
-            if (it != this->reservedINodes.end())
-                this->reservedINodes.erase(it);
+            return this->format;
         }
 
-        LowLevel::FSResult::FSResult FS::checkINodePositionIsValid(int pos)
+        LowLevel::FSResult::FSResult FS::checkINodePositionIsValid(uint64_t pos)
         {
             if (pos < OFFSET_DATA || (pos - OFFSET_DATA) % 4096 != 0)
                 return LowLevel::FSResult::E_FAILURE_INVALID_POSITION;
@@ -1420,7 +1869,49 @@ namespace AppLib
             return AppLib::LowLevel::FSResult::E_SUCCESS;
         }
 
-        void FS::updateTimes(uint16_t id, bool atime, bool mtime, bool ctime)
+        bool FS::indexDirectory(uint32_t parentid)
+        {
+            INode node = this->getINodeByID(parentid);
+            if (node.type != INodeType::INT_DIRECTORY)
+                return false;
+
+            std::vector < std::pair < uint32_t, std::string > > entries;
+            if (node.children)
+            {
+                const DirectoryChildren& children = *node.children;
+                for (DirectoryChildren::const_iterator i = children.begin(); i != children.end(); i++)
+                {
+                    if (*i == 0)
+                        continue;
+                    INode cnode = this->getINodeByID(*i);
+                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
+                        entries.push_back(std::make_pair(*i, cnode.filename));
+                }
+            }
+
+            // The index is published in one go so that concurrent lookups
+            // never see a partially built directory.
+            this->dirindex->build(parentid, entries);
+            return true;
+        }
+
+        void FS::invalidateINodeCache(uint64_t pos)
+        {
+            this->inodecache->invalidate(pos);
+        }
+
+        RWLock * FS::getLock()
+        {
+            return this->lock;
+        }
+
+        void FS::getINodeCacheStatistics(uint64_t& hits, uint64_t& misses)
+        {
+            hits = this->inodecache->getHits();
+            misses = this->inodecache->getMisses();
+        }
+
+        void FS::updateTimes(uint32_t id, bool atime, bool mtime, bool ctime)
         {
             INode node = this->getINodeByID(id);
             if (atime)
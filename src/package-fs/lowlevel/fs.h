@@ -10,6 +10,13 @@ namespace AppLib
     namespace LowLevel
     {
         class FS;
+        class INodeCache;
+        class DirectoryIndex;
+        class INodeBitmap;
+        class BlockIndex;
+        class Journal;
+        class Profile;
+        class RWLock;
     }
 }
 
@@ -18,13 +25,21 @@ namespace AppLib
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <memory>
 #include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <mutex>
 #include "src/package-fs/lowlevel/endian.h"
 #include "src/package-fs/fsfile.h"
 #include "src/package-fs/lowlevel/blockstream.h"
 #include "src/package-fs/lowlevel/inode.h"
+#include "src/package-fs/lowlevel/fsinfo.h"
+#include "src/package-fs/lowlevel/format.h"
 #include "src/package-fs/lowlevel/freelist.h"
 #include "src/package-fs/lowlevel/fsresult.h"
+#include "src/package-fs/lowlevel/segmentlist.h"
+#include "src/package-fs/lowlevel/rwlock.h"
 
 namespace AppLib
 {
@@ -34,6 +49,7 @@ namespace AppLib
         {
         public:
             FS(LowLevel::BlockStream * fd);
+            ~FS();
 
             //! Returns whether the file descriptor is valid.  If this
             //! is false, and you call one of the functions in the class
@@ -44,71 +60,91 @@ namespace AppLib
 
             //! Writes an INode to the specified position and then
             //! updates the inode lookup table.
-            FSResult::FSResult writeINode(uint32_t pos, INode node);
+            FSResult::FSResult writeINode(uint64_t pos, const INode& node);
 
             //! Updates an INode.  The node must exist in the inode
             //! position lookup table.
-            FSResult::FSResult updateINode(INode node);
+            FSResult::FSResult updateINode(const INode& node);
 
             //! Updates a raw INode (such as a freelist block).
-            FSResult::FSResult updateRawINode(INode node, uint32_t pos);
+            FSResult::FSResult updateRawINode(const INode& node, uint64_t pos);
+
+            //! Retrieves the filesystem information block.  The returned
+            //! block has an inodeid of 0 and a pos_root of 0 if it could
+            //! not be read.
+            FSInfo getFSInfo();
+
+            //! Writes out the filesystem information block.
+            FSResult::FSResult updateFSInfo(const FSInfo& info);
 
             //! Retrieves an INode by an ID.
-            INode getINodeByID(uint16_t id);
+            INode getINodeByID(uint32_t id);
 
             //! Retrieves an INode by an ID, without performing hardlink
             //! resolution.
-            INode getRealINodeByID(uint16_t id);
+            INode getRealINodeByID(uint32_t id);
 
             //! Retrieves an INode by position.
-            INode getINodeByPosition(uint32_t pos);
+            INode getINodeByPosition(uint64_t pos);
 
             //! Retrieves the real INode by position (in the case of hardlinks).
-            INode getINodeByRealPosition(uint32_t rpos);
+            INode getINodeByRealPosition(uint64_t rpos);
 
             //! A return value of 0 indicates that the specified INode
             //! does not exist.  Underlyingly calls getINodePositionByID(id, true);
-            uint32_t getINodePositionByID(uint16_t id);
+            uint64_t getINodePositionByID(uint32_t id);
 
             //! A return value of 0 indicates that the specified INode
             //! does not exist.
-            uint32_t getINodePositionByID(uint16_t id, bool resolveHardlinks);
+            uint64_t getINodePositionByID(uint32_t id, bool resolveHardlinks);
 
             //! Sets the position of an inode in the inode lookup table.
-            FSResult::FSResult setINodePositionByID(uint16_t id, uint32_t pos);
+            FSResult::FSResult setINodePositionByID(uint32_t id, uint64_t pos);
 
-            //! Find first free block and return that position.  The user specifies
-            //! INT_FILE or INT_DIRECTORY to indicate the number of sequential free
-            //! blocks to find.  A return value of 0 indicates that the file was either
-            //! at the maximum filesize, or the function could not otherwise find
-            //! a free block.
-            uint32_t getFirstFreeBlock(INodeType::INodeType type);
+            //! Find first free block and return that position.  Every kind of
+            //! inode fits in a single block.  A return value of 0 indicates that
+            //! the package was either at its maximum size, or the function could
+            //! not otherwise find a free block.
+            uint64_t getFirstFreeBlock();
 
             //! Find the first free inode number and return it.  A return value of 0
             //! indicates that there are no free inode numbers available (we can use
             //! a value of 0 since the root inode will always exist and will always
             //! have an ID of 0).
-            uint16_t getFirstFreeINodeNumber();
+            uint32_t getFirstFreeINodeNumber();
 
             //! Returns whether the specified block is free according to the freelist.
-            bool isBlockFree(uint32_t pos);
+            bool isBlockFree(uint64_t pos);
+
+            //! Extends the package by the specified number of free blocks in a
+            //! single write, so that a large amount of data can then be written
+            //! without growing the package a block at a time.
+            FSResult::FSResult reserveBlocks(uint64_t count);
 
             //! Adds a child inode to a parent (directory) inode.  Please note that it doesn't
             //! check to see whether or not the child is already attached to the parent, but
-            //! it will add the child reference in the lowest available slot.
-            FSResult::FSResult addChildToDirectoryINode(uint16_t parentid, uint16_t childid);
+            //! it will add the child reference in the lowest available slot.  In a version 2
+            //! package, a new directory information block is added when every slot is taken.
+            FSResult::FSResult addChildToDirectoryINode(uint32_t parentid, uint32_t childid);
 
             //! Removes a child inode from a parent (directory) inode.
-            FSResult::FSResult removeChildFromDirectoryINode(uint16_t parentid, uint16_t childid);
+            FSResult::FSResult removeChildFromDirectoryINode(uint32_t parentid, uint32_t childid);
 
             //! Returns whether or not a specified filename is unique
             //! inside a directory.  E_SUCCESS indicates unique, E_FAILURE_NOT_UNIQUE
             //! indicates not unique.
-            FSResult::FSResult filenameIsUnique(uint16_t parentid, std::string filename);
+            FSResult::FSResult filenameIsUnique(uint32_t parentid, std::string filename);
 
             //! Returns an std::vector<INode> list of children within
-            //! the specified directory.
-            std::vector < INode > getChildrenOfDirectory(uint16_t parentid);
+            //! the specified directory.  Only the headers of the children
+            //! are copied; their own children are shared with the cache.
+            std::vector < INode > getChildrenOfDirectory(uint32_t parentid);
+
+            //! Calls callback with each child of the specified directory in
+            //! turn, as getChildrenOfDirectory would list them, stopping
+            //! early if it returns false.  Only one child is decoded at a
+            //! time.  Returns false if the inode isn't a directory.
+            bool forEachChildOfDirectory(uint32_t parentid, const std::function < bool (const INode&) > &callback);
 
             /*! Returns an INode for the child with the specified
              * INode id (or filename) within the specified directory.  Returns an
@@ -116,26 +152,26 @@ namespace AppLib
              * the specified child, or if the parent inode is invalid (i.e. not
              * a directory).
              */
-            INode getChildOfDirectory(uint16_t parentid, uint16_t childid);
-            INode getChildOfDirectory(uint16_t parentid, std::string filename);
+            INode getChildOfDirectory(uint32_t parentid, uint32_t childid);
+            INode getChildOfDirectory(uint32_t parentid, std::string filename);
 
             //! Sets a file's contents (replacing the current contents).
-            FSResult::FSResult setFileContents(uint16_t id, const char *data, uint32_t len);
+            FSResult::FSResult setFileContents(uint32_t id, const char *data, uint32_t len);
 
             //! Returns a file's contents.
-            FSResult::FSResult getFileContents(uint16_t id, char **out, uint32_t * len_out, uint32_t len_max);
+            FSResult::FSResult getFileContents(uint32_t id, char **out, uint32_t * len_out, uint32_t len_max);
 
             //! Sets the length of a file (the dat_len and seg_len) fields, without actually
             //! adjusting the length of the file data or allocating new blocks (it only changes
             //! the field values).
-            FSResult::FSResult setFileLengthDirect(uint32_t pos, uint32_t len);
+            FSResult::FSResult setFileLengthDirect(uint64_t pos, uint64_t len);
 
             //! Sets the seg_next field for a FILE or SEGMENT block, without actually
             //! allocating a new block or validating the seg_next position.
-            FSResult::FSResult setFileNextSegmentDirect(uint16_t id, uint32_t pos, uint32_t seg_next);
+            FSResult::FSResult setFileNextSegmentDirect(uint32_t id, uint64_t pos, uint64_t seg_next);
 
             //! This function returns the position of the next block for file data after the current block.
-            uint32_t getFileNextBlock(uint16_t id, uint32_t pos);
+            uint64_t getFileNextBlock(uint32_t id, uint64_t pos);
 
             //! Erase a specified block, marking it as free in the free list.
             /*!
@@ -143,16 +179,20 @@ namespace AppLib
              *       position.  It does not check to make sure the position
              *       is actually the start of a block!
              */
-            FSResult::FSResult resetBlock(uint32_t pos);
+            FSResult::FSResult resetBlock(uint64_t pos);
+
+            //! Frees the directory information blocks of the directory at the
+            //! specified position, before the directory itself is freed.
+            FSResult::FSResult resetDirectoryInfoBlocks(uint64_t pos);
 
             //! Resolves a position in a file to a position in the disk image.
-            uint32_t resolvePositionInFile(uint16_t inodeid, uint32_t pos);
+            uint64_t resolvePositionInFile(uint32_t inodeid, uint64_t pos);
 
             //! Resolve a pathname into an inode id.
-            int32_t resolvePathnameToINodeID(std::string path);
+            int64_t resolvePathnameToINodeID(std::string path);
 
             //! Sets the length of a file, allocating or erasing blocks / data where necessary.
-            FSResult::FSResult truncateFile(uint16_t inodeid, uint32_t len);
+            FSResult::FSResult truncateFile(uint32_t inodeid, uint64_t len);
 
             //! Allocates or frees enough blocks so that there is enough segment list blocks
             //! available to address all of the segments.
@@ -160,11 +200,77 @@ namespace AppLib
              * @param pos The position of the file inode.
              * @param len The length of the data that needs to be addressed (i.e. size of the file).
              */
-            FSResult::FSResult allocateInfoListBlocks(uint32_t pos, uint32_t len);
+            FSResult::FSResult allocateInfoListBlocks(uint64_t pos, uint64_t len);
+
+            //! Returns the decoded segment list for the specified file, or
+            //! an empty pointer if the inode is not a file.
+            /*!
+             * The list is decoded the first time it is requested and then
+             * kept in memory, being updated in place by truncateFile and
+             * allocateInfoListBlocks.  Callers should request the list
+             * again after any operation that may change the file's length.
+             */
+            std::shared_ptr < SegmentList > getFileSegments(uint32_t inodeid);
+
+            //! Compresses each extent of the specified file that gets smaller when
+            //! compressed, freeing the blocks it no longer needs.  Extents that don't
+            //! get smaller are left as they are, so they cost nothing extra to read.
+            //! Up to the specified number of extents are compressed at once, each on
+            //! its own thread.  This is only possible in a version 2 package.
+            FSResult::FSResult compressFile(uint32_t inodeid, unsigned int threads = 1);
+
+            //! Stores the specified extent of a file uncompressed again, so that it
+            //! can be written to in place.  Nothing is done if it isn't compressed.
+            FSResult::FSResult expandExtent(uint32_t inodeid, uint64_t extent);
+
+            //! Reads and decompresses the specified extent of a file into out.
+            /*!
+             * @param list The segment list of the file.
+             * @param extent The index of the extent.
+             * @param len The number of bytes of the file in the extent.
+             * @param out The buffer to decompress into, with room for len bytes.
+             */
+            FSResult::FSResult readExtent(const SegmentList& list, uint64_t extent, uint64_t len, char *out);
+
+            //! Shares each block of the specified file with any other block in the
+            //! package that has the same contents, freeing the file's own copy.
+            //! Blocks that have no match yet are recorded in the block index so
+            //! that later files can share them.  Compressed extents are skipped.
+            //! This is only possible in a version 2 package.
+            FSResult::FSResult deduplicateFile(uint32_t inodeid);
+
+            //! Gives the specified block of a file a copy of its own if it is
+            //! shared, so that it can be written to in place.  Nothing is done
+            //! if it isn't shared.
+            FSResult::FSResult unshareBlock(uint32_t inodeid, uint64_t index);
+
+            //! Retrieves the number of shared blocks in the package, and the
+            //! number of segments that reference them.
+            void getBlockIndexStatistics(uint64_t& blocks, uint64_t& references);
+
+            //! Starts and ends a transaction of the metadata journal.  Use
+            //! Transaction rather than calling these directly.
+            void beginTransaction();
+            void commitTransaction();
+
+            //! Writes out the metadata changes collected by the journal and
+            //! waits for everything written to reach the disk.
+            FSResult::FSResult sync();
+
+            //! Writes out the metadata changes collected by the journal if
+            //! they have waited JOURNAL_COMMIT_INTERVAL seconds or more.
+            FSResult::FSResult commitJournal();
+
+            //! Retrieves the number of groups of changes written by the
+            //! journal, and the number of transactions they contained.
+            void getJournalStatistics(uint64_t& groups, uint64_t& transactions);
+
+            //! Returns the prefetch profile of the package.
+            Profile * getProfile();
 
             //! Returns a FSFile object for interacting with the specified file at
             //! the specified inode.
-            FSFile getFile(uint16_t inodeid);
+            FSFile getFile(uint32_t inodeid);
 
             //! Retrieves the temporary block or creates a new one.
             /*!
@@ -180,23 +286,41 @@ namespace AppLib
              *       the package for the temporary block (i.e. if you delete the temporary block),
              *       you can use the forceRecheck argument to do so.
              */
-            uint32_t getTemporaryBlock(bool forceRecheck = false);
+            uint64_t getTemporaryBlock(bool forceRecheck = false);
 
             //! Closes the filesystem.
             void close();
 
             //! Reserves an INode ID for future use without require the INode to actually be
             //! written to disk.
-            void reserveINodeID(uint16_t id);
+            void reserveINodeID(uint32_t id);
 
             //! Removes an INode ID reservation.
-            void unreserveINodeID(uint16_t id);
+            void unreserveINodeID(uint32_t id);
 
             //! Update times on an inode.
-            void updateTimes(uint16_t id, bool atime, bool mtime, bool ctime);
+            void updateTimes(uint32_t id, bool atime, bool mtime, bool ctime);
+
+            //! Drops any cached copy of the inode at the specified position.  This
+            //! must be called by anything that writes inode data to the stream without
+            //! going through this class.
+            void invalidateINodeCache(uint64_t pos);
+
+            //! Returns the lock that orders readers and writers of this filesystem.
+            //! The methods of this class do not take it themselves; AppLib::FS
+            //! and FSFile hold it shared while reading and exclusively while
+            //! writing, so any number of threads may read at once.
+            RWLock * getLock();
+
+            //! Retrieves the number of inode lookups that were served from the
+            //! in-memory inode cache, and the number that had to go to disk.
+            void getINodeCacheStatistics(uint64_t& hits, uint64_t& misses);
+
+            //! Returns the layout of the package's format version.
+            const Format* getFormat();
 
             //! Checks whether the specified position is valid.
-            static LowLevel::FSResult::FSResult checkINodePositionIsValid(int pos);
+            static LowLevel::FSResult::FSResult checkINodePositionIsValid(uint64_t pos);
 
             //! Copies the basename from basename into the filename.
             static LowLevel::FSResult::FSResult copyBasenameToFilename(const char* path,
@@ -205,7 +329,54 @@ namespace AppLib
         private:
             LowLevel::BlockStream * fd;
             LowLevel::FreeList * freelist;
-            std::vector<uint16_t> reservedINodes;
+            LowLevel::BlockIndex * blockindex;
+            LowLevel::Journal * journal;
+            LowLevel::Profile * profile;
+            LowLevel::INodeCache * inodecache;
+            LowLevel::DirectoryIndex * dirindex;
+            std::unordered_map < uint32_t, std::shared_ptr < SegmentList > > segmentcache;
+
+            //! Guards segmentcache against concurrent calls to getFileSegments
+            //! by threads holding the lock shared; everything else that changes
+            //! it holds the lock exclusively.
+            std::mutex segmentlock;
+            LowLevel::INodeBitmap * inodebitmap;
+            LowLevel::RWLock * lock;
+            const Format* format;
+
+            //! Returns the position of the lookup table entry holding the
+            //! position of the specified inode, or 0 if there is none.  In
+            //! a version 2 package the block of the lookup table for the
+            //! inode is allocated first if allocate is true.
+            uint64_t getLookupEntryPosition(uint32_t id, bool allocate);
+
+            //! Appends the children held in the chain of directory
+            //! information blocks starting at pos to the specified list.
+            void readDirectoryInfoBlocks(uint64_t pos, std::vector < uint32_t >& children);
+
+            //! Finds the directory slot holding the specified child (or
+            //! the first empty slot, if childid is 0), returning its
+            //! position on disk or 0 if there is no such slot.  The
+            //! position of the last block of the directory is stored in
+            //! last.
+            uint64_t findDirectorySlot(uint64_t pos, uint32_t childid, uint64_t& last);
+
+            //! Adds the specified amount to the children count of the
+            //! directory at the specified position.
+            void adjustDirectoryCount(uint64_t pos, int32_t amount);
+
+            //! Populates the filename index for the specified directory
+            //! by scanning its children, returning false if the inode is
+            //! not a directory.
+            bool indexDirectory(uint32_t parentid);
+
+            //! Populates the inode ID allocation bitmap from the lookup
+            //! table.
+            void loadINodeBitmap();
+
+            //! Frees the data block addressed by the specified segment, or
+            //! removes a reference to it if it is shared.
+            void releaseDataBlock(uint64_t segment);
         };
     }
 }
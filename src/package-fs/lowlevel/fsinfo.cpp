@@ -0,0 +1,143 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <string.h>
+#include "src/package-fs/lowlevel/fsinfo.h"
+#include "src/package-fs/lowlevel/inodetype.h"
+#include "src/package-fs/lowlevel/endian.h"
+#include "src/package-fs/lowlevel/format.h"
+#include "src/package-fs/logging.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        FSInfo::FSInfo()
+        {
+            this->inodeid = 0;
+            memcpy(this->fs_name, FS_NAME, 10);
+            this->ver_major = 0;
+            this->ver_minor = 0;
+            this->ver_revision = 0;
+            memset(this->app_name, 0, 256);
+            memset(this->app_ver, 0, 32);
+            memset(this->app_desc, 0, 1024);
+            memset(this->app_author, 0, 256);
+            this->pos_root = 0;
+            this->pos_freelist = 0;
+            this->pos_blockindex = 0;
+        }
+
+        std::string FSInfo::getBinaryRepresentation() const
+        {
+            std::string data(this->getBinarySize(), '\0');
+            this->writeBinaryRepresentation(&data[0]);
+            return data;
+        }
+
+        uint16_t FSInfo::getFormatVersion() const
+        {
+            return Format::getVersion(this->ver_major);
+        }
+
+        const Format* FSInfo::getFormat() const
+        {
+            // Unsupported versions are never read, so this only falls
+            // back for a block that is being built up in memory.
+            const Format* format = Format::get(this->getFormatVersion());
+            if (format == NULL)
+                return Format::get(FORMAT_VERSION_1);
+            return format;
+        }
+
+        uint32_t FSInfo::getBinarySize() const
+        {
+            const Format* format = this->getFormat();
+            uint32_t positions = (format->hsize_blockindex != 0) ? 3 : 2;
+            return 4 + 10 + 6 + 256 + 32 + 1024 + 256 + format->pos_size * positions;
+        }
+
+        void FSInfo::writeBinaryRepresentation(char *out) const
+        {
+            uint32_t off = 0;
+            Endian::putU16(out + off, this->inodeid); off += 2;
+            Endian::putU16(out + off, (uint16_t) INodeType::INT_FSINFO); off += 2;
+            memcpy(out + off, this->fs_name, 10); off += 10;
+            Endian::putU16(out + off, this->ver_major); off += 2;
+            Endian::putU16(out + off, this->ver_minor); off += 2;
+            Endian::putU16(out + off, this->ver_revision); off += 2;
+            memcpy(out + off, this->app_name, 256); off += 256;
+            memcpy(out + off, this->app_ver, 32); off += 32;
+            memcpy(out + off, this->app_desc, 1024); off += 1024;
+            memcpy(out + off, this->app_author, 256); off += 256;
+            const Format* format = this->getFormat();
+            format->putPos(out + off, this->pos_root); off += format->pos_size;
+            format->putPos(out + off, this->pos_freelist); off += format->pos_size;
+            if (format->hsize_blockindex != 0)
+                format->putPos(out + off, this->pos_blockindex);
+        }
+
+        bool FSInfo::readBinaryRepresentation(const char *data, uint32_t len)
+        {
+            if (len < 20)
+                return false;
+            this->ver_major = Endian::getU16(data + 14);
+            const Format* format = Format::get(this->getFormatVersion());
+            if (format == NULL)
+            {
+                Logging::showErrorW("Package format version %u is not supported.", this->ver_major);
+                return false;
+            }
+            if (len < this->getBinarySize())
+                return false;
+            uint32_t off = 0;
+            this->inodeid = Endian::getU16(data + off); off += 2;
+            if (Endian::getU16(data + off) != INodeType::INT_FSINFO)
+                return false;
+            off += 2;
+            memcpy(this->fs_name, data + off, 10); off += 10;
+            this->ver_major = Endian::getU16(data + off); off += 2;
+            this->ver_minor = Endian::getU16(data + off); off += 2;
+            this->ver_revision = Endian::getU16(data + off); off += 2;
+            memcpy(this->app_name, data + off, 256); off += 256;
+            memcpy(this->app_ver, data + off, 32); off += 32;
+            memcpy(this->app_desc, data + off, 1024); off += 1024;
+            memcpy(this->app_author, data + off, 256); off += 256;
+            this->pos_root = format->getPos(data + off); off += format->pos_size;
+            this->pos_freelist = format->getPos(data + off); off += format->pos_size;
+            if (format->hsize_blockindex != 0)
+                this->pos_blockindex = format->getPos(data + off);
+            return true;
+        }
+
+        void FSInfo::setAppName(const char *name)
+        {
+            FSInfo::copyString(name, this->app_name, 256);
+        }
+
+        void FSInfo::setAppVersion(const char *name)
+        {
+            FSInfo::copyString(name, this->app_ver, 32);
+        }
+
+        void FSInfo::setAppDesc(const char *name)
+        {
+            FSInfo::copyString(name, this->app_desc, 1024);
+        }
+
+        void FSInfo::setAppAuthor(const char *name)
+        {
+            FSInfo::copyString(name, this->app_author, 256);
+        }
+
+        void FSInfo::copyString(const char *from, char *to, uint16_t size)
+        {
+            size_t len = strlen(from);
+            if (len > (size_t) size - 1)
+                len = size - 1;
+            memcpy(to, from, len);
+            memset(to + len, 0, size - len);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_FSINFO
+#define CLASS_LOWLEVEL_FSINFO
+
+#include "src/package-fs/config.h"
+
+#include <string>
+#include "src/package-fs/lowlevel/format.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! The filesystem information block stored at OFFSET_FSINFO.
+        /*!
+         * This describes the package as a whole (the version of the
+         * library that created it, the application it contains and
+         * where the root directory and free list start).  It is only
+         * read when a package is opened and when the free list grows,
+         * so it is kept apart from INode to keep inodes small.
+         *
+         * The block starts the same way in every version of the format,
+         * so that ver_major can be read before the version is known;
+         * only the positions at the end are wider in version 2, which
+         * also records where the block index starts.
+         */
+        class FSInfo
+        {
+        public:
+            uint16_t inodeid;
+            char fs_name[10];
+            uint16_t ver_major;
+            uint16_t ver_minor;
+            uint16_t ver_revision;
+            char app_name[256];
+            char app_ver[32];
+            char app_desc[1024];
+            char app_author[256];
+            uint64_t pos_root;
+            uint64_t pos_freelist;
+            uint64_t pos_blockindex; //!< The first block index block (version 2 only).
+
+            FSInfo();
+            std::string getBinaryRepresentation() const;
+
+            //! Returns the format version of the package, based on
+            //! ver_major.
+            uint16_t getFormatVersion() const;
+
+            //! Returns the layout of the package's format version.
+            const Format* getFormat() const;
+
+            //! Returns the number of bytes the block occupies on disk,
+            //! not including the zeros that pad it out to LENGTH_FSINFO.
+            uint32_t getBinarySize() const;
+
+            //! Encodes the block into out, which must have room for
+            //! getBinarySize() bytes.
+            void writeBinaryRepresentation(char *out) const;
+
+            //! Decodes the block from data read from disk, returning
+            //! false if there are too few bytes or it is not an FSInfo
+            //! block.
+            bool readBinaryRepresentation(const char *data, uint32_t len);
+
+            void setAppName(const char *name);
+            void setAppVersion(const char *name);
+            void setAppDesc(const char *name);
+            void setAppAuthor(const char *name);
+
+        private:
+            static void copyString(const char *from, char *to, uint16_t size);
+        };
+    }
+}
+
+#endif
@@ -2,6 +2,8 @@
 
 #include "src/package-fs/config.h"
 
+#include <string.h>
+#include <algorithm>
 #include "src/package-fs/lowlevel/inodetype.h"
 #include "src/package-fs/lowlevel/inode.h"
 
@@ -9,11 +11,12 @@ namespace AppLib
 {
     namespace LowLevel
     {
-        INode::INode(uint16_t id, const char *filename, INodeType::INodeType type, uint16_t uid, uint16_t gid, uint16_t mask, uint64_t atime, uint64_t mtime, uint64_t ctime)
+        INode::INode(uint32_t id, const char *filename, INodeType::INodeType type, uint16_t uid, uint16_t gid, uint16_t mask, uint64_t atime, uint64_t mtime, uint64_t ctime)
         {
             this->inodeid = id;
             this->setFilename(filename, "");
             this->type = type;
+            this->flags = INodeFlag::INF_NONE;
             this->uid = uid;
             this->gid = gid;
             this->mask = mask;
@@ -26,36 +29,19 @@ namespace AppLib
             this->realid = 0;
             this->parent = 0;
             this->children_count = 0;
+            this->dir_next = 0;
             this->dev = 0;
             this->rdev = 0;
             this->nlink = 1;	// we only have one reference to this object
             this->blocks = 0;
-            for (uint16_t i = 0; i < DIRECTORY_CHILDREN_MAX; i += 1)
-                this->children[i] = 0;
-
-            // FSInfo only
-            for (uint16_t i = 0; i < 10; i += 1)
-                this->fs_name[i] = FS_NAME[i];
-            this->ver_major = 0;
-            this->ver_minor = 0;
-            this->ver_revision = 0;
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_name[i] = '\0';
-            for (uint16_t i = 0; i < 32; i += 1)
-                this->app_ver[i] = '\0';
-            for (uint16_t i = 0; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_author[i] = '\0';
-            this->pos_root = 0;
-            this->pos_freelist = 0;
         }
 
-        INode::INode(uint16_t id, const char *filename, INodeType::INodeType type)
+        INode::INode(uint32_t id, const char *filename, INodeType::INodeType type)
         {
             this->inodeid = id;
             this->setFilename(filename, "");
             this->type = type;
+            this->flags = INodeFlag::INF_NONE;
             this->uid = 0;
             this->gid = 0;
             this->mask = 0;
@@ -68,164 +54,223 @@ namespace AppLib
             this->realid = 0;
             this->parent = 0;
             this->children_count = 0;
+            this->dir_next = 0;
             this->dev = 0;
             this->rdev = 0;
             this->nlink = 1;	// we only have one reference to this object
             this->blocks = 0;
-            for (uint16_t i = 0; i < DIRECTORY_CHILDREN_MAX; i += 1)
-                this->children[i] = 0;
-
-            // FSInfo only
-            for (uint16_t i = 0; i < 10; i += 1)
-                this->fs_name[i] = FS_NAME[i];
-            this->ver_major = 0;
-            this->ver_minor = 0;
-            this->ver_revision = 0;
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_name[i] = '\0';
-            for (uint16_t i = 0; i < 32; i += 1)
-                this->app_ver[i] = '\0';
-            for (uint16_t i = 0; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_author[i] = '\0';
-            this->pos_root = 0;
-            this->pos_freelist = 0;
         }
 
         INode::~INode()
         {
         }
 
-        std::string INode::getBinaryRepresentation()
+        std::string INode::getBinaryRepresentation(const Format& format) const
         {
-            std::stringstream binary_rep;
-            Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->inodeid), 2);
-            Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->type), 2);
+            std::string data(this->getBinarySize(format), '\0');
+            this->writeBinaryRepresentation(&data[0], format);
+            return data;
+        }
+
+        uint32_t INode::getBinarySize(const Format& format) const
+        {
+            if (this->type == INodeType::INT_SEGINFO || this->type == INodeType::INT_FREELIST ||
+                this->type == INodeType::INT_DIRINFO || this->type == INodeType::INT_BLOCKINDEX)
+                return format.hsize_header + format.pos_size;
+            else if (this->type == INodeType::INT_FSINFO)
+                return format.hsize_header;	// The rest is only available through FSInfo.
+            else if (this->type == INodeType::INT_HARDLINK)
+                return format.hsize_header + 256 + format.id_size;
+
+            // Every other inode has a filename, ownership, mask and times.
+            uint32_t size = format.hsize_header + 256 + 6 + 24;
+            if (this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_SYMLINK || this->type == INodeType::INT_DEVICE)
+                size += 6 + format.count_size + format.pos_size * 2;
+            else if (this->type == INodeType::INT_DIRECTORY)
+                size = format.hsize_directory + format.dir_children * format.id_size;
+            return size;
+        }
+
+        void INode::writeBinaryRepresentation(char *out, const Format& format) const
+        {
+            uint32_t off = 0;
+            memset(out, 0, format.hsize_header);
+            format.putID(out + off, this->inodeid);
+            Endian::putU16(out + format.off_type, (uint16_t) this->type);
+            if (format.off_flags != 0)
+                Endian::putU16(out + format.off_flags, this->flags);
+            off = format.hsize_header;
             if (this->type == INodeType::INT_SEGINFO)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->info_next), 4);
-                 return binary_rep.str();
+                format.putPos(out + off, this->info_next);
+                return;
             }
-            else if (this->type == INodeType::INT_FREELIST)
+            else if (this->type == INodeType::INT_FREELIST || this->type == INodeType::INT_BLOCKINDEX)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->flst_next), 4);
-                return binary_rep.str();
+                format.putPos(out + off, this->flst_next);
+                return;
             }
-            else if (this->type == INodeType::INT_FSINFO)
+            else if (this->type == INodeType::INT_DIRINFO)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->fs_name), 10);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_major), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_minor), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_revision), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_name), 256);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_ver), 32);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_desc), 1024);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_author), 256);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->pos_root), 4);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->pos_freelist), 4);
-                return binary_rep.str();
+                format.putPos(out + off, this->dir_next);
+                return;
             }
+            else if (this->type == INodeType::INT_FSINFO)
+                return;
             if ((this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_DEVICE) && this->realid != 0)
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->realfilename), 256);
+                INode::writeFilename(out + off, this->realfilename);
             else
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->filename), 256);
+                INode::writeFilename(out + off, this->filename);
+            off += 256;
 
             if (this->type != INodeType::INT_HARDLINK)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->uid), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->gid), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->mask), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->atime), 8);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->mtime), 8);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ctime), 8);
+                Endian::putU16(out + off, this->uid); off += 2;
+                Endian::putU16(out + off, this->gid); off += 2;
+                Endian::putU16(out + off, this->mask); off += 2;
+                Endian::putU64(out + off, this->atime); off += 8;
+                Endian::putU64(out + off, this->mtime); off += 8;
+                Endian::putU64(out + off, this->ctime); off += 8;
             }
             if (this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_SYMLINK || this->type == INodeType::INT_DEVICE)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->dev), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->rdev), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->nlink), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->blocks), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->dat_len), 4);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->info_next), 4);
+                Endian::putU16(out + off, this->dev); off += 2;
+                Endian::putU16(out + off, this->rdev); off += 2;
+                Endian::putU16(out + off, this->nlink); off += 2;
+                format.putCount(out + off, this->blocks); off += format.count_size;
+                format.putPos(out + off, this->dat_len); off += format.pos_size;
+                format.putPos(out + off, this->info_next);
             }
             else if (this->type == INodeType::INT_DIRECTORY)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->parent), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->children_count), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->children), DIRECTORY_CHILDREN_MAX * 2);
+                format.putID(out + off, this->parent); off += format.id_size;
+                format.putCount(out + off, this->children_count); off += format.count_size;
+                if (format.off_dir_next != 0)
+                {
+                    format.putPos(out + off, this->dir_next);
+                    off += format.pos_size;
+                }
+                uint32_t count = 0;
+                if (this->children)
+                {
+                    count = std::min < uint32_t > (this->children->size(), format.dir_children);
+                    format.putIDArray(out + off, this->children->data(), count);
+                }
+                memset(out + off + count * format.id_size, 0, (format.dir_children - count) * format.id_size);
             }
             else if (this->type == INodeType::INT_HARDLINK)
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->realid), 2);
-            return binary_rep.str();
+                format.putID(out + off, this->realid);
         }
 
-        void INode::setFilename(const char *name, const char *real)
+        bool INode::readBinaryRepresentation(const char *data, uint32_t len, const Format& format)
         {
-            uint16_t size = (strlen(name) < 255) ? strlen(name) : 255;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->filename[i] = name[i];
-            for (uint16_t i = size; i < 256; i += 1)
-                this->filename[i] = '\0';
-            uint16_t rsize = (strlen(real) < 255) ? strlen(real) : 255;
-            for (uint16_t i = 0; i < rsize; i += 1)
-                this->realfilename[i] = real[i];
-            for (uint16_t i = size; i < 256; i += 1)
-                this->realfilename[i] = '\0';
-        }
+            if (len < format.hsize_header)
+                return false;
+            uint32_t off = 0;
+            this->inodeid = format.getID(data + off);
+            this->type = (INodeType::INodeType) Endian::getU16(data + format.off_type);
+            this->flags = (format.off_flags != 0) ? (INodeFlag::INodeFlag) Endian::getU16(data + format.off_flags) : INodeFlag::INF_NONE;
+            off = format.hsize_header;
+            if (len < this->getBinarySize(format))
+                return false;
 
-        void INode::setAppName(const char *name)
-        {
-            uint16_t size = (strlen(name) < 255) ? strlen(name) : 255;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->app_name[i] = name[i];
-            for (uint16_t i = size; i < 256; i += 1)
-                this->app_name[i] = '\0';
-        }
+            if (this->type == INodeType::INT_SEGINFO)
+            {
+                this->info_next = format.getPos(data + off);
+                return true;
+            }
+            else if (this->type == INodeType::INT_FREELIST || this->type == INodeType::INT_BLOCKINDEX)
+            {
+                this->flst_next = format.getPos(data + off);
+                return true;
+            }
+            else if (this->type == INodeType::INT_DIRINFO)
+            {
+                this->dir_next = format.getPos(data + off);
+                return true;
+            }
+            else if (this->type == INodeType::INT_FSINFO)
+                return true;
+            this->filename = INode::copyFilename(data + off); off += 256;
 
-        void INode::setAppVersion(const char *name)
-        {
-            uint16_t size = (strlen(name) < 31) ? strlen(name) : 31;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->app_ver[i] = name[i];
-            for (uint16_t i = size; i < 32; i += 1)
-                this->app_ver[i] = '\0';
+            if (this->type != INodeType::INT_HARDLINK)
+            {
+                this->uid = Endian::getU16(data + off); off += 2;
+                this->gid = Endian::getU16(data + off); off += 2;
+                this->mask = Endian::getU16(data + off); off += 2;
+                this->atime = Endian::getU64(data + off); off += 8;
+                this->mtime = Endian::getU64(data + off); off += 8;
+                this->ctime = Endian::getU64(data + off); off += 8;
+            }
+            if (this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_SYMLINK || this->type == INodeType::INT_DEVICE)
+            {
+                this->dev = Endian::getU16(data + off); off += 2;
+                this->rdev = Endian::getU16(data + off); off += 2;
+                this->nlink = Endian::getU16(data + off); off += 2;
+                this->blocks = format.getCount(data + off); off += format.count_size;
+                this->dat_len = format.getPos(data + off); off += format.pos_size;
+                this->info_next = format.getPos(data + off);
+            }
+            else if (this->type == INodeType::INT_DIRECTORY)
+            {
+                this->parent = format.getID(data + off); off += format.id_size;
+                this->children_count = format.getCount(data + off); off += format.count_size;
+                if (format.off_dir_next != 0)
+                {
+                    this->dir_next = format.getPos(data + off);
+                    off += format.pos_size;
+                }
+
+                // Only decode up to the last occupied slot.
+                this->children.reset();
+                uint32_t count = INode::countSlots(data + off, format.dir_children, format.id_size);
+                if (count > 0)
+                {
+                    std::shared_ptr < DirectoryChildren > list(new DirectoryChildren(count));
+                    format.getIDArray(data + off, list->data(), count);
+                    this->children = list;
+                }
+            }
+            else if (this->type == INodeType::INT_HARDLINK)
+                this->realid = format.getID(data + off);
+            return true;
         }
 
-        void INode::setAppDesc(const char *name)
+        uint32_t INode::countSlots(const char *data, uint32_t slots, uint32_t size)
         {
-            uint16_t size = (strlen(name) < 1023) ? strlen(name) : 1023;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->app_desc[i] = name[i];
-            for (uint16_t i = size; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
+            while (slots > 0)
+            {
+                const char *slot = data + (slots - 1) * size;
+                for (uint32_t i = 0; i < size; i += 1)
+                    if (slot[i] != 0)
+                        return slots;
+                slots -= 1;
+            }
+            return 0;
         }
 
-        void INode::setAppAuthor(const char *name)
+        void INode::setFilename(const char *name, const char *real)
         {
-            uint16_t size = (strlen(name) < 255) ? strlen(name) : 255;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->app_author[i] = name[i];
-            for (uint16_t i = size; i < 256; i += 1)
-                this->app_author[i] = '\0';
+            this->filename = INode::copyFilename(name);
+            this->realfilename = INode::copyFilename(real);
         }
 
-        bool INode::verify()
+        bool INode::verify() const
         {
-            if (this->filename[0] == 0 && (this->type == INodeType::INT_DIRECTORY || this->type == INodeType::INT_FILEINFO) && this->inodeid != 0)
+            if (this->filename.empty() && (this->type == INodeType::INT_DIRECTORY || this->type == INodeType::INT_FILEINFO) && this->inodeid != 0)
                 return false;
             return true;
         }
 
-        INode INode::resolve(FS* filesystem)
+        INode INode::resolve(FS* filesystem) const
         {
             if (this->type == INodeType::INT_HARDLINK && this->realid != 0)
             {
                 Logging::showDebugW("Resolving hardlink %u to %u.", this->inodeid, this->realid);
                 INode node = filesystem->getINodeByID(this->realid);
                 node.realid = this->inodeid;
-                INode::copyFilename(node.filename, node.realfilename);
-                INode::copyFilename(this->filename, node.filename);
+                node.realfilename = node.filename;
+                node.filename = this->filename;
                 return node;
             }
             else if ((this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_DEVICE) && this->realid != 0)
@@ -233,23 +278,23 @@ namespace AppLib
                 Logging::showDebugW("Resolving fileinfo %u back to hardlink %u.", this->inodeid, this->realid);
                 INode node = filesystem->getRealINodeByID(this->realid);
                 node.realid = this->inodeid;
-                INode::copyFilename(this->filename, node.realfilename);
+                node.realfilename = this->filename;
                 return node;
             }
             else
                 return *this;
         }
 
-        void INode::copyFilename(char from[256], char to[256])
+        std::string INode::copyFilename(const char *from)
         {
-            for (int i = 0; i < 256; i += 1)
-                to[i] = 0;
-            for (int i = 0; i < 255; i += 1)
-            {
-                if (from[i] == 0)
-                    break;
-                to[i] = from[i];
-            }
+            return std::string(from, strnlen(from, 255));
+        }
+
+        void INode::writeFilename(char *out, const std::string& name)
+        {
+            size_t len = std::min < size_t > (name.size(), 255);
+            memcpy(out, name.data(), len);
+            memset(out + len, 0, 256 - len);
         }
     }
 }
@@ -14,68 +14,88 @@ namespace AppLib
 }
 
 #include <string>
+#include <vector>
+#include <memory>
 #include "src/package-fs/lowlevel/inodetype.h"
+#include "src/package-fs/lowlevel/format.h"
 #include "src/package-fs/lowlevel/fs.h"
 
 namespace AppLib
 {
     namespace LowLevel
     {
+        //! The child inode IDs of a directory, in the order of the
+        //! slots they occupy on disk.  Empty slots are 0, and the list
+        //! stops at the last occupied slot.
+        typedef std::vector < uint32_t > DirectoryChildren;
+
         class INode
         {
         public:
-            uint16_t inodeid;
-            char filename[256];
+            uint32_t inodeid;
+            std::string filename;
             INodeType::INodeType type;
+            uint16_t flags; //!< A combination of INodeFlag values (version 2 only).
             uint16_t uid;
             uint16_t gid;
             uint16_t mask;
             uint64_t atime;
             uint64_t mtime;
             uint64_t ctime;
-            uint16_t parent;
-            uint16_t children[DIRECTORY_CHILDREN_MAX];
-            uint16_t children_count;
+            uint32_t parent;
+            uint32_t children_count;
+            uint64_t dir_next; //!< The first directory information block (version 2 only).
             uint16_t dev;
             uint16_t rdev;
             uint16_t nlink;
-            uint16_t blocks;
-            uint32_t dat_len;
-            uint32_t info_next;
-            uint32_t flst_next;
-            uint16_t realid;
-            char realfilename[256]; //!< In-memory only (never written to disk).
-
-            // FSInfo only
-            char fs_name[10];
-            uint16_t ver_major;
-            uint16_t ver_minor;
-            uint16_t ver_revision;
-            char app_name[256];
-            char app_ver[32];
-            char app_desc[1024];
-            char app_author[256];
-            uint32_t pos_root;
-            uint32_t pos_freelist;
-
-            INode(uint16_t id, const char *filename, INodeType::INodeType type, uint16_t uid, uint16_t gid, uint16_t mask, uint64_t atime, uint64_t mtime, uint64_t ctime);
-            INode(uint16_t id = 0, const char *filename = "", INodeType::INodeType type = INodeType::INT_UNSET);
+            uint32_t blocks;
+            uint64_t dat_len;
+            uint64_t info_next;
+            uint64_t flst_next; //!< The next free list (or block index) block.
+            uint32_t realid;
+            std::string realfilename; //!< In-memory only (never written to disk).
+
+            //! The children of a directory, or empty if it has none.
+            //! This is shared between copies of the same inode, so
+            //! copying a directory inode never copies its children.  In
+            //! a version 2 package it includes the children held in the
+            //! directory's information blocks.
+            std::shared_ptr < const DirectoryChildren > children;
+
+            INode(uint32_t id, const char *filename, INodeType::INodeType type, uint16_t uid, uint16_t gid, uint16_t mask, uint64_t atime, uint64_t mtime, uint64_t ctime);
+            INode(uint32_t id = 0, const char *filename = "", INodeType::INodeType type = INodeType::INT_UNSET);
             ~INode();
-            std::string getBinaryRepresentation();
+            std::string getBinaryRepresentation(const Format& format) const;
+
+            //! Returns the number of bytes the inode occupies on disk in
+            //! the specified format, not including the zeros that pad it
+            //! out to a whole block.
+            uint32_t getBinarySize(const Format& format) const;
+
+            //! Encodes the inode in the specified format into out, which
+            //! must have room for getBinarySize() bytes.  Only the children
+            //! held in the directory block itself are written.
+            void writeBinaryRepresentation(char *out, const Format& format) const;
+
+            //! Decodes the inode from data read from disk, returning false
+            //! if there are too few bytes for the inode's type.  Only the
+            //! children held in the directory block itself are read.
+            bool readBinaryRepresentation(const char *data, uint32_t len, const Format& format);
             void setFilename(const char *name, const char *real = "");
-            void setAppName(const char *name);
-            void setAppVersion(const char *name);
-            void setAppDesc(const char *name);
-            void setAppAuthor(const char *name);
 
             //! Ensures that the node data is valid.
-            bool verify();
+            bool verify() const;
 
             //! Resolves a hardlink to the real file.
-            INode resolve(FS* filesystem);
+            INode resolve(FS* filesystem) const;
+
+            //! Returns the number of slots of the specified size in data,
+            //! up to and including the last one that is not zero.
+            static uint32_t countSlots(const char *data, uint32_t slots, uint32_t size);
 
         private:
-            static void copyFilename(char from[256], char to[256]);
+            static std::string copyFilename(const char *from);
+            static void writeFilename(char *out, const std::string& name);
         };
     }
 }
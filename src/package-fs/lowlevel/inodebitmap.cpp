@@ -0,0 +1,105 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include "src/package-fs/lowlevel/inodebitmap.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        INodeBitmap::INodeBitmap(uint32_t max_id)
+            : max_id(max_id), hint(0)
+        {
+        }
+
+        void INodeBitmap::setUsed(uint32_t id, bool used)
+        {
+            uint64_t bit = (uint64_t) 1 << (id % 64);
+            if (used)
+            {
+                this->grow(id);
+                this->used[id / 64] |= bit;
+            }
+            else if (id / 64 < this->used.size())
+            {
+                this->used[id / 64] &= ~bit;
+                if (id / 64 < this->hint)
+                    this->hint = id / 64;
+            }
+        }
+
+        void INodeBitmap::setReserved(uint32_t id, bool reserved)
+        {
+            uint64_t bit = (uint64_t) 1 << (id % 64);
+            if (reserved)
+            {
+                this->grow(id);
+                this->reserved[id / 64] |= bit;
+            }
+            else if (id / 64 < this->reserved.size())
+            {
+                this->reserved[id / 64] &= ~bit;
+                if (id / 64 < this->hint)
+                    this->hint = id / 64;
+            }
+        }
+
+        bool INodeBitmap::isFree(uint32_t id) const
+        {
+            if (id > this->max_id)
+                return false;
+            if (id / 64 >= this->used.size())
+                return true;
+            uint64_t bit = (uint64_t) 1 << (id % 64);
+            return ((this->used[id / 64] | this->reserved[id / 64]) & bit) == 0;
+        }
+
+        bool INodeBitmap::findFirstFree(uint32_t& out)
+        {
+            // Every word below the hint is known to be full, so the
+            // search is amortized constant time.
+            for (size_t i = this->hint; i < this->used.size(); i += 1)
+            {
+                uint64_t taken = this->used[i] | this->reserved[i];
+                if (taken == ~(uint64_t) 0)
+                    continue;
+                uint64_t id = i * 64 + __builtin_ctzll(~taken);
+                if (id > this->max_id)
+                    break;
+                this->hint = i;
+                out = (uint32_t) id;
+                return true;
+            }
+            this->hint = this->used.size();
+
+            // Everything that is tracked is taken, so use the first
+            // inode ID past the end if there is one.
+            uint64_t id = (uint64_t) this->used.size() * 64;
+            if (id > this->max_id)
+                return false;
+            out = (uint32_t) id;
+            return true;
+        }
+
+        void INodeBitmap::clear()
+        {
+            this->used.clear();
+            this->reserved.clear();
+            this->hint = 0;
+        }
+
+        void INodeBitmap::grow(uint32_t id)
+        {
+            if (id / 64 < this->used.size())
+                return;
+
+            // Grow by at least half again so that IDs allocated one
+            // after another don't reallocate each time.
+            size_t size = std::max < size_t > (id / 64 + 1, this->used.size() + this->used.size() / 2);
+            size = std::min < size_t > (size, (size_t) this->max_id / 64 + 1);
+            this->used.resize(size, 0);
+            this->reserved.resize(size, 0);
+        }
+    }
+}
@@ -0,0 +1,65 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_INODEBITMAP
+#define CLASS_LOWLEVEL_INODEBITMAP
+
+#include "src/package-fs/config.h"
+
+#include <vector>
+#include <algorithm>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! An in-memory allocation bitmap of inode IDs.
+        /*!
+         * Tracks which inode IDs have a position in the lookup table
+         * and which have been reserved but not yet written, so that a
+         * free inode ID can be found without scanning the lookup table.
+         * The owning FS is responsible for keeping it in step with the
+         * lookup table.  The bitmap only grows as far as the highest
+         * inode ID that has been marked, so a package with a large ID
+         * space costs no more than its inodes need.
+         */
+        class INodeBitmap
+        {
+        public:
+            INodeBitmap(uint32_t max_id = INODE_ID_MAX);
+
+            //! Marks whether the specified inode ID has a position in
+            //! the lookup table.
+            void setUsed(uint32_t id, bool used);
+
+            //! Marks whether the specified inode ID is reserved.
+            void setReserved(uint32_t id, bool reserved);
+
+            //! Returns whether the specified inode ID is neither used
+            //! nor reserved.
+            bool isFree(uint32_t id) const;
+
+            //! Finds the lowest free inode ID, returning false if every
+            //! inode ID is used or reserved.
+            bool findFirstFree(uint32_t& out);
+
+            //! Marks every inode ID as free and unreserved.
+            void clear();
+
+        private:
+            std::vector<uint64_t> used;
+            std::vector<uint64_t> reserved;
+
+            //! The highest inode ID that can be allocated.
+            uint32_t max_id;
+
+            //! The index of the lowest word that may contain a free
+            //! inode ID.
+            size_t hint;
+
+            //! Extends the bitmap so that it covers the specified ID.
+            void grow(uint32_t id);
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,132 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include "src/package-fs/lowlevel/inodecache.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        INodeCache::INodeCache(size_t capacity)
+        {
+            this->capacity = (capacity == 0) ? 1 : capacity;
+            this->hits = 0;
+            this->misses = 0;
+        }
+
+        bool INodeCache::get(uint64_t pos, INode& out)
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            std::unordered_map < uint64_t, EntryList::iterator >::iterator i = this->index.find(pos);
+            if (i == this->index.end())
+            {
+                this->misses += 1;
+                return false;
+            }
+
+            // Move the entry to the front of the list so that it is
+            // the last one to be evicted.
+            this->entries.splice(this->entries.begin(), this->entries, i->second);
+            out = i->second->second;
+            this->hits += 1;
+            return true;
+        }
+
+        void INodeCache::put(uint64_t pos, const INode& node)
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            std::unordered_map < uint64_t, EntryList::iterator >::iterator i = this->index.find(pos);
+            if (i != this->index.end())
+            {
+                i->second->second = node;
+                this->entries.splice(this->entries.begin(), this->entries, i->second);
+                return;
+            }
+
+            // Evict the least recently used entry if we are full.
+            if (this->entries.size() >= this->capacity)
+            {
+                this->index.erase(this->entries.back().first);
+                this->entries.pop_back();
+            }
+
+            this->entries.push_front(EntryList::value_type(pos, node));
+            this->index.insert(std::make_pair(pos, this->entries.begin()));
+        }
+
+        void INodeCache::invalidate(uint64_t pos)
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            std::unordered_map < uint64_t, EntryList::iterator >::iterator i = this->index.find(pos);
+            if (i == this->index.end())
+                return;
+            this->entries.erase(i->second);
+            this->index.erase(i);
+        }
+
+        bool INodeCache::getPosition(uint32_t id, uint64_t& out)
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            std::unordered_map < uint32_t, PositionList::iterator >::iterator i = this->positionIndex.find(id);
+            if (i == this->positionIndex.end())
+                return false;
+            this->positions.splice(this->positions.begin(), this->positions, i->second);
+            out = i->second->second;
+            return true;
+        }
+
+        void INodeCache::putPosition(uint32_t id, uint64_t pos)
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            std::unordered_map < uint32_t, PositionList::iterator >::iterator i = this->positionIndex.find(id);
+            if (i != this->positionIndex.end())
+            {
+                i->second->second = pos;
+                this->positions.splice(this->positions.begin(), this->positions, i->second);
+                return;
+            }
+
+            // Misses are cached too, so this has to be bounded as well.
+            if (this->positions.size() >= this->capacity)
+            {
+                this->positionIndex.erase(this->positions.back().first);
+                this->positions.pop_back();
+            }
+
+            this->positions.push_front(PositionList::value_type(id, pos));
+            this->positionIndex.insert(std::make_pair(id, this->positions.begin()));
+        }
+
+        void INodeCache::invalidatePosition(uint32_t id)
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            std::unordered_map < uint32_t, PositionList::iterator >::iterator i = this->positionIndex.find(id);
+            if (i == this->positionIndex.end())
+                return;
+            this->positions.erase(i->second);
+            this->positionIndex.erase(i);
+        }
+
+        void INodeCache::clear()
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            this->entries.clear();
+            this->index.clear();
+            this->positions.clear();
+            this->positionIndex.clear();
+        }
+
+        uint64_t INodeCache::getHits()
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            return this->hits;
+        }
+
+        uint64_t INodeCache::getMisses()
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            return this->misses;
+        }
+    }
+}
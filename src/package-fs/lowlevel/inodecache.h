@@ -0,0 +1,79 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_INODECACHE
+#define CLASS_LOWLEVEL_INODECACHE
+
+#include "src/package-fs/config.h"
+
+#include <list>
+#include <mutex>
+#include <utility>
+#include <unordered_map>
+#include "src/package-fs/lowlevel/inode.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! A bounded, least-recently-used cache of decoded inodes.
+        /*!
+         * Inodes are keyed by their position on disk (since that is
+         * what getINodeByRealPosition reads), and the cache also keeps
+         * the inode ID to position mapping from the lookup table, in a
+         * second least-recently-used list of the same capacity.  The
+         * owning FS is responsible for invalidating entries whenever it
+         * writes to the underlying blocks.  Every method may be called
+         * concurrently.
+         */
+        class INodeCache
+        {
+        public:
+            INodeCache(size_t capacity = INODE_CACHE_SIZE);
+
+            //! Copies the cached inode at the specified position into
+            //! out, returning false if it is not cached.
+            bool get(uint64_t pos, INode& out);
+
+            //! Caches the inode at the specified position, evicting the
+            //! least recently used entry if the cache is full.
+            void put(uint64_t pos, const INode& node);
+
+            //! Drops the inode cached at the specified position.
+            void invalidate(uint64_t pos);
+
+            //! Retrieves the cached position of an inode ID, returning
+            //! false if it is not cached.
+            bool getPosition(uint32_t id, uint64_t& out);
+
+            //! Caches the position of an inode ID.
+            void putPosition(uint32_t id, uint64_t pos);
+
+            //! Drops the cached position of an inode ID.
+            void invalidatePosition(uint32_t id);
+
+            //! Drops every cached inode and position.
+            void clear();
+
+            //! Returns the number of lookups served from the cache.
+            uint64_t getHits();
+
+            //! Returns the number of lookups that went to disk.
+            uint64_t getMisses();
+
+        private:
+            typedef std::list < std::pair < uint64_t, INode > > EntryList;
+            typedef std::list < std::pair < uint32_t, uint64_t > > PositionList;
+
+            size_t capacity;
+            uint64_t hits;
+            uint64_t misses;
+            EntryList entries;
+            std::unordered_map < uint64_t, EntryList::iterator > index;
+            PositionList positions;
+            std::unordered_map < uint32_t, PositionList::iterator > positionIndex;
+            std::mutex mutex;
+        };
+    }
+}
+
+#endif
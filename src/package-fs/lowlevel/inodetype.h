@@ -29,6 +29,9 @@ namespace AppLib
 
                 // Directory Block
                 INT_DIRECTORY = 3,
+                // Directory Information Block (the continuation of a
+                // directory's children in version 2 packages)
+                INT_DIRINFO = 11,
 
                 // Symbolic Link
                 INT_SYMLINK = 4,
@@ -43,12 +46,28 @@ namespace AppLib
                 INT_FREELIST = 7,
                 // Filesystem Information Block
                 INT_FSINFO = 8,
+                // Block Index Block (the hashes and reference counts of
+                // shared data blocks in version 2 packages)
+                INT_BLOCKINDEX = 12,
 
                 // Invalid and Unset Blocks (unused in disk images)
                 INT_INVALID = 9,
                 INT_UNSET = 255
             };
         }
+
+        // WARN: As with the types, these values are stored in packages.
+        namespace INodeFlag
+        {
+            enum INodeFlag
+            {
+                INF_NONE = 0,
+
+                // Some extents of the file's data are compressed
+                // (version 2 packages only).
+                INF_COMPRESSED = 1
+            };
+        }
     }
 }
 
@@ -0,0 +1,338 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <string.h>
+#include <algorithm>
+#include "src/package-fs/lowlevel/journal.h"
+#include "src/package-fs/lowlevel/endian.h"
+#include "src/package-fs/lowlevel/rwlock.h"
+#include "src/package-fs/logging.h"
+
+extern "C"
+{
+#include "src/shared/siphash24.h"
+}
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        // The journal header, at the start of the journal area, is
+        // followed by the descriptor blocks of the group (holding the
+        // positions of its blocks) and then the blocks themselves.
+        static const char journal_magic[8] = { 'A', 'p', 'p', 'F', 'S', 'J', 'n', 'l' };
+        static const uint32_t journal_header_size = 32;
+        static const uint32_t journal_descriptor_slots = BSIZE_FILE / 8;
+
+        // The key used to checksum a group.
+        static const uint8_t journal_key[16] =
+        {
+            0x41, 0x70, 0x70, 0x46, 0x53, 0x20, 0x6a, 0x6f,
+            0x75, 0x72, 0x6e, 0x61, 0x6c, 0x20, 0x63, 0x6b
+        };
+
+        Journal::Journal(BlockStream * fd, const Format* format)
+        {
+            this->fd = fd;
+            this->format = format;
+            this->unsynced = false;
+            this->depth = 0;
+            this->sequence = 1;
+            this->started = 0;
+            this->groups = 0;
+            this->transactions = 0;
+        }
+
+        bool Journal::isAvailable() const
+        {
+            return this->fd != NULL && this->format->length_journal != 0;
+        }
+
+        bool Journal::recover()
+        {
+            if (!this->isAvailable())
+                return true;
+
+            char header[journal_header_size];
+            if (this->fd->readThrough(header, journal_header_size, OFFSET_JOURNAL) != journal_header_size ||
+                memcmp(header, journal_magic, sizeof(journal_magic)) != 0)
+                return true;
+
+            uint64_t sequence = Endian::getU64(header + 8);
+            uint32_t count = Endian::getU32(header + 16);
+            uint32_t descriptors = Endian::getU32(header + 20);
+            uint64_t sum = Endian::getU64(header + 24);
+            this->sequence = sequence + 1;
+
+            // A header whose blocks don't match it belongs to a group that
+            // never finished being written to the journal, and so was never
+            // written in place either.
+            bool valid = (count > 0 && count <= this->getCapacity() &&
+                          descriptors == (count + journal_descriptor_slots - 1) / journal_descriptor_slots);
+            std::vector < char > log;
+            if (valid)
+            {
+                size_t length = (size_t) (descriptors + count) * BSIZE_FILE;
+                log.resize(length);
+                valid = (this->fd->readThrough(&log[0], length, OFFSET_JOURNAL + BSIZE_FILE) == (std::streamsize) length &&
+                         Journal::checksum(&log[0], length) == sum);
+            }
+            if (!valid)
+            {
+                Logging::showWarningW("JOURNAL: Discarding an incomplete group of metadata changes.");
+                char zero[journal_header_size] = { 0 };
+                this->fd->writeThrough(zero, journal_header_size, OFFSET_JOURNAL);
+                this->fd->sync();
+                return !this->fd->fail();
+            }
+
+            Logging::showInfoW("Replaying %u blocks of metadata changes from the journal.", count);
+            for (uint32_t i = 0; i < count; i += 1)
+            {
+                uint64_t pos = Endian::getU64(&log[i * 8]);
+                this->fd->writeThrough(&log[(descriptors + i) * BSIZE_FILE], BSIZE_FILE, pos);
+            }
+            this->unsynced = true;
+            this->retire();
+            return !this->fd->fail();
+        }
+
+        void Journal::begin()
+        {
+            if (this->depth == 0 && this->blocks.empty())
+                this->started = time(NULL);
+            this->depth += 1;
+        }
+
+        void Journal::commit()
+        {
+            if (this->depth == 0)
+                return;
+            this->depth -= 1;
+            if (this->depth != 0)
+                return;
+
+            this->transactions += 1;
+            if (this->blocks.size() >= this->getCapacity() / 2 ||
+                (!this->blocks.empty() && time(NULL) - this->started >= JOURNAL_COMMIT_INTERVAL))
+                this->writeBlocks();
+        }
+
+        bool Journal::commitExpired()
+        {
+            if (this->depth != 0 || this->blocks.empty() ||
+                time(NULL) - this->started < JOURNAL_COMMIT_INTERVAL)
+                return true;
+            return this->writeBlocks() && !this->fd->fail();
+        }
+
+        bool Journal::isRecording() const
+        {
+            return this->depth > 0 && this->isAvailable();
+        }
+
+        void Journal::record(const char *data, std::streamsize count, std::streampos pos)
+        {
+            uint64_t start = (uint64_t) pos;
+            uint64_t end = start + count;
+            for (uint64_t bpos = start - start % BSIZE_FILE; bpos < end; bpos += BSIZE_FILE)
+            {
+                std::map < uint64_t, std::vector < char > >::iterator b = this->blocks.find(bpos);
+                if (b == this->blocks.end())
+                {
+                    // Start from what is on disk (or zeros, past its end).
+                    b = this->blocks.insert(std::make_pair(bpos, std::vector < char > (BSIZE_FILE, 0))).first;
+                    this->fd->readThrough(&b->second[0], BSIZE_FILE, bpos);
+                }
+                uint64_t from = std::max(start, bpos);
+                uint64_t to = std::min(end, bpos + BSIZE_FILE);
+                memcpy(&b->second[from - bpos], data + (from - start), to - from);
+            }
+        }
+
+        void Journal::patch(const char *data, std::streamsize count, std::streampos pos)
+        {
+            uint64_t start = (uint64_t) pos;
+            uint64_t end = start + count;
+            if (!this->applied.empty())
+            {
+                std::set < uint64_t >::iterator a = this->applied.lower_bound(start - start % BSIZE_FILE);
+                if (a != this->applied.end() && *a < end)
+                    this->retire();
+            }
+            if (this->blocks.empty())
+                return;
+            std::map < uint64_t, std::vector < char > >::iterator b = this->blocks.lower_bound(start - start % BSIZE_FILE);
+            for (; b != this->blocks.end() && b->first < end; b++)
+            {
+                uint64_t from = std::max(start, b->first);
+                uint64_t to = std::min(end, b->first + BSIZE_FILE);
+                memcpy(&b->second[from - b->first], data + (from - start), to - from);
+            }
+        }
+
+        std::streamsize Journal::overlay(char *out, std::streamsize count, std::streampos pos, std::streamsize got)
+        {
+            if (this->blocks.empty())
+                return got;
+            uint64_t start = (uint64_t) pos;
+            uint64_t end = start + count;
+            uint64_t valid = start + std::max < std::streamsize > (got, 0);
+            std::map < uint64_t, std::vector < char > >::iterator b = this->blocks.lower_bound(start - start % BSIZE_FILE);
+            for (; b != this->blocks.end() && b->first < end; b++)
+            {
+                uint64_t from = std::max(start, b->first);
+                uint64_t to = std::min(end, b->first + BSIZE_FILE);
+                if (from > valid)
+                    memset(out + (valid - start), 0, from - valid);
+                memcpy(out + (from - start), &b->second[from - b->first], to - from);
+                valid = std::max(valid, to);
+            }
+            return valid - start;
+        }
+
+        bool Journal::holds(uint64_t pos, uint64_t count) const
+        {
+            if (this->blocks.empty() || count == 0)
+                return false;
+            std::map < uint64_t, std::vector < char > >::const_iterator b = this->blocks.lower_bound(pos - pos % BSIZE_FILE);
+            return b != this->blocks.end() && b->first < pos + count;
+        }
+
+        bool Journal::flush()
+        {
+            if (!this->isAvailable())
+                return true;
+
+            bool ok = this->writeBlocks();
+            this->retire();
+            return ok && !this->fd->fail();
+        }
+
+        void Journal::getStatistics(uint64_t& groups, uint64_t& transactions) const
+        {
+            groups = this->groups;
+            transactions = this->transactions;
+        }
+
+        bool Journal::isPending(BlockStream * fd, const Format* format)
+        {
+            if (fd == NULL || format->length_journal == 0)
+                return false;
+            char header[sizeof(journal_magic)];
+            return fd->readThrough(header, sizeof(header), OFFSET_JOURNAL) == sizeof(header) &&
+                   memcmp(header, journal_magic, sizeof(journal_magic)) == 0;
+        }
+
+        size_t Journal::getCapacity() const
+        {
+            // One block of the journal area is the header, and each
+            // descriptor block addresses journal_descriptor_slots blocks.
+            size_t slots = this->format->length_journal / BSIZE_FILE - 1;
+            return slots * journal_descriptor_slots / (journal_descriptor_slots + 1);
+        }
+
+        bool Journal::writeBlocks()
+        {
+            bool ok = true;
+            std::vector < std::map < uint64_t, std::vector < char > >::iterator > group;
+            for (std::map < uint64_t, std::vector < char > >::iterator i = this->blocks.begin(); i != this->blocks.end(); i++)
+            {
+                group.push_back(i);
+                if (group.size() == this->getCapacity())
+                {
+                    ok = this->writeGroup(group) && ok;
+                    group.clear();
+                }
+            }
+            if (!group.empty())
+                ok = this->writeGroup(group) && ok;
+            this->blocks.clear();
+            return ok;
+        }
+
+        bool Journal::writeGroup(const std::vector < std::map < uint64_t, std::vector < char > >::iterator >& group)
+        {
+            // The previous group has to be in place before the journal
+            // holding it is overwritten.
+            if (this->unsynced)
+                this->fd->sync();
+            this->unsynced = false;
+            this->applied.clear();
+
+            uint32_t count = group.size();
+            uint32_t descriptors = (count + journal_descriptor_slots - 1) / journal_descriptor_slots;
+            std::vector < char > log((size_t) (descriptors + count) * BSIZE_FILE, 0);
+            for (uint32_t i = 0; i < count; i += 1)
+            {
+                Endian::putU64(&log[i * 8], group[i]->first);
+                memcpy(&log[(descriptors + i) * BSIZE_FILE], &group[i]->second[0], BSIZE_FILE);
+            }
+
+            char header[journal_header_size] = { 0 };
+            memcpy(header, journal_magic, sizeof(journal_magic));
+            Endian::putU64(header + 8, this->sequence);
+            Endian::putU32(header + 16, count);
+            Endian::putU32(header + 20, descriptors);
+            Endian::putU64(header + 24, Journal::checksum(&log[0], log.size()));
+            this->fd->writeThrough(&log[0], log.size(), OFFSET_JOURNAL + BSIZE_FILE);
+            this->fd->writeThrough(header, journal_header_size, OFFSET_JOURNAL);
+            this->fd->sync();
+            if (this->fd->fail())
+            {
+                Logging::showErrorW("JOURNAL: Unable to write a group of metadata changes to the journal.");
+                return false;
+            }
+
+            // Now the group is safe, write it in place, a run of
+            // contiguous blocks at a time.
+            for (uint32_t i = 0; i < count; )
+            {
+                uint32_t run = 1;
+                while (i + run < count && group[i + run]->first == group[i]->first + run * BSIZE_FILE)
+                    run += 1;
+                this->fd->writeThrough(&log[(descriptors + i) * BSIZE_FILE], (std::streamsize) run * BSIZE_FILE, group[i]->first);
+                for (uint32_t j = i; j < i + run; j += 1)
+                    this->applied.insert(group[j]->first);
+                i += run;
+            }
+            this->unsynced = true;
+            this->sequence += 1;
+            this->groups += 1;
+            return !this->fd->fail();
+        }
+
+        void Journal::retire()
+        {
+            if (!this->unsynced)
+                return;
+            this->fd->sync();
+            char zero[journal_header_size] = { 0 };
+            this->fd->writeThrough(zero, journal_header_size, OFFSET_JOURNAL);
+            this->fd->sync();
+            this->unsynced = false;
+            this->applied.clear();
+        }
+
+        uint64_t Journal::checksum(const char *data, size_t length)
+        {
+            uint8_t out[8];
+            siphash24(out, data, length, journal_key);
+            return Endian::getU64((const char *) out);
+        }
+
+        Transaction::Transaction(FS * filesystem)
+        {
+            this->filesystem = filesystem;
+            this->filesystem->getLock()->lockExclusive();
+            this->filesystem->beginTransaction();
+        }
+
+        Transaction::~Transaction()
+        {
+            this->filesystem->commitTransaction();
+            this->filesystem->getLock()->unlock();
+        }
+    }
+}
@@ -0,0 +1,165 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_JOURNAL
+#define CLASS_LOWLEVEL_JOURNAL
+
+#include "src/package-fs/config.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        class Journal;
+        class Transaction;
+    }
+}
+
+#include <map>
+#include <set>
+#include <vector>
+#include <time.h>
+#include "src/package-fs/lowlevel/blockstream.h"
+#include "src/package-fs/lowlevel/format.h"
+#include "src/package-fs/lowlevel/fs.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! The write-ahead journal of metadata changes to a package.
+        /*!
+         * While a transaction is open, every write made through the
+         * BlockStream is recorded against a copy of the blocks it
+         * touches instead of going to disk, and reads are served from
+         * those copies.  Transactions are committed in groups: once a
+         * group holds half of the journal, or JOURNAL_COMMIT_INTERVAL
+         * seconds after it was started, its blocks are written to the
+         * journal area (the last LENGTH_JOURNAL bytes of the bootstrap
+         * area), followed by a header with a checksum of them, and only
+         * then written in place.  A package that was not closed cleanly
+         * has the last group replayed when it is opened, so each group
+         * (and so each transaction) is either applied in full or not at
+         * all.
+         *
+         * File data is written with BlockStream::writeDataAt, which is
+         * never journaled but keeps the recorded copies up to date.  A
+         * transaction that changes more blocks than fit in the journal
+         * is written out a journal's worth at a time, so is not atomic.
+         *
+         * Callers hold the package lock exclusively while changing the
+         * journal (see Transaction), so it does not lock itself.  Only
+         * version 2 packages have a journal.
+         */
+        class Journal
+        {
+        public:
+            Journal(BlockStream * fd, const Format* format);
+
+            //! Returns whether the package has a journal.
+            bool isAvailable() const;
+
+            //! Replays the last committed group if the package was not
+            //! closed cleanly.  This must be called before anything else
+            //! is read from the package.
+            bool recover();
+
+            //! Starts a transaction.  Transactions may be nested, and the
+            //! changes made are committed when the outermost one ends.
+            void begin();
+
+            //! Ends a transaction, writing out the current group if it
+            //! is large or old enough.
+            void commit();
+
+            //! Writes out the current group if no transaction is open and
+            //! it was started JOURNAL_COMMIT_INTERVAL seconds ago or more,
+            //! so that a package that goes quiet after a change doesn't
+            //! keep the group in memory until the next one.
+            bool commitExpired();
+
+            //! Returns whether writes are currently being recorded.
+            bool isRecording() const;
+
+            //! Records a write made during a transaction.
+            void record(const char *data, std::streamsize count, std::streampos pos);
+
+            //! Updates the recorded blocks with a write that went straight
+            //! to disk.
+            void patch(const char *data, std::streamsize count, std::streampos pos);
+
+            //! Copies the recorded blocks over data that was read from
+            //! disk, returning the number of bytes of the request that are
+            //! now valid (got being the number that were read).
+            std::streamsize overlay(char *out, std::streamsize count, std::streampos pos, std::streamsize got);
+
+            //! Returns whether any of count bytes at pos would be served
+            //! from the recorded blocks rather than the disk.
+            bool holds(uint64_t pos, uint64_t count) const;
+
+            //! Writes out the current group, and makes sure that it has
+            //! reached the disk in place so that the journal is clear.
+            bool flush();
+
+            //! Returns the number of groups and transactions committed
+            //! since the package was opened.
+            void getStatistics(uint64_t& groups, uint64_t& transactions) const;
+
+            //! Returns whether the journal area of a package holds a group
+            //! that has not been cleared, as it does after an unclean
+            //! shutdown until the package is opened again.
+            static bool isPending(BlockStream * fd, const Format* format);
+
+        private:
+            BlockStream * fd;
+            const Format* format;
+
+            //! The copies of the blocks changed by the current group, by
+            //! their position.
+            std::map < uint64_t, std::vector < char > > blocks;
+
+            //! The positions of the blocks of the last group written in
+            //! place, while its header is still in the journal.  Writes to
+            //! these blocks that bypass the journal have to clear the
+            //! header first, or they'd be undone by a replay.
+            std::set < uint64_t > applied;
+            bool unsynced;
+
+            unsigned int depth;
+            uint64_t sequence;
+            time_t started;
+            uint64_t groups;
+            uint64_t transactions;
+
+            //! Returns the number of blocks a single group can hold.
+            size_t getCapacity() const;
+
+            //! Writes out the recorded blocks, in as many groups as it
+            //! takes.
+            bool writeBlocks();
+
+            //! Writes a group of blocks to the journal and then in place.
+            bool writeGroup(const std::vector < std::map < uint64_t, std::vector < char > >::iterator >& group);
+
+            //! Makes the last group durable in place and clears the header.
+            void retire();
+
+            //! Returns the checksum of the journaled blocks of a group.
+            static uint64_t checksum(const char *data, size_t length);
+        };
+
+        //! Holds the package lock exclusively for the lifetime of the
+        //! object, as ExclusiveLock does, with the changes made while it
+        //! is held forming one transaction of the journal.
+        class Transaction
+        {
+        public:
+            Transaction(FS * filesystem);
+            ~Transaction();
+
+        private:
+            FS * filesystem;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,213 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <string.h>
+#include <algorithm>
+#include "src/package-fs/lowlevel/profile.h"
+#include "src/package-fs/lowlevel/endian.h"
+#include "src/package-fs/logging.h"
+
+extern "C"
+{
+#include "src/shared/siphash24.h"
+}
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        // The profile header is followed by its ranges, each stored as
+        // the position of its first block and its length in blocks.
+        static const char profile_magic[8] = { 'A', 'p', 'p', 'F', 'S', 'P', 'r', 'f' };
+        static const uint32_t profile_header_size = 32;
+        static const uint32_t profile_entry_size = 12;
+
+        // The key used to checksum the ranges.
+        static const uint8_t profile_key[16] =
+        {
+            0x41, 0x70, 0x70, 0x46, 0x53, 0x20, 0x70, 0x72,
+            0x6f, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x63, 0x6b
+        };
+
+        Profile::Profile(BlockStream * fd, const Format* format)
+        {
+            this->fd = fd;
+            this->format = format;
+        }
+
+        bool Profile::isAvailable() const
+        {
+            return this->fd != NULL && this->format->length_profile != 0;
+        }
+
+        size_t Profile::getCapacity() const
+        {
+            return (this->format->length_profile - profile_header_size) / profile_entry_size;
+        }
+
+        bool Profile::load()
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            this->ranges.clear();
+            if (!this->isAvailable())
+                return false;
+
+            char header[profile_header_size];
+            if (this->fd->readThrough(header, profile_header_size, OFFSET_PROFILE) != profile_header_size ||
+                memcmp(header, profile_magic, sizeof(profile_magic)) != 0)
+                return false;
+
+            uint32_t count = Endian::getU32(header + 8);
+            uint64_t sum = Endian::getU64(header + 16);
+            if (count == 0 || count > this->getCapacity())
+                return false;
+
+            std::vector < char > entries((size_t) count * profile_entry_size);
+            if (this->fd->readThrough(&entries[0], entries.size(), OFFSET_PROFILE + profile_header_size) != (std::streamsize) entries.size() ||
+                Profile::checksum(&entries[0], entries.size()) != sum)
+            {
+                Logging::showWarningW("PROFILE: Ignoring a damaged prefetch profile.");
+                return false;
+            }
+
+            this->ranges.resize(count);
+            for (uint32_t i = 0; i < count; i += 1)
+            {
+                this->ranges[i].first = Endian::getU64(&entries[i * profile_entry_size]);
+                this->ranges[i].second = (uint64_t) Endian::getU32(&entries[i * profile_entry_size + 8]) * BSIZE_FILE;
+            }
+            return true;
+        }
+
+        bool Profile::save()
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            if (!this->isAvailable())
+                return false;
+
+            // Join ranges across ever larger gaps until they fit.
+            uint64_t gap = PROFILE_MERGE_GAP;
+            this->merge(gap);
+            while (this->ranges.size() > this->getCapacity())
+            {
+                gap *= 2;
+                this->merge(gap);
+            }
+
+            uint32_t count = this->ranges.size();
+            std::vector < char > entries((size_t) count * profile_entry_size + 1, 0);
+            for (uint32_t i = 0; i < count; i += 1)
+            {
+                Endian::putU64(&entries[i * profile_entry_size], this->ranges[i].first);
+                Endian::putU32(&entries[i * profile_entry_size + 8], this->ranges[i].second / BSIZE_FILE);
+            }
+
+            // The header is written last, so a profile that is only
+            // partly written fails its checksum.
+            char header[profile_header_size] = { 0 };
+            memcpy(header, profile_magic, sizeof(profile_magic));
+            Endian::putU32(header + 8, count);
+            Endian::putU64(header + 16, Profile::checksum(&entries[0], (size_t) count * profile_entry_size));
+            char zero[profile_header_size] = { 0 };
+            this->fd->writeThrough(zero, profile_header_size, OFFSET_PROFILE);
+            if (count > 0)
+                this->fd->writeThrough(&entries[0], (size_t) count * profile_entry_size, OFFSET_PROFILE + profile_header_size);
+            this->fd->writeThrough(header, profile_header_size, OFFSET_PROFILE);
+            this->fd->sync();
+            return !this->fd->fail();
+        }
+
+        void Profile::start()
+        {
+            {
+                std::lock_guard < std::mutex > guard(this->mutex);
+                this->ranges.clear();
+            }
+            if (this->isAvailable())
+                this->fd->setProfile(this);
+        }
+
+        void Profile::stop()
+        {
+            if (this->isAvailable())
+                this->fd->setProfile(NULL);
+        }
+
+        void Profile::record(uint64_t pos, uint64_t count)
+        {
+            // Reads of the bootstrap area (the journal and this profile)
+            // aren't part of the application.
+            if (count == 0 || pos < OFFSET_LOOKUP)
+                return;
+            uint64_t start = pos - pos % BSIZE_FILE;
+            uint64_t end = pos + count;
+            if (end % BSIZE_FILE != 0)
+                end += BSIZE_FILE - end % BSIZE_FILE;
+
+            std::lock_guard < std::mutex > guard(this->mutex);
+            if (!this->ranges.empty())
+            {
+                // Sequential reads extend the last range.
+                std::pair < uint64_t, uint64_t >& last = this->ranges.back();
+                if (start >= last.first && start <= last.first + last.second)
+                {
+                    if (end > last.first + last.second)
+                        last.second = end - last.first;
+                    return;
+                }
+            }
+            this->ranges.push_back(std::make_pair(start, end - start));
+
+            // Keep what is held while recording bounded.
+            if (this->ranges.size() >= this->getCapacity() * 4)
+                this->merge(0);
+        }
+
+        uint64_t Profile::prefetch()
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            uint64_t total = 0;
+            for (size_t i = 0; i < this->ranges.size(); i += 1)
+            {
+                this->fd->prefetch(this->ranges[i].first, this->ranges[i].second);
+                total += this->ranges[i].second;
+            }
+            return total;
+        }
+
+        std::vector < std::pair < uint64_t, uint64_t > > Profile::getRanges()
+        {
+            std::lock_guard < std::mutex > guard(this->mutex);
+            return this->ranges;
+        }
+
+        void Profile::merge(uint64_t gap)
+        {
+            if (this->ranges.empty())
+                return;
+            std::sort(this->ranges.begin(), this->ranges.end());
+            size_t out = 0;
+            for (size_t i = 1; i < this->ranges.size(); i += 1)
+            {
+                std::pair < uint64_t, uint64_t >& last = this->ranges[out];
+                const std::pair < uint64_t, uint64_t >& next = this->ranges[i];
+                if (next.first <= last.first + last.second + gap)
+                {
+                    if (next.first + next.second > last.first + last.second)
+                        last.second = next.first + next.second - last.first;
+                }
+                else
+                    this->ranges[++out] = next;
+            }
+            this->ranges.resize(out + 1);
+        }
+
+        uint64_t Profile::checksum(const char *data, size_t length)
+        {
+            uint8_t out[8];
+            siphash24(out, data, length, profile_key);
+            return Endian::getU64((const char *) out);
+        }
+    }
+}
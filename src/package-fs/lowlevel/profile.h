@@ -0,0 +1,97 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_PROFILE
+#define CLASS_LOWLEVEL_PROFILE
+
+#include "src/package-fs/config.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        class Profile;
+    }
+}
+
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "src/package-fs/lowlevel/blockstream.h"
+#include "src/package-fs/lowlevel/format.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! The prefetch profile of a package: the parts of it that are
+        //! read when the application it holds starts.
+        /*!
+         * While recording, every read made through the BlockStream is
+         * noted, rounded out to whole blocks.  When the profile is
+         * saved the ranges are sorted by position and those less than
+         * PROFILE_MERGE_GAP apart are joined, so that replaying it is a
+         * short run of large sequential reads rather than the scattered
+         * block-sized ones the application made.  It is stored in
+         * LENGTH_PROFILE bytes at OFFSET_PROFILE, behind a header with a
+         * checksum of the ranges.
+         *
+         * Replaying a profile only asks the kernel to read the ranges
+         * ahead into the page cache; it doesn't wait for them or check
+         * that they are still what the application reads, so a stale
+         * profile costs some wasted I/O and nothing else.  Only version
+         * 2 packages have a profile.
+         */
+        class Profile
+        {
+        public:
+            Profile(BlockStream * fd, const Format* format);
+
+            //! Returns whether the package has room for a profile.
+            bool isAvailable() const;
+
+            //! Reads the profile stored in the package, returning false
+            //! if there isn't a valid one.
+            bool load();
+
+            //! Writes the recorded ranges to the package, replacing any
+            //! profile it had.  The package must be locked exclusively.
+            bool save();
+
+            //! Starts recording the reads made through the BlockStream,
+            //! discarding the ranges held until now.
+            void start();
+
+            //! Stops recording.
+            void stop();
+
+            //! Notes a read of count bytes at pos.
+            void record(uint64_t pos, uint64_t count);
+
+            //! Asks for each of the ranges to be read ahead, returning
+            //! the number of bytes asked for.
+            uint64_t prefetch();
+
+            //! Returns the ranges held, as positions and lengths.
+            std::vector < std::pair < uint64_t, uint64_t > > getRanges();
+
+        private:
+            BlockStream * fd;
+            const Format* format;
+
+            std::mutex mutex;
+            std::vector < std::pair < uint64_t, uint64_t > > ranges;
+
+            //! Returns the number of ranges that fit in the profile area.
+            size_t getCapacity() const;
+
+            //! Sorts the ranges and joins those less than gap bytes
+            //! apart.  The mutex must be held.
+            void merge(uint64_t gap);
+
+            //! Returns the checksum of the encoded ranges.
+            static uint64_t checksum(const char *data, size_t length);
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,83 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <assert.h>
+#include "src/package-fs/lowlevel/rwlock.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        RWLock::RWLock()
+        {
+            pthread_rwlock_init(&this->lock, NULL);
+        }
+
+        RWLock::~RWLock()
+        {
+            pthread_rwlock_destroy(&this->lock);
+        }
+
+        RWLock::Hold * RWLock::getHold()
+        {
+            Hold initial = { 0, false };
+            return this->holds.get(initial);
+        }
+
+        void RWLock::lockShared()
+        {
+            Hold * hold = this->getHold();
+            if (hold->depth == 0)
+            {
+                pthread_rwlock_rdlock(&this->lock);
+                hold->exclusive = false;
+            }
+            hold->depth += 1;
+        }
+
+        void RWLock::lockExclusive()
+        {
+            Hold * hold = this->getHold();
+            if (hold->depth == 0)
+            {
+                pthread_rwlock_wrlock(&this->lock);
+                hold->exclusive = true;
+            }
+            else
+                assert( /* Shared locks can not be upgraded. */ hold->exclusive);
+            hold->depth += 1;
+        }
+
+        void RWLock::unlock()
+        {
+            Hold * hold = this->getHold();
+            assert( /* Lock must be held. */ hold->depth > 0);
+            hold->depth -= 1;
+            if (hold->depth == 0)
+                pthread_rwlock_unlock(&this->lock);
+        }
+
+        SharedLock::SharedLock(RWLock * lock)
+        {
+            this->lock = lock;
+            this->lock->lockShared();
+        }
+
+        SharedLock::~SharedLock()
+        {
+            this->lock->unlock();
+        }
+
+        ExclusiveLock::ExclusiveLock(RWLock * lock)
+        {
+            this->lock = lock;
+            this->lock->lockExclusive();
+        }
+
+        ExclusiveLock::~ExclusiveLock()
+        {
+            this->lock->unlock();
+        }
+    }
+}
@@ -0,0 +1,80 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_RWLOCK
+#define CLASS_LOWLEVEL_RWLOCK
+
+#include "src/package-fs/config.h"
+
+#include <pthread.h>
+#include "src/package-fs/lowlevel/threadlocal.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! A reader/writer lock that the owning thread may re-enter.
+        /*!
+         * Any number of threads may hold the lock shared, or a single
+         * thread may hold it exclusively.  A thread that already holds
+         * the lock may acquire it again (in either mode if it holds it
+         * exclusively, or shared if it holds it shared); the lock is
+         * released when the outermost holder unlocks it.  A thread
+         * holding the lock shared must not try to acquire it
+         * exclusively.
+         */
+        class RWLock
+        {
+        public:
+            RWLock();
+            ~RWLock();
+
+            //! Acquires the lock for reading.
+            void lockShared();
+
+            //! Acquires the lock for writing.
+            void lockExclusive();
+
+            //! Releases the lock acquired by the last call to
+            //! lockShared or lockExclusive on this thread.
+            void unlock();
+
+        private:
+            pthread_rwlock_t lock;
+
+            struct Hold
+            {
+                unsigned int depth;
+                bool exclusive;
+            };
+
+            //! The per-thread hold state of the lock.
+            ThreadLocal < Hold > holds;
+
+            Hold * getHold();
+        };
+
+        //! Holds an RWLock shared for the lifetime of the object.
+        class SharedLock
+        {
+        public:
+            SharedLock(RWLock * lock);
+            ~SharedLock();
+
+        private:
+            RWLock * lock;
+        };
+
+        //! Holds an RWLock exclusively for the lifetime of the object.
+        class ExclusiveLock
+        {
+        public:
+            ExclusiveLock(RWLock * lock);
+            ~ExclusiveLock();
+
+        private:
+            RWLock * lock;
+        };
+    }
+}
+
+#endif
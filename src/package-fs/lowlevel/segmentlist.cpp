@@ -0,0 +1,74 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include "src/package-fs/lowlevel/segmentlist.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        SegmentList::SegmentList(const Format* format)
+        {
+            this->format = format;
+        }
+
+        uint64_t SegmentList::resolve(uint64_t offset) const
+        {
+            uint64_t index = offset / BSIZE_FILE;
+            if (index >= this->blocks.size() || this->isCompressed(index))
+                return 0;
+            return this->getPosition(index) + (offset % BSIZE_FILE);
+        }
+
+        bool SegmentList::isCompressed(uint64_t index) const
+        {
+            uint64_t first = index - (index % EXTENT_BLOCKS);
+            if (first >= this->blocks.size())
+                return false;
+            return (this->blocks[first] & SEGMENT_COMPRESSED) != 0;
+        }
+
+        bool SegmentList::isShared(uint64_t index) const
+        {
+            if (index >= this->blocks.size())
+                return false;
+            return (this->blocks[index] & SEGMENT_SHARED) != 0;
+        }
+
+        uint64_t SegmentList::getPosition(uint64_t index) const
+        {
+            if (index >= this->blocks.size())
+                return 0;
+            return this->blocks[index] & ~(uint64_t) SEGMENT_FLAGS_MASK;
+        }
+
+        uint64_t SegmentList::getSlotPosition(uint64_t index) const
+        {
+            uint64_t in_file = this->format->getSegmentsInFileBlock();
+            uint64_t in_info = this->format->getSegmentsInInfoBlock();
+            if (index < in_file)
+                return this->infos[0] + this->format->hsize_file + (index * this->format->pos_size);
+            index -= in_file;
+            uint64_t info = 1 + (index / in_info);
+            if (info >= this->infos.size())
+                return 0;
+            return this->infos[info] + this->format->hsize_seginfo + ((index % in_info) * this->format->pos_size);
+        }
+
+        uint64_t SegmentList::getInfoBlocksNeeded(uint64_t count) const
+        {
+            uint64_t in_file = this->format->getSegmentsInFileBlock();
+            uint64_t in_info = this->format->getSegmentsInInfoBlock();
+            if (count <= in_file)
+                return 0;
+            count -= in_file;
+            return (count + in_info - 1) / in_info;
+        }
+
+        const Format* SegmentList::getFormat() const
+        {
+            return this->format;
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_SEGMENTLIST
+#define CLASS_LOWLEVEL_SEGMENTLIST
+
+#include "src/package-fs/config.h"
+
+#include <vector>
+#include "src/package-fs/lowlevel/format.h"
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! The decoded segment list of a file.
+        /*!
+         * A file's data block positions are stored in its file
+         * information block, continuing into a linked list of segment
+         * information blocks.  This holds that list in memory so that a
+         * position in the file can be resolved to a position on disk
+         * without walking the list.
+         */
+        class SegmentList
+        {
+        public:
+            SegmentList(const Format* format);
+
+            //! The position of each data block, in file order.
+            std::vector<uint64_t> blocks;
+
+            //! The position of the file information block, followed by
+            //! the position of each segment information block.
+            std::vector<uint64_t> infos;
+
+            //! Returns the disk position for the specified offset into
+            //! the file, or 0 if the offset isn't backed by a block (or
+            //! falls in a compressed extent).
+            uint64_t resolve(uint64_t offset) const;
+
+            //! Returns whether the extent containing the specified data
+            //! block is compressed.
+            bool isCompressed(uint64_t index) const;
+
+            //! Returns whether the specified data block is shared with
+            //! other files.
+            bool isShared(uint64_t index) const;
+
+            //! Returns the disk position of the specified data block,
+            //! without the flags stored with it.
+            uint64_t getPosition(uint64_t index) const;
+
+            //! Returns the disk position of the slot holding the position
+            //! of the specified data block.  The segment information block
+            //! for the slot must already be allocated.
+            uint64_t getSlotPosition(uint64_t index) const;
+
+            //! Returns the number of segment information blocks (not
+            //! including the file information block) needed to address
+            //! the specified number of data blocks.
+            uint64_t getInfoBlocksNeeded(uint64_t count) const;
+
+            //! Returns the layout of the package the file belongs to.
+            const Format* getFormat() const;
+
+        private:
+            const Format* format;
+        };
+    }
+}
+
+#endif
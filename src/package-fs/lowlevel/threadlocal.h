@@ -0,0 +1,93 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_THREADLOCAL
+#define CLASS_LOWLEVEL_THREADLOCAL
+
+#include "src/package-fs/config.h"
+
+#include <mutex>
+#include <unordered_set>
+#include <pthread.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! A value of which each thread has its own copy, for members
+        //! of objects that are shared between threads.
+        /*!
+         * A thread's copy is made the first time it asks for one, and
+         * is freed when the thread exits or the ThreadLocal is
+         * destroyed, whichever comes first.  The ThreadLocal must not
+         * be destroyed while other threads are still using it.
+         */
+        template < typename T > class ThreadLocal
+        {
+        public:
+            ThreadLocal()
+            {
+                pthread_key_create(&this->key, &ThreadLocal::release);
+            }
+
+            ~ThreadLocal()
+            {
+                pthread_key_delete(this->key);
+                std::lock_guard < std::mutex > guard(this->mutex);
+                for (typename std::unordered_set < Slot * >::iterator i = this->slots.begin(); i != this->slots.end(); i++)
+                    delete *i;
+            }
+
+            //! Returns the calling thread's copy, or NULL if it has
+            //! none yet.
+            T * peek() const
+            {
+                Slot * slot = (Slot *) pthread_getspecific(this->key);
+                return (slot == NULL) ? NULL : &slot->value;
+            }
+
+            //! Returns the calling thread's copy, starting it as a copy
+            //! of initial if it has none yet.
+            T * get(const T& initial)
+            {
+                Slot * slot = (Slot *) pthread_getspecific(this->key);
+                if (slot == NULL)
+                {
+                    slot = new Slot(this, initial);
+                    {
+                        std::lock_guard < std::mutex > guard(this->mutex);
+                        this->slots.insert(slot);
+                    }
+                    pthread_setspecific(this->key, slot);
+                }
+                return &slot->value;
+            }
+
+        private:
+            struct Slot
+            {
+                Slot(ThreadLocal * owner, const T& value) : owner(owner), value(value) { }
+                ThreadLocal * owner;
+                T value;
+            };
+
+            pthread_key_t key;
+            std::mutex mutex;
+            std::unordered_set < Slot * > slots;
+
+            ThreadLocal(const ThreadLocal&);
+            ThreadLocal& operator=(const ThreadLocal&);
+
+            static void release(void *data)
+            {
+                Slot * slot = (Slot *) data;
+                {
+                    std::lock_guard < std::mutex > guard(slot->owner->mutex);
+                    slot->owner->slots.erase(slot);
+                }
+                delete slot;
+            }
+        };
+    }
+}
+
+#endif
@@ -111,8 +111,15 @@ namespace AppLib
         }
 
         bool Util::createPackage(std::string path, const char* appname, const char* appver,
-                            const char* appdesc, const char* appauthor)
+                            const char* appdesc, const char* appauthor, uint16_t version)
         {
+            const Format* format = Format::get(version);
+            if (format == NULL)
+            {
+                AppLib::Logging::showErrorW("Package format version %u is not supported.", version);
+                return false;
+            }
+
             // Open the new package.
             std::fstream * nfd = new std::fstream(path.c_str(),
                 std::ios::out | std::ios::trunc | std::ios::in | std::ios::binary);
@@ -122,31 +129,28 @@ namespace AppLib
                 return false;
             }
 
-            // Write out 1MB for the bootstrap area.
+            // Write out the zeros of the bootstrap area.  Each area of the
+            // package is built up in memory and written in one request.
 #if OFFSET_BOOTSTRAP != 0
 #error The createPackage() function is written under the assumption that the bootstrap
 #error offset is 0, hence the library will not operate correctly with a different offset.
 #endif
-            for (int i = 0; i < LENGTH_BOOTSTRAP; i += 1)
-            {
-                nfd->write("\0", 1);
-            }
+            std::vector<char> area(LENGTH_BOOTSTRAP, 0);
+            nfd->write(&area[0], LENGTH_BOOTSTRAP);
 
-            // Write out the INode lookup table.
-            for (int i = 0; i < LENGTH_LOOKUP / 4; i += 1)
-            {
-                if (i == 0)
-                {
-                    uint32_t pos = OFFSET_DATA;
-                    nfd->write(reinterpret_cast<char *>(&pos), 4);
-                }
-                else
-                    nfd->write("\0\0\0\0", 4);
-            }
+            // Write out the INode lookup table.  In a version 2 package
+            // the table points at lookup blocks instead, and the first of
+            // them is placed straight after the root inode.
+            uint64_t lookup_first = (format->version == FORMAT_VERSION_1) ? OFFSET_DATA : OFFSET_DATA + BSIZE_FILE;
+            area.assign(LENGTH_LOOKUP, 0);
+            format->putPos(&area[0], lookup_first);
+            nfd->write(&area[0], LENGTH_LOOKUP);
 
             // Now add the FSInfo inode at OFFSET_FSINFO.
-            INode fsnode(0, "", INodeType::INT_FSINFO);
-            fsnode.ver_major = LIBRARY_VERSION_MAJOR;
+            FSInfo fsnode;
+            // Version 1 packages have always recorded the library's major
+            // version here, which is below 2.
+            fsnode.ver_major = (version == FORMAT_VERSION_1) ? LIBRARY_VERSION_MAJOR : version;
             fsnode.ver_minor = LIBRARY_VERSION_MINOR;
             fsnode.ver_revision = LIBRARY_VERSION_REVISION;
             fsnode.setAppName(appname);
@@ -156,12 +160,9 @@ namespace AppLib
             fsnode.pos_root = OFFSET_DATA;
             fsnode.pos_freelist = 0; // The first FreeList block will automatically be
                          // created when the first block is freed.
-            std::string fsnode_towrite = fsnode.getBinaryRepresentation();
-            nfd->write(fsnode_towrite.c_str(), fsnode_towrite.size());
-            for (int i = fsnode_towrite.size(); i < LENGTH_FSINFO; i += 1)
-            {
-                nfd->write("\0", 1);
-            }
+            area.assign(LENGTH_FSINFO, 0);
+            fsnode.writeBinaryRepresentation(&area[0]);
+            nfd->write(&area[0], LENGTH_FSINFO);
 
             time_t rtime;
             time(&rtime);
@@ -176,17 +177,26 @@ namespace AppLib
             rnode.ctime = rtime;
             rnode.parent = 0;
             rnode.children_count = 0;
-            std::string rnode_towrite = rnode.getBinaryRepresentation();
-            nfd->write(rnode_towrite.c_str(), rnode_towrite.size());
-            for (int i = rnode_towrite.size(); i < BSIZE_FILE; i += 1)
+            area.assign(BSIZE_FILE, 0);
+            rnode.writeBinaryRepresentation(&area[0], *format);
+            nfd->write(&area[0], BSIZE_FILE);
+
+            // Add the first lookup block of a version 2 package, which
+            // holds the position of the root inode.
+            if (format->version != FORMAT_VERSION_1)
             {
-                nfd->write("\0", 1);
+                area.assign(BSIZE_FILE, 0);
+                format->putPos(&area[0], OFFSET_DATA);
+                nfd->write(&area[0], BSIZE_FILE);
             }
 
+            bool ok = !nfd->fail();
             nfd->close();
             delete nfd;
+            if (!ok)
+                AppLib::Logging::showErrorW("Unable to write out the new package.");
 
-            return true;
+            return ok;
         }
 
         int Util::translateOpenMode(std::string mode)
@@ -23,8 +23,11 @@ namespace AppLib
                 static void sanitizeArguments(char ** argv, int argc, std::string & command, int start);
                 static bool extractBootstrap(std::string source, std::string dest);
                 static char* getProcessFilename();
+
+                //! Creates an empty package in the specified format version.
                 static bool createPackage(std::string path, const char* appname, const char* appver,
-                            const char* appdesc, const char* appauthor);
+                            const char* appdesc, const char* appauthor,
+                            uint16_t version = FORMAT_VERSION_DEFAULT);
                 static int translateOpenMode(std::string mode);
 
                 //! Utility function for splitting paths into their components.
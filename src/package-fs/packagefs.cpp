@@ -19,6 +19,7 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <errno.h>
 #include <stdlib.h>
 
 #include "packagefs.h"
@@ -26,14 +27,6 @@
 #include "lowlevel/util.h"
 
 extern "C" PackageFS *packagefs_new(const char *path) {
-        PackageFS *packagefs;
-
-        packagefs = (PackageFS*)malloc(sizeof(PackageFS));
-        if (!packagefs)
-        {
-                return (PackageFS*)0;
-        }
-
         if (!AppLib::LowLevel::Util::createPackage(
                 path,
                 "",
@@ -57,37 +50,114 @@ extern "C" PackageFS *packagefs_open(const char *path) {
         }
 
         // TODO: uid / gid?
-        packagefs->fs = new AppLib::FS(path, 0, 0);
+        try
+        {
+                packagefs->fs = new AppLib::FS(path, 0, 0);
+        }
+        catch (std::exception& e)
+        {
+                free(packagefs);
+                return (PackageFS*)0;
+        }
 
         return packagefs;
 }
 
-extern "C" void packagefs_getattr(
+extern "C" int packagefs_getattr(
         PackageFS *packagefs,
         const char* path,
         struct stat* stbufOut)
 {
         if (packagefs == (PackageFS*)0)
+        {
+                return -EINVAL;
+        }
+
+        try
         {
                 ((AppLib::FS*)packagefs->fs)->getattr(
                         std::string(path),
                         *stbufOut);
         }
+        catch (std::exception& e)
+        {
+                return -ENOENT;
+        }
+
+        return 0;
 }
 
-extern "C" void packagefs_readdir(
+extern "C" int packagefs_getattr_batch(
         PackageFS *packagefs,
-        const char* path)
+        const char* const* paths,
+        size_t n,
+        struct stat* stbufsOut,
+        int* results)
 {
         if (packagefs == (PackageFS*)0)
         {
-                std::vector<std::string> entries = ((AppLib::FS*)packagefs->fs)->readdir(std::string(path));
+                return -EINVAL;
+        }
 
-                for (int i = 0; i < entries.size(); i++)
+        std::vector<std::string> batch(paths, paths + n);
+        std::vector<struct stat> stbufs;
+        std::vector<int> res;
+        try
+        {
+                res = ((AppLib::FS*)packagefs->fs)->getattr(batch, stbufs);
+        }
+        catch (std::exception& e)
+        {
+                return -EIO;
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+                stbufsOut[i] = stbufs[i];
+                results[i] = res[i];
+        }
+
+        return 0;
+}
+
+extern "C" int packagefs_readdir(
+        PackageFS *packagefs,
+        const char* path,
+        packagefs_readdir_func_t callback,
+        void *userdata)
+{
+        if (packagefs == (PackageFS*)0)
+        {
+                return -EINVAL;
+        }
+
+        AppLib::FS* fs = (AppLib::FS*)packagefs->fs;
+        int ret = 0;
+        try
+        {
+                struct stat st;
+                fs->getattr(std::string(path), st);
+                if (!S_ISDIR(st.st_mode))
                 {
-                        printf("%s", entries[i].c_str());
+                        return -ENOTDIR;
                 }
+
+                fs->readdirplus((uint32_t)st.st_ino, [&](const std::string& name, const struct stat& entry) -> bool
+                {
+                        ret = callback(name.c_str(), &entry, userdata);
+                        return ret == 0;
+                });
         }
+        catch (AppLib::Exception::FileNotFound& e)
+        {
+                return -ENOENT;
+        }
+        catch (std::exception& e)
+        {
+                return -EIO;
+        }
+
+        return ret;
 }
 
 extern "C" void packagefs_close(PackageFS *packagefs) {
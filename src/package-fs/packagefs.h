@@ -25,23 +25,47 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <sys/stat.h>
+
 typedef struct PackageFS PackageFS;
 
 struct PackageFS {
         void *fs;
 };
 
+/* Called with each entry of a directory; returning non-zero stops the
+ * listing, and packagefs_readdir() returns that value. */
+typedef int (*packagefs_readdir_func_t)(
+        const char *name,
+        const struct stat *st,
+        void *userdata);
+
 PackageFS *packagefs_new(const char *path);
 PackageFS *packagefs_open(const char *path);
 
-void packagefs_getattr(
+int packagefs_getattr(
         PackageFS *packagefs,
         const char* path,
         struct stat* stbufOut);
 
-void packagefs_readdir(
+/* Retrieves the attributes of n paths at once, storing 0 or a negative
+ * errno for each in results. */
+int packagefs_getattr_batch(
         PackageFS *packagefs,
-        const char* path);
+        const char* const* paths,
+        size_t n,
+        struct stat* stbufsOut,
+        int* results);
+
+/* Streams the entries of a directory, with their attributes, to
+ * callback as they are read.  The package must not be changed from
+ * the callback. */
+int packagefs_readdir(
+        PackageFS *packagefs,
+        const char* path,
+        packagefs_readdir_func_t callback,
+        void *userdata);
 
 void packagefs_close(PackageFS *packagefs);
 
@@ -0,0 +1,60 @@
+/* vim: set ts=4 sw=4 tw=0 :*/
+
+#include "src/package-fs/pathcache.h"
+
+namespace AppLib
+{
+    PathCache::PathCache(size_t capacity)
+        : capacity(capacity)
+    {
+    }
+
+    bool PathCache::lookup(const std::string& path, int32_t& out) const
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        std::unordered_map<std::string, int32_t>::const_iterator i = this->entries.find(path);
+        if (i == this->entries.end())
+            return false;
+        out = i->second;
+        return true;
+    }
+
+    void PathCache::insert(const std::string& path, int32_t id)
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        if (this->entries.size() >= this->capacity)
+            this->entries.clear();
+        this->entries[path] = id;
+    }
+
+    void PathCache::insertNegative(const std::string& path)
+    {
+        this->insert(path, -1);
+    }
+
+    void PathCache::invalidate(const std::string& path)
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        this->entries.erase(path);
+    }
+
+    void PathCache::invalidateTree(const std::string& path)
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        std::string prefix = path + "/";
+        std::unordered_map<std::string, int32_t>::iterator i = this->entries.begin();
+        while (i != this->entries.end())
+        {
+            if (i->first == path || i->first.compare(0, prefix.length(), prefix) == 0)
+                i = this->entries.erase(i);
+            else
+                i++;
+        }
+    }
+
+    void PathCache::clear()
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        this->entries.clear();
+    }
+}
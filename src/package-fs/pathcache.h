@@ -0,0 +1,55 @@
+/* vim: set ts=4 sw=4 tw=0 :*/
+
+#ifndef CLASS_PATHCACHE
+#define CLASS_PATHCACHE
+
+#include "src/package-fs/config.h"
+
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+namespace AppLib
+{
+    //! A cache of resolved paths within a package.
+    /*!
+     * Maps normalized absolute paths (such as "/usr/lib") to the
+     * ID of the inode they refer to, or to a negative value if the
+     * path is known not to exist.  When the cache reaches
+     * PATH_CACHE_SIZE entries it is emptied and starts again.
+     * Every method may be called concurrently.
+     */
+    class PathCache
+    {
+    public:
+        PathCache(size_t capacity = PATH_CACHE_SIZE);
+
+        //! Retrieves the cached inode ID for a path, returning
+        //! false if the path is not cached.  A negative ID means
+        //! that the path does not exist.
+        bool lookup(const std::string& path, int32_t& out) const;
+
+        //! Caches the inode ID of a path.
+        void insert(const std::string& path, int32_t id);
+
+        //! Caches that a path does not exist.
+        void insertNegative(const std::string& path);
+
+        //! Drops the cached entry for a single path.
+        void invalidate(const std::string& path);
+
+        //! Drops the cached entry for a path and for every path
+        //! beneath it.
+        void invalidateTree(const std::string& path);
+
+        //! Drops every cached entry.
+        void clear();
+
+    private:
+        size_t capacity;
+        std::unordered_map<std::string, int32_t> entries;
+        mutable std::mutex mutex;
+    };
+}
+
+#endif
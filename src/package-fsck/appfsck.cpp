@@ -0,0 +1,114 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include "src/package-fs/config.h"
+
+#include <stdlib.h>
+#include <iostream>
+#include <thread>
+#include "src/package-fs/logging.h"
+#include "src/package-fs/lowlevel/blockstream.h"
+#include "src/package-fs/lowlevel/checker.h"
+#include "src/package-fs/lowlevel/fs.h"
+#include <getopt.h>
+
+// The exit codes of fsck(8).
+#define APPFSCK_OK          0
+#define APPFSCK_CORRECTED   1
+#define APPFSCK_UNCORRECTED 4
+#define APPFSCK_FAILED      8
+
+static void appfsck_usage()
+{
+    std::cerr << "packagefsck [-r|--repair] [-j|--threads <n>] <diskimage>" << std::endl;
+}
+
+int appfsck_start(int argc, char *argv[])
+{
+    bool repair = false;
+    unsigned int threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    static const struct option options[] = {
+        { "repair", no_argument, NULL, 'r' },
+        { "threads", required_argument, NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "rj:", options, NULL)) >= 0)
+    {
+        switch (c)
+        {
+        case 'r':
+            repair = true;
+            break;
+        case 'j':
+            threads = (unsigned int) atoi(optarg);
+            break;
+        default:
+            appfsck_usage();
+            return APPFSCK_FAILED;
+        }
+    }
+
+    if (argc - optind < 1 || threads == 0)
+    {
+        appfsck_usage();
+        return APPFSCK_FAILED;
+    }
+
+    // Set the application name.
+    AppLib::Logging::setApplicationName(std::string("appfsck"));
+
+    const char *disk_path = argv[optind];
+
+    // Opening the package replays its journal, if it has one.
+    AppLib::LowLevel::BlockStream stream(disk_path, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+    if (!stream.is_open())
+    {
+        AppLib::Logging::showErrorW("Unable to open '%s'.", disk_path);
+        return APPFSCK_FAILED;
+    }
+    AppLib::LowLevel::FS filesystem(&stream);
+    if (!filesystem.isValid())
+    {
+        AppLib::Logging::showErrorW("'%s' is not a valid package.", disk_path);
+        return APPFSCK_FAILED;
+    }
+
+    AppLib::LowLevel::Checker checker(&filesystem, &stream);
+    bool clean = checker.check(threads);
+    int ret = APPFSCK_OK;
+    if (repair && checker.getRepairableCount() > 0)
+    {
+        AppLib::Logging::showInfoW("Repairing the package...");
+        if (!checker.repair())
+            AppLib::Logging::showErrorW("Some of the repairs could not be made.");
+        ret = APPFSCK_CORRECTED;
+
+        // Check again, to report what is left.
+        clean = checker.check(threads);
+    }
+
+    uint64_t inodes, blocks;
+    checker.getStatistics(inodes, blocks);
+    if (!clean)
+    {
+        AppLib::Logging::showErrorW("The package at '%s' has errors:", disk_path);
+        ret = APPFSCK_UNCORRECTED;
+    }
+    else
+        AppLib::Logging::showSuccessW("Checked the package at '%s':", disk_path);
+    AppLib::Logging::showInfoO("  * %llu inodes", (unsigned long long) inodes);
+    AppLib::Logging::showInfoO("  * %llu blocks", (unsigned long long) blocks);
+    AppLib::Logging::showInfoO("  * %llu errors, %llu warnings", (unsigned long long) checker.getErrorCount(),
+            (unsigned long long) checker.getWarningCount());
+    if (!repair && checker.getRepairableCount() > 0)
+        AppLib::Logging::showInfoO("Run again with --repair to fix what can be fixed.");
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    return appfsck_start(argc, argv);
+}
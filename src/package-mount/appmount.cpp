@@ -4,6 +4,8 @@
 #include "src/package-fs/internal/fuselink.h"
 #include "config.h"
 #include "funcdefs.h"
+#include <getopt.h>
+#include <stdlib.h>
 
 std::string global_mount_path = "<not set>";
 
@@ -11,10 +13,40 @@ int appmount_start(int argc, char *argv[])
 {
     const char *disk_path = NULL;
     const char *mount_path = NULL;
+    bool multithreaded = false;
+    bool readonly = false;
+    unsigned int profileTime = PROFILE_RECORD_TIME;
 
-    if (argc < 3)
+    static const struct option options[] = {
+        { "threads", no_argument, NULL, 't' },
+        { "read-only", no_argument, NULL, 'r' },
+        { "profile", required_argument, NULL, 'p' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "trp:", options, NULL)) >= 0)
+    {
+        switch (c)
+        {
+        case 't':
+            multithreaded = true;
+            break;
+        case 'r':
+            readonly = true;
+            break;
+        case 'p':
+            profileTime = (unsigned int) atoi(optarg);
+            break;
+        default:
+            std::cerr << "packagemount [-t|--threads] [-r|--read-only] [-p|--profile <seconds>] <diskimage> <mountpoint>" << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2)
     {
-        std::cerr << "packagemount <diskimage> <mountpoint>" << std::endl;
+        std::cerr << "packagemount [-t|--threads] [-r|--read-only] [-p|--profile <seconds>] <diskimage> <mountpoint>" << std::endl;
         return 1;
     }
 
@@ -22,8 +54,8 @@ int appmount_start(int argc, char *argv[])
     AppLib::Logging::setApplicationName(std::string("appmount"));
 
     // Store the disk path and mount point the user has provided.
-    disk_path = argv[1];
-    mount_path = argv[2];
+    disk_path = argv[optind];
+    mount_path = argv[optind + 1];
     global_mount_path = mount_path;
 
     // Open the file for our lock checks / sets.
@@ -58,7 +90,8 @@ int appmount_start(int argc, char *argv[])
     AppLib::Logging::showInfoO("while mounted and that no other operations can be performed");
     AppLib::Logging::showInfoO("on it while this is the case.");
 
-    AppLib::FUSE::Mounter * mnt = new AppLib::FUSE::Mounter(disk_path, mount_path, true, false, appmount_continue);
+    AppLib::FUSE::Mounter * mnt = new AppLib::FUSE::Mounter(disk_path, mount_path, true, false, appmount_continue,
+            AppLib::LowLevel::BlockStreamBackend::BSB_MMAP, multithreaded, readonly, profileTime);
     int ret = mnt->getResult();
 
     if (ret != 0)
@@ -66,7 +99,7 @@ int appmount_start(int argc, char *argv[])
         // Mount failed.
         AppLib::Logging::showErrorW("FUSE was unable to mount the application package.");
         AppLib::Logging::showErrorO("Check that the package is a valid AppFS filesystem and");
-        AppLib::Logging::showErrorO("run 'apputil check' to scan for filesystem errors.");
+        AppLib::Logging::showErrorO("run 'systemd-packagefsck' to scan for filesystem errors.");
     }
     else
     {
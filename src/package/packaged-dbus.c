@@ -22,16 +22,17 @@
 #include <stdio.h>
 
 #include "util.h"
+#include "path-util.h"
 #include "sd-event.h"
 #include "sd-bus.h"
 #include "bus-errors.h"
 
 #include "packagemanager.h"
 #include "packageref.h"
+#include "packagejob.h"
 #include "../package-fs/packagefs.h"
 
 static int method_get_package(sd_bus *bus, sd_bus_message *message, void *userdata, sd_bus_error *error) {
-        _cleanup_free_ char *p = NULL;
         PackageManager *m = userdata;
         PackageRef *package;
         const char *name;
@@ -49,21 +50,70 @@ static int method_get_package(sd_bus *bus, sd_bus_message *message, void *userda
         if (!package)
                 return sd_bus_error_setf(error, BUS_ERROR_NO_SUCH_MACHINE, "No package '%s' known", name);
 
-        // TODO: Something useful with that.
+        package->last_used = now(CLOCK_MONOTONIC);
+
+        return sd_bus_reply_method_return(message, "s", package->name);
+}
+
+static PackageJob *manager_find_job(PackageManager *m, const char *path) {
+        PackageJob *j;
+        Iterator i;
+
+        assert(m);
+        assert(path);
+
+        HASHMAP_FOREACH(j, m->jobs, i)
+                if (streq(j->path, path))
+                        return j;
+
+        return NULL;
+}
+
+static int manager_start_job(PackageManager *m, PackageJobType type, const char *path, sd_bus_message *message, sd_bus_error *error) {
+        _cleanup_free_ char *p = NULL;
+        PackageJob *j;
+        int r;
+
+        assert(m);
+        assert(path);
+        assert(message);
+
+        /* Concurrent loads of the same package share one job.  Any
+         * other pair would open a package while it is being written
+         * out, so the second request is refused. */
+        j = manager_find_job(m, path);
+        if (j) {
+                if (j->type == PACKAGE_JOB_LOAD && type == PACKAGE_JOB_LOAD)
+                        goto reply;
+
+                if (type == PACKAGE_JOB_CREATE)
+                        return sd_bus_error_setf(error, SD_BUS_ERROR_FILE_EXISTS, "Package '%s' is in use", path);
+
+                return sd_bus_error_set_errnof(error, EBUSY, "Package '%s' is being created", path);
+        }
+
+        j = packagejob_new(m, type, path);
+        if (!j)
+                return -ENOMEM;
+
+        r = packagejob_start(j);
+        if (r < 0) {
+                packagejob_free(j);
+                return sd_bus_error_set_errnof(error, -r, "Failed to start package job: %m");
+        }
+
+        packagejob_send_signal(j, true);
 
-        /*
-        p = machine_bus_path(machine);
+reply:
+        p = packagejob_bus_path(j);
         if (!p)
                 return -ENOMEM;
-        */
 
-        return sd_bus_reply_method_return(message, "s", name);
+        return sd_bus_reply_method_return(message, "o", p);
 }
 
 static int method_create_package(sd_bus *bus, sd_bus_message *message, void *userdata, sd_bus_error *error) {
-        _cleanup_free_ char *p = NULL;
         PackageManager *m = userdata;
-        PackageFS *pkgfs;
         const char *path;
         int r;
 
@@ -75,20 +125,18 @@ static int method_create_package(sd_bus *bus, sd_bus_message *message, void *use
         if (r < 0)
                 return r;
 
-        pkgfs = packagefs_new(path);
-
-        packagefs_close(pkgfs);
+        if (!path_is_absolute(path))
+                return sd_bus_error_setf(error, SD_BUS_ERROR_INVALID_ARGS, "Package path '%s' is not absolute", path);
+        if (hashmap_get(m->packages, path))
+                return sd_bus_error_setf(error, SD_BUS_ERROR_FILE_EXISTS, "Package '%s' is in use", path);
 
-        return sd_bus_reply_method_return(message, "s", "Created Package");
+        return manager_start_job(m, PACKAGE_JOB_CREATE, path, message, error);
 }
 
 static int method_load_package(sd_bus *bus, sd_bus_message *message, void *userdata, sd_bus_error *error) {
-        _cleanup_free_ char *p = NULL;
         PackageManager *m = userdata;
-        PackageFS *pkgfs;
         const char *path;
         int r;
-        struct stat stbuf;
 
         assert(bus);
         assert(message);
@@ -98,19 +146,57 @@ static int method_load_package(sd_bus *bus, sd_bus_message *message, void *userd
         if (r < 0)
                 return r;
 
-        pkgfs = packagefs_open(path);
+        if (!path_is_absolute(path))
+                return sd_bus_error_setf(error, SD_BUS_ERROR_INVALID_ARGS, "Package path '%s' is not absolute", path);
 
-        packagefs_readdir(pkgfs, "/");
+        return manager_start_job(m, PACKAGE_JOB_LOAD, path, message, error);
+}
+
+static int method_mount_package(sd_bus *bus, sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        PackageManager *m = userdata;
+        PackageRef *package;
+        const char *path, *where;
+        int read_only, r;
+
+        assert(bus);
+        assert(message);
+        assert(m);
 
-        packagefs_close(pkgfs);
+        r = sd_bus_message_read(message, "ssb", &path, &where, &read_only);
+        if (r < 0)
+                return r;
+
+        if (!path_is_absolute(path))
+                return sd_bus_error_setf(error, SD_BUS_ERROR_INVALID_ARGS, "Package path '%s' is not absolute", path);
+        if (!path_is_absolute(where))
+                return sd_bus_error_setf(error, SD_BUS_ERROR_INVALID_ARGS, "Mount point '%s' is not absolute", where);
+
+        /* The mount process opens the package itself, so it must not
+         * start while a job is still writing or reading it. */
+        if (manager_find_job(m, path))
+                return sd_bus_error_setf(error, BUS_ERROR_JOB_RUNNING, "A job is running for package '%s'", path);
+
+        r = manager_get_package(m, path, &package);
+        if (r < 0)
+                return r;
+
+        if (package->mount_pid > 0)
+                return sd_bus_error_setf(error, SD_BUS_ERROR_FILE_EXISTS, "Package '%s' is already mounted at '%s'", path, package->where);
+
+        r = packageref_mount(package, where, read_only);
+        if (r < 0)
+                return sd_bus_error_set_errnof(error, -r, "Failed to fork package mount process: %m");
 
-        return sd_bus_reply_method_return(message, "i", stbuf.st_ino);
+        return sd_bus_reply_method_return(message, "u", (uint32_t) package->mount_pid);
 }
 
 const sd_bus_vtable manager_vtable[] = {
         SD_BUS_VTABLE_START(0),
         SD_BUS_METHOD("GetPackage", "s", "s", method_get_package, SD_BUS_VTABLE_UNPRIVILEGED),
-        SD_BUS_METHOD("CreatePackage", "s", "s", method_create_package, SD_BUS_VTABLE_UNPRIVILEGED),
-        SD_BUS_METHOD("LoadPackage", "s", "i", method_load_package, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("CreatePackage", "s", "o", method_create_package, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("LoadPackage", "s", "o", method_load_package, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("MountPackage", "ssb", "u", method_mount_package, 0),
+        SD_BUS_SIGNAL("JobNew", "uos", 0),
+        SD_BUS_SIGNAL("JobRemoved", "uoss", 0),
         SD_BUS_VTABLE_END
 };
\ No newline at end of file
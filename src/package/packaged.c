@@ -19,6 +19,8 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <signal.h>
+
 #include "util.h"
 #include "sd-daemon.h"
 
@@ -26,6 +28,7 @@
 
 int main(int argc, char *argv[]) {
         PackageManager *m = NULL;
+        sigset_t ss;
         int r;
 
         log_set_target(LOG_TARGET_AUTO);
@@ -39,6 +42,11 @@ int main(int argc, char *argv[]) {
                 goto finish;
         }
 
+        /* Package mount processes are reaped from the event loop. */
+        assert_se(sigemptyset(&ss) == 0);
+        assert_se(sigaddset(&ss, SIGCHLD) == 0);
+        assert_se(sigprocmask(SIG_BLOCK, &ss, NULL) == 0);
+
         m = manager_new();
         if (!m) {
                 r = log_oom();
@@ -0,0 +1,277 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2014 James Rhodes
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <errno.h>
+
+#include "strv.h"
+#include "bus-util.h"
+
+#include "packagejob.h"
+
+PackageJob *packagejob_new(PackageManager *manager, PackageJobType type, const char *path) {
+        PackageJob *j;
+
+        assert(manager);
+        assert(path);
+
+        j = new0(PackageJob, 1);
+        if (!j)
+                return NULL;
+
+        j->path = strdup(path);
+        if (!j->path)
+                goto fail;
+
+        j->id = ++manager->current_job_id;
+
+        if (hashmap_put(manager->jobs, UINT32_TO_PTR(j->id), j) < 0)
+                goto fail;
+
+        j->manager = manager;
+        j->type = type;
+
+        return j;
+
+fail:
+        free(j->path);
+        free(j);
+
+        return NULL;
+}
+
+void packagejob_free(PackageJob *j) {
+        assert(j);
+
+        hashmap_remove(j->manager->jobs, UINT32_TO_PTR(j->id));
+
+        if (j->fs)
+                packagefs_close(j->fs);
+
+        free(j->path);
+        free(j);
+}
+
+static void *packagejob_thread(void *p) {
+        PackageJob *j = p;
+
+        /* Creating a package writes out its whole bootstrap area, and
+         * opening one reads its lookup table and free list, so both
+         * happen here rather than on the event loop. */
+        if (j->type == PACKAGE_JOB_CREATE)
+                j->fs = packagefs_new(j->path);
+        else
+                j->fs = packagefs_open(j->path);
+
+        if (!j->fs)
+                j->error = -EIO;
+
+        /* Hand the job back; a pointer is written atomically. */
+        if (loop_write(j->manager->job_fd[1], &j, sizeof(j), false) != sizeof(j))
+                log_error("Failed to complete package job %" PRIu32 ".", j->id);
+
+        return NULL;
+}
+
+int packagejob_start(PackageJob *j) {
+        PackageRef *package;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int r;
+
+        assert(j);
+
+        /* A package that is already open needs no worker; the job is
+         * still completed from the event loop, so that its signal
+         * follows the reply that names it. */
+        package = hashmap_get(j->manager->packages, j->path);
+        if (j->type == PACKAGE_JOB_LOAD && package && package->mount_pid > 0 && !package->read_only)
+                return -EBUSY;
+
+        if (j->type == PACKAGE_JOB_LOAD && package && package->fs) {
+                if (loop_write(j->manager->job_fd[1], &j, sizeof(j), false) != sizeof(j))
+                        return -errno;
+
+                return 0;
+        }
+
+        r = pthread_attr_init(&attr);
+        if (r != 0)
+                return -r;
+
+        r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (r == 0)
+                r = pthread_create(&thread, &attr, packagejob_thread, j);
+
+        pthread_attr_destroy(&attr);
+
+        return -r;
+}
+
+void packagejob_finish(PackageJob *j) {
+        PackageRef *package;
+        int r;
+
+        assert(j);
+
+        if (j->fs) {
+                r = manager_get_package(j->manager, j->path, &package);
+                if (r < 0)
+                        j->error = r;
+                else {
+                        /* Another job may have opened the package while
+                         * this one ran, in which case its handle is
+                         * kept and this one is closed.  So is a handle
+                         * to a package that has since been mounted
+                         * read-write, which the mount process owns. */
+                        if (!package->fs && !(package->mount_pid > 0 && !package->read_only)) {
+                                package->fs = j->fs;
+                                j->fs = NULL;
+                        }
+
+                        package->last_used = now(CLOCK_MONOTONIC);
+                }
+        } else if (j->error == 0) {
+                package = hashmap_get(j->manager->packages, j->path);
+                if (package)
+                        package->last_used = now(CLOCK_MONOTONIC);
+                else
+                        j->error = -ENOENT;
+        }
+
+        if (j->error < 0)
+                log_warning("Failed to %s package %s: %s", packagejob_type_to_string(j->type), j->path, strerror(-j->error));
+
+        packagejob_send_signal(j, false);
+        packagejob_free(j);
+}
+
+char *packagejob_bus_path(PackageJob *j) {
+        char *p;
+
+        assert(j);
+
+        if (asprintf(&p, "/org/freedesktop/package1/job/%" PRIu32, j->id) < 0)
+                return NULL;
+
+        return p;
+}
+
+int packagejob_send_signal(PackageJob *j, bool new_job) {
+        _cleanup_free_ char *p = NULL;
+
+        assert(j);
+
+        p = packagejob_bus_path(j);
+        if (!p)
+                return -ENOMEM;
+
+        if (new_job)
+                return sd_bus_emit_signal(
+                                j->manager->bus,
+                                "/org/freedesktop/package1",
+                                "org.freedesktop.package1.Manager",
+                                "JobNew",
+                                "uos", j->id, p, j->path);
+
+        return sd_bus_emit_signal(
+                        j->manager->bus,
+                        "/org/freedesktop/package1",
+                        "org.freedesktop.package1.Manager",
+                        "JobRemoved",
+                        "uoss", j->id, p, j->path, j->error < 0 ? "failed" : "done");
+}
+
+static BUS_DEFINE_PROPERTY_GET_ENUM(property_get_type, packagejob_type, PackageJobType);
+
+const sd_bus_vtable packagejob_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_PROPERTY("Id", "u", NULL, offsetof(PackageJob, id), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("JobType", "s", property_get_type, offsetof(PackageJob, type), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("Package", "s", NULL, offsetof(PackageJob, path), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_VTABLE_END
+};
+
+int packagejob_object_find(sd_bus *bus, const char *path, const char *interface, void *userdata, void **found, sd_bus_error *error) {
+        PackageManager *m = userdata;
+        PackageJob *j;
+        const char *p;
+        uint32_t id;
+        int r;
+
+        assert(bus);
+        assert(path);
+        assert(interface);
+        assert(found);
+        assert(m);
+
+        p = startswith(path, "/org/freedesktop/package1/job/");
+        if (!p)
+                return 0;
+
+        r = safe_atou32(p, &id);
+        if (r < 0 || id == 0)
+                return 0;
+
+        j = hashmap_get(m->jobs, UINT32_TO_PTR(id));
+        if (!j)
+                return 0;
+
+        *found = j;
+        return 1;
+}
+
+int packagejob_node_enumerator(sd_bus *bus, const char *path, void *userdata, char ***nodes, sd_bus_error *error) {
+        _cleanup_strv_free_ char **l = NULL;
+        PackageJob *j = NULL;
+        PackageManager *m = userdata;
+        Iterator i;
+        int r;
+
+        assert(bus);
+        assert(path);
+        assert(nodes);
+
+        HASHMAP_FOREACH(j, m->jobs, i) {
+                char *p;
+
+                p = packagejob_bus_path(j);
+                if (!p)
+                        return -ENOMEM;
+
+                r = strv_push(&l, p);
+                if (r < 0) {
+                        free(p);
+                        return r;
+                }
+        }
+
+        *nodes = l;
+        l = NULL;
+
+        return 1;
+}
+
+static const char* const packagejob_type_table[_PACKAGE_JOB_TYPE_MAX] = {
+        [PACKAGE_JOB_CREATE] = "create",
+        [PACKAGE_JOB_LOAD] = "load"
+};
+
+DEFINE_STRING_TABLE_LOOKUP(packagejob_type, PackageJobType);
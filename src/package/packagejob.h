@@ -0,0 +1,72 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  Copyright 2014 James Rhodes
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "hashmap.h"
+#include "sd-bus.h"
+
+typedef struct PackageJob PackageJob;
+
+#include "packagemanager.h"
+#include "../package-fs/packagefs.h"
+
+typedef enum PackageJobType {
+        PACKAGE_JOB_CREATE,
+        PACKAGE_JOB_LOAD,
+        _PACKAGE_JOB_TYPE_MAX,
+        _PACKAGE_JOB_TYPE_INVALID = -1
+} PackageJobType;
+
+struct PackageJob {
+        PackageManager *manager;
+
+        uint32_t id;
+        PackageJobType type;
+        char *path;
+
+        /* Set by the worker thread before it hands the job back to the
+         * event loop through the manager's job pipe; nothing else
+         * touches the job while the thread runs. */
+        PackageFS *fs;
+        int error;
+};
+
+PackageJob *packagejob_new(PackageManager *manager, PackageJobType type, const char *path);
+void packagejob_free(PackageJob *j);
+int packagejob_start(PackageJob *j);
+void packagejob_finish(PackageJob *j);
+
+char *packagejob_bus_path(PackageJob *j);
+int packagejob_send_signal(PackageJob *j, bool new_job);
+
+extern const sd_bus_vtable packagejob_vtable[];
+
+int packagejob_object_find(sd_bus *bus, const char *path, const char *interface, void *userdata, void **found, sd_bus_error *error);
+int packagejob_node_enumerator(sd_bus *bus, const char *path, void *userdata, char ***nodes, sd_bus_error *error);
+
+const char* packagejob_type_to_string(PackageJobType t) _const_;
+PackageJobType packagejob_type_from_string(const char *s) _pure_;
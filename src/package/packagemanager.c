@@ -19,12 +19,39 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
 #include "def.h"
 #include "bus-util.h"
+#include "unit-name.h"
 
 #include "packagemanager.h"
 #include "packageref.h"
 
+static int manager_dispatch_jobs(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        PackageJob *j;
+        ssize_t n;
+
+        assert(s);
+
+        for (;;) {
+                n = read(fd, &j, sizeof(j));
+                if (n < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                                return 0;
+
+                        log_error("Failed to read completed package jobs: %m");
+                        return -errno;
+                }
+                if (n != sizeof(j))
+                        return 0;
+
+                packagejob_finish(j);
+        }
+}
+
 PackageManager *manager_new(void) {
         PackageManager *m;
         int r;
@@ -33,9 +60,17 @@ PackageManager *manager_new(void) {
         if (!m)
                 return NULL;
 
+        m->job_fd[0] = m->job_fd[1] = -1;
+
         m->packages = hashmap_new(string_hash_func, string_compare_func);
+        m->jobs = hashmap_new(trivial_hash_func, trivial_compare_func);
 
-        if (!m->packages) {
+        if (!m->packages || !m->jobs) {
+                manager_free(m);
+                return NULL;
+        }
+
+        if (pipe2(m->job_fd, O_CLOEXEC) < 0 || fd_nonblock(m->job_fd[0], true) < 0) {
                 manager_free(m);
                 return NULL;
         }
@@ -46,6 +81,12 @@ PackageManager *manager_new(void) {
                 return NULL;
         }
 
+        r = sd_event_add_io(m->event, m->job_fd[0], EPOLLIN, manager_dispatch_jobs, m, &m->job_event_source);
+        if (r < 0) {
+                manager_free(m);
+                return NULL;
+        }
+
         sd_event_set_watchdog(m->event, true);
 
         return m;
@@ -53,20 +94,125 @@ PackageManager *manager_new(void) {
 
 void manager_free(PackageManager *m) {
         PackageRef *entry;
+        PackageJob *j;
 
         assert(m);
 
+        /* A job that finished but was never dispatched still holds the
+         * package it opened, so it is closed along with the handles
+         * the registry holds. */
+        if (m->job_fd[0] >= 0)
+                while (read(m->job_fd[0], &j, sizeof(j)) == sizeof(j))
+                        packagejob_free(j);
+
         while ((entry = hashmap_first(m->packages)))
                 packageref_free(entry);
 
         hashmap_free(m->packages);
 
+        sd_event_source_unref(m->job_event_source);
+
+        /* Jobs still held by worker threads can't be freed from under
+         * them, and need somewhere to write when they finish; they go
+         * when the process exits. */
+        if (hashmap_isempty(m->jobs))
+                close_pipe(m->job_fd);
+
+        hashmap_free(m->jobs);
+
         sd_bus_unref(m->bus);
         sd_event_unref(m->event);
 
         free(m);
 }
 
+int manager_get_package(PackageManager *m, const char *path, PackageRef **_package) {
+        PackageRef *package;
+
+        assert(m);
+        assert(path);
+        assert(_package);
+
+        package = hashmap_get(m->packages, path);
+        if (!package) {
+                package = packageref_new(m, path);
+                if (!package)
+                        return -ENOMEM;
+        }
+
+        *_package = package;
+        return 0;
+}
+
+static int manager_enumerate_packages(PackageManager *m) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        int r = 0;
+
+        assert(m);
+
+        /* Read in package data stored on disk */
+        d = opendir("/run/systemd/packages");
+        if (!d) {
+                if (errno == ENOENT)
+                        return 0;
+
+                log_error("Failed to open /run/systemd/packages: %m");
+                return -errno;
+        }
+
+        FOREACH_DIRENT(de, d, return -errno) {
+                _cleanup_free_ char *name = NULL;
+                PackageRef *package;
+                int k;
+
+                if (!dirent_is_file(de))
+                        continue;
+
+                name = unit_name_path_unescape(de->d_name);
+                if (!name) {
+                        r = log_oom();
+                        continue;
+                }
+
+                k = manager_get_package(m, name, &package);
+                if (k < 0) {
+                        log_error("Failed to add package by file name %s: %s", de->d_name, strerror(-k));
+
+                        r = k;
+                        continue;
+                }
+
+                k = packageref_load(package);
+                if (k < 0)
+                        r = k;
+
+                /* Only mounts outlive the daemon; a package that was
+                 * merely open is reopened when it's next asked for. */
+                if (package->mount_pid <= 0) {
+                        unlink(package->state_file);
+                        packageref_free(package);
+                }
+        }
+
+        return r;
+}
+
+void manager_gc(PackageManager *m) {
+        PackageRef *package;
+        Iterator i;
+
+        assert(m);
+
+        HASHMAP_FOREACH(package, m->packages, i) {
+                if (packageref_check_gc(package))
+                        continue;
+
+                unlink(package->state_file);
+                packageref_free(package);
+        }
+}
+
 static int manager_connect_bus(PackageManager *m) {
         _cleanup_bus_error_free_ sd_bus_error error = SD_BUS_ERROR_NULL;
         int r;
@@ -86,6 +232,18 @@ static int manager_connect_bus(PackageManager *m) {
                 return r;
         }
 
+        r = sd_bus_add_fallback_vtable(m->bus, "/org/freedesktop/package1/job", "org.freedesktop.package1.Job", packagejob_vtable, packagejob_object_find, m);
+        if (r < 0) {
+                log_error("Failed to add job object vtable: %s", strerror(-r));
+                return r;
+        }
+
+        r = sd_bus_add_node_enumerator(m->bus, "/org/freedesktop/package1/job", packagejob_node_enumerator, m);
+        if (r < 0) {
+                log_error("Failed to add job enumerator: %s", strerror(-r));
+                return r;
+        }
+
         r = sd_bus_request_name(m->bus, "org.freedesktop.package1", 0);
         if (r < 0) {
                 log_error("Failed to register name: %s", strerror(-r));
@@ -109,15 +267,18 @@ int manager_startup(PackageManager *m) {
         if (r < 0)
                 return r;
 
-        /* TODO: Load packages */
+        /* Deserialize state */
+        manager_enumerate_packages(m);
 
         return 0;
 }
 
 static bool check_idle(void* userdata) {
-        /* TODO: GC */
+        PackageManager *m = userdata;
+
+        manager_gc(m);
 
-        return false;
+        return hashmap_isempty(m->packages) && hashmap_isempty(m->jobs);
 }
 
 int manager_run(PackageManager *m) {
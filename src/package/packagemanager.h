@@ -32,16 +32,29 @@
 
 typedef struct PackageManager PackageManager;
 
+#include "packageref.h"
+#include "packagejob.h"
+
 struct PackageManager {
         sd_event *event;
         sd_bus *bus;
 
         Hashmap *packages;
+
+        /* Jobs running in worker threads, by ID.  Each thread writes
+         * its job to job_fd[1] when it is done. */
+        Hashmap *jobs;
+        uint32_t current_job_id;
+        int job_fd[2];
+        sd_event_source *job_event_source;
 };
 
 PackageManager *manager_new(void);
 void manager_free(PackageManager *m);
 
+int manager_get_package(PackageManager *m, const char *path, PackageRef **_package);
+void manager_gc(PackageManager *m);
+
 extern const sd_bus_vtable manager_vtable[];
 
 int manager_startup(PackageManager *m);
@@ -19,32 +19,307 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <errno.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+
 #include "sd-daemon.h"
+#include "fileio.h"
+#include "mkdir.h"
+#include "path-util.h"
+#include "unit-name.h"
 
 #include "packageref.h"
 
-PackageRef *packageref_new(void) {
-        PackageRef *m;
+PackageRef *packageref_new(PackageManager *manager, const char *name) {
+        _cleanup_free_ char *escaped = NULL;
+        PackageRef *p;
+
+        assert(manager);
+        assert(name);
 
-        m = new0(PackageRef, 1);
-        if (!m)
+        p = new0(PackageRef, 1);
+        if (!p)
                 return NULL;
 
-        m->name = NULL;
+        p->name = strdup(name);
+        if (!p->name)
+                goto fail;
 
-        if (!m->name) {
-                packageref_free(m);
-                return NULL;
+        escaped = unit_name_path_escape(name);
+        if (!escaped)
+                goto fail;
+
+        p->state_file = strappend("/run/systemd/packages/", escaped);
+        if (!p->state_file)
+                goto fail;
+
+        if (hashmap_put(manager->packages, p->name, p) < 0)
+                goto fail;
+
+        p->manager = manager;
+        p->last_used = now(CLOCK_MONOTONIC);
+
+        return p;
+
+fail:
+        free(p->state_file);
+        free(p->name);
+        free(p);
+
+        return NULL;
+}
+
+void packageref_free(PackageRef *p) {
+        assert(p);
+
+        hashmap_remove(p->manager->packages, p->name);
+
+        if (p->fs)
+                packagefs_close(p->fs);
+
+        sd_event_source_unref(p->mount_source);
+
+        free(p->where);
+        free(p->state_file);
+        free(p->name);
+        free(p);
+}
+
+int packageref_open(PackageRef *p, PackageFS **ret) {
+        assert(p);
+        assert(ret);
+
+        p->last_used = now(CLOCK_MONOTONIC);
+
+        /* A read-write mount process owns the package until it exits;
+         * a handle of ours would read metadata it is changing. */
+        if (p->mount_pid > 0 && !p->read_only)
+                return -EBUSY;
+
+        /* Opening a package reads its header, lookup table and free
+         * list, so the handle is kept for the next request. */
+        if (!p->fs) {
+                p->fs = packagefs_open(p->name);
+                if (!p->fs) {
+                        log_warning("Failed to open package %s.", p->name);
+                        return -EIO;
+                }
+        }
+
+        *ret = p->fs;
+        return 0;
+}
+
+static int mount_process_exited(sd_event_source *s, const siginfo_t *si, void *userdata) {
+        PackageRef *p = userdata;
+
+        assert(s);
+        assert(si);
+        assert(p);
+
+        if (si->si_code != CLD_EXITED || si->si_status != EXIT_SUCCESS)
+                log_warning("Package mount process %lu failed.", (unsigned long) si->si_pid);
+        else
+                log_debug("Package mount process %lu exited.", (unsigned long) si->si_pid);
+
+        p->mount_source = sd_event_source_unref(p->mount_source);
+        p->mount_pid = 0;
+        free(p->where);
+        p->where = NULL;
+        p->last_used = now(CLOCK_MONOTONIC);
+
+        packageref_save(p);
+
+        return 0;
+}
+
+int packageref_mount(PackageRef *p, const char *where, bool read_only) {
+        sigset_t ss;
+        pid_t pid;
+        int r;
+
+        assert(p);
+        assert(where);
+
+        p->last_used = now(CLOCK_MONOTONIC);
+
+        if (p->mount_pid > 0)
+                return -EBUSY;
+
+        /* The mount process writes to the package behind our back, so
+         * a handle we hold would go stale. */
+        if (!read_only && p->fs) {
+                packagefs_close(p->fs);
+                p->fs = NULL;
+        }
+
+        p->where = strdup(where);
+        if (!p->where)
+                return -ENOMEM;
+
+        pid = fork();
+        if (pid < 0) {
+                r = -errno;
+                free(p->where);
+                p->where = NULL;
+                return r;
+        }
+
+        if (pid == 0) {
+                /* Child; the package is served from here until it
+                 * is unmounted. */
+                reset_all_signal_handlers();
+                assert_se(sigemptyset(&ss) == 0);
+                assert_se(sigprocmask(SIG_SETMASK, &ss, NULL) == 0);
+                close_all_fds(NULL, 0);
+
+                if (read_only)
+                        execl(SYSTEMD_PACKAGEMOUNT_BINARY_PATH, SYSTEMD_PACKAGEMOUNT_BINARY_PATH,
+                              "--read-only", p->name, where, NULL);
+                else
+                        execl(SYSTEMD_PACKAGEMOUNT_BINARY_PATH, SYSTEMD_PACKAGEMOUNT_BINARY_PATH,
+                              p->name, where, NULL);
+
+                _exit(EXIT_FAILURE);
+        }
+
+        p->mount_pid = pid;
+        p->read_only = read_only;
+
+        r = sd_event_add_child(p->manager->event, pid, WEXITED, mount_process_exited, p, &p->mount_source);
+        if (r < 0)
+                log_error("Failed to watch package mount process: %s", strerror(-r));
+
+        packageref_save(p);
+
+        return 0;
+}
+
+int packageref_unmount(PackageRef *p) {
+        assert(p);
+
+        if (p->mount_pid <= 0)
+                return 0;
+
+        /* This fails with EBUSY while anything on the mount is open, in
+         * which case it is left alone.  Otherwise the mount process
+         * sees its session end and exits. */
+        if (umount2(p->where, 0) < 0 && errno != EINVAL)
+                return -errno;
+
+        log_debug("Unmounted package %s from %s.", p->name, p->where);
+
+        /* A mount inherited from an earlier instance of the daemon isn't
+         * our child, so there will be no exit to wait for. */
+        if (!p->mount_source) {
+                p->mount_pid = 0;
+                free(p->where);
+                p->where = NULL;
+                packageref_save(p);
+        }
+
+        return 0;
+}
+
+bool packageref_check_gc(PackageRef *p) {
+        assert(p);
+
+        /* Returns whether the package should be kept. */
+        if (now(CLOCK_MONOTONIC) < p->last_used + PACKAGE_IDLE_USEC)
+                return true;
+
+        if (p->fs) {
+                packagefs_close(p->fs);
+                p->fs = NULL;
+        }
+
+        if (p->mount_pid > 0) {
+                packageref_unmount(p);
+                return true;
+        }
+
+        return false;
+}
+
+int packageref_save(PackageRef *p) {
+        _cleanup_free_ char *temp_path = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        int r;
+
+        assert(p);
+        assert(p->state_file);
+
+        r = mkdir_safe("/run/systemd/packages", 0755, 0, 0);
+        if (r < 0)
+                goto finish;
+
+        r = fopen_temporary(p->state_file, &f, &temp_path);
+        if (r < 0)
+                goto finish;
+
+        fchmod(fileno(f), 0644);
+
+        fprintf(f,
+                "# This is private data. Do not parse.\n"
+                "NAME=%s\n",
+                p->name);
+
+        if (p->mount_pid > 0)
+                fprintf(f,
+                        "WHERE=%s\n"
+                        "LEADER="PID_FMT"\n"
+                        "READ_ONLY=%s\n",
+                        p->where,
+                        p->mount_pid,
+                        yes_no(p->read_only));
+
+        fflush(f);
+
+        if (ferror(f) || rename(temp_path, p->state_file) < 0) {
+                r = -errno;
+                unlink(p->state_file);
+                unlink(temp_path);
         }
 
-        return m;
+finish:
+        if (r < 0)
+                log_error("Failed to save package data %s: %s", p->state_file, strerror(-r));
+
+        return r;
 }
 
-void packageref_free(PackageRef *m) {
-        if (m->name != NULL)
-        {
-                free(m->name);
+int packageref_load(PackageRef *p) {
+        _cleanup_free_ char *where = NULL, *leader = NULL, *read_only = NULL;
+        pid_t pid;
+        int r;
+
+        assert(p);
+
+        r = parse_env_file(p->state_file, NEWLINE,
+                           "WHERE",     &where,
+                           "LEADER",    &leader,
+                           "READ_ONLY", &read_only,
+                           NULL);
+        if (r < 0) {
+                if (r == -ENOENT)
+                        return 0;
+
+                log_error("Failed to read %s: %s", p->state_file, strerror(-r));
+                return r;
         }
 
-        free(m);
-}
\ No newline at end of file
+        /* Only adopt a mount that is still being served. */
+        if (!where || !leader || parse_pid(leader, &pid) < 0)
+                return 0;
+        if (kill(pid, 0) < 0 || path_is_mount_point(where, false) <= 0)
+                return 0;
+
+        p->where = where;
+        where = NULL;
+        p->mount_pid = pid;
+        p->read_only = read_only && parse_boolean(read_only) > 0;
+
+        return 0;
+}
@@ -32,9 +32,38 @@
 
 typedef struct PackageRef PackageRef;
 
+#include "packagemanager.h"
+#include "../package-fs/packagefs.h"
+
+/* How long a package may go unused before its handle is closed and
+ * its mount (if it isn't busy) is taken down. */
+#define PACKAGE_IDLE_USEC (5 * USEC_PER_MINUTE)
+
 struct PackageRef {
+        PackageManager *manager;
+
+        /* The path of the package image, which identifies it */
         char *name;
+        char *state_file;
+
+        /* The open package, or NULL until it is first used */
+        PackageFS *fs;
+
+        /* The process serving the package's mount, and where it is
+         * mounted */
+        char *where;
+        pid_t mount_pid;
+        bool read_only;
+        sd_event_source *mount_source;
+
+        usec_t last_used;
 };
 
-PackageRef *packageref_new(void);
-void packageref_free(PackageRef *m);
+PackageRef *packageref_new(PackageManager *manager, const char *name);
+void packageref_free(PackageRef *p);
+int packageref_open(PackageRef *p, PackageFS **ret);
+int packageref_mount(PackageRef *p, const char *where, bool read_only);
+int packageref_unmount(PackageRef *p);
+bool packageref_check_gc(PackageRef *p);
+int packageref_save(PackageRef *p);
+int packageref_load(PackageRef *p);
@@ -0,0 +1,600 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+// Measures the performance of package-fs on synthetic packages, through
+// AppLib::FS and optionally through a FUSE mount, printing one JSON
+// object per measurement so that runs can be compared by a script.
+
+#include "src/package-fs/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "src/package-fs/fs.h"
+#include "src/package-fs/logging.h"
+#include "src/package-fs/internal/fuselink.h"
+#include "src/package-fs/lowlevel/format.h"
+#include "src/package-fs/lowlevel/util.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// The unit of data read and written, and the size of the small files.
+#define BENCH_IO_SIZE    4096
+#define BENCH_CHUNK_SIZE (128 * 1024)
+
+// A package, or the directory a package is mounted at, that the
+// workloads are run against.
+class BenchTarget
+{
+public:
+    virtual ~BenchTarget() { }
+    virtual void mkdir(const std::string& path) = 0;
+    virtual void createFile(const std::string& path, const char *data, size_t len) = 0;
+    virtual void lookup(const std::string& path) = 0;
+    virtual void getattr(const std::string& path) = 0;
+    virtual size_t readdir(const std::string& path) = 0;
+
+    // Opens, reads or writes, and closes the large file.
+    virtual void openLarge(const std::string& path) = 0;
+    virtual void writeLarge(const char *data, size_t len, uint64_t offset) = 0;
+    virtual void readLarge(char *out, size_t len, uint64_t offset) = 0;
+    virtual void closeLarge() = 0;
+};
+
+class FSTarget : public BenchTarget
+{
+public:
+    FSTarget(AppLib::FS& filesystem) : filesystem(filesystem), file(NULL) { }
+
+    void mkdir(const std::string& path)
+    {
+        this->filesystem.mkdir(path, 0755);
+    }
+
+    void createFile(const std::string& path, const char *data, size_t len)
+    {
+        this->filesystem.create(path, 0644);
+        if (len == 0)
+            return;
+        AppLib::FSFile f = this->filesystem.open(path);
+        f.write(data, len);
+        f.close();
+    }
+
+    void lookup(const std::string& path)
+    {
+        // Walk the path one component at a time, as the kernel does.
+        struct stat st;
+        uint32_t id = 0;
+        size_t start = 1;
+        while (start < path.size())
+        {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos)
+                end = path.size();
+            id = this->filesystem.lookup(id, path.substr(start, end - start), st);
+            start = end + 1;
+        }
+    }
+
+    void getattr(const std::string& path)
+    {
+        struct stat st;
+        this->filesystem.getattr(path, st);
+    }
+
+    size_t readdir(const std::string& path)
+    {
+        return this->filesystem.readdir(path).size();
+    }
+
+    void openLarge(const std::string& path)
+    {
+        this->file = new AppLib::FSFile(this->filesystem.open(path));
+    }
+
+    void writeLarge(const char *data, size_t len, uint64_t offset)
+    {
+        this->file->seekp(offset);
+        this->file->write(data, len);
+    }
+
+    void readLarge(char *out, size_t len, uint64_t offset)
+    {
+        this->file->seekg(offset);
+        this->file->read(out, len);
+    }
+
+    void closeLarge()
+    {
+        this->file->close();
+        delete this->file;
+        this->file = NULL;
+    }
+
+private:
+    AppLib::FS& filesystem;
+    AppLib::FSFile *file;
+};
+
+class PosixTarget : public BenchTarget
+{
+public:
+    PosixTarget(const std::string& root) : root(root), fd(-1) { }
+
+    void mkdir(const std::string& path)
+    {
+        ::mkdir((this->root + path).c_str(), 0755);
+    }
+
+    void createFile(const std::string& path, const char *data, size_t len)
+    {
+        int f = ::open((this->root + path).c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (f < 0)
+            return;
+        if (len > 0 && ::write(f, data, len) < 0)
+            perror("write");
+        ::close(f);
+    }
+
+    void lookup(const std::string& path)
+    {
+        ::access((this->root + path).c_str(), F_OK);
+    }
+
+    void getattr(const std::string& path)
+    {
+        struct stat st;
+        ::stat((this->root + path).c_str(), &st);
+    }
+
+    size_t readdir(const std::string& path)
+    {
+        size_t count = 0;
+        DIR *dir = ::opendir((this->root + path).c_str());
+        if (dir == NULL)
+            return 0;
+        while (::readdir(dir) != NULL)
+            count += 1;
+        ::closedir(dir);
+        return count;
+    }
+
+    void openLarge(const std::string& path)
+    {
+        this->fd = ::open((this->root + path).c_str(), O_CREAT | O_RDWR, 0644);
+    }
+
+    void writeLarge(const char *data, size_t len, uint64_t offset)
+    {
+        if (::pwrite(this->fd, data, len, offset) < 0)
+            perror("pwrite");
+    }
+
+    void readLarge(char *out, size_t len, uint64_t offset)
+    {
+        if (::pread(this->fd, out, len, offset) < 0)
+            perror("pread");
+    }
+
+    void closeLarge()
+    {
+        ::close(this->fd);
+        this->fd = -1;
+    }
+
+private:
+    std::string root;
+    int fd;
+};
+
+// The shape and size of the synthetic packages.
+struct BenchConfig
+{
+    unsigned int scale;
+    unsigned int repeats;
+    uint16_t format;
+    std::string workdir;
+    std::string mountpoint;
+    FILE *out;
+};
+
+// The times taken by each repetition of one measurement.
+struct BenchResult
+{
+    std::string target;
+    std::string workload;
+    std::string op;
+    uint64_t count;
+    uint64_t bytes;
+    std::vector<double> seconds;
+};
+
+static std::vector<BenchResult> bench_results;
+
+static double bench_now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void bench_record(const char *target, const char *workload, const char *op,
+        uint64_t count, uint64_t bytes, double seconds)
+{
+    for (size_t i = 0; i < bench_results.size(); i += 1)
+    {
+        BenchResult& r = bench_results[i];
+        if (r.target == target && r.workload == workload && r.op == op)
+        {
+            r.seconds.push_back(seconds);
+            return;
+        }
+    }
+    BenchResult r;
+    r.target = target;
+    r.workload = workload;
+    r.op = op;
+    r.count = count;
+    r.bytes = bytes;
+    r.seconds.push_back(seconds);
+    bench_results.push_back(r);
+}
+
+static void bench_report(const BenchConfig& config)
+{
+    for (size_t i = 0; i < bench_results.size(); i += 1)
+    {
+        BenchResult& r = bench_results[i];
+        std::vector<double> sorted = r.seconds;
+        std::sort(sorted.begin(), sorted.end());
+        double median = sorted[sorted.size() / 2];
+        double best = sorted[0];
+        fprintf(config.out,
+                "{\"target\":\"%s\",\"workload\":\"%s\",\"op\":\"%s\",\"format\":%u,\"scale\":%u,"
+                "\"repeats\":%zu,\"count\":%llu,\"bytes\":%llu,\"median_s\":%.6f,\"min_s\":%.6f,"
+                "\"ops_per_s\":%.1f,\"mb_per_s\":%.2f}\n",
+                r.target.c_str(), r.workload.c_str(), r.op.c_str(), config.format, config.scale,
+                sorted.size(), (unsigned long long) r.count, (unsigned long long) r.bytes, median, best,
+                median > 0 ? r.count / median : 0.0,
+                median > 0 ? r.bytes / median / (1024 * 1024) : 0.0);
+    }
+    fflush(config.out);
+}
+
+// Builds the workloads in the target, timing how long it takes, and
+// returns the paths of the files and directories that were created.
+static void bench_create(BenchTarget& target, const char *tname, const char *name, const BenchConfig& config,
+        std::vector<std::string>& files, std::vector<std::string>& dirs)
+{
+    std::vector<char> data(BENCH_IO_SIZE, 'x');
+    std::string workload = name;
+    double start = bench_now();
+    if (workload == "small")
+    {
+        // Many small files, spread over a few directories.
+        target.mkdir("/small");
+        dirs.push_back("/small");
+        for (unsigned int d = 0; d < 20; d += 1)
+        {
+            std::string dir = "/small/d" + std::to_string(d);
+            target.mkdir(dir);
+            dirs.push_back(dir);
+            for (unsigned int f = 0; f < 100 * config.scale; f += 1)
+            {
+                std::string path = dir + "/f" + std::to_string(f);
+                target.createFile(path, &data[0], data.size());
+                files.push_back(path);
+            }
+        }
+    }
+    else if (workload == "deep")
+    {
+        // A deep tree, with a few files at each level.
+        std::string dir = "/deep";
+        target.mkdir(dir);
+        for (unsigned int level = 0; level < 32 * config.scale; level += 1)
+        {
+            dirs.push_back(dir);
+            for (unsigned int f = 0; f < 8; f += 1)
+            {
+                std::string path = dir + "/f" + std::to_string(f);
+                target.createFile(path, NULL, 0);
+                files.push_back(path);
+            }
+            dir += "/l" + std::to_string(level);
+            target.mkdir(dir);
+        }
+    }
+    else if (workload == "wide")
+    {
+        // A single wide directory of empty files, as wide as the format
+        // allows.
+        const AppLib::LowLevel::Format* format = AppLib::LowLevel::Format::get(config.format);
+        unsigned int count = 5000 * config.scale;
+        if (format->dirinfo_children == 0)
+            count = std::min(count, format->dir_children);
+        target.mkdir("/wide");
+        dirs.push_back("/wide");
+        for (unsigned int f = 0; f < count; f += 1)
+        {
+            std::string path = "/wide/f" + std::to_string(f);
+            target.createFile(path, NULL, 0);
+            files.push_back(path);
+        }
+    }
+    bench_record(tname, name, "create", files.size() + dirs.size(), 0, bench_now() - start);
+}
+
+// Times lookups, getattrs and readdirs of what bench_create made.
+static void bench_metadata(BenchTarget& target, const char *tname, const char *name,
+        const std::vector<std::string>& files, const std::vector<std::string>& dirs)
+{
+    double start = bench_now();
+    for (size_t i = 0; i < files.size(); i += 1)
+        target.lookup(files[i]);
+    bench_record(tname, name, "lookup", files.size(), 0, bench_now() - start);
+
+    start = bench_now();
+    for (size_t i = 0; i < files.size(); i += 1)
+        target.getattr(files[i]);
+    bench_record(tname, name, "getattr", files.size(), 0, bench_now() - start);
+
+    start = bench_now();
+    size_t entries = 0;
+    for (size_t i = 0; i < dirs.size(); i += 1)
+        entries += target.readdir(dirs[i]);
+    bench_record(tname, name, "readdir", entries, 0, bench_now() - start);
+}
+
+// Times sequential and random reads and writes of a large file.
+static void bench_large(BenchTarget& target, const char *tname, const BenchConfig& config)
+{
+    uint64_t size = (uint64_t) 64 * 1024 * 1024 * config.scale;
+    uint64_t ios = 4096 * config.scale;
+    std::vector<char> chunk(BENCH_CHUNK_SIZE);
+    for (size_t i = 0; i < chunk.size(); i += 1)
+        chunk[i] = (char) (i * 31);
+
+    target.createFile("/large", NULL, 0);
+    target.openLarge("/large");
+
+    double start = bench_now();
+    for (uint64_t off = 0; off < size; off += chunk.size())
+        target.writeLarge(&chunk[0], chunk.size(), off);
+    target.closeLarge();
+    bench_record(tname, "large", "seq_write", size / chunk.size(), size, bench_now() - start);
+
+    target.openLarge("/large");
+    start = bench_now();
+    for (uint64_t off = 0; off < size; off += chunk.size())
+        target.readLarge(&chunk[0], chunk.size(), off);
+    bench_record(tname, "large", "seq_read", size / chunk.size(), size, bench_now() - start);
+
+    // The same offsets are used by every run.
+    std::mt19937_64 random(1);
+    std::vector<uint64_t> offsets(ios);
+    for (uint64_t i = 0; i < ios; i += 1)
+        offsets[i] = (random() % (size / BENCH_IO_SIZE)) * BENCH_IO_SIZE;
+
+    start = bench_now();
+    for (uint64_t i = 0; i < ios; i += 1)
+        target.readLarge(&chunk[0], BENCH_IO_SIZE, offsets[i]);
+    bench_record(tname, "large", "rand_read", ios, ios * BENCH_IO_SIZE, bench_now() - start);
+
+    start = bench_now();
+    for (uint64_t i = 0; i < ios; i += 1)
+        target.writeLarge(&chunk[0], BENCH_IO_SIZE, offsets[i]);
+    target.closeLarge();
+    bench_record(tname, "large", "rand_write", ios, ios * BENCH_IO_SIZE, bench_now() - start);
+}
+
+static const char *bench_workloads[] = { "small", "deep", "wide" };
+
+static std::string bench_package(const BenchConfig& config, const char *name)
+{
+    std::string path = config.workdir + "/bench-" + name + ".afs";
+    unlink(path.c_str());
+    if (!AppLib::LowLevel::Util::createPackage(path, "bench", "1.0", "Benchmark package", "bench", config.format))
+        throw std::runtime_error("unable to create " + path);
+    return path;
+}
+
+// Runs every workload against AppLib::FS.
+static void bench_run_fs(const BenchConfig& config)
+{
+    for (size_t w = 0; w < sizeof(bench_workloads) / sizeof(bench_workloads[0]); w += 1)
+    {
+        std::string path = bench_package(config, bench_workloads[w]);
+        AppLib::FS filesystem(path, 0, 0, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+        FSTarget target(filesystem);
+        std::vector<std::string> files, dirs;
+        bench_create(target, "fs", bench_workloads[w], config, files, dirs);
+        bench_metadata(target, "fs", bench_workloads[w], files, dirs);
+    }
+
+    std::string path = bench_package(config, "large");
+    AppLib::FS filesystem(path, 0, 0, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+    FSTarget target(filesystem);
+    bench_large(target, "fs", config);
+}
+
+static void bench_mounted()
+{
+    // Execution continues at this point when the package is mounted.
+}
+
+// Mounts a package in a child process, returning its PID once the
+// mount is ready, or -1 if it could not be mounted.
+static pid_t bench_mount(const std::string& image, const std::string& mountpoint)
+{
+    struct stat parent, mounted;
+    if (stat((mountpoint + "/..").c_str(), &parent) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        AppLib::FUSE::Mounter mnt(image, mountpoint, true, false, bench_mounted,
+                AppLib::LowLevel::BlockStreamBackend::BSB_MMAP, true, false);
+        _exit(mnt.getResult());
+    }
+    else if (pid < 0)
+        return -1;
+
+    for (unsigned int i = 0; i < 500; i += 1)
+    {
+        if (stat(mountpoint.c_str(), &mounted) == 0 && mounted.st_dev != parent.st_dev)
+            return pid;
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            return -1;
+        usleep(10000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void bench_unmount(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+// Runs every workload through a FUSE mount of a fresh package.
+static bool bench_run_fuse(const BenchConfig& config)
+{
+    for (size_t w = 0; w <= sizeof(bench_workloads) / sizeof(bench_workloads[0]); w += 1)
+    {
+        bool large = (w == sizeof(bench_workloads) / sizeof(bench_workloads[0]));
+        const char *name = large ? "large" : bench_workloads[w];
+        std::string path = bench_package(config, name);
+        pid_t pid = bench_mount(path, config.mountpoint);
+        if (pid < 0)
+        {
+            fprintf(stderr, "Unable to mount the benchmark package at '%s'.\n", config.mountpoint.c_str());
+            return false;
+        }
+        PosixTarget target(config.mountpoint);
+        if (large)
+            bench_large(target, "fuse", config);
+        else
+        {
+            std::vector<std::string> files, dirs;
+            bench_create(target, "fuse", name, config, files, dirs);
+            bench_metadata(target, "fuse", name, files, dirs);
+        }
+        bench_unmount(pid);
+    }
+    return true;
+}
+
+static void bench_usage()
+{
+    fprintf(stderr, "bench-package-fs [-s|--scale <n>] [-r|--repeats <n>] [-f|--format <version>]\n");
+    fprintf(stderr, "                 [-d|--dir <workdir>] [-m|--mount <mountpoint>] [-o|--output <file>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig config;
+    bool fuse = false;
+    config.scale = 1;
+    config.repeats = 3;
+    config.format = FORMAT_VERSION_DEFAULT;
+    config.workdir = "/tmp";
+    config.out = stdout;
+
+    static const struct option options[] = {
+        { "scale", required_argument, NULL, 's' },
+        { "repeats", required_argument, NULL, 'r' },
+        { "format", required_argument, NULL, 'f' },
+        { "dir", required_argument, NULL, 'd' },
+        { "mount", required_argument, NULL, 'm' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "s:r:f:d:m:o:", options, NULL)) >= 0)
+    {
+        switch (c)
+        {
+        case 's':
+            config.scale = (unsigned int) atoi(optarg);
+            break;
+        case 'r':
+            config.repeats = (unsigned int) atoi(optarg);
+            break;
+        case 'f':
+            config.format = (uint16_t) atoi(optarg);
+            break;
+        case 'd':
+            config.workdir = optarg;
+            break;
+        case 'm':
+            config.mountpoint = optarg;
+            break;
+        case 'o':
+            config.out = fopen(optarg, "w");
+            if (config.out == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            bench_usage();
+            return 1;
+        }
+    }
+    if (config.scale == 0 || config.repeats == 0 || AppLib::LowLevel::Format::get(config.format) == NULL)
+    {
+        bench_usage();
+        return 1;
+    }
+
+    // Logging writes to stdout, where the results go.
+    AppLib::Logging::verbose = false;
+    AppLib::Logging::setApplicationName(std::string("bench"));
+
+    try
+    {
+        fuse = !config.mountpoint.empty();
+        for (unsigned int i = 0; i < config.repeats; i += 1)
+        {
+            bench_run_fs(config);
+            if (fuse && !bench_run_fuse(config))
+                fuse = false;
+        }
+    }
+    catch (std::exception& e)
+    {
+        fprintf(stderr, "The benchmark failed: %s\n", e.what());
+        return 1;
+    }
+
+    bench_report(config);
+    if (!config.mountpoint.empty() && !fuse)
+    {
+        // Report that the FUSE results are missing, rather than leaving
+        // them out silently.
+        fprintf(config.out, "{\"target\":\"fuse\",\"skipped\":true}\n");
+    }
+    const char *names[] = { "small", "deep", "wide", "large" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i += 1)
+        unlink((config.workdir + "/bench-" + names[i] + ".afs").c_str());
+    if (config.out != stdout)
+        fclose(config.out);
+    return 0;
+}
@@ -0,0 +1,259 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+// Checks that a version 2 package which is not closed cleanly comes
+// back with every committed group of metadata changes, including one
+// committed because it grew old, and none of the changes that were
+// still waiting in memory.  A child process makes the
+// changes and exits without closing the package, as a crash would.
+
+#include "src/package-fs/config.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "src/package-fs/fs.h"
+#include "src/package-fs/logging.h"
+#include "src/package-fs/lowlevel/blockstream.h"
+#include "src/package-fs/lowlevel/checker.h"
+#include "src/package-fs/lowlevel/endian.h"
+#include "src/package-fs/lowlevel/format.h"
+#include "src/package-fs/lowlevel/fs.h"
+#include "src/package-fs/lowlevel/journal.h"
+#include "src/package-fs/lowlevel/util.h"
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// The most files the first test creates while waiting for a group to
+// be written to the journal.  Creating a file and writing to it are a
+// transaction each, and the group may be written at the end of either.
+#define TEST_MAX_FILES 10000
+
+static std::string test_name(unsigned int i)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/f%u", i);
+    return std::string(name);
+}
+
+static std::string test_contents(unsigned int i)
+{
+    char contents[32];
+    snprintf(contents, sizeof(contents), "contents of file %u", i);
+    return std::string(contents);
+}
+
+static bool test_is_pending(const char *path)
+{
+    AppLib::LowLevel::BlockStream probe(path, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+    assert(probe.is_open());
+    return AppLib::LowLevel::Journal::isPending(&probe, AppLib::LowLevel::Format::get(2));
+}
+
+static void test_check_clean(const char *path)
+{
+    AppLib::LowLevel::BlockStream stream(path, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+    AppLib::LowLevel::FS filesystem(&stream);
+    assert(filesystem.isValid());
+    AppLib::LowLevel::Checker checker(&filesystem, &stream);
+    bool clean = checker.check(1);
+    assert(clean);
+}
+
+// Runs func in a child process that exits without closing anything,
+// and returns what it wrote to its pipe.
+template <typename F>
+static unsigned int test_crash(F func)
+{
+    int fds[2];
+    int r = pipe(fds);
+    assert(r == 0);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0)
+    {
+        close(fds[0]);
+        unsigned int result = func();
+        ssize_t n = write(fds[1], &result, sizeof(result));
+        _exit(n == sizeof(result) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+    unsigned int result = 0;
+    ssize_t n = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status;
+    pid_t waited = waitpid(pid, &status, 0);
+    assert(waited == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    assert(n == sizeof(result));
+    return result;
+}
+
+// Overwrites the blocks of the group in the journal where they belong
+// with zeros, as if the package had gone down after the group reached
+// the journal and before it was written in place.
+static void test_lose_group(const char *path)
+{
+    AppLib::LowLevel::BlockStream stream(path, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+    assert(stream.is_open());
+
+    char header[32];
+    std::streamsize n = stream.readThrough(header, sizeof(header), OFFSET_JOURNAL);
+    assert(n == sizeof(header));
+    uint32_t count = AppLib::LowLevel::Endian::getU32(header + 16);
+    assert(count > 0);
+
+    std::vector<char> positions((size_t) count * 8);
+    n = stream.readThrough(&positions[0], positions.size(), OFFSET_JOURNAL + BSIZE_FILE);
+    assert(n == (std::streamsize) positions.size());
+
+    std::vector<char> zero(BSIZE_FILE, 0);
+    for (uint32_t i = 0; i < count; i += 1)
+        stream.writeThrough(&zero[0], BSIZE_FILE, AppLib::LowLevel::Endian::getU64(&positions[i * 8]));
+    stream.sync();
+    assert(!stream.fail());
+    stream.close();
+}
+
+static void test_committed_group_is_replayed(const char *path)
+{
+    // Create and write files until a group of changes is written to
+    // the journal, and stop there, returning the number of transactions
+    // that were made.
+    unsigned int steps = test_crash([&]()
+    {
+        AppLib::FS *fs = new AppLib::FS(path, 0, 0, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+        for (unsigned int i = 0; i < TEST_MAX_FILES; i += 1)
+        {
+            std::string contents = test_contents(i);
+            fs->create(test_name(i), 0644);
+            if (test_is_pending(path))
+                return 2 * i + 1;
+            AppLib::FSFile file = fs->open(test_name(i));
+            file.seekp(0);
+            file.write(contents.c_str(), contents.length());
+            file.close();
+            if (test_is_pending(path))
+                return 2 * i + 2;
+        }
+        return 0u;
+    });
+    assert(steps > 0);
+    assert(test_is_pending(path));
+
+    test_lose_group(path);
+
+    // Opening the package replays the group.
+    {
+        AppLib::FS fs(path);
+        assert(!test_is_pending(path));
+        for (unsigned int i = 0; 2 * i < steps; i += 1)
+        {
+            std::string contents = test_contents(i);
+            struct stat st;
+            fs.getattr(test_name(i), st);
+            assert(S_ISREG(st.st_mode));
+
+            // The write after the last create is lost.
+            if (2 * i + 2 > steps)
+            {
+                assert(st.st_size == 0);
+                break;
+            }
+            assert((size_t) st.st_size == contents.length());
+
+            std::vector<char> data(contents.length());
+            AppLib::FSFile file = fs.open(test_name(i));
+            file.seekg(0);
+            std::streamsize n = file.read(&data[0], data.size());
+            assert(n == (std::streamsize) contents.length());
+            assert(memcmp(&data[0], contents.c_str(), contents.length()) == 0);
+        }
+    }
+
+    test_check_clean(path);
+}
+
+static void test_uncommitted_group_is_lost(const char *path)
+{
+    // A change that is still in memory when the package goes down
+    // never happened.  The block it allocated past the end of the
+    // image is left behind, which the checker only warns about.
+    test_crash([&]()
+    {
+        AppLib::FS *fs = new AppLib::FS(path, 0, 0, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+        fs->mkdir("/lost", 0755);
+        return 0u;
+    });
+    assert(!test_is_pending(path));
+
+    {
+        AppLib::FS fs(path);
+        bool found = true;
+        try
+        {
+            struct stat st;
+            fs.getattr("/lost", st);
+        }
+        catch (AppLib::Exception::FileNotFound& e)
+        {
+            found = false;
+        }
+        assert(!found);
+    }
+
+    test_check_clean(path);
+}
+
+static void test_expired_group_is_committed(const char *path)
+{
+    // A package that goes quiet after a change has the group written
+    // out by commitJournal once it is old enough, as mounts do.
+    unsigned int pending = test_crash([&]()
+    {
+        AppLib::FS *fs = new AppLib::FS(path, 0, 0, AppLib::LowLevel::BlockStreamBackend::BSB_PREAD);
+        fs->mkdir("/kept", 0755);
+        fs->commitJournal();
+        if (test_is_pending(path))
+            return 1u;
+        sleep(JOURNAL_COMMIT_INTERVAL);
+        fs->commitJournal();
+        return test_is_pending(path) ? 2u : 0u;
+    });
+    assert(pending == 2);
+
+    {
+        AppLib::FS fs(path);
+        struct stat st;
+        fs.getattr("/kept", st);
+        assert(S_ISDIR(st.st_mode));
+    }
+
+    test_check_clean(path);
+}
+
+int main(void)
+{
+    AppLib::Logging::verbose = false;
+
+    char path[] = "/tmp/test-package-fs-journal.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    bool created = AppLib::LowLevel::Util::createPackage(path, "test", "1.0", "Journal test", "test", 2);
+    assert(created);
+
+    test_committed_group_is_replayed(path);
+    test_uncommitted_group_is_lost(path);
+    test_expired_group_is_committed(path);
+
+    unlink(path);
+    return 0;
+}